@@ -35,6 +35,13 @@ def test_dim():
 
 def test_fmm_config():
     config = TwoD.FMMConfig(0.3, 20, 100, 0.05, False)
+    assert(config.order == 20)
+    assert(config.use_fmm)
+    direct = TwoD.FMMConfig(0.3, 20, 100, 0.05, False, use_fmm = False)
+    assert(not direct.use_fmm)
+    assert(not config.float_farfield)
+    single = TwoD.FMMConfig(0.3, 20, 100, 0.05, False, float_farfield = True)
+    assert(single.float_farfield)
 
 if __name__ == "__main__":
     test_mesh_union()
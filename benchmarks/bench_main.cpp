@@ -1,11 +1,18 @@
 #include "benchmark/benchmark.h"
 #include "octree.h"
 #include "geometry.h"
+#include "mesh.h"
+#include "mesh_gen.h"
 #include "util.h"
+#include <random>
+#include <sstream>
 
 #include "fmm.h"
 #include "nbody_operator.h"
 #include "elastic_kernels.h"
+#ifdef TBEM_USE_MPI
+#include "fmm_mpi.h"
+#endif
 
 using namespace tbem;
 
@@ -19,6 +26,137 @@ static void construct_octree(benchmark::State& state)
 }
 BENCHMARK(construct_octree)->Range(1, 250000);
 
+/* Build the octree of balls over and over and label the benchmark with the
+ * shape of the tree: the depth, the number of leaves, the mean and largest
+ * number of balls in a leaf and the bytes of nodes and indices per node.
+ * The trees use 20 balls per cell, like NearfieldFacetFinder.
+ */
+template <size_t dim>
+void bench_octree_construction(benchmark::State& state,
+    const std::vector<Ball<dim>>& balls)
+{
+    size_t min_pts_per_cell = 20;
+    while (state.KeepRunning()) {
+        auto oct = make_octree(balls, min_pts_per_cell);
+        benchmark::DoNotOptimize(oct.nodes.data());
+    }
+    state.SetItemsProcessed(state.iterations() * balls.size());
+
+    auto oct = make_octree(balls, min_pts_per_cell);
+    size_t depth = 0;
+    size_t n_leaves = 0;
+    size_t max_leaf_pts = 0;
+    for (auto& n: oct.nodes) {
+        depth = std::max(depth, n.level);
+        if (n.is_leaf()) {
+            n_leaves++;
+            max_leaf_pts = std::max(max_leaf_pts, n.n_pts());
+        }
+    }
+    auto bytes = oct.nodes.capacity() * sizeof(OctreeNode<dim>) +
+        oct.indices.capacity() * sizeof(size_t);
+    std::stringstream label;
+    label << "n=" << balls.size() << " depth=" << depth
+        << " leaves=" << n_leaves
+        << " leaf_pts_mean=" << double(balls.size()) / n_leaves
+        << " leaf_pts_max=" << max_leaf_pts
+        << " bytes_per_node=" << double(bytes) / oct.n_nodes();
+    state.SetLabel(label.str());
+}
+
+/* A closed surface: the facets of a sphere refined range_x times. */
+static void construct_octree_sphere_mesh(benchmark::State& state)
+{
+    auto m = sphere_mesh({0, 0, 0}, 1, state.range_x());
+    bench_octree_construction<3>(state, make_facet_balls(m.facets));
+}
+BENCHMARK(construct_octree_sphere_mesh)->DenseRange(3, 7);
+
+/* A planar free surface, refined range_x times. The balls all lie in the
+ * z = 0 plane, so the tree never splits along z.
+ */
+static void construct_octree_rect_mesh(benchmark::State& state)
+{
+    auto m = rect_mesh({-1, -1, 0}, {-1, 1, 0}, {1, 1, 0}, {1, -1, 0})
+        .refine_repeatedly(state.range_x());
+    bench_octree_construction<3>(state, make_facet_balls(m.facets));
+}
+BENCHMARK(construct_octree_rect_mesh)->DenseRange(4, 8);
+
+/* A free surface and a vertical fault whose upper tip sits just below it,
+ * both refined uniformly base_refinements times. Then each of 30 passes
+ * refines the fault facets within half the previous distance of either
+ * tip, so the facet size grades down to a billionth of the uniform size at
+ * the tips, like a crack tip mesh.
+ */
+Mesh<2> fault_tip_mesh(size_t base_refinements)
+{
+    Vec2<double> upper_tip{0, -0.05};
+    Vec2<double> lower_tip{0, -1};
+    auto surface = line_mesh({-2, 0}, {2, 0})
+        .refine_repeatedly(base_refinements + 2);
+    auto fault = line_mesh(upper_tip, lower_tip)
+        .refine_repeatedly(base_refinements).facets;
+    double r = 0.25;
+    for (size_t i = 0; i < 30; i++, r /= 2) {
+        std::vector<size_t> refine_these;
+        for (size_t j = 0; j < fault.size(); j++) {
+            auto midpt = (fault[j][0] + fault[j][1]) / 2.0;
+            if (std::min(dist(midpt, upper_tip), dist(midpt, lower_tip)) < r) {
+                refine_these.push_back(j);
+            }
+        }
+        fault = Mesh<2>{fault}.refine(refine_these).facets;
+    }
+    return Mesh<2>::create_union({surface, Mesh<2>{fault}});
+}
+
+static void construct_octree_fault_tip_mesh(benchmark::State& state)
+{
+    auto m = fault_tip_mesh(state.range_x());
+    bench_octree_construction<2>(state, make_facet_balls(m.facets));
+}
+BENCHMARK(construct_octree_fault_tip_mesh)->DenseRange(8, 14, 2);
+
+/* range_x points, a tenth of them uniform in the unit cube and the rest in
+ * gaussian clusters whose widths span four orders of magnitude. The seed is
+ * fixed so that every run builds the same tree.
+ */
+std::vector<Vec3<double>> clustered_pts(size_t n)
+{
+    std::mt19937 gen(42);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> normal(0, 1);
+    size_t n_clusters = 8;
+    std::vector<Vec3<double>> centers(n_clusters);
+    std::vector<double> widths(n_clusters);
+    for (size_t c = 0; c < n_clusters; c++) {
+        centers[c] = {uniform(gen), uniform(gen), uniform(gen)};
+        widths[c] = 0.1 * std::pow(10.0, -4.0 * c / (n_clusters - 1));
+    }
+
+    std::vector<Vec3<double>> pts(n);
+    for (size_t i = 0; i < n; i++) {
+        if (i % 10 == 0) {
+            pts[i] = {uniform(gen), uniform(gen), uniform(gen)};
+            continue;
+        }
+        auto c = i % n_clusters;
+        for (size_t d = 0; d < 3; d++) {
+            pts[i][d] = centers[c][d] + widths[c] * normal(gen);
+        }
+    }
+    return pts;
+}
+
+static void construct_octree_clustered_pts(benchmark::State& state)
+{
+    auto pts = clustered_pts(state.range_x());
+    std::vector<double> r(pts.size(), 0.0);
+    bench_octree_construction<3>(state, balls_from_centers_radii(pts, r));
+}
+BENCHMARK(construct_octree_clustered_pts)->Range(1000, 1000000);
+
 template <size_t dim>
 static void fmm_hypersingular_apply(benchmark::State& state)
 {
@@ -82,6 +220,192 @@ BENCHMARK_TEMPLATE(fmm_hypersingular_apply, 3)
     // ->ArgPair(500000, 100)
     // ->ArgPair(500000, 250);
 
+/* Compare scheduling every FMM task separately with atomic accumulation 
+ * against grouping the tasks so that each output has a single owner. 
+ * range_y == 1 selects owner computes.
+ */
+template <size_t dim>
+static void fmm_accumulation(benchmark::State& state)
+{
+    int n = state.range_x();
+    bool owner_computes = state.range_y() == 1;
+    size_t n_per_cell = 60;
+    size_t order = 30;
+    if (dim == 3) {
+        order = 100;
+    }
+
+    auto src_pts = random_pts<dim>(n);
+    auto obs_pts = random_pts<dim>(n);
+    auto normals = random_pts<dim>(n);
+    std::vector<double> weights(n, 1.0);
+    NBodyData<dim> data{obs_pts, normals, src_pts, normals, weights};
+    std::vector<double> x(dim * data.src_locs.size(), 1.0);
+
+    FMMOperator<dim,dim,dim> tree(
+        ElasticHypersingular<dim>(30e9, 0.25),
+        data,
+        {0.35, order, n_per_cell, 0.05, true, owner_computes}
+    );
+
+    while (state.KeepRunning()) {
+        auto out = tree.apply(x);
+    }
+}
+BENCHMARK_TEMPLATE(fmm_accumulation, 2)
+    ->ArgPair(100000, 0)
+    ->ArgPair(100000, 1)
+    ->ArgPair(500000, 0)
+    ->ArgPair(500000, 1);
+
+BENCHMARK_TEMPLATE(fmm_accumulation, 3)
+    ->ArgPair(100000, 0)
+    ->ArgPair(100000, 1);
+
+template <size_t dim>
+static void fmm_block(benchmark::State& state)
+{
+    int n = state.range_x();
+    size_t n_rhs = state.range_y();
+    size_t order = 30;
+    if (dim == 3) {
+        order = 100;
+    }
+
+    auto src_pts = random_pts<dim>(n);
+    auto obs_pts = random_pts<dim>(n);
+    auto normals = random_pts<dim>(n);
+    std::vector<double> weights(n, 1.0);
+    NBodyData<dim> data{obs_pts, normals, src_pts, normals, weights};
+    std::vector<std::vector<double>> xs(
+        n_rhs, std::vector<double>(dim * data.src_locs.size(), 1.0)
+    );
+
+    FMMOperator<dim,dim,dim> tree(
+        ElasticHypersingular<dim>(30e9, 0.25),
+        data,
+        {0.35, order, 60, 0.05, true}
+    );
+
+    while (state.KeepRunning()) {
+        auto out = tree.apply_block(xs);
+    }
+}
+BENCHMARK_TEMPLATE(fmm_block, 2)
+    ->ArgPair(100000, 1)
+    ->ArgPair(100000, 8)
+    ->ArgPair(100000, 32);
+
+/* Compare the dense M2L translations against the Fourier space ones at
+ * expansion order range_x. range_y == 1 selects fft_m2l.
+ */
+static void fmm_fft_m2l(benchmark::State& state)
+{
+    size_t n = 20000;
+    size_t order = state.range_x();
+    bool fft_m2l = state.range_y() == 1;
+
+    auto pts = random_pts<3>(n);
+    auto normals = random_pts<3>(n);
+    std::vector<double> weights(n, 1.0);
+    NBodyData<3> data{pts, normals, pts, normals, weights};
+    std::vector<double> x(3 * n, 1.0);
+
+    FMMOperator<3,3,3> tree(
+        ElasticHypersingular<3>(30e9, 0.25),
+        data,
+        {0.35, order, 60, 0.05, true, true, true, false, "", fft_m2l}
+    );
+
+    while (state.KeepRunning()) {
+        auto out = tree.apply(x);
+    }
+}
+BENCHMARK(fmm_fft_m2l)
+    ->ArgPair(100, 0)
+    ->ArgPair(100, 1)
+    ->ArgPair(296, 0)
+    ->ArgPair(296, 1);
+
+#ifdef TBEM_USE_MPI
+/* The weak scaling of the distributed FMM: fmm_hypersingular_apply with 
+ * range_x points on each rank. Run with increasing mpirun -np; ideal weak 
+ * scaling keeps the time constant.
+ *
+ * The benchmark harness picks the number of runs from its own timings, so
+ * only rank 0 runs it. The other ranks wait in main for rank 0 to broadcast
+ * a command and then make the same collective calls.
+ */
+enum MPIBenchCommand {mpi_setup, mpi_apply, mpi_teardown, mpi_exit};
+
+void broadcast_command(std::array<int,4>& command)
+{
+    MPI_Bcast(command.data(), command.size(), MPI_INT, 0, MPI_COMM_WORLD);
+}
+
+template <size_t dim>
+std::unique_ptr<DistributedFMMOperator<dim,dim,dim>>
+make_distributed_hypersingular(size_t n, size_t n_per_cell)
+{
+    size_t order = 30;
+    if (dim == 3) {
+        order = 100;
+    }
+
+    auto src_pts = random_pts<dim>(n);
+    auto obs_pts = random_pts<dim>(n);
+    auto normals = random_pts<dim>(n);
+    std::vector<double> weights(n, 1.0);
+    NBodyData<dim> data{obs_pts, normals, src_pts, normals, weights};
+
+    return std::unique_ptr<DistributedFMMOperator<dim,dim,dim>>(
+        new DistributedFMMOperator<dim,dim,dim>(
+            ElasticHypersingular<dim>(30e9, 0.25),
+            data,
+            {0.35, order, n_per_cell, 0.05, true}
+        )
+    );
+}
+
+template <size_t dim>
+void follow_distributed_hypersingular(size_t n, size_t n_per_cell)
+{
+    auto op = make_distributed_hypersingular<dim>(n, n_per_cell);
+    std::vector<double> x(dim * n, 1.0);
+    std::array<int,4> command;
+    broadcast_command(command);
+    while (command[0] == mpi_apply) {
+        auto out = op->apply(x);
+        broadcast_command(command);
+    }
+}
+
+template <size_t dim>
+static void fmm_hypersingular_apply_mpi(benchmark::State& state)
+{
+    int n = state.range_x();
+    int n_per_cell = state.range_y();
+    std::array<int,4> command{{mpi_setup, static_cast<int>(dim), n, n_per_cell}};
+    broadcast_command(command);
+    auto op = make_distributed_hypersingular<dim>(n, n_per_cell);
+    std::vector<double> x(dim * n, 1.0);
+
+    command[0] = mpi_apply;
+    while (state.KeepRunning()) {
+        broadcast_command(command);
+        auto out = op->apply(x);
+    }
+    command[0] = mpi_teardown;
+    broadcast_command(command);
+}
+BENCHMARK_TEMPLATE(fmm_hypersingular_apply_mpi, 2)
+    ->ArgPair(100000, 60)
+    ->ArgPair(500000, 60);
+
+BENCHMARK_TEMPLATE(fmm_hypersingular_apply_mpi, 3)
+    ->ArgPair(100000, 100);
+#endif
+
 // TEST_CASE("all pairs performance", "[intersect_balls]") 
 // {
 //     size_t n = 50000;
@@ -90,5 +414,30 @@ BENCHMARK_TEMPLATE(fmm_hypersingular_apply, 3)
 //     auto result = intersect_balls_all_pairs(pts, pts);
 // }
 
-
+#ifdef TBEM_USE_MPI
+int main(int argc, char** argv)
+{
+    MPI_Init(&argc, &argv);
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    std::array<int,4> command{{mpi_exit, 0, 0, 0}};
+    if (rank == 0) {
+        benchmark::Initialize(&argc, argv);
+        benchmark::RunSpecifiedBenchmarks();
+        broadcast_command(command);
+    } else {
+        broadcast_command(command);
+        while (command[0] == mpi_setup) {
+            if (command[1] == 2) {
+                follow_distributed_hypersingular<2>(command[2], command[3]);
+            } else {
+                follow_distributed_hypersingular<3>(command[2], command[3]);
+            }
+            broadcast_command(command);
+        }
+    }
+    MPI_Finalize();
+}
+#else
 BENCHMARK_MAIN()
+#endif
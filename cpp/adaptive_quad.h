@@ -57,11 +57,14 @@ T adaptlobstp(const F& f, const double a, const double b,
     double mr = m + bh;
     double mrr = m + ah;
 
-    T fmll = f(mll);
-    T fml = f(ml);
-    T fm = f(m);
-    T fmr = f(mr);
-    T fmrr = f(mrr);
+    const double xs[5] = {mll, ml, m, mr, mrr};
+    T ys[5];
+    f(xs, 5, ys);
+    const T& fmll = ys[0];
+    const T& fml = ys[1];
+    const T& fm = ys[2];
+    const T& fmr = ys[3];
+    const T& fmrr = ys[4];
 
     T i2 = (h / 6.) * (fa + fb + 5.0 * (fml + fmr));    
     T i1 = (h / 1470.) * (
@@ -122,27 +125,34 @@ Vec3<T> get_error_is(double p_tol, Vec3<T> erri1, Vec3<T> erri2,
     };
 }
 
+/* The same as adaptive_integrate, but the integrand is evaluated at all the
+ * points of a step together: f(xs, n, out) sets out[i] to the integrand at
+ * xs[i] for i < n. There are 13 points in the first step and 5 in each 
+ * later one.
+ */
 template <typename T, typename F>
-T adaptive_integrate(const F& f, double a,
+T adaptive_integrate_batched(const F& f, double a,
                      double b, double p_tol) {
     double m = (a + b) / 2.; 
     double h = (b - a) / 2.;
 
-    const T y[13] = {
-        f(a),
-        f(m - lobatto_x1 * h),
-        f(m - lobatto_alpha * h),
-        f(m - lobatto_x2 * h),
-        f(m - lobatto_beta * h),
-        f(m - lobatto_x3 * h),
-        f(m),
-        f(m + lobatto_x3 * h),
-        f(m + lobatto_beta * h),
-        f(m + lobatto_x2 * h),
-        f(m + lobatto_alpha * h),
-        f(m + lobatto_x1 * h),
-        f(b)
+    const double xs[13] = {
+        a,
+        m - lobatto_x1 * h,
+        m - lobatto_alpha * h,
+        m - lobatto_x2 * h,
+        m - lobatto_beta * h,
+        m - lobatto_x3 * h,
+        m,
+        m + lobatto_x3 * h,
+        m + lobatto_beta * h,
+        m + lobatto_x2 * h,
+        m + lobatto_alpha * h,
+        m + lobatto_x1 * h,
+        b
     };
+    T y[13];
+    f(xs, 13, y);
     
     const T fa = y[0];
     const T fb = y[12];
@@ -170,5 +180,16 @@ T adaptive_integrate(const F& f, double a,
     return adaptlobstp(f, a, b, fa, fb, err_is);
 }
 
+template <typename T, typename F>
+T adaptive_integrate(const F& f, double a,
+                     double b, double p_tol) {
+    return adaptive_integrate_batched<T>(
+        [&] (const double* xs, size_t n, T* out) {
+            for (size_t i = 0; i < n; i++) {
+                out[i] = f(xs[i]);
+            }
+        }, a, b, p_tol);
+}
+
 } //END NAMESPACE tbem
 #endif
@@ -1,6 +1,7 @@
 #include "blas_wrapper.h"
 #include <cmath>
 #include <cassert>
+#include <algorithm>
 
 extern "C" void dgetrf_(int* dim1, int* dim2, double* a, int* lda, int* ipiv,
     int* info);
@@ -12,6 +13,9 @@ extern "C" void dgesvd_(char* JOBU, char* JOBVT, int* M, int* N, double* A,
 extern "C" void dgemm_(char* TRANSA, char* TRANSB, int* M, int* N, int* K, 
     double* ALPHA, double* A, int* LDA, double* B, int* LDB, double* BETA,
     double* C, int* LDC);
+extern "C" void sgemm_(char* TRANSA, char* TRANSB, int* M, int* N, int* K, 
+    float* ALPHA, float* A, int* LDA, float* B, int* LDB, float* BETA,
+    float* C, int* LDC);
 extern "C" void dgemv_(char* TRANS, int* M, int* N, double* ALPHA, double* A,
     int* LDA, double* X, int* INCX, double* BETA, double* Y, int* INCY);
 
@@ -189,4 +193,138 @@ std::vector<double> matrix_vector_product(const std::vector<double>& matrix,
     return out;
 }
 
+std::vector<double> matrix_transpose_vector_product(
+    const std::vector<double>& matrix, const std::vector<double>& vector)
+{
+    char TRANS = 'N';
+    int n_rows = static_cast<int>(vector.size());
+    if (n_rows == 0) {
+        return {};
+    }
+    int n_matrix_els = static_cast<int>(matrix.size());
+    int n_cols = n_matrix_els / n_rows;
+    double alpha = 1;
+    double beta = 0;
+    int inc = 1;
+    assert(n_rows * n_cols == n_matrix_els);
+    std::vector<double> out(n_cols);
+    if (n_cols == 0) {
+        return out;
+    }
+    // The row-major matrix is its own transpose in column-major order.
+    dgemv_(&TRANS, &n_cols, &n_rows, &alpha, (double*)matrix.data(),
+        &n_cols, (double*)vector.data(), &inc, &beta, out.data(), &inc);
+    return out;
+}
+
+std::vector<double> matrix_matrix_product(const std::vector<double>& A,
+    const std::vector<double>& B, size_t n_rows, size_t n_inner, size_t n_cols)
+{
+    assert(A.size() == n_rows * n_inner);
+    assert(B.size() == n_inner * n_cols);
+    std::vector<double> out(n_rows * n_cols, 0.0);
+    matrix_matrix_product(A.data(), B.data(), out.data(), n_rows, n_inner, n_cols);
+    return out;
+}
+
+void matrix_matrix_product(const double* A, const double* B, double* out,
+    size_t n_rows, size_t n_inner, size_t n_cols)
+{
+    if (n_rows * n_cols == 0) {
+        return;
+    }
+    if (n_inner == 0) {
+        std::fill(out, out + n_rows * n_cols, 0.0);
+        return;
+    }
+    // Row-major C = AB is column-major C^T = B^T A^T, so the operands are
+    // passed to BLAS in swapped order.
+    char transa = 'N';
+    char transb = 'N';
+    int m = static_cast<int>(n_cols);
+    int n = static_cast<int>(n_rows);
+    int k = static_cast<int>(n_inner);
+    double alpha = 1;
+    double beta = 0;
+    dgemm_(
+        &transa, &transb, &m, &n, &k, &alpha,
+        (double*)B, &m, (double*)A, &k,
+        &beta, out, &m
+    );
+}
+
+void matrix_matrix_product(const float* A, const float* B, float* out,
+    size_t n_rows, size_t n_inner, size_t n_cols)
+{
+    if (n_rows * n_cols == 0) {
+        return;
+    }
+    if (n_inner == 0) {
+        std::fill(out, out + n_rows * n_cols, 0.0f);
+        return;
+    }
+    char transa = 'N';
+    char transb = 'N';
+    int m = static_cast<int>(n_cols);
+    int n = static_cast<int>(n_rows);
+    int k = static_cast<int>(n_inner);
+    float alpha = 1;
+    float beta = 0;
+    sgemm_(
+        &transa, &transb, &m, &n, &k, &alpha,
+        (float*)B, &m, (float*)A, &k,
+        &beta, out, &m
+    );
+}
+
+void transpose_matrix_product(const double* A, const double* B, double* out,
+    size_t n_rows, size_t n_inner, size_t n_cols)
+{
+    if (n_rows * n_cols == 0) {
+        return;
+    }
+    if (n_inner == 0) {
+        std::fill(out, out + n_rows * n_cols, 0.0);
+        return;
+    }
+    // As in matrix_matrix_product, BLAS computes C^T = B^T A. The row-major
+    // A is column-major A^T, so BLAS is asked to transpose it back.
+    char transa = 'N';
+    char transb = 'T';
+    int m = static_cast<int>(n_cols);
+    int n = static_cast<int>(n_rows);
+    int k = static_cast<int>(n_inner);
+    double alpha = 1;
+    double beta = 0;
+    dgemm_(
+        &transa, &transb, &m, &n, &k, &alpha,
+        (double*)B, &m, (double*)A, &n,
+        &beta, out, &m
+    );
+}
+
+void transpose_matrix_product(const float* A, const float* B, float* out,
+    size_t n_rows, size_t n_inner, size_t n_cols)
+{
+    if (n_rows * n_cols == 0) {
+        return;
+    }
+    if (n_inner == 0) {
+        std::fill(out, out + n_rows * n_cols, 0.0f);
+        return;
+    }
+    char transa = 'N';
+    char transb = 'T';
+    int m = static_cast<int>(n_cols);
+    int n = static_cast<int>(n_rows);
+    int k = static_cast<int>(n_inner);
+    float alpha = 1;
+    float beta = 0;
+    sgemm_(
+        &transa, &transb, &m, &n, &k, &alpha,
+        (float*)B, &m, (float*)A, &n,
+        &beta, out, &m
+    );
+}
+
 }// end namespace tbem
@@ -37,6 +37,36 @@ double condition_number(const SVDPtr& svd);
 std::vector<double> matrix_vector_product(const std::vector<double>& matrix,
     const std::vector<double>& vector);
 
+/* Multiply the transpose of a row-major matrix with vector.size() rows by
+ * vector.
+ */
+std::vector<double> matrix_transpose_vector_product(
+    const std::vector<double>& matrix, const std::vector<double>& vector);
+
+/* Multiply a row-major (n_rows x n_inner) matrix A by a row-major 
+ * (n_inner x n_cols) matrix B.
+ */
+std::vector<double> matrix_matrix_product(const std::vector<double>& A,
+    const std::vector<double>& B, size_t n_rows, size_t n_inner, size_t n_cols);
+
+/* The same product, written into a caller-provided (n_rows x n_cols) buffer.
+ */
+void matrix_matrix_product(const double* A, const double* B, double* out,
+    size_t n_rows, size_t n_inner, size_t n_cols);
+
+/* The single precision version of the same product. */
+void matrix_matrix_product(const float* A, const float* B, float* out,
+    size_t n_rows, size_t n_inner, size_t n_cols);
+
+/* Multiply the transpose of a row-major (n_inner x n_rows) matrix A by a
+ * row-major (n_inner x n_cols) matrix B, writing the (n_rows x n_cols)
+ * result to out.
+ */
+void transpose_matrix_product(const double* A, const double* B, double* out,
+    size_t n_rows, size_t n_inner, size_t n_cols);
+void transpose_matrix_product(const float* A, const float* B, float* out,
+    size_t n_rows, size_t n_inner, size_t n_cols);
+
 } // end namespace tbem
 
 #endif
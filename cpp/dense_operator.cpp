@@ -45,6 +45,16 @@ std::vector<double> DenseOperator::apply(const std::vector<double>& x) const
     return out;
 }
 
+std::vector<double> DenseOperator::apply_transpose(
+    const std::vector<double>& y) const 
+{
+    assert(y.size() == n_rows());
+    if (n_rows() == 0) {
+        return std::vector<double>(n_cols(), 0.0);
+    }
+    return matrix_transpose_vector_product(*storage, y);
+}
+
 const DenseOperator::DataT& DenseOperator::data() const 
 {
     return *storage;
@@ -24,6 +24,8 @@ struct DenseOperator: public OperatorI {
     size_t n_elements() const; 
 
     virtual std::vector<double> apply(const std::vector<double>& x) const override;
+    virtual std::vector<double> apply_transpose(
+        const std::vector<double>& y) const override;
 
     const DataT& data() const;
     double& operator[] (size_t idx); 
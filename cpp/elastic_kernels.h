@@ -48,12 +48,21 @@ struct ElasticDisplacement<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
             new ElasticDisplacement<2>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -90,12 +99,22 @@ struct ElasticTraction<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
             new ElasticTraction<2>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -1.0;}
 };
 
 template <>
@@ -132,12 +151,22 @@ struct ElasticAdjointTraction<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
             new ElasticAdjointTraction<2>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -1.0;}
 };
 
 template <>
@@ -180,12 +209,23 @@ struct ElasticHypersingular<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
             new ElasticHypersingular<2>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -2.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -218,12 +258,23 @@ struct ElasticDisplacement<3>: public Kernel<3,3,3>
         return out;
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
             new ElasticDisplacement<3>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -1.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -260,12 +311,22 @@ struct ElasticTraction<3>: public Kernel<3,3,3>
         return out;
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
             new ElasticTraction<3>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -2.0;}
 };
 
 template <>
@@ -302,12 +363,22 @@ struct ElasticAdjointTraction<3>: public Kernel<3,3,3>
         return out;
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
             new ElasticAdjointTraction<3>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -2.0;}
 };
 
 template <>
@@ -335,33 +406,51 @@ struct ElasticHypersingular<3>: public Kernel<3,3,3>
         Kernel::OperatorType out;
         double r = std::sqrt(r2);
         const Vec3<double> dr = delta / r;
-        const auto drdm = dot_product(delta, nobs) / r;
+        const auto drdm = dot_product(dr, nobs);
         const auto drdn = dot_product(dr, nsrc);
+        const auto nsrc_nobs = dot_product(nsrc, nobs);
+        const auto C = hyp_C1 / (r2 * r);
+        // The kernel is a sum of outer products of dr, nobs and nsrc plus a 
+        // multiple of the identity. Collecting the coefficients first keeps
+        // the loop below small enough to unroll, so that the batched 
+        // evaluation vectorizes.
+        const auto c_nobs_dr = C * 3 * drdn * trac_C2;
+        const auto c_dr_nobs = C * 3 * drdn * poisson_ratio;
+        const auto c_dr_dr = C * (hyp_C3 * nsrc_nobs - 15 * drdn * drdm);
+        const auto c_dr_nsrc = C * 3 * trac_C2 * drdm;
+        const auto c_nsrc_nobs = C * trac_C2;
+        const auto c_nsrc_dr = C * hyp_C3 * drdm;
+        const auto c_nobs_nsrc = C * hyp_C2;
+        const auto c_identity = C * (
+            3 * drdn * poisson_ratio * drdm + trac_C2 * nsrc_nobs);
         for (int k = 0; k < 3; k++) {
             for (int j = 0; j < 3; j++) {
-                const auto line1 = 3 * drdn * (
-                    trac_C2 * nobs[k] * dr[j] +
-                    poisson_ratio * (nobs[j] * dr[k] + kronecker[k][j] * drdm) -
-                    5 * dr[k] * dr[j] * drdm);
-                const auto line2 = trac_C2 * (
-                    3 * nsrc[j] * dr[k] * drdm + kronecker[k][j] * dot_product(nsrc, nobs) 
-                    + nsrc[k] * nobs[j]);
-                const auto line3 = hyp_C3 * (
-                        nsrc[k] * dr[j] * drdm + dot_product(nsrc, nobs) * dr[k] * dr[j]);
-                const auto line4 = hyp_C2 * nsrc[j] * nobs[k];
-                const auto C = hyp_C1 / (r2 * r);
-                out[k][j] = C * (line1 + line2 + line3 + line4);
+                out[k][j] = c_nobs_dr * nobs[k] * dr[j] + c_dr_nobs * dr[k] * nobs[j] +
+                    c_dr_dr * dr[k] * dr[j] + c_dr_nsrc * dr[k] * nsrc[j] +
+                    c_nsrc_nobs * nsrc[k] * nobs[j] + c_nsrc_dr * nsrc[k] * dr[j] +
+                    c_nobs_nsrc * nobs[k] * nsrc[j] + c_identity * kronecker[k][j];
             }
         }
         return out;
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
             new ElasticHypersingular<3>(shear_modulus, poisson_ratio)
         );
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -3.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 } // END namespace tbem
@@ -0,0 +1,236 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "fft.h"
+
+namespace tbem {
+
+typedef std::complex<double> Complex;
+
+FFTPlan::FFTPlan(size_t n, size_t n_dims):
+    n(n), n_dims(n_dims)
+{
+    assert(n > 0);
+    // Radix 4 butterflies need fewer operations than two radix 2 stages.
+    auto remaining = n;
+    while (remaining % 4 == 0) {
+        factors.push_back(4);
+        remaining /= 4;
+    }
+    for (size_t p = 2; remaining > 1; p++) {
+        while (remaining % p == 0) {
+            factors.push_back(p);
+            remaining /= p;
+        }
+    }
+    for (size_t j = 0; j < n; j++) {
+        auto theta = -2 * M_PI * static_cast<double>(j) / static_cast<double>(n);
+        roots.push_back(Complex(std::cos(theta), std::sin(theta)));
+    }
+    size_t n_done = 1;
+    for (auto p: factors) {
+        for (size_t k = 0; k < n_done; k++) {
+            for (size_t r = 1; r < p; r++) {
+                twiddles.push_back(roots[(n / (n_done * p)) * k * r]);
+            }
+        }
+        n_done *= p;
+    }
+}
+
+size_t FFTPlan::size() const
+{
+    size_t out = 1;
+    for (size_t d = 0; d < n_dims; d++) {
+        out *= n;
+    }
+    return out;
+}
+
+size_t FFTPlan::scratch_size() const
+{
+    size_t max_factor = 1;
+    for (auto p: factors) {
+        max_factor = std::max(max_factor, p);
+    }
+    return size() + max_factor;
+}
+
+/* The complex product written out, since the std::complex operator checks
+ * for NaNs and then does not vectorize.
+ */
+inline Complex mul(const Complex& a, const Complex& b)
+{
+    return Complex(
+        a.real() * b.real() - a.imag() * b.imag(),
+        a.real() * b.imag() + a.imag() * b.real()
+    );
+}
+
+/* -i * a */
+inline Complex mul_neg_i(const Complex& a)
+{
+    return Complex(a.imag(), -a.real());
+}
+
+/* One stage of a Stockham transform of length n that combines p transforms
+ * of length n_done, already computed, into transforms of length n_done * p.
+ * The entries of the transform are blocks of inner contiguous values, one
+ * per line being transformed, so that the innermost loops run along
+ * contiguous memory. tw holds the stage's twiddle factors and tmp p entries.
+ */
+void fft_stage(const FFTPlan& plan, const Complex* x, Complex* y, size_t inner,
+    size_t p, size_t n_done, const Complex* tw, Complex* tmp)
+{
+    auto m = plan.n / p;
+    for (size_t j = 0; j < m; j++) {
+        auto k = j % n_done;
+        auto w = tw + k * (p - 1);
+        auto in = x + j * inner;
+        auto out = y + ((j / n_done) * n_done * p + k) * inner;
+        auto in_step = m * inner;
+        auto out_step = n_done * inner;
+        if (p == 2) {
+            for (size_t t = 0; t < inner; t++) {
+                auto a0 = in[t];
+                auto a1 = mul(in[in_step + t], w[0]);
+                out[t] = a0 + a1;
+                out[out_step + t] = a0 - a1;
+            }
+        } else if (p == 3) {
+            const double s = std::sqrt(3.0) / 2;
+            for (size_t t = 0; t < inner; t++) {
+                auto a0 = in[t];
+                auto a1 = mul(in[in_step + t], w[0]);
+                auto a2 = mul(in[2 * in_step + t], w[1]);
+                auto sum = a1 + a2;
+                auto mid = a0 - 0.5 * sum;
+                auto rot = s * mul_neg_i(a1 - a2);
+                out[t] = a0 + sum;
+                out[out_step + t] = mid + rot;
+                out[2 * out_step + t] = mid - rot;
+            }
+        } else if (p == 4) {
+            for (size_t t = 0; t < inner; t++) {
+                auto a0 = in[t];
+                auto a1 = mul(in[in_step + t], w[0]);
+                auto a2 = mul(in[2 * in_step + t], w[1]);
+                auto a3 = mul(in[3 * in_step + t], w[2]);
+                auto sum02 = a0 + a2;
+                auto diff02 = a0 - a2;
+                auto sum13 = a1 + a3;
+                auto rot13 = mul_neg_i(a1 - a3);
+                out[t] = sum02 + sum13;
+                out[out_step + t] = diff02 + rot13;
+                out[2 * out_step + t] = sum02 - sum13;
+                out[3 * out_step + t] = diff02 - rot13;
+            }
+        } else if (p == 5) {
+            const double c1 = std::cos(2 * M_PI / 5);
+            const double c2 = std::cos(4 * M_PI / 5);
+            const double s1 = std::sin(2 * M_PI / 5);
+            const double s2 = std::sin(4 * M_PI / 5);
+            for (size_t t = 0; t < inner; t++) {
+                auto a0 = in[t];
+                auto a1 = mul(in[in_step + t], w[0]);
+                auto a2 = mul(in[2 * in_step + t], w[1]);
+                auto a3 = mul(in[3 * in_step + t], w[2]);
+                auto a4 = mul(in[4 * in_step + t], w[3]);
+                auto b1 = a1 + a4;
+                auto b2 = a2 + a3;
+                auto d1 = a1 - a4;
+                auto d2 = a2 - a3;
+                auto mid1 = a0 + c1 * b1 + c2 * b2;
+                auto mid2 = a0 + c2 * b1 + c1 * b2;
+                auto rot1 = mul_neg_i(s1 * d1 + s2 * d2);
+                auto rot2 = mul_neg_i(s2 * d1 - s1 * d2);
+                out[t] = a0 + b1 + b2;
+                out[out_step + t] = mid1 + rot1;
+                out[2 * out_step + t] = mid2 + rot2;
+                out[3 * out_step + t] = mid2 - rot2;
+                out[4 * out_step + t] = mid1 - rot1;
+            }
+        } else {
+            auto root_step = plan.n / p;
+            for (size_t t = 0; t < inner; t++) {
+                tmp[0] = in[t];
+                for (size_t r = 1; r < p; r++) {
+                    tmp[r] = mul(in[r * in_step + t], w[r - 1]);
+                }
+                for (size_t q = 0; q < p; q++) {
+                    auto sum = tmp[0];
+                    for (size_t r = 1; r < p; r++) {
+                        sum += mul(tmp[r], plan.roots[((r * q) % p) * root_step]);
+                    }
+                    out[q * out_step + t] = sum;
+                }
+            }
+        }
+    }
+}
+
+void FFTPlan::transform(Complex* data, Complex* scratch, bool inverse) const
+{
+    // The inverse transform is conj(forward(conj(x))).
+    auto total = size();
+    if (inverse) {
+        for (size_t i = 0; i < total; i++) {
+            data[i] = std::conj(data[i]);
+        }
+    }
+    auto tmp = scratch + total;
+    size_t inner = total;
+    for (size_t d = 0; d < n_dims; d++) {
+        inner /= n;
+        // Transform along dimension d for all the lines at once: each block
+        // of n * inner values holds the lines that differ only in the
+        // coordinates after dimension d.
+        for (size_t outer = 0; outer < total; outer += n * inner) {
+            auto x = data + outer;
+            auto y = scratch;
+            auto tw = twiddles.data();
+            size_t n_done = 1;
+            for (auto p: factors) {
+                fft_stage(*this, x, y, inner, p, n_done, tw, tmp);
+                tw += n_done * (p - 1);
+                n_done *= p;
+                std::swap(x, y);
+            }
+            if (x != data + outer) {
+                std::copy(x, x + n * inner, data + outer);
+            }
+        }
+    }
+    if (inverse) {
+        for (size_t i = 0; i < total; i++) {
+            data[i] = std::conj(data[i]);
+        }
+    }
+}
+
+void FFTPlan::forward(Complex* data, Complex* scratch) const
+{
+    transform(data, scratch, false);
+}
+
+void FFTPlan::inverse(Complex* data, Complex* scratch) const
+{
+    transform(data, scratch, true);
+}
+
+size_t fft_size(size_t min_n)
+{
+    for (size_t n = std::max<size_t>(min_n, 1);; n++) {
+        auto remaining = n;
+        for (size_t p: {2, 3, 5}) {
+            while (remaining % p == 0) {
+                remaining /= p;
+            }
+        }
+        if (remaining == 1) {
+            return n;
+        }
+    }
+}
+
+} // end namespace tbem
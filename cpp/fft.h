@@ -0,0 +1,55 @@
+#ifndef TBEMQWPOQWPOQWPO_FFT_H
+#define TBEMQWPOQWPOQWPO_FFT_H
+
+#include <complex>
+#include <vector>
+
+namespace tbem {
+
+/* Discrete Fourier transforms of n_dims dimensional arrays with n entries
+ * along each dimension, stored row-major. The one dimensional transforms
+ * are mixed radix Stockham transforms, so any n works, but n with only
+ * factors of 2, 3 and 5 (see fft_size) is much faster.
+ *
+ * The forward transform is X[k] = sum_j x[j] exp(-2 pi i j.k / n) and the
+ * inverse transform uses the opposite sign and is not scaled, so that
+ * inverse(forward(x)) = size() * x.
+ */
+struct FFTPlan {
+    size_t n;
+    size_t n_dims;
+    // The radices of the one dimensional transform, in the order they are
+    // applied.
+    std::vector<size_t> factors;
+    // exp(-2 pi i j / n) for j < n.
+    std::vector<std::complex<double>> roots;
+    // The twiddle factors of each stage, one after the other. A stage of
+    // radix p that follows stages with a product of radices n_done has the
+    // n_done * (p - 1) values exp(-2 pi i k r / (n_done * p)) for k < n_done
+    // and 0 < r < p.
+    std::vector<std::complex<double>> twiddles;
+
+    FFTPlan(): n(0), n_dims(0) {}
+    FFTPlan(size_t n, size_t n_dims);
+
+    /* The number of entries in a transformed array. */
+    size_t size() const;
+
+    /* The number of entries of the scratch buffer needed by forward and
+     * inverse.
+     */
+    size_t scratch_size() const;
+
+    void forward(std::complex<double>* data, std::complex<double>* scratch) const;
+    void inverse(std::complex<double>* data, std::complex<double>* scratch) const;
+
+    void transform(std::complex<double>* data, std::complex<double>* scratch,
+        bool inverse) const;
+};
+
+/* The smallest n >= min_n with no prime factors other than 2, 3 and 5. */
+size_t fft_size(size_t min_n);
+
+} // end namespace tbem
+
+#endif
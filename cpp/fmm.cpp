@@ -1,4 +1,17 @@
+#include <map>
+#include <tuple>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "fmm.h"
+#include "fmm_cache.h"
 #include "nbody_operator.h"
 #include "util.h"
 
@@ -50,557 +63,3266 @@ TranslationSurface<3> TranslationSurface<3>::make_surrounding_surface(size_t ord
     return surrounding_surface_sphere(order);
 }
 
+/* The number of points on the boundary of a grid with n points per side. */
+template <size_t dim>
+size_t n_grid_boundary_pts(size_t n)
+{
+    size_t total = 1;
+    size_t interior = 1;
+    for (size_t d = 0; d < dim; d++) {
+        total *= n;
+        interior *= n - 2;
+    }
+    return total - interior;
+}
+
+template <size_t dim>
+TranslationSurface<dim> TranslationSurface<dim>::make_grid_surface(size_t order)
+{
+    size_t n = 2;
+    while (n_grid_boundary_pts<dim>(n) < order) {
+        n++;
+    }
+    if (n > 2 && order - n_grid_boundary_pts<dim>(n - 1) <
+            n_grid_boundary_pts<dim>(n) - order) {
+        n--;
+    }
+
+    std::vector<Vec<double,dim>> pts;
+    std::vector<Vec<double,dim>> normals;
+    size_t n_grid = 1;
+    for (size_t d = 0; d < dim; d++) {
+        n_grid *= n;
+    }
+    for (size_t i = 0; i < n_grid; i++) {
+        auto remaining = i;
+        bool boundary = false;
+        Vec<double,dim> pt;
+        auto normal = zeros<Vec<double,dim>>::make();
+        for (int d = dim - 1; d >= 0; d--) {
+            auto coord = remaining % n;
+            remaining /= n;
+            pt[d] = -1.0 + 2.0 * coord / (n - 1);
+            if (coord == 0) {
+                normal[d] = -1.0;
+                boundary = true;
+            } else if (coord == n - 1) {
+                normal[d] = 1.0;
+                boundary = true;
+            }
+        }
+        if (!boundary) {
+            continue;
+        }
+        pts.push_back(pt);
+        normals.push_back(normal / hypot(normal));
+    }
+    return {pts, normals};
+}
+
 
 template struct TranslationSurface<2>;
 template struct TranslationSurface<3>;
 
-//TODO: use dense operators...
-std::vector<double> 
-mat_vec(const std::vector<double>& A, const std::vector<double>& x)
+template <size_t dim>
+CellSurfaces<dim> make_cell_surfaces(const TranslationSurface<dim>& surf,
+    const Octree<dim>& oct)
+{
+    auto n_pts = surf.pts.size();
+    std::vector<Vec<double,dim>> pts(oct.n_nodes() * n_pts);
+    for (auto& cell: oct.nodes) {
+        surf.move(cell.bounds, pts.data() + cell.index * n_pts);
+    }
+    return {n_pts, pts, surf.normals, std::vector<double>(n_pts, 1.0)};
+}
+
+template CellSurfaces<2> make_cell_surfaces(const TranslationSurface<2>& surf,
+    const Octree<2>& oct);
+template CellSurfaces<3> make_cell_surfaces(const TranslationSurface<3>& surf,
+    const Octree<3>& oct);
+
+/* Apply a translation operator to a block of n_rhs coefficient vectors stored
+ * row-major, so that the operator is read once for all the vectors.
+ */
+template <typename Real>
+void translate(const std::vector<Real>& A, const Real* x, Real* out,
+    size_t n_inner, size_t n_rhs)
+{
+    auto n_rows = A.size() / n_inner;
+    assert(n_rows * n_inner == A.size());
+    matrix_matrix_product(A.data(), x, out, n_rows, n_inner, n_rhs);
+}
+
+/* Apply the transpose of a translation operator with n_rows rows. */
+template <typename Real>
+void translate_transpose(const std::vector<Real>& A, const Real* x, Real* out,
+    size_t n_rows, size_t n_rhs)
+{
+    auto n_cols = A.size() / n_rows;
+    assert(n_rows * n_cols == A.size());
+    transpose_matrix_product(A.data(), x, out, n_cols, n_rows, n_rhs);
+}
+
+void atomic_add(double& target, double value)
+{
+    #pragma omp atomic
+    target += value;
+}
+
+size_t thread_index()
+{
+#ifdef _OPENMP
+    return static_cast<size_t>(omp_get_thread_num());
+#else
+    return 0;
+#endif
+}
+
+size_t max_threads()
+{
+#ifdef _OPENMP
+    return static_cast<size_t>(omp_get_max_threads());
+#else
+    return 1;
+#endif
+}
+
+/* The arena of the apply whose tasks the calling thread is running. */
+template <size_t dim>
+FMMArena<dim>*& active_arena()
+{
+    static thread_local FMMArena<dim>* arena = nullptr;
+    return arena;
+}
+
+/* Points workspace() on the calling thread at an arena for as long as it is
+ * in scope.
+ */
+template <size_t dim>
+struct ActiveArena
+{
+    FMMArena<dim>* previous;
+
+    ActiveArena(FMMArena<dim>& arena): previous(active_arena<dim>())
+    {
+        active_arena<dim>() = &arena;
+    }
+
+    ~ActiveArena()
+    {
+        active_arena<dim>() = previous;
+    }
+};
+
+template struct FMMTasks<2>;
+template struct FMMTasks<3>;
+
+const size_t FMMStats::n_phases;
+
+template <size_t dim>
+void add_leaf_stats(const Octree<dim>& oct, size_t& depth,
+    std::vector<size_t>& histogram)
+{
+    for (auto& cell: oct.nodes) {
+        if (!cell.is_leaf()) {
+            continue;
+        }
+        depth = std::max(depth, cell.level);
+        size_t bin = 0;
+        for (auto n = cell.n_pts(); n > 0; n /= 2) {
+            bin++;
+        }
+        if (histogram.size() <= bin) {
+            histogram.resize(bin + 1, 0);
+        }
+        histogram[bin]++;
+    }
+}
+
+template <size_t dim>
+NBodyData<dim> permute_data(const NBodyData<dim>& data,
+    const std::vector<size_t>& obs_idx, const std::vector<size_t>& src_idx)
+{
+    NBodyData<dim> out;
+    out.obs_locs.resize(obs_idx.size());
+    out.obs_normals.resize(obs_idx.size());
+    for (size_t i = 0; i < obs_idx.size(); i++) {
+        out.obs_locs[i] = data.obs_locs[obs_idx[i]];
+        out.obs_normals[i] = data.obs_normals[obs_idx[i]];
+    }
+    out.src_locs.resize(src_idx.size());
+    out.src_normals.resize(src_idx.size());
+    out.src_weights.resize(src_idx.size());
+    for (size_t i = 0; i < src_idx.size(); i++) {
+        out.src_locs[i] = data.src_locs[src_idx[i]];
+        out.src_normals[i] = data.src_normals[src_idx[i]];
+        out.src_weights[i] = data.src_weights[src_idx[i]];
+    }
+    return out;
+}
+
+/* Move a vector with n_comp components per point and n_rhs values per 
+ * component between the original and tree orderings of the points.
+ */
+void to_tree_order(const std::vector<size_t>& original_index, size_t n_comp,
+    size_t n_rhs, const double* in, double* out)
+{
+    auto n = original_index.size();
+    for (size_t d = 0; d < n_comp; d++) {
+        for (size_t i = 0; i < n; i++) {
+            auto from = in + (d * n + original_index[i]) * n_rhs;
+            std::copy(from, from + n_rhs, out + (d * n + i) * n_rhs);
+        }
+    }
+}
+
+void from_tree_order(const std::vector<size_t>& original_index, size_t n_comp,
+    size_t n_rhs, const double* in, double* out)
+{
+    auto n = original_index.size();
+    for (size_t d = 0; d < n_comp; d++) {
+        for (size_t i = 0; i < n; i++) {
+            auto from = in + (d * n + i) * n_rhs;
+            std::copy(from, from + n_rhs, out + (d * n + original_index[i]) * n_rhs);
+        }
+    }
+}
+
+template <size_t dim>
+bool same_points(const NBodyData<dim>& data)
+{
+    return data.obs_locs == data.src_locs && data.obs_normals == data.src_normals;
+}
+
+/* Whether each point is within its leaf cell of oct, with the leaf grown by 
+ * tolerance times its half width. The points on the outer edge of the tree 
+ * can be a rounding error outside of their leaf, so a tiny bit of slack is 
+ * always allowed.
+ */
+template <size_t dim>
+bool points_in_leaves(const Octree<dim>& oct,
+    const std::vector<Vec<double,dim>>& pts, double tolerance)
+{
+    for (auto& cell: oct.nodes) {
+        if (!cell.is_leaf()) {
+            continue;
+        }
+        for (size_t i = cell.begin; i < cell.end; i++) {
+            auto& pt = pts[oct.indices[i]];
+            for (size_t d = 0; d < dim; d++) {
+                auto dist = std::fabs(pt[d] - cell.bounds.center[d]);
+                if (dist > cell.bounds.half_width[d] * (1 + tolerance + 1e-10)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/* The distance from the center of a translation surface to its nearest 
+ * point, relative to the cell radius.
+ */
+template <size_t dim>
+double surface_radius(const TranslationSurface<dim>& surf)
+{
+    double r = std::numeric_limits<double>::max();
+    for (auto& p: surf.pts) {
+        r = std::min(r, hypot(p));
+    }
+    return r;
+}
+
+/* How much both cells of a far field pair can grow before they fail the MAC
+ * of well_separated: the largest t for which cells with radii scaled by 
+ * 1 + t are still well separated.
+ */
+template <size_t dim>
+double mac_margin(const Box<dim>& a, const Box<dim>& b, double mac)
+{
+    auto r_a = hypot(a.half_width);
+    auto r_b = hypot(b.half_width);
+    double r_max = std::max(r_a, r_b);
+    double r_min = std::min(r_a, r_b);
+    auto sep = hypot(a.center - b.center);
+    return mac * sep / (r_max + mac * r_min) - 1;
+}
+
+/* See FMMOperator::max_refit_tolerance. A point within tolerance of its leaf
+ * is at most 1 + tolerance leaf radii from the leaf center.
+ */
+template <size_t dim>
+double refit_tolerance_cap(const FMMTasks<dim>& tasks, double mac,
+    const TranslationSurface<dim>& up_check_surface,
+    const TranslationSurface<dim>& down_equiv_surface)
+{
+    auto cap = std::min(
+        surface_radius(up_check_surface), surface_radius(down_equiv_surface)
+    ) - 1;
+    for (auto* far_tasks: {&tasks.m2ls, &tasks.m2ps, &tasks.p2ls}) {
+        for (auto& t: *far_tasks) {
+            cap = std::min(
+                cap, mac_margin(t.obs_cell.bounds, t.src_cell.bounds, mac)
+            );
+        }
+    }
+    return std::max(cap, 0.0);
+}
+
+template <size_t dim>
+std::shared_ptr<const Octree<dim>> build_tree(
+    const std::vector<Vec<double,dim>>& pts, size_t min_pts_per_cell)
+{
+    return std::make_shared<const Octree<dim>>(make_octree(pts, min_pts_per_cell));
+}
+
+/* With FMMConfig::fft_m2l, separate observation and source trees are built
+ * in the bounding box of all the points, so that cells on the same level of
+ * the two trees are the same size and the translations between them are 
+ * convolutions.
+ */
+template <size_t dim>
+std::shared_ptr<const Octree<dim>> build_tree(
+    const std::vector<Vec<double,dim>>& pts, const NBodyData<dim>& data,
+    const FMMConfig& config)
+{
+    if (!config.fft_m2l || data.obs_locs.empty() || data.src_locs.empty()) {
+        return build_tree(pts, config.min_pts_per_cell);
+    }
+    auto all_pts = data.obs_locs;
+    all_pts.insert(all_pts.end(), data.src_locs.begin(), data.src_locs.end());
+    auto box = Box<dim>::bounding_box(
+        balls_from_centers_radii(all_pts, std::vector<double>(all_pts.size(), 0.0))
+    );
+    return std::make_shared<const Octree<dim>>(
+        make_octree(pts, config.min_pts_per_cell, box)
+    );
+}
+
+FloatCheckToEquiv to_float(const CheckToEquiv& ops)
+{
+    FloatCheckToEquiv out;
+    for (auto& op: ops) {
+        out.push_back(std::vector<float>(op.begin(), op.end()));
+    }
+    return out;
+}
+
+CheckToEquiv transpose_check_to_equiv(const CheckToEquiv& ops, size_t n_rows)
+{
+    CheckToEquiv out;
+    for (auto& op: ops) {
+        auto n_cols = op.size() / n_rows;
+        std::vector<double> op_t(op.size());
+        for (size_t i = 0; i < n_rows; i++) {
+            for (size_t j = 0; j < n_cols; j++) {
+                op_t[j * n_rows + i] = op[i * n_cols + j];
+            }
+        }
+        out.push_back(std::move(op_t));
+    }
+    return out;
+}
+
+typedef std::complex<double> Complex;
+
+/* The number of channels needed for one of the normals of K by the Fourier
+ * space M2L (see FFTM2LGrid): 1 if K does not depend on the normal, dim if 
+ * K is linear in it and 0 otherwise. The kernel is compared at a few fixed
+ * points and normals.
+ */
+template <size_t dim, size_t R, size_t C>
+size_t normal_channels(const Kernel<dim,R,C>& K, bool obs_normal)
+{
+    auto eval = [&] (const Vec<double,dim>& x, const Vec<double,dim>& y,
+        const Vec<double,dim>& normal, const Vec<double,dim>& other) 
+    {
+        return obs_normal ? K(x, y, normal, other) : K(x, y, other, normal);
+    };
+
+    bool independent = true;
+    bool linear = true;
+    for (size_t trial = 0; trial < 3; trial++) {
+        Vec<double,dim> x, y, n1, n2, other;
+        for (size_t d = 0; d < dim; d++) {
+            x[d] = 0.3 * (d + 1) - 0.2 * trial;
+            y[d] = 1.7 - 0.6 * d + 0.5 * trial;
+            n1[d] = 0.2 + 0.3 * d - 0.4 * trial;
+            n2[d] = -0.7 + 0.5 * d + 0.1 * trial;
+            other[d] = 0.4 - 0.3 * d + 0.2 * trial;
+        }
+        n1 = n1 / hypot(n1);
+        n2 = n2 / hypot(n2);
+        other = other / hypot(other);
+
+        auto v1 = eval(x, y, n1, other);
+        auto v2 = eval(x, y, n2, other);
+        auto combined = zeros<typename Kernel<dim,R,C>::OperatorType>::make();
+        for (size_t d = 0; d < dim; d++) {
+            auto e_d = zeros<Vec<double,dim>>::make();
+            e_d[d] = 1.0;
+            auto v = eval(x, y, e_d, other);
+            for (size_t r = 0; r < R; r++) {
+                for (size_t c = 0; c < C; c++) {
+                    combined[r][c] += n1[d] * v[r][c];
+                }
+            }
+        }
+
+        double scale = 0;
+        double independent_error = 0;
+        double linear_error = 0;
+        for (size_t r = 0; r < R; r++) {
+            for (size_t c = 0; c < C; c++) {
+                scale = std::max(scale, std::fabs(v1[r][c]));
+                independent_error = std::max(
+                    independent_error, std::fabs(v1[r][c] - v2[r][c])
+                );
+                linear_error = std::max(
+                    linear_error, std::fabs(v1[r][c] - combined[r][c])
+                );
+            }
+        }
+        auto tolerance = 1e-10 * scale + 1e-300;
+        independent = independent && independent_error <= tolerance;
+        linear = linear && linear_error <= tolerance;
+    }
+    if (independent) {
+        return 1;
+    }
+    return linear ? dim : 0;
+}
+
+/* The unit normal used for channel a of a normal with n_channels channels
+ * (see normal_channels).
+ */
+template <size_t dim>
+Vec<double,dim> channel_normal(size_t a, size_t n_channels)
 {
-    assert(A.size() == x.size() * x.size());
-    std::vector<double> out(x.size(), 0.0);
-    for (size_t i = 0; i < x.size(); i++) {
-        for (size_t j = 0; j < x.size(); j++) {
-            out[i] += A[i * x.size() + j] * x[j];
+    auto out = zeros<Vec<double,dim>>::make();
+    out[n_channels == 1 ? 0 : a] = 1.0;
+    return out;
+}
+
+/* Number the output and input channels of K for the Fourier space M2L, 
+ * giving the same number to channels with the same kernel values (see
+ * FFTM2LGrid::out_channel). The channels are compared at a few fixed 
+ * offsets.
+ */
+template <size_t dim, size_t R, size_t C>
+void merge_channels(const Kernel<dim,R,C>& K, FFTM2LGrid<dim>& g)
+{
+    auto n_obs_channels = g.n_obs_channels;
+    auto n_src_channels = g.n_src_channels;
+    auto n_rows = R * n_obs_channels;
+    auto n_cols = C * n_src_channels;
+    auto zero = zeros<Vec<double,dim>>::make();
+
+    // For each trial offset, the kernel values for every pair of channels.
+    std::vector<double> vals;
+    double scale = 0;
+    for (size_t trial = 0; trial < 3; trial++) {
+        Vec<double,dim> delta;
+        for (size_t d = 0; d < dim; d++) {
+            delta[d] = 1.3 - 0.7 * d + 0.4 * trial;
+        }
+        for (size_t o = 0; o < n_rows; o++) {
+            for (size_t s = 0; s < n_cols; s++) {
+                auto k = K(
+                    delta, zero,
+                    channel_normal<dim>(o % n_obs_channels, n_obs_channels),
+                    channel_normal<dim>(s % n_src_channels, n_src_channels)
+                );
+                auto v = k[o / n_obs_channels][s / n_src_channels];
+                scale = std::max(scale, std::fabs(v));
+                vals.push_back(v);
+            }
+        }
+    }
+    auto tolerance = 1e-10 * scale;
+    auto n_trials = vals.size() / (n_rows * n_cols);
+    auto val = [&] (size_t trial, size_t o, size_t s) {
+        return vals[(trial * n_rows + o) * n_cols + s];
+    };
+
+    auto number = [&] (size_t n, std::function<bool(size_t,size_t)> same,
+        std::vector<size_t>& channel) 
+    {
+        size_t n_distinct = 0;
+        for (size_t i = 0; i < n; i++) {
+            channel.push_back(n_distinct);
+            for (size_t j = 0; j < i; j++) {
+                if (same(i, j)) {
+                    channel[i] = channel[j];
+                    break;
+                }
+            }
+            if (channel[i] == n_distinct) {
+                n_distinct++;
+            }
+        }
+        return n_distinct;
+    };
+    g.n_out = number(n_rows, [&] (size_t o1, size_t o2) {
+        for (size_t t = 0; t < n_trials; t++) {
+            for (size_t s = 0; s < n_cols; s++) {
+                if (std::fabs(val(t, o1, s) - val(t, o2, s)) > tolerance) {
+                    return false;
+                }
+            }
         }
+        return true;
+    }, g.out_channel);
+    g.n_in = number(n_cols, [&] (size_t s1, size_t s2) {
+        for (size_t t = 0; t < n_trials; t++) {
+            for (size_t o = 0; o < n_rows; o++) {
+                if (std::fabs(val(t, o, s1) - val(t, o, s2)) > tolerance) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }, g.in_channel);
+}
+
+/* The Fourier space M2L layout for K on a surface from make_grid_surface. */
+template <size_t dim, size_t R, size_t C>
+FFTM2LGrid<dim> make_fft_m2l_grid(const Kernel<dim,R,C>& K,
+    const TranslationSurface<dim>& surf)
+{
+    FFTM2LGrid<dim> out;
+    out.n_obs_channels = normal_channels(K, true);
+    out.n_src_channels = normal_channels(K, false);
+    if (!out.enabled()) {
+        return out;
+    }
+
+    auto n_pts = surf.pts.size();
+    out.grid_n = 2;
+    while (n_grid_boundary_pts<dim>(out.grid_n) < n_pts) {
+        out.grid_n++;
     }
+    assert(n_grid_boundary_pts<dim>(out.grid_n) == n_pts);
+    auto lower = surf.pts[0];
+    auto upper = surf.pts[0];
+    for (auto& p: surf.pts) {
+        for (size_t d = 0; d < dim; d++) {
+            lower[d] = std::min(lower[d], p[d]);
+            upper[d] = std::max(upper[d], p[d]);
+        }
+    }
+    out.unit_spacing = (upper[0] - lower[0]) / (out.grid_n - 1);
+
+    // The kernel values are needed at offsets from -(grid_n - 1) to 
+    // grid_n - 1 grid points along each dimension.
+    out.plan = FFTPlan(fft_size(2 * out.grid_n - 1), dim);
+    auto L = out.plan.n;
+    for (auto& p: surf.pts) {
+        size_t idx = 0;
+        for (size_t d = 0; d < dim; d++) {
+            auto coord = std::llround((p[d] - lower[d]) / out.unit_spacing);
+            idx = idx * L + static_cast<size_t>(coord);
+        }
+        out.grid_index.push_back(idx);
+    }
+    auto n_outer = out.plan.size() / L;
+    for (size_t i = 0; i < n_outer; i++) {
+        size_t negated = 0;
+        size_t place = 1;
+        auto remaining = i;
+        for (size_t d = 0; d + 1 < dim; d++) {
+            auto coord = remaining % L;
+            remaining /= L;
+            negated += ((L - coord) % L) * place;
+            place *= L;
+        }
+        out.negated_index.push_back(negated);
+    }
+
+    auto channel_weights = [&] (size_t n_channels) {
+        std::vector<double> weights;
+        for (size_t i = 0; i < n_pts; i++) {
+            for (size_t a = 0; a < n_channels; a++) {
+                weights.push_back(n_channels == 1 ? 1.0 : surf.normals[i][a]);
+            }
+        }
+        return weights;
+    };
+    out.obs_channel_weights = channel_weights(out.n_obs_channels);
+    out.src_channel_weights = channel_weights(out.n_src_channels);
+    merge_channels(K, out);
     return out;
 }
 
+/* Add the values for convolution channel u, which is summed from the 
+ * channels merged into it (see FFTM2LGrid::out_channel) with their weights,
+ * to the real or imaginary parts of a grid: grid entry j is part[2 * j]. 
+ * Surface point i of the values for kernel row or column r is at
+ * vals[(r * n_pts + i) * stride + offset]. 
+ */
+template <size_t dim, typename Real>
+void gather_channel(const FFTM2LGrid<dim>& g, const std::vector<size_t>& channel,
+    const std::vector<double>& weights, size_t n_channels, size_t u,
+    const Real* vals, size_t stride, size_t offset, double* part)
+{
+    auto n_pts = g.grid_index.size();
+    for (size_t o = 0; o < channel.size(); o++) {
+        if (channel[o] != u) {
+            continue;
+        }
+        auto r = o / n_channels;
+        auto a = o % n_channels;
+        for (size_t i = 0; i < n_pts; i++) {
+            part[2 * g.grid_index[i]] += weights[i * n_channels + a] *
+                static_cast<double>(vals[(r * n_pts + i) * stride + offset]);
+        }
+    }
+}
+
+/* The reverse of gather_channel: add the weighted values in the real or
+ * imaginary parts of a grid for convolution channel u to each of the 
+ * channels merged into it.
+ */
+template <size_t dim, typename Real>
+void scatter_channel(const FFTM2LGrid<dim>& g, const std::vector<size_t>& channel,
+    const std::vector<double>& weights, size_t n_channels, size_t u,
+    const double* part, Real* vals, size_t stride, size_t offset)
+{
+    auto n_pts = g.grid_index.size();
+    for (size_t o = 0; o < channel.size(); o++) {
+        if (channel[o] != u) {
+            continue;
+        }
+        auto r = o / n_channels;
+        auto a = o % n_channels;
+        for (size_t i = 0; i < n_pts; i++) {
+            vals[(r * n_pts + i) * stride + offset] += static_cast<Real>(
+                weights[i * n_channels + a] * part[2 * g.grid_index[i]]
+            );
+        }
+    }
+}
+
+/* Write or read the value at position idx of a stored transform (see 
+ * FFTM2LGrid::spectrum_index). 
+ */
+void store_freq(Complex v, double* spectra, size_t idx)
+{
+    spectra[idx] = v.real();
+    spectra[idx + fft_freq_block] = v.imag();
+}
+
+Complex load_freq(const double* spectra, size_t idx)
+{
+    return Complex(spectra[idx], spectra[idx + fft_freq_block]);
+}
+
+/* The transforms of real values are computed two at a time: with the 
+ * first values in the real parts of a grid and the second in the imaginary
+ * parts, the two transforms are the Hermitian and anti-Hermitian parts of
+ * the transform of the grid. 
+ *
+ * Transform grid in place and store the half (see FFTM2LGrid) of the 
+ * transform of its real parts as the given channel of the n_channels in 
+ * spectra and, with pair, that of its imaginary parts as the next channel.
+ * Without pair, the imaginary parts must be zero.
+ */
+template <size_t dim>
+void forward_half(const FFTM2LGrid<dim>& g, Complex* grid, Complex* scratch,
+    double* spectra, size_t n_channels, size_t channel, bool pair)
+{
+    g.plan.forward(grid, scratch);
+    auto L = g.plan.n;
+    auto L_half = L / 2 + 1;
+    auto n_outer = g.plan.size() / L;
+    for (size_t i = 0; i < n_outer; i++) {
+        auto negated = grid + g.negated_index[i] * L;
+        for (size_t l = 0; l < L_half; l++) {
+            auto j = i * L_half + l;
+            auto idx = g.spectrum_index(n_channels, channel, j);
+            auto v = grid[i * L + l];
+            if (!pair) {
+                store_freq(v, spectra, idx);
+                continue;
+            }
+            auto v_neg = std::conj(negated[(L - l) % L]);
+            auto diff = 0.5 * (v - v_neg);
+            store_freq(0.5 * (v + v_neg), spectra, idx);
+            store_freq(
+                Complex(diff.imag(), -diff.real()), spectra,
+                g.spectrum_index(n_channels, channel + 1, j)
+            );
+        }
+    }
+    auto n_padded = g.n_freq_blocks() * fft_freq_block;
+    for (size_t j = g.n_freqs(); j < n_padded; j++) {
+        for (size_t p = 0; p < (pair ? 2 : 1); p++) {
+            store_freq(0.0, spectra, g.spectrum_index(n_channels, channel + p, j));
+        }
+    }
+}
+
+/* The inverse of forward_half: fill in the full transform from the stored
+ * halves of the given channel and, with pair, the next one, and transform
+ * it back, leaving the values for the first channel in the real parts of 
+ * grid and those for the second in the imaginary parts.
+ */
+template <size_t dim>
+void inverse_half(const FFTM2LGrid<dim>& g, const double* spectra,
+    size_t n_channels, size_t channel, bool pair, Complex* grid,
+    Complex* scratch)
+{
+    auto L = g.plan.n;
+    auto L_half = L / 2 + 1;
+    auto n_outer = g.plan.size() / L;
+    const Complex i_unit(0.0, 1.0);
+    auto value = [&] (size_t j) {
+        auto v = load_freq(spectra, g.spectrum_index(n_channels, channel, j));
+        if (pair) {
+            v += i_unit * load_freq(
+                spectra, g.spectrum_index(n_channels, channel + 1, j)
+            );
+        }
+        return v;
+    };
+    auto conj_value = [&] (size_t j) {
+        auto v = std::conj(
+            load_freq(spectra, g.spectrum_index(n_channels, channel, j))
+        );
+        if (pair) {
+            v += i_unit * std::conj(load_freq(
+                spectra, g.spectrum_index(n_channels, channel + 1, j)
+            ));
+        }
+        return v;
+    };
+    for (size_t i = 0; i < n_outer; i++) {
+        for (size_t l = 0; l < L_half; l++) {
+            grid[i * L + l] = value(i * L_half + l);
+        }
+        auto negated = g.negated_index[i] * L_half;
+        for (size_t l = L_half; l < L; l++) {
+            grid[i * L + l] = conj_value(negated + L - l);
+        }
+    }
+    g.plan.inverse(grid, scratch);
+}
+
+/* The Fourier space translations of the tasks in an M2L batch that share an
+ * operator are done together, a block of frequencies at a time: for each 
+ * frequency, the translation is a small complex matrix product of the 
+ * operator's n_out by n_in matrix with a matrix that has a column per task.
+ * The operator's block is read once, as one contiguous run, for all of the
+ * tasks, instead of streaming the whole operator through the cache once per
+ * task.
+ *
+ * For block q of an operator (see M2LOperators::fft_ops), add the product 
+ * with the n_in channels of the transforms at srcs[t] to the n_out channels
+ * of the transforms at dsts[t], for each task t.
+ */
+void batched_spectra_product(const double* op, size_t n_out, size_t n_in,
+    size_t q, const double* const* srcs, double* const* dsts, size_t n_tasks)
+{
+    const size_t B = fft_freq_block;
+    auto op_block = op + q * n_out * n_in * 2 * B;
+    for (size_t t = 0; t < n_tasks; t++) {
+        auto x_block = srcs[t] + q * n_in * 2 * B;
+        auto y_block = dsts[t] + q * n_out * 2 * B;
+        for (size_t o = 0; o < n_out; o++) {
+            double sum_re[B] = {};
+            double sum_im[B] = {};
+            for (size_t s = 0; s < n_in; s++) {
+                auto k_re = op_block + (o * n_in + s) * 2 * B;
+                auto k_im = k_re + B;
+                auto x_re = x_block + s * 2 * B;
+                auto x_im = x_re + B;
+                for (size_t b = 0; b < B; b++) {
+                    sum_re[b] += k_re[b] * x_re[b] - k_im[b] * x_im[b];
+                    sum_im[b] += k_re[b] * x_im[b] + k_im[b] * x_re[b];
+                }
+            }
+            auto y_re = y_block + o * 2 * B;
+            auto y_im = y_re + B;
+            for (size_t b = 0; b < B; b++) {
+                y_re[b] += sum_re[b];
+                y_im[b] += sum_im[b];
+            }
+        }
+    }
+}
+
+/* The transposed translation: multiply the n_out output channels by the 
+ * conjugate transpose of the operator and add to the n_in input channels.
+ */
+void add_spectra_product_transpose(const double* op, const double* out,
+    double* in, size_t n_out, size_t n_in, size_t n_blocks)
+{
+    const size_t B = fft_freq_block;
+    for (size_t q = 0; q < n_blocks; q++) {
+        auto op_block = op + q * n_out * n_in * 2 * B;
+        for (size_t s = 0; s < n_in; s++) {
+            auto y_re = in + (q * n_in + s) * 2 * B;
+            auto y_im = y_re + B;
+            for (size_t o = 0; o < n_out; o++) {
+                auto k_re = op_block + (o * n_in + s) * 2 * B;
+                auto k_im = k_re + B;
+                auto x_re = out + (q * n_out + o) * 2 * B;
+                auto x_im = x_re + B;
+                for (size_t b = 0; b < B; b++) {
+                    y_re[b] += k_re[b] * x_re[b] + k_im[b] * x_im[b];
+                    y_im[b] += k_re[b] * x_im[b] - k_im[b] * x_re[b];
+                }
+            }
+        }
+    }
+}
+
 template <size_t dim, size_t R, size_t C>
 FMMOperator<dim,R,C>::FMMOperator(const Kernel<dim,R,C>& K,
     const NBodyData<dim>& data, const FMMConfig& config):
     K(K.clone()),
-    data(data),
-    up_equiv_surface(
-        TranslationSurface<dim>::up_equiv_surface(config.order, config.d)
+    up_equiv_surface(TranslationSurface<dim>::up_equiv_surface(
+        config.order, config.d, config.fft_m2l
+    )),
+    up_check_surface(TranslationSurface<dim>::up_check_surface(
+        config.order, config.d, config.fft_m2l
+    )),
+    down_equiv_surface(TranslationSurface<dim>::down_equiv_surface(
+        config.order, config.d, config.fft_m2l
+    )),
+    down_check_surface(TranslationSurface<dim>::down_check_surface(
+        config.order, config.d, config.fft_m2l
+    )),
+    single_tree(same_points(data)),
+    symmetric(single_tree && R == C && K.is_symmetric()),
+    src_tree(build_tree(data.src_locs, data, config)),
+    obs_tree(
+        single_tree ? src_tree : build_tree(data.obs_locs, data, config)
     ),
-    up_check_surface(
-        TranslationSurface<dim>::up_check_surface(config.order, config.d)
+    src_oct(*src_tree),
+    obs_oct(*obs_tree),
+    up_equiv_cells(make_cell_surfaces(up_equiv_surface, src_oct)),
+    up_check_cells(make_cell_surfaces(up_check_surface, src_oct)),
+    down_equiv_cells(make_cell_surfaces(down_equiv_surface, obs_oct)),
+    down_check_cells(make_cell_surfaces(down_check_surface, obs_oct)),
+    data(permute_data(
+        data, obs_oct.indices, src_oct.indices
+    )),
+    config(config),
+    up_check_to_equiv(
+        build_check_to_equiv(src_oct, up_equiv_surface, up_check_surface)
     ),
-    down_equiv_surface(
-        TranslationSurface<dim>::down_equiv_surface(config.order, config.d)
+    // With a symmetric kernel and a single tree, the down check surfaces 
+    // are the up equivalent surfaces and vice versa, so the down check to 
+    // equivalent operator is the transpose of the up operator.
+    down_check_to_equiv(symmetric ?
+        transpose_check_to_equiv(
+            up_check_to_equiv, C * up_equiv_surface.pts.size()
+        ) :
+        build_check_to_equiv(obs_oct, down_equiv_surface, down_check_surface)
     ),
-    down_check_surface(
-        TranslationSurface<dim>::down_check_surface(config.order, config.d)
+    float_down_check_to_equiv(config.float_farfield ?
+        to_float(down_check_to_equiv) : FloatCheckToEquiv{}
     ),
-    src_oct(make_octree(data.src_locs, config.min_pts_per_cell)),
-    obs_oct(make_octree(data.obs_locs, config.min_pts_per_cell)),
-    config(config),
-    up_check_to_equiv(
-        build_check_to_equiv(src_oct, 0, up_equiv_surface, up_check_surface)
+    fft_grid(config.fft_m2l ?
+        make_fft_m2l_grid(K, up_equiv_surface) : FFTM2LGrid<dim>{}
     ),
-    down_check_to_equiv(
-        build_check_to_equiv(obs_oct, 0, down_equiv_surface, down_check_surface)
-    )
+    tasks(build_tasks())
 {
-    upward_traversal(src_oct, tasks);
-    dual_tree(obs_oct, src_oct, tasks);
-    downward_traversal(obs_oct, tasks);
+    m2l_ops = precompute_M2L(tasks.m2ls);
+    schedule = build_schedule(tasks);
+    transpose_schedule = reverse_schedule(schedule);
+    max_refit_tolerance = refit_tolerance_cap(
+        tasks, config.mac, up_check_surface, down_equiv_surface
+    );
+    reserve_workspaces(arenas.latest(), 1);
+    add_leaf_stats(src_oct, stats.src_tree_depth, stats.src_leaf_size_histogram);
+    add_leaf_stats(obs_oct, stats.obs_tree_depth, stats.obs_leaf_size_histogram);
 }
 
 template <size_t dim, size_t R, size_t C>
 std::unique_ptr<OperatorI> FMMOperator<dim,R,C>::clone() const
 {
-    return std::unique_ptr<OperatorI>(new FMMOperator<dim,R,C>(
-        *K, data, config
-    ));
+    return std::unique_ptr<OperatorI>(new FMMOperator<dim,R,C>(*this));
+}
+
+template <size_t dim, size_t R, size_t C>
+bool FMMOperator<dim,R,C>::refit(const NBodyData<dim>& new_data, double tolerance)
+{
+    assert(new_data.obs_locs.size() == data.obs_locs.size());
+    assert(new_data.src_locs.size() == data.src_locs.size());
+    if (single_tree && !same_points(new_data)) {
+        return false;
+    }
+    tolerance = std::min(tolerance, max_refit_tolerance);
+    if (!points_in_leaves(src_oct, new_data.src_locs, tolerance)) {
+        return false;
+    }
+    if (!single_tree && !points_in_leaves(obs_oct, new_data.obs_locs, tolerance)) {
+        return false;
+    }
+    data = permute_data(
+        new_data, obs_oct.indices, src_oct.indices
+    );
+    return true;
+}
+
+
+/* In some cases, the equivalent surface to check surface operator is poorly
+ * conditioned, so the singular values are truncated to solve a regularized 
+ * least squares version of the problem. A single precision far field needs
+ * much stronger regularization: otherwise the equivalent densities are large
+ * and nearly cancel, and rounding them to float destroys the result. 
+ */
+double svd_threshold(const FMMConfig& config)
+{
+    return config.float_farfield ? 1e-5 : 1e-10;
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double>
+svd_inverse_nbody(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double threshold)
+{
+    auto op = nbody_matrix(K, data);
+    auto svd = svd_decompose(op);
+    set_threshold(svd, threshold);
+
+    auto out = svd_pseudoinverse(svd);
+    assert(out.size() == R * C * data.obs_locs.size() * data.src_locs.size());
+    return out;
+}
+
+template <size_t dim>
+void collect_level_cells(const Octree<dim>& oct,
+    std::vector<const OctreeNode<dim>*>& level_cells)
+{
+    for (auto& cell: oct.nodes) {
+        if (level_cells.size() <= cell.level) {
+            assert(level_cells.size() == cell.level);
+            level_cells.push_back(&cell);
+        }
+    }
 }
 
+template <size_t dim, size_t R, size_t C>
+CheckToEquiv FMMOperator<dim,R,C>::build_check_to_equiv(const Octree<dim>& oct,
+        const TranslationSurface<dim>& equiv_surf,
+        const TranslationSurface<dim>& check_surf) const
+{
+    // All the cells on a level are the same size, so one cell per level is
+    // enough to build the operators.
+    std::vector<const OctreeNode<dim>*> level_cells;
+    collect_level_cells(oct, level_cells);
+
+    CheckToEquiv ops;
+    std::vector<double> unit_op;
+    for (auto cell: level_cells) {
+        auto cell_r = hypot(cell->bounds.half_width);
+        if (K->is_homogeneous() && cell_r > 0) {
+            // The surfaces scale with the cell size. If K(s * r) = s^p K(r), 
+            // the check to equivalent operator, which inverts K, scales 
+            // by s^-p. The SVD truncation threshold is relative, so the 
+            // regularization is unchanged.
+            if (unit_op.size() == 0) {
+                unit_op = check_to_equiv_op(equiv_surf, check_surf, 1.0);
+            }
+            auto factor = std::pow(cell_r, -K->homogeneity_degree());
+            std::vector<double> op(unit_op.size());
+            for (size_t i = 0; i < op.size(); i++) {
+                op[i] = factor * unit_op[i];
+            }
+            ops.push_back(op);
+            continue;
+        }
+        ops.push_back(check_to_equiv_op(equiv_surf, check_surf, cell_r));
+    }
+
+    return ops;
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double> FMMOperator<dim,R,C>::check_to_equiv_op(
+    const TranslationSurface<dim>& equiv_surf,
+    const TranslationSurface<dim>& check_surf, double cell_r) const
+{
+    auto threshold = svd_threshold(config);
+    auto& cache_dir = config.precompute_cache_dir;
+    std::string key;
+    if (!cache_dir.empty()) {
+        std::ostringstream key_stream;
+        key_stream << std::setprecision(17) << "check_to_equiv "
+            << kernel_fingerprint(*K) << " " << surface_hash(equiv_surf) << " "
+            << surface_hash(check_surf) << " " << cell_r << " " << threshold;
+        key = key_stream.str();
+        std::vector<double> op;
+        if (load_cached_operator(cache_dir, key, op)) {
+            return op;
+        }
+    }
+
+    NBodyData<dim> down_data{
+        check_surf.scale(cell_r).pts, check_surf.normals,
+        equiv_surf.scale(cell_r).pts, equiv_surf.normals,
+        std::vector<double>(equiv_surf.pts.size(), 1.0)
+    };
+    auto op = svd_inverse_nbody(*K, down_data, threshold);
+    if (!cache_dir.empty()) {
+        save_cached_operator(cache_dir, key, op);
+    }
+    return op;
+}
+
+template <size_t dim>
+void set_obs(NBodyView<dim>& view, const CellSurfaces<dim>& surf,
+    const OctreeNode<dim>& cell)
+{
+    view.obs_locs = surf.cell_pts(cell);
+    view.obs_normals = surf.normals.data();
+    view.n_obs = surf.n_pts;
+}
+
+template <size_t dim>
+void set_src(NBodyView<dim>& view, const CellSurfaces<dim>& surf,
+    const OctreeNode<dim>& cell)
+{
+    view.src_locs = surf.cell_pts(cell);
+    view.src_normals = surf.normals.data();
+    view.src_weights = surf.weights.data();
+    view.n_src = surf.n_pts;
+}
+
+template <size_t dim>
+void set_obs(NBodyView<dim>& view, const NBodyData<dim>& pts,
+    size_t start, size_t n)
+{
+    view.obs_locs = pts.obs_locs.data() + start;
+    view.obs_normals = pts.obs_normals.data() + start;
+    view.n_obs = n;
+}
+
+template <size_t dim>
+void set_src(NBodyView<dim>& view, const NBodyData<dim>& pts,
+    size_t start, size_t n)
+{
+    view.src_locs = pts.src_locs.data() + start;
+    view.src_normals = pts.src_normals.data() + start;
+    view.src_weights = pts.src_weights.data() + start;
+    view.n_src = n;
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::add_obs_vals(const OctreeNode<dim>& cell,
+    const double* vals, std::vector<double>& out, size_t n_rhs) const
+{
+    auto n_obs = cell.n_pts();
+    auto start = cell.begin;
+    for (size_t d = 0; d < R; d++) {
+        auto out_start = (d * data.obs_locs.size() + start) * n_rhs;
+        auto vals_start = d * n_obs * n_rhs;
+        for (size_t i = 0; i < n_obs * n_rhs; i++) {
+            accumulate(out[out_start + i], vals[vals_start + i]);
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2M(const OctreeNode<dim>& cell,
+    const std::vector<double>& check_to_equiv, const std::vector<double>& x,
+    double* parent_multipoles, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = up_check_surface.pts.size();
+    auto src_start = cell.begin;
+
+    NBodyView<dim> s2c;
+    set_obs(s2c, up_check_cells, cell);
+    set_src(s2c, data, src_start, cell.n_pts());
+
+    auto check_eval = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    nbody_eval(
+        *K, s2c, x.data() + src_start * n_rhs, data.src_locs.size(), n_rhs,
+        check_eval, ws.kernel_scratch
+    );
+    translate(check_to_equiv, check_eval, parent_multipoles, n_check * R, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2M(const OctreeNode<dim>& cell,
+    const std::vector<double>& check_to_equiv,
+    const std::array<double*,Octree<dim>::split>& child_multipoles,
+    double* parent_multipoles, size_t n_rhs) const
+{
+    assert(!cell.is_leaf());
+
+    auto& ws = workspace();
+    auto n_children = cell.n_immediate_children();
+    auto n_equiv = up_equiv_surface.pts.size();
+    auto n_check = up_check_surface.pts.size();
+    auto n_src = n_children * n_equiv;
+
+    NBodyView<dim> c2c;
+    set_obs(c2c, up_check_cells, cell);
+
+    // The children's surfaces are not contiguous in the cache, so they are
+    // copied together.
+    auto& nbody = ws.nbody;
+
+    auto src_str = ws.buffer(ws.src_str, n_src * C * n_rhs);
+    size_t child_idx = 0;
+    for (size_t c = 0; c < Octree<dim>::split; c++) {
+        auto child = cell.child(c);
+        if (child == nullptr) {
+            continue;
+        }
+        auto start = child_idx * n_equiv;
+        auto child_pts = up_equiv_cells.cell_pts(*child);
+        std::copy(child_pts, child_pts + n_equiv, nbody.src_locs.begin() + start);
+        std::copy(
+            up_equiv_cells.normals.begin(), up_equiv_cells.normals.end(),
+            nbody.src_normals.begin() + start
+        );
+        std::fill_n(nbody.src_weights.begin() + start, n_equiv, 1.0);
+        for (size_t i = 0; i < n_equiv; i++) {
+            auto idx = child_idx * n_equiv + i;
+            for (size_t d = 0; d < C; d++) {
+                for (size_t k = 0; k < n_rhs; k++) {
+                    src_str[(d * n_src + idx) * n_rhs + k] = 
+                        child_multipoles[c][(d * n_equiv + i) * n_rhs + k];
+                }
+            }
+        }
+        child_idx++;
+    }
+    set_src(c2c, nbody, 0, n_src);
+
+    auto check_eval = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    nbody_eval(
+        *K, c2c, src_str, n_src, n_rhs, check_eval, ws.kernel_scratch
+    );
+    translate(check_to_equiv, check_eval, parent_multipoles, n_check * R, n_rhs);
+}
+
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2P(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& x, std::vector<double>& out,
+    size_t n_rhs) const 
+{
+    // The points of both cells are contiguous in the tree ordered data, so
+    // they are read in place.
+    auto& ws = workspace();
+    auto n_obs = obs_cell.n_pts();
+    auto src_start = src_cell.begin;
+
+    NBodyView<dim> p2p;
+    set_obs(p2p, data, obs_cell.begin, n_obs);
+    set_src(p2p, data, src_start, src_cell.n_pts());
+
+    auto res = ws.buffer(ws.obs_vals, n_obs * R * n_rhs);
+    nbody_eval(
+        *K, p2p, x.data() + src_start * n_rhs, data.src_locs.size(), n_rhs,
+        res, ws.kernel_scratch
+    );
+    add_obs_vals(obs_cell, res, out, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2P_symmetric(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& x,
+    std::vector<double>& out, size_t n_rhs, bool transpose) const
+{
+    assert(symmetric);
+    auto& ws = workspace();
+    bool same_cell = &obs_cell == &src_cell;
+    auto n_a = obs_cell.n_pts();
+    auto n_b = src_cell.n_pts();
+    auto a_start = obs_cell.begin;
+    auto b_start = src_cell.begin;
+    auto n_pts = data.src_locs.size();
+
+    auto a_vals = ws.buffer(ws.obs_vals, n_a * R * n_rhs);
+    auto b_vals = ws.buffer(ws.equiv, n_b * R * n_rhs);
+    std::fill_n(a_vals, n_a * R * n_rhs, 0.0);
+    std::fill_n(b_vals, n_b * R * n_rhs, 0.0);
+    auto& scratch = ws.kernel_scratch;
+    auto src = to_soa(
+        &data.src_locs[b_start], &data.src_normals[b_start], n_b, scratch.src
+    );
+    scratch.row.resize(R * C * n_b);
+    auto row = scratch.row.data();
+    for (size_t i = 0; i < n_a; i++) {
+        auto pi = a_start + i;
+        // Within a cell, each pair is visited once. A point has no 
+        // influence on itself.
+        auto j_start = same_cell ? i + 1 : 0;
+        auto n_row = n_b - j_start;
+        if (n_row == 0) {
+            continue;
+        }
+        K->call_row(
+            data.obs_locs[pi], data.obs_normals[pi],
+            src.slice(j_start, n_row), row
+        );
+        auto wi = data.src_weights[pi];
+        for (size_t d1 = 0; d1 < R; d1++) {
+            for (size_t d2 = 0; d2 < C; d2++) {
+                auto vals = &row[(d1 * C + d2) * n_row];
+                auto a_row = (d1 * n_a + i) * n_rhs;
+                auto xi = (d1 * n_pts + pi) * n_rhs;
+                for (size_t jj = 0; jj < n_row; jj++) {
+                    auto j = j_start + jj;
+                    auto pj = b_start + j;
+                    auto wj = data.src_weights[pj];
+                    auto k_val = vals[jj];
+                    auto b_row = (d2 * n_b + j) * n_rhs;
+                    auto xj = (d2 * n_pts + pj) * n_rhs;
+                    // The transpose swaps which weight goes with which
+                    // point.
+                    auto a_weight = transpose ? wi : wj;
+                    auto b_weight = transpose ? wj : wi;
+                    for (size_t k = 0; k < n_rhs; k++) {
+                        a_vals[a_row + k] += k_val * a_weight * x[xj + k];
+                        b_vals[b_row + k] += k_val * b_weight * x[xi + k];
+                    }
+                }
+            }
+        }
+    }
+    add_obs_vals(obs_cell, a_vals, out, n_rhs);
+    add_obs_vals(src_cell, b_vals, out, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2L(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& check_to_equiv,
+    const std::vector<double>& x, double* locals, size_t n_rhs) const
+{
+    //TODO: This is almost identical to the P2M operator.
+    auto& ws = workspace();
+    auto n_check = down_check_surface.pts.size();
+    auto n_equiv = down_equiv_surface.pts.size();
+    auto src_start = src_cell.begin;
+
+    NBodyView<dim> s2c;
+    set_obs(s2c, down_check_cells, obs_cell);
+    set_src(s2c, data, src_start, src_cell.n_pts());
+
+    auto check_eval = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    nbody_eval(
+        *K, s2c, x.data() + src_start * n_rhs, data.src_locs.size(), n_rhs,
+        check_eval, ws.kernel_scratch
+    );
+    auto n_out = n_equiv * C * n_rhs;
+    auto equiv_srcs = ws.buffer(ws.equiv, n_out);
+    translate(check_to_equiv, check_eval, equiv_srcs, n_check * R, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        accumulate(locals[i], equiv_srcs[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2P(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, double* multipoles, std::vector<double>& out,
+    size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_obs = obs_cell.n_pts();
+    auto n_equiv = up_equiv_surface.pts.size();
+
+    NBodyView<dim> m2p;
+    set_obs(m2p, data, obs_cell.begin, n_obs);
+    set_src(m2p, up_equiv_cells, src_cell);
+
+    auto res = ws.buffer(ws.obs_vals, n_obs * R * n_rhs);
+    nbody_eval(*K, m2p, multipoles, n_equiv, n_rhs, res, ws.kernel_scratch);
+    add_obs_vals(obs_cell, res, out, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double> FMMOperator<dim,R,C>::build_M2L(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell) const
+{
+    auto n_src_equiv = up_equiv_surface.pts.size();
+    NBodyData<dim> m2l;
+    m2l.src_locs = up_equiv_surface.move(src_cell.bounds);
+    m2l.src_normals = up_equiv_surface.normals;
+    m2l.src_weights = std::vector<double>(n_src_equiv, 1.0);
+    m2l.obs_locs = down_check_surface.move(obs_cell.bounds);
+    m2l.obs_normals = down_check_surface.normals;
+    return nbody_matrix(*K, m2l);
+}
+
+/* Whether the surface grids of two cells have the same spacing, so that the
+ * translation between them is a convolution.
+ */
+template <size_t dim>
+bool same_size(const OctreeNode<dim>& a, const OctreeNode<dim>& b)
+{
+    auto r_a = hypot(a.bounds.half_width);
+    auto r_b = hypot(b.bounds.half_width);
+    return std::fabs(r_a - r_b) <= 1e-12 * r_a;
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double> FMMOperator<dim,R,C>::build_fft_M2L(
+    const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell) const
+{
+    assert(fft_grid.enabled());
+    assert(same_size(obs_cell, src_cell));
+    auto& plan = fft_grid.plan;
+    auto L = plan.n;
+    auto n_grid = plan.size();
+    auto n = static_cast<long>(fft_grid.grid_n);
+    auto n_obs_channels = fft_grid.n_obs_channels;
+    auto n_src_channels = fft_grid.n_src_channels;
+    auto n_out = fft_grid.n_out;
+    auto n_in = fft_grid.n_in;
+
+    // The surface points of a cell are hypot(half_width) * pts + center, so
+    // for grid points g_i and g_j of the two cells, 
+    // x_i - y_j = (obs center - src center) + spacing * (g_i - g_j).
+    auto spacing = hypot(obs_cell.bounds.half_width) * fft_grid.unit_spacing;
+    auto center_delta = obs_cell.bounds.center - src_cell.bounds.center;
+    auto zero = zeros<Vec<double,dim>>::make();
+
+    // The kernel values for each pair of channels, at the offsets wrapped 
+    // around onto the grid. The grid is large enough that the offsets do not
+    // overlap, and the other entries are zero.
+    std::vector<Complex> vals(n_out * n_in * n_grid, Complex(0.0));
+    for (size_t idx = 0; idx < n_grid; idx++) {
+        auto remaining = idx;
+        auto delta = center_delta;
+        bool used = true;
+        for (int d = dim - 1; d >= 0; d--) {
+            auto coord = static_cast<long>(remaining % L);
+            remaining /= L;
+            auto offset = coord < n ? coord : coord - static_cast<long>(L);
+            used = used && offset > -n;
+            delta[d] += spacing * offset;
+        }
+        if (!used) {
+            continue;
+        }
+        for (size_t a = 0; a < n_obs_channels; a++) {
+            for (size_t b = 0; b < n_src_channels; b++) {
+                auto k = (*K)(
+                    delta, zero, channel_normal<dim>(a, n_obs_channels),
+                    channel_normal<dim>(b, n_src_channels)
+                );
+                // Merged channels have the same values, so writing them 
+                // more than once does not matter.
+                for (size_t r = 0; r < R; r++) {
+                    for (size_t c = 0; c < C; c++) {
+                        auto o = fft_grid.out_channel[r * n_obs_channels + a];
+                        auto s = fft_grid.in_channel[c * n_src_channels + b];
+                        vals[(o * n_in + s) * n_grid + idx] = k[r][c] / n_grid;
+                    }
+                }
+            }
+        }
+    }
+
+    auto n_ops = n_out * n_in;
+    std::vector<double> out(fft_grid.spectrum_size(n_ops));
+    std::vector<Complex> scratch(plan.scratch_size());
+    for (size_t i = 0; i < n_ops; i += 2) {
+        auto grid = &vals[i * n_grid];
+        bool pair = i + 1 < n_ops;
+        if (pair) {
+            for (size_t j = 0; j < n_grid; j++) {
+                grid[j] += Complex(0.0, vals[(i + 1) * n_grid + j].real());
+            }
+        }
+        forward_half(fft_grid, grid, scratch.data(), out.data(), n_ops, i, pair);
+    }
+    return out;
+}
+
+template <size_t dim>
+using M2LKey = std::tuple<size_t,size_t,Vec<long long,dim>>;
+
+template <size_t dim>
+M2LKey<dim> m2l_key(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell)
+{
+    // All cells on the same level of a tree have the same size, so the levels
+    // and the relative offset determine the geometry of the translation. 
+    // The offset is measured in units of the observation cell size and 
+    // rounded so that floating point noise in the cell centers does not
+    // prevent operators from being shared.
+    const double quantum = 1e-8;
+    auto scale = hypot(obs_cell.bounds.half_width);
+    auto delta = src_cell.bounds.center - obs_cell.bounds.center;
+    Vec<long long,dim> offset;
+    for (size_t d = 0; d < dim; d++) {
+        offset[d] = std::llround(delta[d] / (scale * quantum));
+    }
+    return M2LKey<dim>{obs_cell.level, src_cell.level, offset};
+}
+
+template <size_t dim, size_t R, size_t C>
+M2LOperators FMMOperator<dim,R,C>::precompute_M2L(
+    const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls) const
+{
+    M2LOperators out;
+    out.task_ops.resize(m2ls.size());
+
+    std::map<M2LKey<dim>,size_t> op_indices;
+    std::vector<size_t> op_tasks;
+    for (size_t i = 0; i < m2ls.size(); i++) {
+        auto key = m2l_key(m2ls[i].obs_cell, m2ls[i].src_cell);
+        auto inserted = op_indices.insert({key, op_tasks.size()});
+        if (inserted.second) {
+            op_tasks.push_back(i);
+        }
+        out.task_ops[i] = inserted.first->second;
+    }
+
+    if (config.float_farfield) {
+        out.float_ops.resize(op_tasks.size());
+    } else {
+        out.ops.resize(op_tasks.size());
+    }
+    if (fft_grid.enabled()) {
+        out.fft_ops.resize(op_tasks.size());
+    }
+#pragma omp parallel for
+    for (size_t i = 0; i < op_tasks.size(); i++) {
+        auto& t = m2ls[op_tasks[i]];
+        if (fft_grid.enabled() && same_size(t.obs_cell, t.src_cell)) {
+            out.fft_ops[i] = build_fft_M2L(t.obs_cell, t.src_cell);
+            continue;
+        }
+        auto op = build_M2L(t.obs_cell, t.src_cell);
+        if (config.float_farfield) {
+            out.float_ops[i].assign(op.begin(), op.end());
+        } else {
+            out.ops[i] = std::move(op);
+        }
+    }
+
+    if (fft_grid.enabled()) {
+        const size_t none = std::numeric_limits<size_t>::max();
+        out.fft_src_slots.assign(src_oct.n_nodes(), none);
+        for (size_t i = 0; i < m2ls.size(); i++) {
+            auto& slot = out.fft_src_slots[m2ls[i].src_cell.index];
+            if (out.is_fft(out.task_ops[i]) && slot == none) {
+                slot = out.n_fft_src_cells;
+                out.n_fft_src_cells++;
+            }
+        }
+    }
+    return out;
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2L(const std::vector<double>& m2l_op,
+    const std::vector<double>& down_check_to_equiv, double* multipoles,
+    double* locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = R * down_check_surface.pts.size();
+    auto n_multipole = C * up_equiv_surface.pts.size();
+    assert(m2l_op.size() == n_check * n_multipole);
+
+    auto check_eval = ws.buffer(ws.obs_vals, n_check * n_rhs);
+    matrix_matrix_product(
+        m2l_op.data(), multipoles, check_eval, n_check, n_multipole, n_rhs
+    );
+    auto n_out = C * down_equiv_surface.pts.size() * n_rhs;
+    auto solved = ws.buffer(ws.equiv, n_out);
+    translate(down_check_to_equiv, check_eval, solved, n_check, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        accumulate(locals[i], solved[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2L(const std::vector<float>& m2l_op,
+    const std::vector<float>& down_check_to_equiv, float* multipoles,
+    float* locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = R * down_check_surface.pts.size();
+    auto n_multipole = C * up_equiv_surface.pts.size();
+    assert(m2l_op.size() == n_check * n_multipole);
+
+    auto check_eval = ws.buffer(ws.float_vals, n_check * n_rhs);
+    matrix_matrix_product(
+        m2l_op.data(), multipoles, check_eval, n_check, n_multipole, n_rhs
+    );
+    auto n_out = C * down_equiv_surface.pts.size() * n_rhs;
+    auto solved = ws.buffer(ws.float_equiv, n_out);
+    translate(down_check_to_equiv, check_eval, solved, n_check, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        accumulate(locals[i], solved[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::transform_multipoles(const double* multipoles,
+    double* spectra, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_in = fft_grid.n_in;
+    auto n_grid = fft_grid.plan.size();
+    auto grid = ws.buffer(ws.fft_grid, n_grid);
+    auto scratch = ws.buffer(ws.fft_scratch, fft_grid.plan.scratch_size());
+    auto grid_parts = reinterpret_cast<double*>(grid);
+    for (size_t k = 0; k < n_rhs; k++) {
+        auto out = spectra + k * fft_grid.spectrum_size(n_in);
+        for (size_t s = 0; s < n_in; s += 2) {
+            std::fill_n(grid, n_grid, Complex(0.0));
+            bool pair = s + 1 < n_in;
+            for (size_t p = 0; p < (pair ? 2 : 1); p++) {
+                gather_channel(
+                    fft_grid, fft_grid.in_channel, fft_grid.src_channel_weights,
+                    fft_grid.n_src_channels, s + p, multipoles, n_rhs, k,
+                    grid_parts + p
+                );
+            }
+            forward_half(fft_grid, grid, scratch, out, n_in, s, pair);
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+template <typename Real>
+void FMMOperator<dim,R,C>::M2L_fft_tasks(const M2LBatch<dim>& batch,
+    const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls,
+    const std::vector<size_t>& task_ops,
+    const std::vector<std::vector<double>>& fft_ops,
+    const std::vector<size_t>& fft_src_slots, const double* multipole_spectra,
+    const size_t* fft_tasks, size_t n_fft_tasks, Real* check, size_t k,
+    size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_cells = batch.obs_cells.size();
+    auto n_out = fft_grid.n_out;
+    auto n_in = fft_grid.n_in;
+    auto n_src_spectrum = fft_grid.spectrum_size(n_in);
+    auto n_obs_spectrum = fft_grid.spectrum_size(n_out);
+
+    auto n_grid = fft_grid.plan.size();
+    auto grid = ws.buffer(ws.fft_grid, n_grid);
+    auto scratch = ws.buffer(ws.fft_scratch, fft_grid.plan.scratch_size());
+    auto sums = ws.buffer(ws.fft_sums, n_cells * n_obs_spectrum);
+    std::fill_n(sums, n_cells * n_obs_spectrum, 0.0);
+
+    size_t begin = 0;
+    while (begin < n_fft_tasks) {
+        auto op_idx = task_ops[batch.tasks[fft_tasks[begin]]];
+        auto end = begin + 1;
+        while (end < n_fft_tasks && task_ops[batch.tasks[fft_tasks[end]]] == op_idx) {
+            end++;
+        }
+        auto op = fft_ops[op_idx].data();
+        auto n_tasks = end - begin;
+        auto srcs = ws.buffer(ws.fft_batch_srcs, n_tasks);
+        auto dsts = ws.buffer(ws.fft_batch_dsts, n_tasks);
+        for (size_t t = 0; t < n_tasks; t++) {
+            auto j = fft_tasks[begin + t];
+            auto src_slot = fft_src_slots[m2ls[batch.tasks[j]].src_cell.index];
+            srcs[t] = multipole_spectra + (src_slot * n_rhs + k) * n_src_spectrum;
+            dsts[t] = sums + batch.obs_slots[j] * n_obs_spectrum;
+        }
+        for (size_t q = 0; q < fft_grid.n_freq_blocks(); q++) {
+            batched_spectra_product(op, n_out, n_in, q, srcs, dsts, n_tasks);
+        }
+        begin = end;
+    }
+
+    auto grid_parts = reinterpret_cast<const double*>(grid);
+    for (size_t slot = 0; slot < n_cells; slot++) {
+        auto cell_sums = sums + slot * n_obs_spectrum;
+        for (size_t o = 0; o < n_out; o += 2) {
+            bool pair = o + 1 < n_out;
+            inverse_half(fft_grid, cell_sums, n_out, o, pair, grid, scratch);
+            for (size_t p = 0; p < (pair ? 2 : 1); p++) {
+                scatter_channel(
+                    fft_grid, fft_grid.out_channel, fft_grid.obs_channel_weights,
+                    fft_grid.n_obs_channels, o + p, grid_parts + p, check,
+                    n_cells, slot
+                );
+            }
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+template <typename Real>
+void FMMOperator<dim,R,C>::M2L_batch(const M2LBatch<dim>& batch,
+    const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls,
+    const std::vector<size_t>& task_ops,
+    const std::vector<std::vector<Real>>& m2l_ops,
+    const std::vector<std::vector<double>>& fft_ops,
+    const std::vector<size_t>& fft_src_slots, const double* multipole_spectra,
+    const std::vector<Real>& down_check_to_equiv, const Real* multipoles,
+    Real* locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = R * down_check_surface.pts.size();
+    auto n_multipole = C * up_equiv_surface.pts.size();
+    auto n_local = C * down_equiv_surface.pts.size();
+    auto n_cells = batch.obs_cells.size();
+    const Real* precision = nullptr;
+    auto is_fft = [&] (size_t op_idx) {
+        return op_idx < fft_ops.size() && fft_ops[op_idx].size() > 0;
+    };
+
+    // The positions in the batch of the tasks with Fourier space operators.
+    // The batch tasks are sorted by operator, so these are too.
+    size_t n_fft_tasks = 0;
+    size_t* fft_tasks = nullptr;
+    if (fft_ops.size() > 0) {
+        fft_tasks = ws.buffer(ws.fft_tasks, batch.tasks.size());
+        for (size_t j = 0; j < batch.tasks.size(); j++) {
+            if (is_fft(task_ops[batch.tasks[j]])) {
+                fft_tasks[n_fft_tasks] = j;
+                n_fft_tasks++;
+            }
+        }
+    }
+
+    // The right hand sides are translated one at a time. BLAS may round a
+    // column differently depending on how many columns the product has, and 
+    // the ill-conditioned check to equivalent solve magnifies that, so this 
+    // keeps a block apply equal to applying each vector separately.
+    for (size_t k = 0; k < n_rhs; k++) {
+        // The check surface values of the cells side by side, as the n_check
+        // rows of a matrix with a column per cell.
+        auto check = ws.buffer(ws.m2l_buffer(2, precision), n_check * n_cells);
+        std::fill_n(check, n_check * n_cells, Real(0));
+
+        size_t begin = 0;
+        while (begin < batch.tasks.size()) {
+            auto op_idx = task_ops[batch.tasks[begin]];
+            auto end = begin + 1;
+            while (end < batch.tasks.size() && task_ops[batch.tasks[end]] == op_idx) {
+                end++;
+            }
+            if (is_fft(op_idx)) {
+                begin = end;
+                continue;
+            }
+
+            // Gather the multipoles of the source cells that share this
+            // operator into the columns of a single matrix.
+            auto n_cols = end - begin;
+            auto gathered = ws.buffer(
+                ws.m2l_buffer(0, precision), n_multipole * n_cols
+            );
+            for (size_t j = begin; j < end; j++) {
+                auto& src_cell = m2ls[batch.tasks[j]].src_cell;
+                auto src = multipoles + src_cell.index * n_multipole * n_rhs;
+                for (size_t row = 0; row < n_multipole; row++) {
+                    gathered[row * n_cols + j - begin] = src[row * n_rhs + k];
+                }
+            }
+
+            auto product = ws.buffer(ws.m2l_buffer(1, precision), n_check * n_cols);
+            assert(m2l_ops[op_idx].size() == n_check * n_multipole);
+            matrix_matrix_product(
+                m2l_ops[op_idx].data(), gathered, product, n_check, n_multipole,
+                n_cols
+            );
+
+            for (size_t j = begin; j < end; j++) {
+                auto slot = batch.obs_slots[j];
+                for (size_t row = 0; row < n_check; row++) {
+                    check[row * n_cells + slot] += product[row * n_cols + j - begin];
+                }
+            }
+            begin = end;
+        }
+        if (n_fft_tasks > 0) {
+            M2L_fft_tasks(
+                batch, m2ls, task_ops, fft_ops, fft_src_slots,
+                multipole_spectra, fft_tasks, n_fft_tasks, check, k, n_rhs
+            );
+        }
+
+        auto solved = ws.buffer(ws.m2l_buffer(0, precision), n_local * n_cells);
+        assert(down_check_to_equiv.size() == n_local * n_check);
+        matrix_matrix_product(
+            down_check_to_equiv.data(), check, solved, n_local, n_check, n_cells
+        );
+        for (size_t s = 0; s < n_cells; s++) {
+            auto cell_locals = locals + batch.obs_cells[s]->index * n_local * n_rhs;
+            for (size_t row = 0; row < n_local; row++) {
+                accumulate(cell_locals[row * n_rhs + k], solved[row * n_cells + s]);
+            }
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::L2L(const OctreeNode<dim>& parent_cell,
+    const OctreeNode<dim>& child_cell, const std::vector<double>& check_to_equiv,
+    double* parent_locals, double* child_locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = down_check_surface.pts.size();
+    auto n_equiv = down_equiv_surface.pts.size();
+
+    NBodyView<dim> l2l;
+    set_src(l2l, down_equiv_cells, parent_cell);
+    set_obs(l2l, down_check_cells, child_cell);
+
+    auto check_eval = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    nbody_eval(
+        *K, l2l, parent_locals, n_equiv, n_rhs, check_eval, ws.kernel_scratch
+    );
+    auto n_out = n_equiv * C * n_rhs;
+    auto equiv_srcs = ws.buffer(ws.equiv, n_out);
+    translate(check_to_equiv, check_eval, equiv_srcs, n_check * R, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        accumulate(child_locals[i], equiv_srcs[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::L2P(const OctreeNode<dim>& cell,
+    double* locals, std::vector<double>& out, size_t n_rhs) const
+{
+    //TODO: Code is essentially identical to M2P, refactor out a coeffs2P function
+    auto& ws = workspace();
+    auto n_obs = cell.n_pts();
+    auto n_equiv = down_equiv_surface.pts.size();
+
+    NBodyView<dim> l2p;
+    set_obs(l2p, data, cell.begin, n_obs);
+    set_src(l2p, down_equiv_cells, cell);
+
+    auto res = ws.buffer(ws.obs_vals, n_obs * R * n_rhs);
+    nbody_eval(*K, l2p, locals, n_equiv, n_rhs, res, ws.kernel_scratch);
+    add_obs_vals(cell, res, out, n_rhs);
+}
+
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::add_src_vals(const OctreeNode<dim>& cell,
+    const double* vals, std::vector<double>& x, size_t n_rhs) const
+{
+    auto n_src = cell.n_pts();
+    auto start = cell.begin;
+    for (size_t d = 0; d < C; d++) {
+        auto x_start = (d * data.src_locs.size() + start) * n_rhs;
+        auto vals_start = d * n_src * n_rhs;
+        for (size_t i = 0; i < n_src * n_rhs; i++) {
+            atomic_add(x[x_start + i], vals[vals_start + i]);
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2M_transpose(const OctreeNode<dim>& cell,
+    const std::vector<double>& check_to_equiv, const double* multipoles,
+    std::vector<double>& x, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = up_check_surface.pts.size();
+    auto n_src = cell.n_pts();
+
+    NBodyView<dim> s2c;
+    set_obs(s2c, up_check_cells, cell);
+    set_src(s2c, data, cell.begin, n_src);
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    translate_transpose(
+        check_to_equiv, multipoles, check_vals, C * up_equiv_surface.pts.size(),
+        n_rhs
+    );
+    auto src_vals = ws.buffer(ws.src_str, n_src * C * n_rhs);
+    nbody_eval_transpose(
+        *K, s2c, check_vals, n_check, n_rhs, src_vals, ws.kernel_scratch
+    );
+    add_src_vals(cell, src_vals, x, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2M_transpose(const OctreeNode<dim>& cell,
+    const std::vector<double>& check_to_equiv, const double* parent_multipoles,
+    const std::array<double*,Octree<dim>::split>& child_multipoles,
+    size_t n_rhs) const
+{
+    assert(!cell.is_leaf());
+
+    auto& ws = workspace();
+    auto n_children = cell.n_immediate_children();
+    auto n_equiv = up_equiv_surface.pts.size();
+    auto n_check = up_check_surface.pts.size();
+    auto n_src = n_children * n_equiv;
+
+    NBodyView<dim> c2c;
+    set_obs(c2c, up_check_cells, cell);
+
+    auto& nbody = ws.nbody;
+    size_t child_idx = 0;
+    for (size_t c = 0; c < Octree<dim>::split; c++) {
+        auto child = cell.child(c);
+        if (child == nullptr) {
+            continue;
+        }
+        auto start = child_idx * n_equiv;
+        auto child_pts = up_equiv_cells.cell_pts(*child);
+        std::copy(child_pts, child_pts + n_equiv, nbody.src_locs.begin() + start);
+        std::copy(
+            up_equiv_cells.normals.begin(), up_equiv_cells.normals.end(),
+            nbody.src_normals.begin() + start
+        );
+        std::fill_n(nbody.src_weights.begin() + start, n_equiv, 1.0);
+        child_idx++;
+    }
+    set_src(c2c, nbody, 0, n_src);
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    translate_transpose(
+        check_to_equiv, parent_multipoles, check_vals, C * n_equiv, n_rhs
+    );
+    auto src_vals = ws.buffer(ws.src_str, n_src * C * n_rhs);
+    nbody_eval_transpose(
+        *K, c2c, check_vals, n_check, n_rhs, src_vals, ws.kernel_scratch
+    );
+
+    child_idx = 0;
+    for (size_t c = 0; c < Octree<dim>::split; c++) {
+        if (cell.child(c) == nullptr) {
+            continue;
+        }
+        for (size_t i = 0; i < n_equiv; i++) {
+            auto idx = child_idx * n_equiv + i;
+            for (size_t d = 0; d < C; d++) {
+                for (size_t k = 0; k < n_rhs; k++) {
+                    atomic_add(
+                        child_multipoles[c][(d * n_equiv + i) * n_rhs + k],
+                        src_vals[(d * n_src + idx) * n_rhs + k]
+                    );
+                }
+            }
+        }
+        child_idx++;
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2L_transpose(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& check_to_equiv,
+    const double* locals, std::vector<double>& x, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = down_check_surface.pts.size();
+    auto n_src = src_cell.n_pts();
+
+    NBodyView<dim> s2c;
+    set_obs(s2c, down_check_cells, obs_cell);
+    set_src(s2c, data, src_cell.begin, n_src);
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    translate_transpose(
+        check_to_equiv, locals, check_vals, C * down_equiv_surface.pts.size(),
+        n_rhs
+    );
+    auto src_vals = ws.buffer(ws.src_str, n_src * C * n_rhs);
+    nbody_eval_transpose(
+        *K, s2c, check_vals, n_check, n_rhs, src_vals, ws.kernel_scratch
+    );
+    add_src_vals(src_cell, src_vals, x, n_rhs);
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2P_transpose(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& y,
+    double* multipoles, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_obs = obs_cell.n_pts();
+    auto n_equiv = up_equiv_surface.pts.size();
+    auto obs_start = obs_cell.begin;
+
+    NBodyView<dim> m2p;
+    set_obs(m2p, data, obs_start, n_obs);
+    set_src(m2p, up_equiv_cells, src_cell);
+
+    auto n_out = n_equiv * C * n_rhs;
+    auto equiv_vals = ws.buffer(ws.equiv, n_out);
+    nbody_eval_transpose(
+        *K, m2p, y.data() + obs_start * n_rhs, data.obs_locs.size(), n_rhs,
+        equiv_vals, ws.kernel_scratch
+    );
+    for (size_t i = 0; i < n_out; i++) {
+        atomic_add(multipoles[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2L_transpose(const std::vector<double>& m2l_op,
+    const std::vector<double>& down_check_to_equiv, const double* locals,
+    double* multipoles, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = R * down_check_surface.pts.size();
+    auto n_multipole = C * up_equiv_surface.pts.size();
+    assert(m2l_op.size() == n_check * n_multipole);
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * n_rhs);
+    translate_transpose(
+        down_check_to_equiv, locals, check_vals,
+        C * down_equiv_surface.pts.size(), n_rhs
+    );
+    auto n_out = n_multipole * n_rhs;
+    auto equiv_vals = ws.buffer(ws.equiv, n_out);
+    translate_transpose(m2l_op, check_vals, equiv_vals, n_check, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        atomic_add(multipoles[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2L_transpose(const std::vector<float>& m2l_op,
+    const std::vector<float>& down_check_to_equiv, const double* locals,
+    double* multipoles, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = R * down_check_surface.pts.size();
+    auto n_multipole = C * up_equiv_surface.pts.size();
+    auto n_local = C * down_equiv_surface.pts.size();
+    assert(m2l_op.size() == n_check * n_multipole);
+
+    auto float_locals = ws.buffer(ws.float_equiv, n_local * n_rhs);
+    std::copy(locals, locals + n_local * n_rhs, float_locals);
+    auto check_vals = ws.buffer(ws.float_vals, n_check * n_rhs);
+    translate_transpose(
+        down_check_to_equiv, float_locals, check_vals, n_local, n_rhs
+    );
+    // The local coefficients have been read, so their buffer is reused.
+    auto n_out = n_multipole * n_rhs;
+    auto equiv_vals = ws.buffer(ws.float_equiv, n_out);
+    translate_transpose(m2l_op, check_vals, equiv_vals, n_check, n_rhs);
+
+    for (size_t i = 0; i < n_out; i++) {
+        atomic_add(multipoles[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::M2L_fft_transpose(const std::vector<double>& fft_op,
+    const std::vector<double>& down_check_to_equiv, const double* locals,
+    double* multipoles, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_pts = up_equiv_surface.pts.size();
+    auto n_check = R * n_pts;
+    auto n_multipole = C * n_pts;
+    auto n_out = fft_grid.n_out;
+    auto n_in = fft_grid.n_in;
+    auto n_grid = fft_grid.plan.size();
+    assert(fft_op.size() == fft_grid.spectrum_size(n_out * n_in));
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * n_rhs);
+    translate_transpose(
+        down_check_to_equiv, locals, check_vals,
+        C * down_equiv_surface.pts.size(), n_rhs
+    );
+    auto equiv_vals = ws.buffer(ws.equiv, n_multipole * n_rhs);
+    auto grid = ws.buffer(ws.fft_grid, n_grid);
+    auto scratch = ws.buffer(ws.fft_scratch, fft_grid.plan.scratch_size());
+    auto check_freqs = ws.buffer(ws.fft_sums, fft_grid.spectrum_size(n_out));
+    auto src_freqs = ws.buffer(ws.fft_src, fft_grid.spectrum_size(n_in));
+    auto grid_parts = reinterpret_cast<double*>(grid);
+    std::fill_n(equiv_vals, n_multipole * n_rhs, 0.0);
+    for (size_t k = 0; k < n_rhs; k++) {
+        for (size_t o = 0; o < n_out; o += 2) {
+            std::fill_n(grid, n_grid, Complex(0.0));
+            bool pair = o + 1 < n_out;
+            for (size_t p = 0; p < (pair ? 2 : 1); p++) {
+                gather_channel(
+                    fft_grid, fft_grid.out_channel, fft_grid.obs_channel_weights,
+                    fft_grid.n_obs_channels, o + p, check_vals, n_rhs, k,
+                    grid_parts + p
+                );
+            }
+            forward_half(fft_grid, grid, scratch, check_freqs, n_out, o, pair);
+        }
+
+        std::fill_n(src_freqs, fft_grid.spectrum_size(n_in), 0.0);
+        add_spectra_product_transpose(
+            fft_op.data(), check_freqs, src_freqs, n_out, n_in,
+            fft_grid.n_freq_blocks()
+        );
+
+        for (size_t s = 0; s < n_in; s += 2) {
+            bool pair = s + 1 < n_in;
+            inverse_half(fft_grid, src_freqs, n_in, s, pair, grid, scratch);
+            for (size_t p = 0; p < (pair ? 2 : 1); p++) {
+                scatter_channel(
+                    fft_grid, fft_grid.in_channel, fft_grid.src_channel_weights,
+                    fft_grid.n_src_channels, s + p, grid_parts + p, equiv_vals,
+                    n_rhs, k
+                );
+            }
+        }
+    }
+
+    for (size_t i = 0; i < n_multipole * n_rhs; i++) {
+        atomic_add(multipoles[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::L2L_transpose(const OctreeNode<dim>& parent_cell,
+    const OctreeNode<dim>& child_cell, const std::vector<double>& check_to_equiv,
+    const double* child_locals, double* parent_locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_check = down_check_surface.pts.size();
+    auto n_equiv = down_equiv_surface.pts.size();
+
+    NBodyView<dim> l2l;
+    set_src(l2l, down_equiv_cells, parent_cell);
+    set_obs(l2l, down_check_cells, child_cell);
+
+    auto check_vals = ws.buffer(ws.obs_vals, n_check * R * n_rhs);
+    translate_transpose(check_to_equiv, child_locals, check_vals, C * n_equiv, n_rhs);
+    auto n_out = n_equiv * C * n_rhs;
+    auto equiv_vals = ws.buffer(ws.equiv, n_out);
+    nbody_eval_transpose(
+        *K, l2l, check_vals, n_check, n_rhs, equiv_vals, ws.kernel_scratch
+    );
+
+    for (size_t i = 0; i < n_out; i++) {
+        atomic_add(parent_locals[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::L2P_transpose(const OctreeNode<dim>& cell,
+    const std::vector<double>& y, double* locals, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_obs = cell.n_pts();
+    auto n_equiv = down_equiv_surface.pts.size();
+    auto obs_start = cell.begin;
+
+    NBodyView<dim> l2p;
+    set_obs(l2p, data, obs_start, n_obs);
+    set_src(l2p, down_equiv_cells, cell);
+
+    auto n_out = n_equiv * C * n_rhs;
+    auto equiv_vals = ws.buffer(ws.equiv, n_out);
+    nbody_eval_transpose(
+        *K, l2p, y.data() + obs_start * n_rhs, data.obs_locs.size(), n_rhs,
+        equiv_vals, ws.kernel_scratch
+    );
+    for (size_t i = 0; i < n_out; i++) {
+        atomic_add(locals[i], equiv_vals[i]);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::P2P_transpose(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, const std::vector<double>& y,
+    std::vector<double>& x, size_t n_rhs) const
+{
+    auto& ws = workspace();
+    auto n_obs = obs_cell.n_pts();
+    auto n_src = src_cell.n_pts();
+    auto obs_start = obs_cell.begin;
+
+    NBodyView<dim> p2p;
+    set_obs(p2p, data, obs_start, n_obs);
+    set_src(p2p, data, src_cell.begin, n_src);
+
+    auto src_vals = ws.buffer(ws.src_str, n_src * C * n_rhs);
+    nbody_eval_transpose(
+        *K, p2p, y.data() + obs_start * n_rhs, data.obs_locs.size(), n_rhs,
+        src_vals, ws.kernel_scratch
+    );
+    add_src_vals(src_cell, src_vals, x, n_rhs);
+}
+
+template <size_t dim>
+void collect_leaves(const OctreeNode<dim>& cell, std::vector<const OctreeNode<dim>*>& leaves)
+{
+    if (cell.is_leaf()) {
+        leaves.push_back(&cell);
+        return;
+    }
+    for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+        auto c = cell.child(c_idx);
+        if (c == nullptr) {
+            continue;
+        }
+        collect_leaves(*c, leaves);
+    }
+}
+
+template <size_t dim>
+size_t add_node(FMMSchedule<dim>& schedule)
+{
+    schedule.work.push_back({});
+    return schedule.graph.add_task();
+}
+
+template <size_t dim>
+std::vector<size_t> add_multipole_nodes(const FMMTasks<dim>& tasks,
+    size_t n_src_cells, FMMSchedule<dim>& schedule)
+{
+    typedef FMMTasks<dim> Tasks;
+
+    // Each source cell's multipoles are written by exactly one P2M or M2M
+    // task, so these nodes are the same with or without owner computes.
+    std::vector<size_t> multipole_node(n_src_cells);
+    for (size_t i = 0; i < tasks.p2ms.size(); i++) {
+        auto& cell = tasks.p2ms[i].cell;
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::P2M, i, &cell});
+        multipole_node[cell.index] = node;
+    }
+    for (size_t i = 0; i < tasks.m2ms.size(); i++) {
+        auto& cell = tasks.m2ms[i].cell;
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::M2M, i, &cell});
+        multipole_node[cell.index] = node;
+        for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+            auto c = cell.child(c_idx);
+            if (c == nullptr) {
+                continue;
+            }
+            schedule.graph.add_dependency(multipole_node[c->index], node);
+        }
+    }
+    return multipole_node;
+}
+
+/* Split the m2l tasks into batches of up to m2l_batch_cells observation 
+ * cells from the same level, taking the cells in the order in which they 
+ * first appear in the tasks. The dual tree traversal visits nearby cells
+ * together, so the cells in a batch have many of the same relative offsets 
+ * to their source cells and share translation operators.
+ */
+template <size_t dim>
+std::vector<M2LBatch<dim>> build_m2l_batches(const FMMTasks<dim>& tasks,
+    const std::vector<size_t>& task_ops, size_t n_obs_cells)
+{
+    const size_t m2l_batch_cells = 32;
+    const size_t none = std::numeric_limits<size_t>::max();
+
+    std::vector<M2LBatch<dim>> batches;
+    std::vector<size_t> cell_batch(n_obs_cells, none);
+    std::vector<size_t> cell_slot(n_obs_cells);
+    // The batch that is being filled for each level.
+    std::vector<size_t> open_batch;
+    for (size_t i = 0; i < tasks.m2ls.size(); i++) {
+        auto& cell = tasks.m2ls[i].obs_cell;
+        if (cell_batch[cell.index] == none) {
+            if (open_batch.size() <= cell.level) {
+                open_batch.resize(cell.level + 1, none);
+            }
+            auto& b = open_batch[cell.level];
+            if (b == none || batches[b].obs_cells.size() == m2l_batch_cells) {
+                b = batches.size();
+                batches.push_back({});
+            }
+            cell_batch[cell.index] = b;
+            cell_slot[cell.index] = batches[b].obs_cells.size();
+            batches[b].obs_cells.push_back(&cell);
+        }
+        batches[cell_batch[cell.index]].tasks.push_back(i);
+    }
+
+    for (auto& b: batches) {
+        std::stable_sort(b.tasks.begin(), b.tasks.end(),
+            [&] (size_t a, size_t c) { return task_ops[a] < task_ops[c]; });
+        for (auto t: b.tasks) {
+            b.obs_slots.push_back(cell_slot[tasks.m2ls[t].obs_cell.index]);
+        }
+    }
+    return batches;
+}
+
+/* Add a node for each m2l batch, after the multipoles it reads. */
+template <size_t dim>
+std::vector<size_t> add_m2l_nodes(const FMMTasks<dim>& tasks,
+    const std::vector<size_t>& task_ops, size_t n_obs_cells,
+    const std::vector<size_t>& multipole_node, FMMSchedule<dim>& schedule)
+{
+    typedef FMMTasks<dim> Tasks;
+    schedule.m2l_batches = build_m2l_batches(tasks, task_ops, n_obs_cells);
+    std::vector<size_t> nodes;
+    for (size_t i = 0; i < schedule.m2l_batches.size(); i++) {
+        auto& b = schedule.m2l_batches[i];
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::M2L, i, b.obs_cells[0]});
+        for (auto t: b.tasks) {
+            auto& src_cell = tasks.m2ls[t].src_cell;
+            schedule.graph.add_dependency(multipole_node[src_cell.index], node);
+        }
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+template <size_t dim>
+FMMSchedule<dim> build_shared_schedule(const FMMTasks<dim>& tasks,
+    const std::vector<size_t>& task_ops, size_t n_src_cells, size_t n_obs_cells)
+{
+    typedef FMMTasks<dim> Tasks;
+    FMMSchedule<dim> schedule;
+    auto& graph = schedule.graph;
+    auto multipole_node = add_multipole_nodes(tasks, n_src_cells, schedule);
+
+    for (size_t i = 0; i < tasks.p2ps.size(); i++) {
+        auto& t = tasks.p2ps[i];
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::P2P, i, &t.obs_cell});
+    }
+
+    for (size_t i = 0; i < tasks.m2ps.size(); i++) {
+        auto& t = tasks.m2ps[i];
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::M2P, i, &t.obs_cell});
+        graph.add_dependency(multipole_node[t.src_cell.index], node);
+    }
+
+    // The nodes that contribute to the local coefficients of each obs cell.
+    std::vector<std::vector<size_t>> local_nodes(n_obs_cells);
+    for (size_t i = 0; i < tasks.p2ls.size(); i++) {
+        auto& t = tasks.p2ls[i];
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::P2L, i, &t.obs_cell});
+        local_nodes[t.obs_cell.index].push_back(node);
+    }
+    std::vector<size_t> l2l_nodes(tasks.l2ls.size());
+    for (size_t i = 0; i < tasks.l2ls.size(); i++) {
+        l2l_nodes[i] = add_node(schedule);
+        for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+            auto c = tasks.l2ls[i].cell.child(c_idx);
+            if (c == nullptr) {
+                continue;
+            }
+            schedule.work[l2l_nodes[i]].push_back({Tasks::L2L, i, c});
+            local_nodes[c->index].push_back(l2l_nodes[i]);
+        }
+    }
+    // The M2L batches add their contributions after all the others, as in 
+    // the owner computes schedule.
+    auto m2l_nodes = add_m2l_nodes(
+        tasks, task_ops, n_obs_cells, multipole_node, schedule
+    );
+    for (size_t i = 0; i < m2l_nodes.size(); i++) {
+        for (auto cell: schedule.m2l_batches[i].obs_cells) {
+            for (auto n: local_nodes[cell->index]) {
+                graph.add_dependency(n, m2l_nodes[i]);
+            }
+        }
+        for (auto cell: schedule.m2l_batches[i].obs_cells) {
+            local_nodes[cell->index].push_back(m2l_nodes[i]);
+        }
+    }
+
+    for (size_t i = 0; i < tasks.l2ls.size(); i++) {
+        for (auto n: local_nodes[tasks.l2ls[i].cell.index]) {
+            graph.add_dependency(n, l2l_nodes[i]);
+        }
+    }
+    for (size_t i = 0; i < tasks.l2ps.size(); i++) {
+        auto& cell = tasks.l2ps[i].cell;
+        auto node = add_node(schedule);
+        schedule.work[node].push_back({Tasks::L2P, i, &cell});
+        for (auto n: local_nodes[cell.index]) {
+            graph.add_dependency(n, node);
+        }
+    }
+
+    return schedule;
+}
+
+template <size_t dim>
+FMMSchedule<dim> build_owner_schedule(const FMMTasks<dim>& tasks,
+    const std::vector<size_t>& task_ops, size_t n_src_cells, size_t n_obs_cells)
+{
+    typedef FMMTasks<dim> Tasks;
+    FMMSchedule<dim> schedule;
+    auto& graph = schedule.graph;
+    auto multipole_node = add_multipole_nodes(tasks, n_src_cells, schedule);
+
+    // One node per obs cell owns that cell's local coefficients. It first 
+    // pulls the parent cell's local coefficients and then adds the P2L 
+    // contributions. The M2L batch that includes the cell adds its 
+    // contributions last, after the local nodes of all the batch's cells,
+    // and the cell's local coefficients are complete once the batch is done.
+    std::vector<size_t> local_node(n_obs_cells);
+    for (size_t i = 0; i < n_obs_cells; i++) {
+        local_node[i] = add_node(schedule);
+    }
+    auto locals_done = local_node;
+    auto m2l_nodes = add_m2l_nodes(
+        tasks, task_ops, n_obs_cells, multipole_node, schedule
+    );
+    for (size_t i = 0; i < m2l_nodes.size(); i++) {
+        for (auto cell: schedule.m2l_batches[i].obs_cells) {
+            graph.add_dependency(local_node[cell->index], m2l_nodes[i]);
+            locals_done[cell->index] = m2l_nodes[i];
+        }
+    }
+    for (size_t i = 0; i < tasks.l2ls.size(); i++) {
+        auto& cell = tasks.l2ls[i].cell;
+        for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+            auto c = cell.child(c_idx);
+            if (c == nullptr) {
+                continue;
+            }
+            auto node = local_node[c->index];
+            schedule.work[node].push_back({Tasks::L2L, i, c});
+            graph.add_dependency(locals_done[cell.index], node);
+        }
+    }
+    for (size_t i = 0; i < tasks.p2ls.size(); i++) {
+        auto& t = tasks.p2ls[i];
+        auto node = local_node[t.obs_cell.index];
+        schedule.work[node].push_back({Tasks::P2L, i, &t.obs_cell});
+    }
+
+    // Two nodes per obs leaf own that leaf's output values. The near field
+    // node has no dependencies, so it overlaps with the upward pass. The 
+    // far field node runs after it so that the two never write concurrently.
+    // P2P and M2P tasks with a non-leaf obs cell are split between the 
+    // leaves below it.
+    std::vector<size_t> near_node(n_obs_cells);
+    std::vector<size_t> far_node(n_obs_cells);
+    for (size_t i = 0; i < tasks.l2ps.size(); i++) {
+        auto leaf_idx = tasks.l2ps[i].cell.index;
+        near_node[leaf_idx] = add_node(schedule);
+        far_node[leaf_idx] = add_node(schedule);
+        graph.add_dependency(near_node[leaf_idx], far_node[leaf_idx]);
+    }
+
+    std::vector<const OctreeNode<dim>*> leaves;
+    for (size_t i = 0; i < tasks.p2ps.size(); i++) {
+        leaves.clear();
+        collect_leaves(tasks.p2ps[i].obs_cell, leaves);
+        for (auto leaf: leaves) {
+            schedule.work[near_node[leaf->index]].push_back({Tasks::P2P, i, leaf});
+        }
+    }
+    for (size_t i = 0; i < tasks.m2ps.size(); i++) {
+        auto& t = tasks.m2ps[i];
+        leaves.clear();
+        collect_leaves(t.obs_cell, leaves);
+        for (auto leaf: leaves) {
+            auto node = far_node[leaf->index];
+            schedule.work[node].push_back({Tasks::M2P, i, leaf});
+            graph.add_dependency(multipole_node[t.src_cell.index], node);
+        }
+    }
+    for (size_t i = 0; i < tasks.l2ps.size(); i++) {
+        auto& cell = tasks.l2ps[i].cell;
+        auto node = far_node[cell.index];
+        schedule.work[node].push_back({Tasks::L2P, i, &cell});
+        graph.add_dependency(locals_done[cell.index], node);
+    }
+
+    return schedule;
+}
+
+template <size_t dim, size_t R, size_t C>
+FMMSchedule<dim> FMMOperator<dim,R,C>::build_schedule(const FMMTasks<dim>& tasks) const
+{
+    auto n_src_cells = src_oct.n_nodes();
+    auto n_obs_cells = obs_oct.n_nodes();
+    if (owns_outputs()) {
+        return build_owner_schedule(
+            tasks, m2l_ops.task_ops, n_src_cells, n_obs_cells
+        );
+    } else {
+        return build_shared_schedule(
+            tasks, m2l_ops.task_ops, n_src_cells, n_obs_cells
+        );
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+size_t FMMOperator<dim,R,C>::n_kernel_evals(const FMMTasks<dim>& tasks,
+    const FMMWorkItem<dim>& item) const
+{
+    typedef FMMTasks<dim> Tasks;
+    auto n_up_equiv = up_equiv_surface.pts.size();
+    auto n_up_check = up_check_surface.pts.size();
+    auto n_down_equiv = down_equiv_surface.pts.size();
+    auto n_down_check = down_check_surface.pts.size();
+    auto n_obs = item.obs_cell->n_pts();
+    switch (item.phase) {
+        case Tasks::P2M:
+            return n_up_check * tasks.p2ms[item.task].cell.n_pts();
+        case Tasks::M2M:
+            return n_up_check * n_up_equiv * 
+                tasks.m2ms[item.task].cell.n_immediate_children();
+        case Tasks::P2P:
+            if (symmetric && &tasks.p2ps[item.task].src_cell == item.obs_cell) {
+                return n_obs * (n_obs - 1) / 2;
+            }
+            return n_obs * tasks.p2ps[item.task].src_cell.n_pts();
+        case Tasks::M2P:
+            return n_obs * n_up_equiv;
+        case Tasks::P2L:
+            return n_down_check * tasks.p2ls[item.task].src_cell.n_pts();
+        case Tasks::M2L:
+            return 0;
+        case Tasks::L2L:
+            return n_down_check * n_down_equiv;
+        case Tasks::L2P:
+            return n_obs * n_down_equiv;
+    }
+    return 0;
+}
+
+/* The operators that evaluate the kernel read and write double precision
+ * coefficients. Double precision coefficients are used in place, while float
+ * coefficients are copied to and from a double precision scratch buffer 
+ * starting at offset.
+ */
+double* double_coeffs(double* coeffs, std::vector<double>&, size_t)
+{
+    return coeffs;
+}
+
+double* double_coeffs(float*, std::vector<double>& scratch, size_t offset)
+{
+    assert(offset < scratch.size());
+    return scratch.data() + offset;
+}
+
+template <typename From, typename To>
+void copy_coeffs(const From* from, To* to, size_t n)
+{
+    if (static_cast<const void*>(from) == static_cast<const void*>(to)) {
+        return;
+    }
+    std::copy(from, from + n, to);
+}
+
+const std::vector<std::vector<double>>& m2l_matrices(
+    const M2LOperators& m2l_ops, const double*)
+{
+    return m2l_ops.ops;
+}
+
+const std::vector<std::vector<float>>& m2l_matrices(
+    const M2LOperators& m2l_ops, const float*)
+{
+    return m2l_ops.float_ops;
+}
+
+const std::vector<double>& level_op(const CheckToEquiv& ops,
+    const FloatCheckToEquiv&, size_t level, const double*)
+{
+    assert(level < ops.size());
+    return ops[level];
+}
+
+const std::vector<float>& level_op(const CheckToEquiv&,
+    const FloatCheckToEquiv& float_ops, size_t level, const float*)
+{
+    assert(level < float_ops.size());
+    return float_ops[level];
+}
+
+template <size_t dim, size_t R, size_t C>
+template <typename Real>
+void FMMOperator<dim,R,C>::run_schedule(FMMArena<dim>& arena,
+    const FMMTasks<dim>& tasks,
+    const FMMSchedule<dim>& schedule, const std::vector<double>& x_tree,
+    const CheckToEquiv& up_check_to_equiv,
+    const CheckToEquiv& down_check_to_equiv,
+    const M2LOperators& m2l_ops, Real* multipoles, Real* locals,
+    std::vector<double>& out_tree, size_t n_rhs) const
+{
+    typedef FMMTasks<dim> Tasks;
+
+    auto n_src_equiv = up_equiv_surface.pts.size();
+    auto n_multipole = n_src_equiv * C * n_rhs;
+    auto src_equiv_start = [&](const OctreeNode<dim>& cell) {
+        return cell.index * n_multipole;
+    };
+
+    auto n_obs_equiv = down_equiv_surface.pts.size();
+    auto n_local = n_obs_equiv * C * n_rhs;
+    auto obs_equiv_start = [&](const OctreeNode<dim>& cell) {
+        return cell.index * n_local;
+    };
+
+    // Returns the double precision values that an operator should add to 
+    // the coefficients, zeroed if they are a separate buffer.
+    auto accumulator = [&] (Real* coeffs, size_t n) {
+        auto vals = double_coeffs(coeffs, workspace().coeffs_out, 0);
+        if (static_cast<void*>(vals) != static_cast<void*>(coeffs)) {
+            std::fill_n(vals, n, 0.0);
+        }
+        return vals;
+    };
+    auto add_coeffs = [&] (const double* vals, Real* coeffs, size_t n) {
+        if (static_cast<const void*>(vals) == static_cast<void*>(coeffs)) {
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            accumulate(coeffs[i], static_cast<Real>(vals[i]));
+        }
+    };
+    auto read_coeffs = [&] (Real* coeffs, size_t n, size_t offset) {
+        auto vals = double_coeffs(coeffs, workspace().coeffs_in, offset);
+        copy_coeffs(coeffs, vals, n);
+        return vals;
+    };
+
+    // The multipoles of the sources of Fourier space translations are 
+    // transformed as soon as they are computed.
+    const size_t none = std::numeric_limits<size_t>::max();
+    auto n_spectrum = fft_grid.spectrum_size(fft_grid.n_in) * n_rhs;
+    auto transform_fft_source = [&] (const OctreeNode<dim>& cell, const double* vals) {
+        if (m2l_ops.n_fft_src_cells == 0) {
+            return;
+        }
+        auto slot = m2l_ops.fft_src_slots[cell.index];
+        if (slot == none) {
+            return;
+        }
+        transform_multipoles(
+            vals, arena.multipole_spectra.data() + slot * n_spectrum, n_rhs
+        );
+    };
+
+    auto run_p2m = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.p2ms[item.task].cell;
+        assert(cell.level < up_check_to_equiv.size());
+        auto& check_to_equiv_op = up_check_to_equiv[cell.level];
+        auto data_ptr = multipoles + src_equiv_start(cell);
+        auto vals = double_coeffs(data_ptr, workspace().coeffs_out, 0);
+        P2M(cell, check_to_equiv_op, x_tree, vals, n_rhs);
+        copy_coeffs(vals, data_ptr, n_multipole);
+        transform_fft_source(cell, vals);
+    };
+
+    auto run_m2m = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.m2ms[item.task].cell;
+        assert(cell.level < up_check_to_equiv.size());
+        auto& check_to_equiv_op = up_check_to_equiv[cell.level];
+        std::array<double*,Octree<dim>::split> child_data_ptrs{};
+        for (size_t c = 0; c < Octree<dim>::split; c++) {
+            if (cell.child(c) == nullptr) {
+                continue;
+            }
+            auto ptr = multipoles + src_equiv_start(*cell.child(c));
+            child_data_ptrs[c] = read_coeffs(ptr, n_multipole, c * n_multipole);
+        }
+        auto parent_data_ptr = multipoles + src_equiv_start(cell);
+        auto vals = double_coeffs(parent_data_ptr, workspace().coeffs_out, 0);
+        M2M(cell, check_to_equiv_op, child_data_ptrs, vals, n_rhs);
+        copy_coeffs(vals, parent_data_ptr, n_multipole);
+        transform_fft_source(cell, vals);
+    };
+
+    auto run_p2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.p2ps[item.task];
+        if (symmetric) {
+            P2P_symmetric(t.obs_cell, t.src_cell, x_tree, out_tree, n_rhs);
+        } else {
+            P2P(*item.obs_cell, t.src_cell, x_tree, out_tree, n_rhs);
+        }
+    };
+
+    auto run_m2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.m2ps[item.task];
+        auto data_ptr = multipoles + src_equiv_start(t.src_cell);
+        auto vals = read_coeffs(data_ptr, n_multipole, 0);
+        M2P(*item.obs_cell, t.src_cell, vals, out_tree, n_rhs);
+    };
+
+    auto run_p2l = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.p2ls[item.task];
+        assert(t.obs_cell.level < down_check_to_equiv.size());
+        auto& check_to_equiv_op = down_check_to_equiv[t.obs_cell.level];
+        auto data_ptr = locals + obs_equiv_start(t.obs_cell);
+        auto vals = accumulator(data_ptr, n_local);
+        P2L(t.obs_cell, t.src_cell, check_to_equiv_op, x_tree, vals, n_rhs);
+        add_coeffs(vals, data_ptr, n_local);
+    };
 
-template <size_t dim, size_t R, size_t C>
-std::vector<double>
-svd_inverse_nbody(const Kernel<dim,R,C>& K, const NBodyData<dim>& data) 
-{
-    auto op = nbody_matrix(K, data);
-    auto svd = svd_decompose(op);
+    auto run_m2l = [&] (const FMMWorkItem<dim>& item) {
+        auto& batch = schedule.m2l_batches[item.task];
+        auto& check_to_equiv_op = level_op(
+            down_check_to_equiv, float_down_check_to_equiv, 
+            batch.obs_cells[0]->level, locals
+        );
+        M2L_batch(
+            batch, tasks.m2ls, m2l_ops.task_ops, m2l_matrices(m2l_ops, locals),
+            m2l_ops.fft_ops, m2l_ops.fft_src_slots,
+            arena.multipole_spectra.data(), check_to_equiv_op, multipoles,
+            locals, n_rhs
+        );
+    };
 
-    // In some cases, the equivalent surface to check surface operator
-    // is poorly conditioned. In this case, truncate the singular values 
-    // to solve a regularized least squares version of the problem.
-    set_threshold(svd, 1e-10);
+    auto run_l2l = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.l2ls[item.task].cell;
+        auto& child = *item.obs_cell;
+        assert(child.level < down_check_to_equiv.size());
+        auto& check_to_equiv_op = down_check_to_equiv[child.level];
+        auto parent_vals = read_coeffs(
+            locals + obs_equiv_start(cell), n_local, 0
+        );
+        auto child_data_ptr = locals + obs_equiv_start(child);
+        auto child_vals = accumulator(child_data_ptr, n_local);
+        L2L(cell, child, check_to_equiv_op, parent_vals, child_vals, n_rhs);
+        add_coeffs(child_vals, child_data_ptr, n_local);
+    };
 
-    auto out = svd_pseudoinverse(svd);
-    assert(out.size() == R * C * data.obs_locs.size() * data.src_locs.size());
-    return out;
+    auto run_l2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.l2ps[item.task].cell;
+        auto vals = read_coeffs(locals + obs_equiv_start(cell), n_local, 0);
+        L2P(cell, vals, out_tree, n_rhs);
+    };
+
+    typedef std::chrono::steady_clock Clock;
+    schedule.graph.execute([&] (size_t node) {
+        ActiveArena<dim> active(arena);
+        auto& ws = workspace();
+        for (auto& item: schedule.work[node]) {
+            auto item_start = Clock::now();
+            switch (item.phase) {
+                case Tasks::P2M: run_p2m(item); break;
+                case Tasks::M2M: run_m2m(item); break;
+                case Tasks::P2P: run_p2p(item); break;
+                case Tasks::M2P: run_m2p(item); break;
+                case Tasks::P2L: run_p2l(item); break;
+                case Tasks::M2L: run_m2l(item); break;
+                case Tasks::L2L: run_l2l(item); break;
+                case Tasks::L2P: run_l2p(item); break;
+            }
+            std::chrono::duration<double> elapsed = Clock::now() - item_start;
+            ws.phase_time[item.phase] += elapsed.count();
+            ws.n_kernel_evals[item.phase] += n_kernel_evals(tasks, item);
+        }
+    });
 }
 
 template <size_t dim, size_t R, size_t C>
-CheckToEquiv FMMOperator<dim,R,C>::build_check_to_equiv(const Octree<dim>& cell,
-        size_t start_level, const TranslationSurface<dim>& equiv_surf,
-        const TranslationSurface<dim>& check_surf) const
+std::vector<double> FMMOperator<dim,R,C>::execute_tasks(const FMMTasks<dim>& tasks,
+    const FMMSchedule<dim>& schedule, const std::vector<double>& x, 
+    const CheckToEquiv& up_check_to_equiv,
+    const CheckToEquiv& down_check_to_equiv,
+    const M2LOperators& m2l_ops, size_t n_rhs) const
 {
-    assert(cell.level <= start_level);
-
-    CheckToEquiv ops;
-
-    if (start_level <= cell.level) {
-        NBodyData<dim> down_data{
-            check_surf.move(cell.bounds), check_surf.normals,
-            equiv_surf.move(cell.bounds), equiv_surf.normals,
-            std::vector<double>(equiv_surf.pts.size(), 1.0)
-        };
-        ops.push_back(svd_inverse_nbody(*K, down_data));
+    auto& arena = arenas.acquire();
+    reserve_workspaces(arena, n_rhs);
+
+    auto n_src_cells = src_oct.n_nodes();
+    auto n_multipoles = n_src_cells * up_equiv_surface.pts.size() * C * n_rhs;
+    auto n_obs_cells = obs_oct.n_nodes();
+    auto n_locals = n_obs_cells * down_equiv_surface.pts.size() * C * n_rhs;
+
+    // The operators work on the tree ordered points.
+    auto n_src = data.src_locs.size();
+    reuse_buffer(arena.x_tree, C * n_src * n_rhs, arena.n_allocations);
+    to_tree_order(src_oct.indices, C, n_rhs, x.data(), arena.x_tree.data());
+
+    auto n_obs = data.obs_locs.size();
+    auto& out_tree = arena.out_tree;
+    reuse_buffer(out_tree, R * n_obs * n_rhs, arena.n_allocations);
+    std::fill(out_tree.begin(), out_tree.end(), 0.0);
+
+    for (auto& w: arena.workspaces) {
+        w.phase_time.fill(0.0);
+        w.n_kernel_evals.fill(0);
     }
 
-    for (auto& c: cell.children) {
-        if (c == nullptr) {
-            continue;
-        }
-        auto child_ops = build_check_to_equiv(
-            *c, start_level + ops.size(), equiv_surf, check_surf
+    reuse_buffer(
+        arena.multipole_spectra,
+        m2l_ops.n_fft_src_cells * fft_grid.spectrum_size(fft_grid.n_in) * n_rhs,
+        arena.n_allocations
+    );
+
+    typedef std::chrono::steady_clock Clock;
+    auto apply_start = Clock::now();
+    if (config.float_farfield) {
+        auto multipoles = reuse_buffer(
+            arena.float_multipoles, n_multipoles, arena.n_allocations
+        );
+        auto locals = reuse_buffer(arena.float_locals, n_locals, arena.n_allocations);
+        std::fill_n(locals, n_locals, 0.0f);
+        run_schedule(
+            arena, tasks, schedule, arena.x_tree, up_check_to_equiv, down_check_to_equiv,
+            m2l_ops, multipoles, locals, out_tree, n_rhs
+        );
+    } else {
+        auto multipoles = reuse_buffer(
+            arena.multipoles, n_multipoles, arena.n_allocations
+        );
+        auto locals = reuse_buffer(arena.locals, n_locals, arena.n_allocations);
+        std::fill_n(locals, n_locals, 0.0);
+        run_schedule(
+            arena, tasks, schedule, arena.x_tree, up_check_to_equiv, down_check_to_equiv,
+            m2l_ops, multipoles, locals, out_tree, n_rhs
         );
-        for (auto c_op: child_ops) {
-            ops.push_back(c_op);
+    }
+    std::chrono::duration<double> apply_time = Clock::now() - apply_start;
+
+    std::vector<double> out(out_tree.size());
+    from_tree_order(obs_oct.indices, R, n_rhs, out_tree.data(), out.data());
+
+    std::array<double,FMMStats::n_phases> phase_time{};
+    std::array<size_t,FMMStats::n_phases> phase_evals{};
+    std::vector<double> thread_time(arena.workspaces.size(), 0.0);
+    for (size_t t = 0; t < arena.workspaces.size(); t++) {
+        auto& w = arena.workspaces[t];
+        for (size_t p = 0; p < FMMStats::n_phases; p++) {
+            phase_time[p] += w.phase_time[p];
+            phase_evals[p] += w.n_kernel_evals[p];
+            thread_time[t] += w.phase_time[p];
         }
     }
-
-    return ops;
+    arenas.release(arena);
+    auto temporary_bytes = arenas.n_bytes();
+
+    std::lock_guard<std::mutex> lock(arenas.mutex);
+    stats.n_applies++;
+    stats.n_rhs = n_rhs;
+    stats.apply_time = apply_time.count();
+    stats.n_tasks = {
+        tasks.p2ms.size(), tasks.m2ms.size(), tasks.p2ps.size(),
+        tasks.m2ps.size(), tasks.p2ls.size(), tasks.m2ls.size(),
+        tasks.l2ls.size(), tasks.l2ps.size()
+    };
+    stats.phase_time.assign(phase_time.begin(), phase_time.end());
+    stats.n_kernel_evals.assign(phase_evals.begin(), phase_evals.end());
+    stats.thread_time = thread_time;
+    stats.temporary_bytes = temporary_bytes;
+    return out;
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::P2M(const Octree<dim>& cell,
-    const std::vector<double>& check_to_equiv, const std::vector<double>& x,
-    double* parent_multipoles) const
+std::vector<double> FMMOperator<dim,R,C>::apply(const std::vector<double>& x) const 
 {
-    auto n_src = cell.indices.size();
-
-    NBodyData<dim> s2c;
-    s2c.src_locs.resize(n_src);
-    s2c.src_normals.resize(n_src);
-    s2c.src_weights.resize(n_src);
-    s2c.obs_locs = up_check_surface.move(cell.bounds);
-    s2c.obs_normals = up_check_surface.normals;
+    assert(x.size() == C * data.src_locs.size());
 
-    std::vector<double> src_str(n_src * C);
-    for (size_t i = 0; i < n_src; i++) {
-        // std::cout << s2c.src_locs.size() << std::endl;
-        // std::cout << data.src_locs.size() << std::endl;
-        // std::cout << cell.indices.size() << std::endl;
-        // std::cout << cell.index << std::endl;
-        // std::cout << i << std::endl;
-        // std::cout << cell.indices[i] << std::endl;
-        // std::cout << cell.indices[0] << std::endl;
-        s2c.src_locs[i] = data.src_locs[cell.indices[i]];
-        s2c.src_normals[i] = data.src_normals[cell.indices[i]];
-        s2c.src_weights[i] = data.src_weights[cell.indices[i]];
-        for (size_t d = 0; d < C; d++) {
-            auto src_idx = d * data.src_locs.size() + cell.indices[i];
-            src_str[d * n_src + i] = x[src_idx];
-        }
-    }
+    auto out = execute_tasks(
+        tasks, schedule, x, up_check_to_equiv, down_check_to_equiv, m2l_ops, 1
+    );
 
-    auto check_eval = nbody_eval(*K, s2c, src_str.data());
-    auto equiv_srcs = mat_vec(check_to_equiv, check_eval);
+    return out;
+}
 
-    auto n_equiv = up_check_surface.pts.size();
-#pragma omp critical
-    for (size_t i = 0; i < C * n_equiv; i++) {
-        parent_multipoles[i] = equiv_srcs[i];
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::copy_multipoles(const OctreeNode<dim>& cell,
+    double* out) const
+{
+    auto& arena = latest_arena();
+    auto n = up_equiv_surface.pts.size() * C * latest_stats().n_rhs;
+    auto start = cell.index * n;
+    if (config.float_farfield) {
+        assert(start + n <= arena.float_multipoles.size());
+        std::copy_n(arena.float_multipoles.data() + start, n, out);
+    } else {
+        assert(start + n <= arena.multipoles.size());
+        std::copy_n(arena.multipoles.data() + start, n, out);
     }
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::M2M(const Octree<dim>& cell,
-    const std::vector<double>& check_to_equiv, std::vector<double*>& child_multipoles,
-    double* parent_multipoles) const
+std::vector<std::vector<double>> FMMOperator<dim,R,C>::apply_block(
+    const std::vector<std::vector<double>>& xs) const 
 {
-    assert(!cell.is_leaf());
-
-    auto check_pts = up_check_surface.move(cell.bounds);
-
-    auto n_children = cell.n_immediate_children();
-    auto n_equiv = up_equiv_surface.pts.size();
-    auto n_src = n_children * n_equiv;
-
-    NBodyData<dim> c2c;
-    c2c.obs_locs = check_pts;
-    c2c.obs_normals = up_check_surface.normals;
-    c2c.src_locs.resize(n_src);
-    c2c.src_normals.resize(n_src);
-    c2c.src_weights.resize(n_src);
+    auto n_rhs = xs.size();
+    if (n_rhs == 0) {
+        return {};
+    }
 
-    std::vector<double> src_str(n_src * C);
-    size_t child_idx = 0;
-    for (size_t c = 0; c < Octree<dim>::split; c++) {
-        auto& child = cell.children[c];
-        if (child == nullptr) {
-            continue;
-        }
-        auto equiv_pts = up_equiv_surface.move(child->bounds);
-        for (size_t i = 0; i < n_equiv; i++) {
-            auto idx = child_idx * n_equiv + i;
-            c2c.src_locs[idx] = equiv_pts[i];
-            c2c.src_normals[idx] = up_equiv_surface.normals[i];
-            c2c.src_weights[idx] = 1.0;
-            for (size_t d = 0; d < C; d++) {
-                src_str[d * n_src + idx] = child_multipoles[c][d * n_equiv + i];
-            }
+    auto n_in = n_cols();
+    std::vector<double> x_block(n_in * n_rhs);
+    for (size_t k = 0; k < n_rhs; k++) {
+        assert(xs[k].size() == n_in);
+        for (size_t i = 0; i < n_in; i++) {
+            x_block[i * n_rhs + k] = xs[k][i];
         }
-        child_idx++;
     }
 
-    auto check_eval = nbody_eval(*K, c2c, src_str.data());
-    auto equiv_srcs = mat_vec(check_to_equiv, check_eval);
+    auto out_block = execute_tasks(
+        tasks, schedule, x_block, up_check_to_equiv, down_check_to_equiv,
+        m2l_ops, n_rhs
+    );
 
-#pragma omp critical
-    for (size_t i = 0; i < C * n_equiv; i++) {
-        parent_multipoles[i] = equiv_srcs[i];
+    auto n_out = n_rows();
+    std::vector<std::vector<double>> out(n_rhs, std::vector<double>(n_out));
+    for (size_t k = 0; k < n_rhs; k++) {
+        for (size_t i = 0; i < n_out; i++) {
+            out[k][i] = out_block[i * n_rhs + k];
+        }
     }
+    return out;
 }
 
+/* The schedule for the transposed tasks. Every value that a task reads 
+ * becomes a value that its transpose adds to, so each transposed task must 
+ * wait for every task that read what it wrote: the dependencies and the 
+ * order of the work within each node are reversed.
+ */
+template <size_t dim>
+FMMSchedule<dim> reverse_schedule(const FMMSchedule<dim>& schedule)
+{
+    FMMSchedule<dim> out;
+    out.graph = schedule.graph.reversed();
+    out.work = schedule.work;
+    out.m2l_batches = schedule.m2l_batches;
+    for (auto& w: out.work) {
+        std::reverse(w.begin(), w.end());
+    }
+    return out;
+}
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::P2P(const Octree<dim>& obs_cell,
-    const Octree<dim>& src_cell, const std::vector<double>& x, std::vector<double>& out) const 
+std::vector<double> FMMOperator<dim,R,C>::execute_transpose_tasks(
+    const std::vector<double>& y, size_t n_rhs) const
 {
-    auto n_src = src_cell.indices.size();
-    auto n_obs = obs_cell.indices.size();
+    typedef FMMTasks<dim> Tasks;
+
+    auto& arena = arenas.acquire();
+    reserve_workspaces(arena, n_rhs);
+
+    auto n_multipole = up_equiv_surface.pts.size() * C * n_rhs;
+    auto n_local = down_equiv_surface.pts.size() * C * n_rhs;
+    auto n_multipoles = (src_oct.n_nodes()) * n_multipole;
+    auto n_locals = (obs_oct.n_nodes()) * n_local;
+
+    // The input and output buffers swap roles: the input is in observation
+    // tree order and the output in source tree order.
+    auto n_obs = data.obs_locs.size();
+    auto& y_tree = arena.out_tree;
+    reuse_buffer(y_tree, R * n_obs * n_rhs, arena.n_allocations);
+    to_tree_order(obs_oct.indices, R, n_rhs, y.data(), y_tree.data());
+
+    auto n_src = data.src_locs.size();
+    auto& x_tree = arena.x_tree;
+    reuse_buffer(x_tree, C * n_src * n_rhs, arena.n_allocations);
+    std::fill(x_tree.begin(), x_tree.end(), 0.0);
+
+    auto multipoles = reuse_buffer(arena.multipoles, n_multipoles, arena.n_allocations);
+    std::fill_n(multipoles, n_multipoles, 0.0);
+    auto locals = reuse_buffer(arena.locals, n_locals, arena.n_allocations);
+    std::fill_n(locals, n_locals, 0.0);
+
+    auto multipole_ptr = [&] (const OctreeNode<dim>& cell) {
+        return multipoles + cell.index * n_multipole;
+    };
+    auto local_ptr = [&] (const OctreeNode<dim>& cell) {
+        return locals + cell.index * n_local;
+    };
+
+    auto run_p2m = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.p2ms[item.task].cell;
+        assert(cell.level < up_check_to_equiv.size());
+        P2M_transpose(
+            cell, up_check_to_equiv[cell.level], multipole_ptr(cell), x_tree,
+            n_rhs
+        );
+    };
 
-    NBodyData<dim> p2p;
-    p2p.src_locs.resize(n_src);
-    p2p.src_normals.resize(n_src);
-    p2p.src_weights.resize(n_src);
-    std::vector<double> src_str(C * n_src);
-    for (size_t j = 0; j < n_src; j++) {
-        // std::cout << data.src_locs.size() << std::endl;
-        // std::cout << src_cell.indices[j] << std::endl;
-        p2p.src_locs[j] = data.src_locs[src_cell.indices[j]];
-        p2p.src_normals[j] = data.src_normals[src_cell.indices[j]];
-        p2p.src_weights[j] = data.src_weights[src_cell.indices[j]];
-        for (size_t d = 0; d < C; d++) {
-            auto src_idx = d * data.src_locs.size() + src_cell.indices[j];
-            src_str[d * n_src + j] = x[src_idx];
+    auto run_m2m = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.m2ms[item.task].cell;
+        assert(cell.level < up_check_to_equiv.size());
+        std::array<double*,Octree<dim>::split> child_ptrs{};
+        for (size_t c = 0; c < Octree<dim>::split; c++) {
+            if (cell.child(c) != nullptr) {
+                child_ptrs[c] = multipole_ptr(*cell.child(c));
+            }
         }
-    }
+        M2M_transpose(
+            cell, up_check_to_equiv[cell.level], multipole_ptr(cell), child_ptrs,
+            n_rhs
+        );
+    };
 
-    p2p.obs_locs.resize(n_obs);
-    p2p.obs_normals.resize(n_obs);
-    for (size_t i = 0; i < n_obs; i++) {
-        p2p.obs_locs[i] = data.obs_locs[obs_cell.indices[i]];
-        p2p.obs_normals[i] = data.obs_normals[obs_cell.indices[i]];
-    }
+    auto run_p2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.p2ps[item.task];
+        if (symmetric) {
+            P2P_symmetric(t.obs_cell, t.src_cell, y_tree, x_tree, n_rhs, true);
+        } else {
+            P2P_transpose(*item.obs_cell, t.src_cell, y_tree, x_tree, n_rhs);
+        }
+    };
 
-    auto res = nbody_eval(*K, p2p, src_str.data());
+    auto run_m2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.m2ps[item.task];
+        M2P_transpose(
+            *item.obs_cell, t.src_cell, y_tree, multipole_ptr(t.src_cell), n_rhs
+        );
+    };
 
-    for (size_t i = 0; i < n_obs; i++) {
-        for (size_t d = 0; d < R; d++) {
-            auto out_idx = d * data.obs_locs.size() + obs_cell.indices[i];
-            #pragma omp atomic
-            out[out_idx] += res[d * n_obs + i];
-        }
-    }
-}
+    auto run_p2l = [&] (const FMMWorkItem<dim>& item) {
+        auto& t = tasks.p2ls[item.task];
+        assert(t.obs_cell.level < down_check_to_equiv.size());
+        P2L_transpose(
+            t.obs_cell, t.src_cell, down_check_to_equiv[t.obs_cell.level],
+            local_ptr(t.obs_cell), x_tree, n_rhs
+        );
+    };
 
-template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::P2L(const Octree<dim>& obs_cell,
-    const Octree<dim>& src_cell, const std::vector<double>& check_to_equiv,
-    const std::vector<double>& x, double* locals) const
-{
-    //TODO: This is almost identical to the P2M operator.
-    auto n_src = src_cell.indices.size();
+    auto run_m2l = [&] (const FMMWorkItem<dim>& item) {
+        for (auto i: transpose_schedule.m2l_batches[item.task].tasks) {
+            auto& t = tasks.m2ls[i];
+            auto op_idx = m2l_ops.task_ops[i];
+            if (m2l_ops.is_fft(op_idx)) {
+                M2L_fft_transpose(
+                    m2l_ops.fft_ops[op_idx], down_check_to_equiv[t.obs_cell.level],
+                    local_ptr(t.obs_cell), multipole_ptr(t.src_cell), n_rhs
+                );
+            } else if (config.float_farfield) {
+                M2L_transpose(
+                    m2l_ops.float_ops[op_idx],
+                    float_down_check_to_equiv[t.obs_cell.level],
+                    local_ptr(t.obs_cell), multipole_ptr(t.src_cell), n_rhs
+                );
+            } else {
+                M2L_transpose(
+                    m2l_ops.ops[op_idx], down_check_to_equiv[t.obs_cell.level],
+                    local_ptr(t.obs_cell), multipole_ptr(t.src_cell), n_rhs
+                );
+            }
+        }
+    };
 
-    NBodyData<dim> s2c;
-    s2c.src_locs.resize(n_src);
-    s2c.src_normals.resize(n_src);
-    s2c.src_weights.resize(n_src);
+    auto run_l2l = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.l2ls[item.task].cell;
+        auto& child = *item.obs_cell;
+        assert(child.level < down_check_to_equiv.size());
+        L2L_transpose(
+            cell, child, down_check_to_equiv[child.level], local_ptr(child),
+            local_ptr(cell), n_rhs
+        );
+    };
 
-    s2c.obs_locs = down_check_surface.move(obs_cell.bounds);
-    s2c.obs_normals = down_check_surface.normals;
+    auto run_l2p = [&] (const FMMWorkItem<dim>& item) {
+        auto& cell = tasks.l2ps[item.task].cell;
+        L2P_transpose(cell, y_tree, local_ptr(cell), n_rhs);
+    };
 
-    std::vector<double> src_str(n_src * C);
-    for (size_t i = 0; i < n_src; i++) {
-        s2c.src_locs[i] = data.src_locs[src_cell.indices[i]];
-        s2c.src_normals[i] = data.src_normals[src_cell.indices[i]];
-        s2c.src_weights[i] = data.src_weights[src_cell.indices[i]];
-        for (size_t d = 0; d < C; d++) {
-            auto src_idx = d * data.src_locs.size() + src_cell.indices[i];
-            src_str[d * n_src + i] = x[src_idx];
+    transpose_schedule.graph.execute([&] (size_t node) {
+        ActiveArena<dim> active(arena);
+        for (auto& item: transpose_schedule.work[node]) {
+            switch (item.phase) {
+                case Tasks::P2M: run_p2m(item); break;
+                case Tasks::M2M: run_m2m(item); break;
+                case Tasks::P2P: run_p2p(item); break;
+                case Tasks::M2P: run_m2p(item); break;
+                case Tasks::P2L: run_p2l(item); break;
+                case Tasks::M2L: run_m2l(item); break;
+                case Tasks::L2L: run_l2l(item); break;
+                case Tasks::L2P: run_l2p(item); break;
+            }
         }
-    }
+    });
 
-    auto check_eval = nbody_eval(*K, s2c, src_str.data());
-    auto equiv_srcs = mat_vec(check_to_equiv, check_eval);
-
-    for (size_t i = 0; i < equiv_srcs.size(); i++) {
-        #pragma omp atomic
-        locals[i] += equiv_srcs[i];
-    }
+    std::vector<double> out(x_tree.size());
+    from_tree_order(src_oct.indices, C, n_rhs, x_tree.data(), out.data());
+    arenas.release(arena);
+    return out;
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::M2P(const Octree<dim>& obs_cell,
-    const Octree<dim>& src_cell, double* multipoles, std::vector<double>& out) const
+std::vector<double> FMMOperator<dim,R,C>::apply_transpose(
+    const std::vector<double>& y) const 
 {
-    auto equiv_pts = up_equiv_surface.move(src_cell.bounds);
-
-    NBodyData<dim> m2p;
-    m2p.src_locs = equiv_pts;
-    m2p.src_normals = up_equiv_surface.normals;
-    m2p.src_weights = std::vector<double>(equiv_pts.size(), 1.0);
-
-    auto n_obs = obs_cell.indices.size();
-    m2p.obs_locs.resize(n_obs);
-    m2p.obs_normals.resize(n_obs);
-    for (size_t i = 0; i < n_obs; i++) {
-        m2p.obs_locs[i] = data.obs_locs[obs_cell.indices[i]];
-        m2p.obs_normals[i] = data.obs_normals[obs_cell.indices[i]];
-    }
-
-    auto res = nbody_eval(*K, m2p, multipoles);
+    assert(y.size() == R * data.obs_locs.size());
+    return execute_transpose_tasks(y, 1);
+}
 
-    for (size_t i = 0; i < n_obs; i++) {
-        for (size_t d = 0; d < R; d++) {
-            auto out_idx = d * data.obs_locs.size() + obs_cell.indices[i];
-            #pragma omp atomic
-            out[out_idx] += res[d * n_obs + i];
-        }
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::accumulate(double& target, double value) const
+{
+    if (owns_outputs()) {
+        target += value;
+    } else {
+        #pragma omp atomic
+        target += value;
     }
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::M2L(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
-    const std::vector<double>& down_check_to_equiv, double* multipoles, 
-    double* locals) const
+void FMMOperator<dim,R,C>::accumulate(float& target, float value) const
 {
-    auto n_src_equiv = up_equiv_surface.pts.size();
-    NBodyData<dim> m2l;
-    m2l.src_locs = up_equiv_surface.move(src_cell.bounds);
-    m2l.src_normals = up_equiv_surface.normals;
-    m2l.src_weights = std::vector<double>(n_src_equiv, 1.0);
-    m2l.obs_locs = down_check_surface.move(obs_cell.bounds);
-    m2l.obs_normals = down_check_surface.normals;
-
-    auto check_eval = nbody_eval(*K, m2l, multipoles);
-    auto solved = mat_vec(down_check_to_equiv, check_eval);
-
-    for (size_t i = 0; i < solved.size(); i++) {
+    if (owns_outputs()) {
+        target += value;
+    } else {
         #pragma omp atomic
-        locals[i] += solved[i];
+        target += value;
     }
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::L2L(const Octree<dim>& cell,
-    const std::vector<double>& check_to_equiv, double* parent_locals,
-    std::vector<double*>& child_locals) const
+void FMMOperator<dim,R,C>::reserve_workspaces(FMMArena<dim>& arena,
+    size_t n_rhs) const
 {
-    assert(!cell.is_leaf());
-
-    NBodyData<dim> l2l;
-    l2l.src_locs = down_equiv_surface.move(cell.bounds);
-    l2l.src_normals = down_equiv_surface.normals;
-    l2l.src_weights = std::vector<double>(l2l.src_locs.size(), 1.0);
+    auto n_threads = max_threads();
+    if (arena.workspaces.size() >= n_threads && arena.n_rhs_reserved >= n_rhs) {
+        return;
+    }
+    if (arena.workspaces.size() < n_threads) {
+        arena.workspaces.resize(n_threads);
+        arena.n_allocations++;
+    }
+    arena.n_rhs_reserved = std::max(arena.n_rhs_reserved, n_rhs);
 
-    for (size_t c = 0; c < Octree<dim>::split; c++) {
-        auto& child = cell.children[c];
-        if (child == nullptr) {
-            continue;
+    // Points and surfaces are read in place, so the point buffers in the 
+    // workspace only hold the combined child surfaces for M2M.
+    size_t max_pts = 0;
+    for (auto& t: tasks.p2ms) {
+        max_pts = std::max(max_pts, t.cell.n_pts());
+    }
+    for (auto& t: tasks.l2ps) {
+        max_pts = std::max(max_pts, t.cell.n_pts());
+    }
+    for (auto task_list: {&tasks.p2ps, &tasks.m2ps, &tasks.p2ls}) {
+        for (auto& t: *task_list) {
+            max_pts = std::max(max_pts, t.obs_cell.n_pts());
+            max_pts = std::max(max_pts, t.src_cell.n_pts());
         }
-
-        l2l.obs_locs = down_check_surface.move(child->bounds);
-        l2l.obs_normals = down_check_surface.normals;
-
-        auto check_eval = nbody_eval(*K, l2l, parent_locals);
-        auto equiv_srcs = mat_vec(check_to_equiv, check_eval);
-
-        for (size_t i = 0; i < equiv_srcs.size(); i++) {
-            #pragma omp atomic
-            child_locals[c][i] += equiv_srcs[i];
+    }
+    auto n_surf = std::max(
+        std::max(up_equiv_surface.pts.size(), up_check_surface.pts.size()),
+        std::max(down_equiv_surface.pts.size(), down_check_surface.pts.size())
+    );
+    auto n_surf_src = Octree<dim>::split * n_surf;
+    auto n_vals = std::max(max_pts, n_surf);
+    // The symmetric P2P also uses the equivalent source buffer for the 
+    // values at its source cell.
+    auto n_equiv = C * n_surf;
+    if (symmetric) {
+        n_equiv = std::max(n_equiv, R * max_pts);
+    }
+    // The transposed operators also put the values at the points of a cell
+    // in the source strength buffer.
+    auto n_src_str = C * std::max(n_surf_src, max_pts);
+    auto n = arena.n_rhs_reserved;
+
+    // The largest M2L batch and the most tasks in a batch that share a 
+    // translation operator.
+    size_t max_batch_cells = 0;
+    size_t max_batch_tasks = 0;
+    size_t max_shared_op = 0;
+    for (auto& b: schedule.m2l_batches) {
+        max_batch_cells = std::max(max_batch_cells, b.obs_cells.size());
+        max_batch_tasks = std::max(max_batch_tasks, b.tasks.size());
+        size_t run = 0;
+        for (size_t i = 0; i < b.tasks.size(); i++) {
+            bool same_op = i > 0 &&
+                m2l_ops.task_ops[b.tasks[i]] == m2l_ops.task_ops[b.tasks[i - 1]];
+            run = same_op ? run + 1 : 1;
+            max_shared_op = std::max(max_shared_op, run);
+        }
+    }
+    auto n_check = R * down_check_surface.pts.size();
+    std::array<size_t,3> m2l_sizes{{
+        std::max(
+            C * up_equiv_surface.pts.size() * max_shared_op,
+            C * down_equiv_surface.pts.size() * max_batch_cells
+        ),
+        n_check * max_shared_op,
+        n_check * max_batch_cells
+    }};
+
+    for (auto& w: arena.workspaces) {
+        w.reserve(0, n_surf_src, n_src_str * n, R * n_vals * n, n_equiv * n);
+        w.reserve_m2l(m2l_sizes, config.float_farfield);
+        if (fft_grid.enabled()) {
+            w.reserve_fft(
+                fft_grid.plan.size(), fft_grid.plan.scratch_size(),
+                fft_grid.spectrum_size(fft_grid.n_in),
+                std::max<size_t>(max_batch_cells, 1) *
+                    fft_grid.spectrum_size(fft_grid.n_out),
+                max_batch_tasks, max_shared_op
+            );
+        }
+        if (config.float_farfield) {
+            w.reserve_float(
+                C * n_surf_src * n, C * n_surf * n, R * n_surf * n, C * n_surf * n
+            );
         }
     }
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::L2P(const Octree<dim>& cell,
-    double* locals, std::vector<double>& out) const
+FMMWorkspace<dim>& FMMOperator<dim,R,C>::workspace() const
 {
-    //TODO: Code is essentially identical to M2P, refactor out a coeffs2P function
-    NBodyData<dim> l2p;
-    l2p.src_locs = down_equiv_surface.move(cell.bounds);
-    l2p.src_normals = down_equiv_surface.normals;
-    l2p.src_weights = std::vector<double>(l2p.src_locs.size(), 1.0);
-
-    auto n_obs = cell.indices.size();
-    l2p.obs_locs.resize(n_obs);
-    l2p.obs_normals.resize(n_obs);
-    for (size_t i = 0; i < n_obs; i++) {
-        l2p.obs_locs[i] = data.obs_locs[cell.indices[i]];
-        l2p.obs_normals[i] = data.obs_normals[cell.indices[i]];
+    auto arena = active_arena<dim>();
+    if (arena == nullptr) {
+        arena = &arenas.latest();
     }
+    auto idx = thread_index();
+    assert(idx < arena->workspaces.size());
+    return arena->workspaces[idx];
+}
 
-    auto res = nbody_eval(*K, l2p, locals);
+// Cell pairs above this depth (the sum of the two cell levels in the dual
+// tree traversal) are split into OpenMP tasks.
+const size_t parallel_traversal_depth = 4;
 
-    for (size_t i = 0; i < n_obs; i++) {
-        for (size_t d = 0; d < R; d++) {
-            #pragma omp atomic
-            out[d * data.obs_locs.size() + cell.indices[i]] += res[d * n_obs + i];
-        }
+template <typename T>
+void append(std::vector<T>& to, const std::vector<T>& from)
+{
+    // The tasks hold references, so they cannot be assigned, only copied. 
+    for (auto& t: from) {
+        to.push_back(t);
     }
 }
 
-
-template <size_t dim, size_t R, size_t C>
-std::vector<double> FMMOperator<dim,R,C>::execute_tasks(const FMMTasks<dim>& tasks,
-    const std::vector<double>& x, 
-    const CheckToEquiv& up_check_to_equiv,
-    const CheckToEquiv& down_check_to_equiv) const
+template <size_t dim>
+void append_tasks(FMMTasks<dim>& to, const FMMTasks<dim>& from)
 {
-    auto n_src_cells = 1 + src_oct.n_children();
-    auto n_src_equiv = up_equiv_surface.pts.size();
-    std::vector<double> multipoles(n_src_cells * n_src_equiv * C);
-    std::vector<double> out(R * data.obs_locs.size(), 0.0);
-
-    auto src_equiv_start = [&](const Octree<dim>& cell) {
-        return cell.index * n_src_equiv * C;
-    };
-
-#pragma omp parallel for 
-    for (size_t i = 0; i < tasks.p2ms.size(); i++) {
-        auto& cell = tasks.p2ms[i].cell;
-        assert(cell.level < up_check_to_equiv.size());
-        auto check_to_equiv_op = up_check_to_equiv[cell.level];
-        P2M(cell, check_to_equiv_op, x, multipoles.data() + src_equiv_start(cell));
-    }
+    append(to.p2ms, from.p2ms);
+    append(to.m2ms, from.m2ms);
+    append(to.m2ps, from.m2ps);
+    append(to.p2ps, from.p2ps);
+    append(to.p2ls, from.p2ls);
+    append(to.m2ls, from.m2ls);
+    append(to.l2ls, from.l2ls);
+    append(to.l2ps, from.l2ps);
+}
 
-// #pragma omp parallel for 
-    for (size_t i = 0; i < tasks.m2ms.size(); i++) {
-        auto& cell = tasks.m2ms[i].cell;
-        assert(cell.level < up_check_to_equiv.size());
-        auto check_to_equiv_op = up_check_to_equiv[cell.level];
-        std::vector<double*> child_data_ptrs(Octree<dim>::split);
-        for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (cell.children[c] == nullptr) {
-                continue;
-            }
-            auto ptr = multipoles.data() + src_equiv_start(*cell.children[c]);
-            child_data_ptrs[c] = ptr;
+/* Run job(k, tasks) for k in [0, n_jobs). If spawn is true, each job runs
+ * as an OpenMP task with its own task lists and the lists are appended in
+ * job order afterwards, so the result is the same as running the jobs in 
+ * order on one thread.
+ */
+template <size_t dim, typename F>
+void run_traversal_jobs(size_t n_jobs, bool spawn, FMMTasks<dim>& tasks,
+    const F& job)
+{
+    if (!spawn) {
+        for (size_t k = 0; k < n_jobs; k++) {
+            job(k, tasks);
         }
-        auto parent_data_ptr = multipoles.data() + src_equiv_start(cell);
-        M2M(cell, check_to_equiv_op, child_data_ptrs, parent_data_ptr);
-    }
-
-#pragma omp parallel for 
-    for (size_t i = 0; i < tasks.p2ps.size(); i++) {
-        auto t = tasks.p2ps[i];
-        P2P(t.obs_cell, t.src_cell, x, out);
-    }
-
-#pragma omp parallel for
-    for (size_t i = 0; i < tasks.m2ps.size(); i++) {
-        auto t = tasks.m2ps[i];
-        auto data_ptr = multipoles.data() + src_equiv_start(t.src_cell);
-        M2P(t.obs_cell, t.src_cell, data_ptr, out);
+        return;
     }
 
-    auto n_obs_cells = 1 + obs_oct.n_children();
-    auto n_obs_equiv = down_equiv_surface.pts.size();
-    std::vector<double> locals(n_obs_cells * n_obs_equiv * C, 0.0);
-    auto obs_equiv_start = [&](const Octree<dim>& cell) {
-        return cell.index * n_obs_equiv * C;
-    };
-
-#pragma omp parallel for
-    for (size_t i = 0; i < tasks.p2ls.size(); i++) {
-        auto t = tasks.p2ls[i];
-        assert(t.obs_cell.level < down_check_to_equiv.size());
-        auto check_to_equiv_op = down_check_to_equiv[t.obs_cell.level];
-        auto data_ptr = locals.data() + obs_equiv_start(t.obs_cell);
-        P2L(t.obs_cell, t.src_cell, check_to_equiv_op, x, data_ptr);
+    std::vector<FMMTasks<dim>> job_tasks(n_jobs);
+    auto job_ptr = &job;
+    auto job_tasks_ptr = job_tasks.data();
+    for (size_t k = 0; k < n_jobs; k++) {
+#pragma omp task firstprivate(k, job_ptr, job_tasks_ptr)
+        (*job_ptr)(k, job_tasks_ptr[k]);
     }
-
-#pragma omp parallel for
-    for (size_t i = 0; i < tasks.m2ls.size(); i++) {
-        auto t = tasks.m2ls[i];
-        assert(t.obs_cell.level < down_check_to_equiv.size());
-        auto check_to_equiv_op = down_check_to_equiv[t.obs_cell.level];
-        auto multipole_data = multipoles.data() + src_equiv_start(t.src_cell);
-        auto local_data = locals.data() + obs_equiv_start(t.obs_cell);
-        M2L(t.obs_cell, t.src_cell, check_to_equiv_op, multipole_data, local_data);
+#pragma omp taskwait
+    for (auto& t: job_tasks) {
+        append_tasks(tasks, t);
     }
+}
 
-// #pragma omp parallel for
-    for (size_t i = 0; i < tasks.l2ls.size(); i++) {
-        auto& cell = tasks.l2ls[i].cell;
-        assert(cell.level + 1 < down_check_to_equiv.size());
-        auto check_to_equiv_op = down_check_to_equiv[cell.level + 1];
-        std::vector<double*> child_data_ptrs(Octree<dim>::split);
-        for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (cell.children[c] == nullptr) {
-                continue;
+template <size_t dim, size_t R, size_t C>
+FMMTasks<dim> FMMOperator<dim,R,C>::build_tasks() const
+{
+    // The three traversals fill separate task lists, so they also run 
+    // concurrently.
+    FMMTasks<dim> up;
+    FMMTasks<dim> far;
+    FMMTasks<dim> down;
+#pragma omp parallel
+#pragma omp single
+    {
+#pragma omp task shared(up)
+        upward_traversal(src_oct.root(), up);
+#pragma omp task shared(far)
+        {
+            if (symmetric) {
+                dual_tree_symmetric(obs_oct.root(), src_oct.root(), far);
+            } else {
+                dual_tree(obs_oct.root(), src_oct.root(), far);
             }
-            auto ptr = locals.data() + obs_equiv_start(*cell.children[c]);
-            child_data_ptrs[c] = ptr;
         }
-        auto parent_data_ptr = locals.data() + obs_equiv_start(cell);
-        L2L(cell, check_to_equiv_op, parent_data_ptr, child_data_ptrs);
-    }
-
-#pragma omp parallel for
-    for (size_t i = 0; i < tasks.l2ps.size(); i++) {
-        auto& cell = tasks.l2ps[i].cell;
-        auto data_ptr = locals.data() + obs_equiv_start(cell);
-        L2P(cell, data_ptr, out);
+#pragma omp task shared(down)
+        downward_traversal(obs_oct.root(), down);
+#pragma omp taskwait
     }
 
+    FMMTasks<dim> out;
+    append_tasks(out, up);
+    append_tasks(out, far);
+    append_tasks(out, down);
     return out;
 }
 
 template <size_t dim, size_t R, size_t C>
-std::vector<double> FMMOperator<dim,R,C>::apply(const std::vector<double>& x) const 
+void FMMOperator<dim,R,C>::upward_traversal(const OctreeNode<dim>& cell,
+    FMMTasks<dim>& tasks) const
 {
-    assert(x.size() == C * data.src_locs.size());
+    if (cell.is_leaf()) {
+        tasks.p2ms.push_back({cell});
+    } else {
+        bool spawn = 2 * cell.level < parallel_traversal_depth;
+        run_traversal_jobs(Octree<dim>::split, spawn, tasks,
+            [&] (size_t c, FMMTasks<dim>& out) {
+                if (cell.child(c) != nullptr) {
+                    upward_traversal(*cell.child(c), out);
+                }
+            });
+        tasks.m2ms.push_back({cell});
+    }
+}
+
+template <size_t dim>
+bool well_separated(const Box<dim>& a, const Box<dim>& b, double mac)
+{
+    auto r_a = hypot(a.half_width);
+    auto r_b = hypot(b.half_width);
+    double r_max = std::max(r_a, r_b);
+    double r_min = std::min(r_a, r_b);
+    auto sep = hypot(a.center - b.center);
+    return r_max + mac * r_min <= mac * sep;
+}
 
-    auto out = execute_tasks(tasks, x, up_check_to_equiv, down_check_to_equiv);
+template bool well_separated(const Box<2>& a, const Box<2>& b, double mac);
+template bool well_separated(const Box<3>& a, const Box<3>& b, double mac);
 
-    return out;
+template <size_t dim, size_t R, size_t C>
+bool FMMOperator<dim,R,C>::well_separated(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell) const
+{
+    return tbem::well_separated(obs_cell.bounds, src_cell.bounds, config.mac);
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::upward_traversal(const Octree<dim>& cell,
+typename FMMTasks<dim>::Phase FMMOperator<dim,R,C>::add_farfield_task(
+    const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
     FMMTasks<dim>& tasks) const
 {
-    if (cell.is_leaf()) {
-        tasks.p2ms.push_back({cell});
-    } else {
-        for (size_t i = 0; i < Octree<dim>::split; i++) {
-            if (cell.children[i] == nullptr) {
-                continue;
-            }
-            upward_traversal(*cell.children[i], tasks);
+    typedef FMMTasks<dim> Tasks;
+    bool small_src = src_cell.n_pts() <= down_equiv_surface.pts.size();
+    bool small_obs = obs_cell.n_pts() <= up_equiv_surface.pts.size();
+    if (config.account_for_small_cells) {
+        if (small_obs && small_src) {
+            tasks.p2ps.push_back({obs_cell, src_cell});
+            return Tasks::P2P;
+        } else if (small_obs) {
+            tasks.m2ps.push_back({obs_cell, src_cell});
+            return Tasks::M2P;
+        } else if (small_src) {
+            tasks.p2ls.push_back({obs_cell, src_cell});
+            return Tasks::P2L;
         }
-        tasks.m2ms.push_back({cell});
     }
+    tasks.m2ls.push_back({obs_cell, src_cell});
+    return Tasks::M2L;
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::dual_tree(const Octree<dim>& obs_cell,
-    const Octree<dim>& src_cell, FMMTasks<dim>& tasks) const
+void FMMOperator<dim,R,C>::dual_tree(const OctreeNode<dim>& obs_cell,
+    const OctreeNode<dim>& src_cell, FMMTasks<dim>& tasks) const
 {
-    auto r_src = hypot(src_cell.bounds.half_width);
-    auto r_obs = hypot(obs_cell.bounds.half_width);
-    double r_max = std::max(r_src, r_obs);
-    double r_min = std::min(r_src, r_obs);
-    auto sep = hypot(obs_cell.bounds.center - src_cell.bounds.center);
-    if (r_max + config.mac * r_min <= config.mac * sep) {
-        bool small_src = src_cell.indices.size() <= down_equiv_surface.pts.size();
-        bool small_obs = obs_cell.indices.size() <= up_equiv_surface.pts.size();
-        if (config.account_for_small_cells) {
-            if (small_obs && small_src) {
-                tasks.p2ps.push_back({obs_cell, src_cell});
-            } else if (small_obs) {
-                tasks.m2ps.push_back({obs_cell, src_cell});
-            } else if (small_src) {
-                tasks.p2ls.push_back({obs_cell, src_cell});
-            } else {
-                tasks.m2ls.push_back({obs_cell, src_cell});
-            }
-        } else {
-            tasks.m2ls.push_back({obs_cell, src_cell});
-        }
+    if (well_separated(obs_cell, src_cell)) {
+        add_farfield_task(obs_cell, src_cell, tasks);
         return;
-
     }
 
     if (obs_cell.is_leaf() && src_cell.is_leaf()) {
@@ -610,27 +3332,77 @@ void FMMOperator<dim,R,C>::dual_tree(const Octree<dim>& obs_cell,
 
     bool src_is_shallower = obs_cell.level > src_cell.level;
     bool split_src = (src_is_shallower && !src_cell.is_leaf()) || obs_cell.is_leaf();
-    if (split_src) {
-        //split src because it is shallower
-        for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (src_cell.children[c] == nullptr) {
-                continue;
+    bool spawn = obs_cell.level + src_cell.level < parallel_traversal_depth;
+    run_traversal_jobs(Octree<dim>::split, spawn, tasks,
+        [&] (size_t c, FMMTasks<dim>& out) {
+            if (split_src) {
+                //split src because it is shallower
+                if (src_cell.child(c) != nullptr) {
+                    dual_tree(obs_cell, *src_cell.child(c), out);
+                }
+            } else {
+                //split obs
+                if (obs_cell.child(c) != nullptr) {
+                    dual_tree(*obs_cell.child(c), src_cell, out);
+                }
             }
-            dual_tree(obs_cell, *src_cell.children[c], tasks);
+        });
+}
+
+template <size_t dim, size_t R, size_t C>
+void FMMOperator<dim,R,C>::dual_tree_symmetric(const OctreeNode<dim>& a,
+    const OctreeNode<dim>& b, FMMTasks<dim>& tasks) const
+{
+    typedef FMMTasks<dim> Tasks;
+    if (&a == &b) {
+        if (a.is_leaf()) {
+            tasks.p2ps.push_back({a, a});
+            return;
         }
-    } else {
-        //split obs
-        for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (obs_cell.children[c] == nullptr) {
-                continue;
-            }
-            dual_tree(*obs_cell.children[c], src_cell, tasks);
+        // Each unordered pair of children, including each child with itself.
+        const size_t split = Octree<dim>::split;
+        bool spawn = 2 * a.level < parallel_traversal_depth;
+        run_traversal_jobs(split * split, spawn, tasks,
+            [&] (size_t k, FMMTasks<dim>& out) {
+                auto i = k / split;
+                auto j = k % split;
+                if (j < i || a.child(i) == nullptr || a.child(j) == nullptr) {
+                    return;
+                }
+                dual_tree_symmetric(*a.child(i), *a.child(j), out);
+            });
+        return;
+    }
+
+    if (well_separated(a, b)) {
+        // Both cells have the same number of equivalent surface points, so 
+        // a P2P in one direction is a P2P in the other and it covers both.
+        if (add_farfield_task(a, b, tasks) != Tasks::P2P) {
+            add_farfield_task(b, a, tasks);
         }
+        return;
+    }
+
+    if (a.is_leaf() && b.is_leaf()) {
+        tasks.p2ps.push_back({a, b});
+        return;
     }
+
+    // Split the larger cell, unless it is a leaf.
+    bool split_a = !a.is_leaf() && (b.is_leaf() || a.level <= b.level);
+    auto& parent = split_a ? a : b;
+    auto& other = split_a ? b : a;
+    bool spawn = a.level + b.level < parallel_traversal_depth;
+    run_traversal_jobs(Octree<dim>::split, spawn, tasks,
+        [&] (size_t c, FMMTasks<dim>& out) {
+            if (parent.child(c) != nullptr) {
+                dual_tree_symmetric(*parent.child(c), other, out);
+            }
+        });
 }
 
 template <size_t dim, size_t R, size_t C>
-void FMMOperator<dim,R,C>::downward_traversal(const Octree<dim>& obs_cell,
+void FMMOperator<dim,R,C>::downward_traversal(const OctreeNode<dim>& obs_cell,
     FMMTasks<dim>& tasks) const
 {
     if (obs_cell.is_leaf()) {
@@ -638,12 +3410,13 @@ void FMMOperator<dim,R,C>::downward_traversal(const Octree<dim>& obs_cell,
         return;
     } else {
         tasks.l2ls.push_back({obs_cell});
-        for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (obs_cell.children[c] == nullptr) {
-                continue;
-            }
-            downward_traversal(*obs_cell.children[c], tasks);
-        }
+        bool spawn = 2 * obs_cell.level < parallel_traversal_depth;
+        run_traversal_jobs(Octree<dim>::split, spawn, tasks,
+            [&] (size_t c, FMMTasks<dim>& out) {
+                if (obs_cell.child(c) != nullptr) {
+                    downward_traversal(*obs_cell.child(c), out);
+                }
+            });
     }
 }
 
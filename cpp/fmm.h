@@ -1,13 +1,20 @@
 #ifndef TBEMKASDJLKJKJ_FMM_H
 #define TBEMKASDJLKJKJ_FMM_H
 
+#include <array>
 #include <cassert>
+#include <complex>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include "kernel.h"
 #include "octree.h"
 #include "numbers.h"
 #include "blas_wrapper.h"
+#include "fft.h"
 #include "operator.h"
+#include "task_graph.h"
 
 namespace tbem {
 
@@ -17,17 +24,21 @@ struct TranslationSurface {
     const std::vector<Vec<double,dim>> normals;
 
     std::vector<Vec<double,dim>> move(const Box<dim>& box) const
+    {
+        std::vector<Vec<double,dim>> out_pts(pts.size());
+        move(box, out_pts.data());
+        return out_pts;
+    }
+
+    void move(const Box<dim>& box, Vec<double,dim>* out_pts) const
     {
         auto cell_r = hypot(box.half_width);
         auto out_r = cell_r;
         auto out_center = box.center;
 
-        std::vector<Vec<double,dim>> out_pts(pts.size());
         for (size_t i = 0; i < pts.size(); i++) {
             out_pts[i] = out_r * pts[i] + out_center;
         }
-
-        return out_pts;
     }
 
     TranslationSurface<dim> scale(double factor) const
@@ -39,36 +50,86 @@ struct TranslationSurface {
         return {out_pts, normals};
     }
 
-    static TranslationSurface<dim> up_check_surface(size_t order, double d) 
+    // With grid, the surfaces are the boundaries of regular grids instead,
+    // as needed by FMMConfig::fft_m2l (see FFTM2LGrid). The check to
+    // equivalent solves need the same number of points on every surface.
+    static TranslationSurface<dim> up_check_surface(size_t order, double d,
+        bool grid = false)
     {
         auto r_ref = 4.0 - std::sqrt(2) - 2 * d;
-        return make_surrounding_surface(order).scale(r_ref);
+        return make_surface(order, grid).scale(r_ref);
     }
 
-    static TranslationSurface<dim> up_equiv_surface(size_t order, double d)
+    static TranslationSurface<dim> up_equiv_surface(size_t order, double d,
+        bool grid = false)
     {
         (void)d;
         auto r_ref = 0.3;//std::sqrt(2) + d;
-        return make_surrounding_surface(order).scale(r_ref);
+        return make_surface(order, grid).scale(r_ref);
     }
 
-    static TranslationSurface<dim> down_check_surface(size_t order, double d)
+    static TranslationSurface<dim> down_check_surface(size_t order, double d,
+        bool grid = false)
     {
         (void)d;
         auto r_ref = 0.3;//std::sqrt(2) + d;
-        return make_surrounding_surface(order).scale(r_ref);
+        return make_surface(order, grid).scale(r_ref);
     }
 
-    static TranslationSurface<dim> down_equiv_surface(size_t order, double d)
+    static TranslationSurface<dim> down_equiv_surface(size_t order, double d,
+        bool grid = false)
     {
         auto r_ref = 4.0 - std::sqrt(2) - 2 * d;
-        return make_surrounding_surface(order).scale(r_ref);
+        return make_surface(order, grid).scale(r_ref);
+    }
+
+    static TranslationSurface<dim> make_surface(size_t order, bool grid)
+    {
+        return grid ? make_grid_surface(order) : make_surrounding_surface(order);
     }
 
     static TranslationSurface<dim> make_surrounding_surface(size_t order);
+
+    /* The points on the boundary of the regular grid spanning [-1, 1] in 
+     * each dimension with the number of boundary points closest to order.
+     * The normals point out of the faces of the cube, and at the edges and
+     * corners they are the normalized sum of the normals of the adjacent 
+     * faces.
+     */
+    static TranslationSurface<dim> make_grid_surface(size_t order);
 };
 
+/* The points of a translation surface for every cell of a tree, computed
+ * once so that the FMM operators can read them in place. The points for the
+ * cell with index i are pts[i * n_pts, (i + 1) * n_pts). The normals and
+ * the unit weights are the same for every cell.
+ */
+template <size_t dim>
+struct CellSurfaces {
+    const size_t n_pts;
+    const std::vector<Vec<double,dim>> pts;
+    const std::vector<Vec<double,dim>> normals;
+    const std::vector<double> weights;
+
+    const Vec<double,dim>* cell_pts(const OctreeNode<dim>& cell) const
+    {
+        return pts.data() + cell.index * n_pts;
+    }
+};
+
+template <size_t dim>
+CellSurfaces<dim> make_cell_surfaces(const TranslationSurface<dim>& surf,
+    const Octree<dim>& oct);
+
+/* Whether two boxes are far enough apart, relative to their sizes, for
+ * their interaction to go through the far field operators. mac is 
+ * FMMConfig::mac.
+ */
+template <size_t dim>
+bool well_separated(const Box<dim>& a, const Box<dim>& b, double mac);
+
 typedef std::vector<std::vector<double>> CheckToEquiv;
+typedef std::vector<std::vector<float>> FloatCheckToEquiv;
 
 struct FMMConfig {
     const double mac;
@@ -88,25 +149,103 @@ struct FMMConfig {
     //
     const bool account_for_small_cells;
 
+    // When true, the FMM tasks are grouped by the output they write so that
+    // a single thread owns each output range and no atomic updates are 
+    // needed. When false, every task is scheduled separately and outputs are
+    // accumulated atomically.
+    const bool owner_computes;
+
+    // When false, operators built from this config (boundary_operator, for
+    // example) evaluate the far field directly with a dense O(N^2) matrix
+    // instead of using the FMM. Useful for checking FMM accuracy on small 
+    // problems.
+    const bool use_fmm;
+
+    // When true, the multipole and local coefficients, the M2L operators 
+    // and the M2L arithmetic are single precision. The kernel evaluations, 
+    // including the whole near field, stay in double precision. The check to
+    // equivalent operators are regularized more strongly to suit, so the 
+    // error is limited to between roughly 1e-5 and 1e-4 depending on the 
+    // kernel, in exchange for half the memory and memory traffic in the M2L
+    // phase. float_farfield_report (fmm_autotune.h) measures the difference 
+    // for a particular problem.
+    const bool float_farfield;
+
+    // If not empty, the check to equivalent operators are stored in this 
+    // directory (see fmm_cache.h) and loaded from it instead of being 
+    // recomputed with SVDs by later operators with the same kernel, kernel
+    // parameters, order and cell sizes. For a homogeneous kernel, the cell
+    // sizes do not matter.
+    const std::string precompute_cache_dir;
+
+    // When true, the M2L translations between cells on the same level are
+    // done in Fourier space (see FFTM2LGrid): the up equivalent and down 
+    // check surfaces are regular grids, and a translation is a pointwise 
+    // product of Fourier transforms instead of a dense matrix product. The
+    // cost per translation grows like order^1.5 instead of order^2, so this
+    // pays off at high orders. Kernels that are not linear in the normals 
+    // fall back to the dense translations.
+    const bool fft_m2l;
+
     FMMConfig(double mac, size_t order, size_t min_pts_per_cell,
-        double d, bool account_for_small_cells):
+        double d, bool account_for_small_cells, bool owner_computes = true,
+        bool use_fmm = true, bool float_farfield = false,
+        std::string precompute_cache_dir = "", bool fft_m2l = false):
         mac(mac), order(order), min_pts_per_cell(min_pts_per_cell),
-        d(d), account_for_small_cells(account_for_small_cells)
+        d(d), account_for_small_cells(account_for_small_cells),
+        owner_computes(owner_computes), use_fmm(use_fmm),
+        float_farfield(float_farfield),
+        precompute_cache_dir(precompute_cache_dir),
+        fft_m2l(fft_m2l)
     {}
 };
 
+/* Where an FMMOperator spends its time and memory. The per phase vectors 
+ * are indexed by FMMTasks<dim>::Phase: P2M, M2M, P2P, M2P, P2L, M2L, L2L, L2P.
+ * The tree statistics are filled in at construction and the rest describe 
+ * the most recent apply.
+ */
+struct FMMStats {
+    static const size_t n_phases = 8;
+
+    size_t src_tree_depth = 0;
+    size_t obs_tree_depth = 0;
+
+    // Entry 0 counts the empty leaves and entry k > 0 counts the leaves with
+    // between 2^(k - 1) and 2^k - 1 points.
+    std::vector<size_t> src_leaf_size_histogram;
+    std::vector<size_t> obs_leaf_size_histogram;
+
+    size_t n_applies = 0;
+    size_t n_rhs = 0;
+    double apply_time = 0.0;
+    std::vector<size_t> n_tasks = std::vector<size_t>(n_phases, 0);
+    std::vector<size_t> n_kernel_evals = std::vector<size_t>(n_phases, 0);
+
+    // The time summed over all threads, in seconds. Phases overlap in the
+    // task graph, so the total can be more than apply_time.
+    std::vector<double> phase_time = std::vector<double>(n_phases, 0.0);
+
+    // The time each thread spent running FMM tasks, in seconds. A thread 
+    // with much less time than the others points to load imbalance.
+    std::vector<double> thread_time;
+
+    // The size of the scratch memory held by the operator after the apply.
+    size_t temporary_bytes = 0;
+};
+
 template <size_t dim>
 struct FMMTasks 
 {
     struct CellPairTask
     {
-        const Octree<dim>& obs_cell;
-        const Octree<dim>& src_cell;
+        const OctreeNode<dim>& obs_cell;
+        const OctreeNode<dim>& src_cell;
     };
 
     struct CellTask
     {
-        const Octree<dim>& cell;
+        const OctreeNode<dim>& cell;
     };
 
     std::vector<CellTask> p2ms;
@@ -117,10 +256,469 @@ struct FMMTasks
     std::vector<CellPairTask> m2ls;
     std::vector<CellTask> l2ls;
     std::vector<CellTask> l2ps;
+
+    enum Phase {P2M, M2M, P2P, M2P, P2L, M2L, L2L, L2P};
+};
+
+/* A piece of an FMM task: the task with index "task" in the given phase of 
+ * FMMTasks, restricted to writing the outputs of obs_cell. For most phases,
+ * obs_cell is just the observation cell of the task. For P2P and M2P, it 
+ * can be a leaf below the task's observation cell, and for L2L, it is the
+ * child cell that receives the translated local coefficients. M2L work is
+ * batched: "task" is the index of an M2LBatch in FMMSchedule::m2l_batches
+ * and obs_cell is the batch's first observation cell.
+ */
+template <size_t dim>
+struct FMMWorkItem
+{
+    typename FMMTasks<dim>::Phase phase;
+    size_t task;
+    const OctreeNode<dim>* obs_cell;
+};
+
+/* A group of m2l tasks that is run together by M2L_batch. The observation
+ * cells are all on the same level, so they share a check to equivalent 
+ * operator, and each belongs to only one batch. The tasks are sorted so
+ * that the tasks sharing a translation operator are adjacent. 
+ */
+template <size_t dim>
+struct M2LBatch
+{
+    std::vector<const OctreeNode<dim>*> obs_cells;
+    std::vector<size_t> tasks;
+    // For each task, the position of its observation cell in obs_cells.
+    std::vector<size_t> obs_slots;
+};
+
+/* The order of execution of the FMM tasks. Each node of the task graph runs 
+ * its work items in order.
+ */
+template <size_t dim>
+struct FMMSchedule
+{
+    TaskGraph graph;
+    std::vector<std::vector<FMMWorkItem<dim>>> work;
+    std::vector<M2LBatch<dim>> m2l_batches;
+};
+
+/* The layout of the Fourier space M2L translations of FMMConfig::fft_m2l.
+ * The up equivalent and down check surfaces are the same regular grid 
+ * surface, so the translation between two cells on the same level is a
+ * discrete convolution of the kernel values at the grid offsets with the
+ * multipole coefficients. It is computed as a cyclic convolution on a grid
+ * with plan.n >= 2 * grid_n - 1 points along each dimension, so that no
+ * offsets wrap around, by multiplying Fourier transforms. The transforms of
+ * real values are Hermitian, so only the n_freqs() with a last index of at
+ * most plan.n / 2 are stored.
+ *
+ * The stored transforms of n channels are split into blocks of 
+ * fft_freq_block frequencies. Each block holds, for each channel in turn, 
+ * the real parts of its values followed by their imaginary parts, and the
+ * last block is padded with zeros. The products of the transforms then 
+ * read each block of an operator as one contiguous run and vectorize.
+ *
+ * Kernels that depend on the normals are split into channels. If a kernel
+ * is linear in the source normal, for example, K(x, y, n_x, n_y) is the 
+ * sum over d of n_y[d] K(x, y, n_x, e_d), so each component of the source
+ * normals becomes an input channel of the convolution, with the multipoles
+ * scaled by that normal component. The observation normals are handled the
+ * same way. There are n_src_channels per kernel column and n_obs_channels 
+ * per kernel row: 1 if the kernel does not depend on that normal, dim if it
+ * is linear in it and 0 if it is neither, which disables the Fourier space
+ * translations.
+ */
+const size_t fft_freq_block = 16;
+
+template <size_t dim>
+struct FFTM2LGrid
+{
+    FFTPlan plan;
+    // The number of surface grid points along each side.
+    size_t grid_n = 0;
+    // The grid spacing for a cell with hypot(half_width) equal to 1.
+    double unit_spacing = 0;
+    // For each surface point, its index in the plan.n^dim grid.
+    std::vector<size_t> grid_index;
+    // For each index along the first dim - 1 dimensions of the grid, the
+    // index of the negated coordinates. Used to fill in the Hermitian half
+    // of a transform that is not stored.
+    std::vector<size_t> negated_index;
+    size_t n_obs_channels = 0;
+    size_t n_src_channels = 0;
+    // The factor for the value at surface point i in channel a is 
+    // obs_channel_weights[i * n_obs_channels + a], and likewise for the
+    // sources.
+    std::vector<double> obs_channel_weights;
+    std::vector<double> src_channel_weights;
+    // Channels with the same kernel values share a convolution, so there
+    // are only n_out outputs and n_in inputs: the values for kernel row r
+    // and observation normal component a are output 
+    // out_channel[r * n_obs_channels + a], and likewise for the inputs. The
+    // stress of the elastic hypersingular kernel is symmetric, for example,
+    // so its 9 channels per normal only need 6 convolutions.
+    std::vector<size_t> out_channel;
+    std::vector<size_t> in_channel;
+    size_t n_out = 0;
+    size_t n_in = 0;
+
+    bool enabled() const
+    {
+        return n_obs_channels > 0 && n_src_channels > 0;
+    }
+
+    size_t n_freqs() const
+    {
+        if (!enabled()) {
+            return 0;
+        }
+        return plan.size() / plan.n * (plan.n / 2 + 1);
+    }
+
+    size_t n_freq_blocks() const
+    {
+        return (n_freqs() + fft_freq_block - 1) / fft_freq_block;
+    }
+
+    size_t spectrum_size(size_t n_channels) const
+    {
+        return n_freq_blocks() * n_channels * 2 * fft_freq_block;
+    }
+
+    /* The position of the real part of frequency f of a channel. The 
+     * imaginary part is fft_freq_block entries later.
+     */
+    size_t spectrum_index(size_t n_channels, size_t channel, size_t f) const
+    {
+        auto block = f / fft_freq_block;
+        return (block * n_channels + channel) * 2 * fft_freq_block +
+            f % fft_freq_block;
+    }
+};
+
+/* The M2L translation operators for a set of m2l tasks. The operator for a
+ * pair of cells depends only on the levels of the two cells and their 
+ * relative position, so each unique operator is built once and shared by
+ * all the tasks with the same levels and offset. 
+ *
+ * The operators map the source cell equivalent surface to the observation
+ * cell check surface. The check to equivalent solve is left to M2L, because
+ * premultiplying by the (poorly conditioned) check to equivalent operator
+ * loses several digits of accuracy.
+ */
+struct M2LOperators
+{
+    std::vector<std::vector<double>> ops;
+    // With FMMConfig::float_farfield, the operators are stored here in 
+    // single precision instead and ops is empty.
+    std::vector<std::vector<float>> float_ops;
+    // For each m2l task, the index in ops of its translation operator.
+    std::vector<size_t> task_ops;
+    // With FMMConfig::fft_m2l, the operators between cells on the same 
+    // level are stored here as the transforms of the kernel values at the
+    // grid offsets (see FFTM2LGrid) and their entries in ops or float_ops 
+    // are empty. For each frequency f, convolution output o and input s 
+    // (see FFTM2LGrid::out_channel) the value is channel o * n_in + s of the
+    // n_out * n_in channels of fft_ops[op] (see FFTM2LGrid::spectrum_index).
+    // The 1 / plan.size() scaling of the inverse transform is included.
+    std::vector<std::vector<double>> fft_ops;
+    // For each source cell, the position of its transformed multipoles in
+    // FMMArena::multipole_spectra, or the largest size_t if the cell is not
+    // the source of any Fourier space translation.
+    std::vector<size_t> fft_src_slots;
+    size_t n_fft_src_cells = 0;
+
+    bool is_fft(size_t op_idx) const
+    {
+        return op_idx < fft_ops.size() && fft_ops[op_idx].size() > 0;
+    }
 };
 
 template <size_t dim> struct NBodyData;
 
+/* Resize a buffer to n entries, counting the times that it has to grow. */
+template <typename T>
+T* reuse_buffer(std::vector<T>& buffer, size_t n, size_t& n_allocations)
+{
+    if (buffer.capacity() < n) {
+        n_allocations++;
+    }
+    buffer.resize(n);
+    return buffer.data();
+}
+
+/* Scratch memory for running FMM operators on one thread. The buffers keep
+ * their capacity between uses, so once they have grown to fit the largest 
+ * operator, the FMM operators do no further heap allocation.
+ */
+template <size_t dim>
+struct FMMWorkspace
+{
+    NBodyData<dim> nbody;
+    std::vector<double> src_str;
+    std::vector<double> obs_vals;
+    std::vector<double> equiv;
+    // Only used with FMMConfig::float_farfield: double precision copies of 
+    // the coefficients read and written by the operators that evaluate the
+    // kernel, and the single precision M2L intermediates.
+    std::vector<double> coeffs_in;
+    std::vector<double> coeffs_out;
+    std::vector<float> float_vals;
+    std::vector<float> float_equiv;
+    // Only used by M2L_batch, in the precision of the coefficients: the 
+    // gathered multipoles, their product with a translation operator and
+    // the summed check surface values.
+    std::array<std::vector<double>,3> m2l_buffers;
+    std::array<std::vector<float>,3> float_m2l_buffers;
+    // Only used with FMMConfig::fft_m2l: a grid for the Fourier transforms,
+    // their scratch space, the transformed input channels of a transposed
+    // translation, the summed transforms for each observation cell of an
+    // M2L batch, the positions of the Fourier space tasks in the batch and
+    // the transforms read and written by the tasks that share an operator.
+    std::vector<std::complex<double>> fft_grid;
+    std::vector<std::complex<double>> fft_scratch;
+    std::vector<double> fft_src;
+    std::vector<double> fft_sums;
+    std::vector<size_t> fft_tasks;
+    std::vector<const double*> fft_batch_srcs;
+    std::vector<double*> fft_batch_dsts;
+    // The structure of arrays sources and kernel rows of nbody_eval and the
+    // P2P operators.
+    KernelScratch kernel_scratch;
+    size_t n_allocations = 0;
+
+    // The FMMStats counters for the tasks run on this thread.
+    std::array<double,FMMStats::n_phases> phase_time;
+    std::array<size_t,FMMStats::n_phases> n_kernel_evals;
+
+    template <typename T>
+    T* buffer(std::vector<T>& b, size_t n)
+    {
+        return reuse_buffer(b, n, n_allocations);
+    }
+
+    /* Grow the buffers up front so that operators with up to n_obs 
+     * observation points and n_src sources fit without allocating.
+     */
+    void reserve(size_t n_obs, size_t n_src, size_t n_src_str, 
+        size_t n_obs_vals, size_t n_equiv)
+    {
+        reuse_buffer(src_str, n_src_str, n_allocations);
+        reuse_buffer(obs_vals, n_obs_vals, n_allocations);
+        reuse_buffer(equiv, n_equiv, n_allocations);
+        nbody_data(n_obs, n_src);
+    }
+
+    /* Grow the buffers used only with FMMConfig::float_farfield. */
+    void reserve_float(size_t n_coeffs_in, size_t n_coeffs_out,
+        size_t n_float_vals, size_t n_float_equiv)
+    {
+        reuse_buffer(coeffs_in, n_coeffs_in, n_allocations);
+        reuse_buffer(coeffs_out, n_coeffs_out, n_allocations);
+        reuse_buffer(float_vals, n_float_vals, n_allocations);
+        reuse_buffer(float_equiv, n_float_equiv, n_allocations);
+    }
+
+    /* Grow the M2L_batch buffers, in single precision with 
+     * FMMConfig::float_farfield.
+     */
+    void reserve_m2l(const std::array<size_t,3>& sizes, bool float_farfield)
+    {
+        for (size_t i = 0; i < sizes.size(); i++) {
+            if (float_farfield) {
+                reuse_buffer(float_m2l_buffers[i], sizes[i], n_allocations);
+            } else {
+                reuse_buffer(m2l_buffers[i], sizes[i], n_allocations);
+            }
+        }
+    }
+
+    std::vector<double>& m2l_buffer(size_t i, const double*)
+    {
+        return m2l_buffers[i];
+    }
+
+    std::vector<float>& m2l_buffer(size_t i, const float*)
+    {
+        return float_m2l_buffers[i];
+    }
+
+    /* Grow the buffers used only with FMMConfig::fft_m2l. */
+    void reserve_fft(size_t n_grid, size_t n_scratch, size_t n_src,
+        size_t n_sums, size_t n_tasks, size_t n_batch)
+    {
+        reuse_buffer(fft_grid, n_grid, n_allocations);
+        reuse_buffer(fft_scratch, n_scratch, n_allocations);
+        reuse_buffer(fft_src, n_src, n_allocations);
+        reuse_buffer(fft_sums, n_sums, n_allocations);
+        reuse_buffer(fft_tasks, n_tasks, n_allocations);
+        reuse_buffer(fft_batch_srcs, n_batch, n_allocations);
+        reuse_buffer(fft_batch_dsts, n_batch, n_allocations);
+    }
+
+    size_t n_bytes() const
+    {
+        size_t m2l_bytes = 0;
+        for (size_t i = 0; i < m2l_buffers.size(); i++) {
+            m2l_bytes += sizeof(double) * m2l_buffers[i].capacity() +
+                sizeof(float) * float_m2l_buffers[i].capacity();
+        }
+        auto fft_bytes = sizeof(std::complex<double>) * (
+                fft_grid.capacity() + fft_scratch.capacity()
+            ) + sizeof(double) * (fft_src.capacity() + fft_sums.capacity()) +
+            sizeof(size_t) * fft_tasks.capacity() +
+            sizeof(double*) * (
+                fft_batch_srcs.capacity() + fft_batch_dsts.capacity()
+            );
+        return m2l_bytes + fft_bytes + sizeof(double) * (
+                src_str.capacity() + obs_vals.capacity() + equiv.capacity() +
+                coeffs_in.capacity() + coeffs_out.capacity() +
+                nbody.src_weights.capacity()
+            ) + sizeof(float) * (
+                float_vals.capacity() + float_equiv.capacity()
+            ) + sizeof(Vec<double,dim>) * (
+                nbody.obs_locs.capacity() + nbody.obs_normals.capacity() +
+                nbody.src_locs.capacity() + nbody.src_normals.capacity()
+            );
+    }
+
+    NBodyData<dim>& nbody_data(size_t n_obs, size_t n_src)
+    {
+        reuse_buffer(nbody.obs_locs, n_obs, n_allocations);
+        reuse_buffer(nbody.obs_normals, n_obs, n_allocations);
+        reuse_buffer(nbody.src_locs, n_src, n_allocations);
+        reuse_buffer(nbody.src_normals, n_src, n_allocations);
+        reuse_buffer(nbody.src_weights, n_src, n_allocations);
+        return nbody;
+    }
+};
+
+/* The memory that an FMMOperator reuses between evaluations: the input and
+ * output in tree order, the multipole and local coefficients and a workspace
+ * for each thread. With FMMConfig::float_farfield, the coefficients are in 
+ * the float vectors instead.
+ */
+template <size_t dim>
+struct FMMArena
+{
+    std::vector<double> x_tree;
+    std::vector<double> out_tree;
+    std::vector<double> multipoles;
+    std::vector<double> locals;
+    std::vector<float> float_multipoles;
+    std::vector<float> float_locals;
+    // With FMMConfig::fft_m2l, the transformed multipoles of the source 
+    // cells of the Fourier space translations (see 
+    // FMMOperator::transform_multipoles).
+    std::vector<double> multipole_spectra;
+    std::vector<FMMWorkspace<dim>> workspaces;
+    // The number of vectors that the workspaces have been reserved for.
+    size_t n_rhs_reserved = 0;
+    size_t n_allocations = 0;
+
+    // The scratch memory is never shared and its contents are not worth 
+    // keeping, so a copy starts out empty.
+    FMMArena() = default;
+    FMMArena(const FMMArena<dim>&) {}
+    FMMArena<dim>& operator=(const FMMArena<dim>&) {return *this;}
+
+    size_t n_bytes() const
+    {
+        auto total = sizeof(double) * (
+            x_tree.capacity() + out_tree.capacity() + multipoles.capacity() +
+            locals.capacity() + multipole_spectra.capacity()
+        ) + sizeof(float) * (
+            float_multipoles.capacity() + float_locals.capacity()
+        );
+        for (auto& w: workspaces) {
+            total += w.n_bytes();
+        }
+        return total;
+    }
+
+    /* The number of times any of the arena's buffers have had to grow. */
+    size_t total_allocations() const
+    {
+        auto total = n_allocations;
+        for (auto& w: workspaces) {
+            total += w.n_allocations;
+        }
+        return total;
+    }
+};
+
+/* The scratch arenas of an FMMOperator. Each apply takes an arena that no
+ * other apply is using, creating one if they are all busy, and returns it 
+ * when it finishes, so concurrent applies of one operator never share 
+ * scratch memory. Applying from one thread at a time reuses one arena. The 
+ * mutex also guards the operator's statistics.
+ */
+template <size_t dim>
+struct FMMArenaPool
+{
+    std::mutex mutex;
+    // Every arena created so far. The first one is also used by the 
+    // translation operators when they are called outside of an apply.
+    std::vector<std::unique_ptr<FMMArena<dim>>> arenas;
+    // The arenas not in use, the most recently returned last.
+    std::vector<FMMArena<dim>*> available;
+
+    // Like the arenas themselves, a copy starts out empty.
+    FMMArenaPool() = default;
+    FMMArenaPool(const FMMArenaPool<dim>&) {}
+    FMMArenaPool<dim>& operator=(const FMMArenaPool<dim>&) {return *this;}
+
+    FMMArena<dim>& acquire()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (available.empty()) {
+            arenas.emplace_back(new FMMArena<dim>());
+            return *arenas.back();
+        }
+        auto arena = available.back();
+        available.pop_back();
+        return *arena;
+    }
+
+    void release(FMMArena<dim>& arena)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        available.push_back(&arena);
+    }
+
+    /* The arena returned most recently, or the first arena if none has 
+     * been returned. This is only meaningful while no apply is running.
+     */
+    FMMArena<dim>& latest()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (arenas.empty()) {
+            arenas.emplace_back(new FMMArena<dim>());
+            available.push_back(arenas.back().get());
+        }
+        return available.empty() ? *arenas[0] : *available.back();
+    }
+
+    size_t n_bytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for (auto& a: arenas) {
+            total += a->n_bytes();
+        }
+        return total;
+    }
+
+    size_t total_allocations()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t total = 0;
+        for (auto& a: arenas) {
+            total += a->total_allocations();
+        }
+        return total;
+    }
+};
+
 /* An implementation of the kernel independent fast multipole method
  * as described in:
  *
@@ -131,110 +729,490 @@ template <size_t dim> struct NBodyData;
 template <size_t dim, size_t R, size_t C>
 struct FMMOperator: public OperatorI {
     const std::shared_ptr<Kernel<dim,R,C>> K;
-    const NBodyData<dim> data;
     const TranslationSurface<dim> up_equiv_surface;
     const TranslationSurface<dim> up_check_surface;
     const TranslationSurface<dim> down_equiv_surface;
     const TranslationSurface<dim> down_check_surface;
-    Octree<dim> src_oct;
-    Octree<dim> obs_oct;
+
+    // When the observation and source points and normals are identical, a 
+    // single tree is built and shared by both sides. If the kernel is also
+    // symmetric, the operator is symmetric: the dual tree traversal visits 
+    // each unordered pair of cells once and each P2P task evaluates its 
+    // kernel block once and applies it in both directions. The down check to
+    // equivalent operators are then the transposes of the up operators.
+    const bool single_tree;
+    const bool symmetric;
+    const std::shared_ptr<const Octree<dim>> src_tree;
+    const std::shared_ptr<const Octree<dim>> obs_tree;
+    const Octree<dim>& src_oct;
+    const Octree<dim>& obs_oct;
+    const CellSurfaces<dim> up_equiv_cells;
+    const CellSurfaces<dim> up_check_cells;
+    const CellSurfaces<dim> down_equiv_cells;
+    const CellSurfaces<dim> down_check_cells;
+    // The points, permuted into tree order so that the points of each cell 
+    // are contiguous. apply() permutes its input into the same order and its
+    // output back into the original order. refit() replaces the points.
+    NBodyData<dim> data;
     const FMMConfig config;
     const CheckToEquiv up_check_to_equiv;
     const CheckToEquiv down_check_to_equiv;
+    // Single precision copies of down_check_to_equiv for the M2L operator
+    // with config.float_farfield, empty otherwise.
+    const FloatCheckToEquiv float_down_check_to_equiv;
+    // The layout of the Fourier space M2L translations with config.fft_m2l,
+    // disabled otherwise.
+    const FFTM2LGrid<dim> fft_grid;
     FMMTasks<dim> tasks;
+    M2LOperators m2l_ops;
+    FMMSchedule<dim> schedule;
+    // The schedule for apply_transpose: the same work with the order 
+    // reversed. It is built with schedule so that apply_transpose, like
+    // apply, only reads it.
+    FMMSchedule<dim> transpose_schedule;
+
+    // The scratch memory of the applies in progress and the statistics of 
+    // the most recent one to finish. Each apply works in its own arena and
+    // updates the statistics under the pool's lock, so one operator can be
+    // applied from several threads at once. Read the statistics with 
+    // latest_stats() while other threads may be applying the operator.
+    mutable FMMArenaPool<dim> arenas;
+    mutable FMMStats stats;
 
     FMMOperator(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
         const FMMConfig& config);
+
+    /* A copy shares the trees and kernel, copies the precomputed operators 
+     * and tasks and gets its own scratch memory, so it is cheap to build and
+     * can be applied independently of the original.
+     */
     virtual std::unique_ptr<OperatorI> clone() const;
 
+    /* Move the points without rebuilding the trees. The cells are fixed 
+     * boxes, so the cells, tasks, schedule and translation operators all 
+     * remain valid as long as every point stays inside its leaf cell, with 
+     * the leaf allowed to grow by tolerance times its half width in each 
+     * direction. In that case only the points are replaced and true is 
+     * returned. Otherwise, or if the operator was built with a single tree 
+     * and the new observation and source points differ, nothing changes and
+     * false is returned; a new operator must then be built. The number and 
+     * order of the points must match the original data. This must not be 
+     * called while the operator is being applied.
+     *
+     * Larger tolerances than max_refit_tolerance are reduced to it.
+     */
+    bool refit(const NBodyData<dim>& new_data, double tolerance = 0.0);
+
+    /* The largest tolerance refit accepts. Points may move out of their 
+     * leaves by this much and still lie inside the up check and down 
+     * equivalent surfaces of their cells, and every far field pair of cells
+     * grown by this much still passes the MAC. The far field is then as 
+     * accurate as for points that never left their leaves.
+     */
+    double max_refit_tolerance;
+
     /* Construct the operators relating the influence of a set of
      * a sources on the check surface to the equivalent set of sources on
-     * the equivalent surface.
+     * the equivalent surface, one for each level of the tree. For a 
+     * homogeneous kernel, only the operator for a cell of unit size requires
+     * an SVD and the others are rescaled copies of it.
      */
-    CheckToEquiv build_check_to_equiv(const Octree<dim>& cell,
-        size_t start_level, const TranslationSurface<dim>& equiv_surf,
+    CheckToEquiv build_check_to_equiv(const Octree<dim>& oct,
+        const TranslationSurface<dim>& equiv_surf,
         const TranslationSurface<dim>& check_surf) const;
+
+    /* The check to equivalent operator for a cell with radius cell_r, the
+     * length of the cell's half width vector. The kernel is translation 
+     * invariant, so the cell center does not matter. Uses 
+     * config.precompute_cache_dir when it is set.
+     */
+    std::vector<double> check_to_equiv_op(
+        const TranslationSurface<dim>& equiv_surf,
+        const TranslationSurface<dim>& check_surf, double cell_r) const;
     
+    /* The translation operators below act on n_rhs vectors at once. The 
+     * source strengths, coefficients and outputs are stored row-major with 
+     * the n_rhs values for each row adjacent, so the kernel evaluations and
+     * translation matrices are shared by all the vectors. Source strengths
+     * x and outputs out are in the tree order of data.
+     */
+
     /* The P2M operator converts sources to equivalent sources in the
      * upward tree traversal.
      */
-    void P2M(const Octree<dim>& cell, const std::vector<double>& check_to_equiv,
-        const std::vector<double>& x, double* parent_multipoles) const;
+    void P2M(const OctreeNode<dim>& cell, const std::vector<double>& check_to_equiv,
+        const std::vector<double>& x, double* parent_multipoles,
+        size_t n_rhs = 1) const;
 
     /* The M2M operator converts child cell equivalent sources to parent cell
      * equivalent sources in the upward tree traversal.
      */
-    void M2M(const Octree<dim>& cell, const std::vector<double>& check_to_equiv,
-        std::vector<double*>& child_multipoles, double* parent_multipoles) const;
+    void M2M(const OctreeNode<dim>& cell, const std::vector<double>& check_to_equiv,
+        const std::array<double*,Octree<dim>::split>& child_multipoles,
+        double* parent_multipoles, size_t n_rhs = 1) const;
 
     /* The P2L operator converts from sources straight to the equivalent sources
      * at a farfield observation cell (local coefficients) bypassing the P2M, M2M 
      * and M2L operators in cases where there are insufficient sources to justify
      * using those operators.
      */
-    void P2L(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
+    void P2L(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
         const std::vector<double>& check_to_equiv, const std::vector<double>& x,
-        double* locals) const;
+        double* locals, size_t n_rhs = 1) const;
 
     /* The M2P operator evaluates the influence of source cell equivalent
      * sources (multipole coefficients) on farfield observation points bypassing
      * the M2L, L2L, L2P operators in cases where there are insufficient observation
      * points to justify using those operators.
      */
-    void M2P(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
-        double* multipoles, std::vector<double>& out) const;
+    void M2P(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        double* multipoles, std::vector<double>& out, size_t n_rhs = 1) const;
+
+    /* Build the matrix that evaluates the multipole coefficients of a
+     * source tree cell on the check surface of an observation tree cell.
+     */
+    std::vector<double> build_M2L(const OctreeNode<dim>& obs_cell,
+        const OctreeNode<dim>& src_cell) const;
+
+    /* Build the Fourier space translation operator (see 
+     * M2LOperators::fft_ops) between two cells on the same level.
+     */
+    std::vector<double> build_fft_M2L(
+        const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell) const;
+
+    /* Build the translation operators for a list of m2l tasks. Tasks with 
+     * the same obs and src cell levels and the same relative offset between
+     * the cells share an operator.
+     */
+    M2LOperators precompute_M2L(
+        const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls) const;
 
     /* The M2L operator converts equivalent sources from an source tree 
      * cell (multipole coefficients) into equivalent sources for an
-     * observation tree cell (local coefficients).
+     * observation tree cell (local coefficients) using a precomputed 
+     * translation matrix from build_M2L.
+     */
+    void M2L(const std::vector<double>& m2l_op,
+        const std::vector<double>& down_check_to_equiv, double* multipoles,
+        double* locals, size_t n_rhs = 1) const;
+
+    /* The single precision M2L used with config.float_farfield. */
+    void M2L(const std::vector<float>& m2l_op,
+        const std::vector<float>& down_check_to_equiv, float* multipoles,
+        float* locals, size_t n_rhs = 1) const;
+
+    /* Run the m2l tasks of a batch, with coefficients of type Real (see 
+     * run_schedule). The tasks that share a translation operator are run as
+     * a single matrix product on their gathered multipole coefficients. The
+     * tasks with Fourier space operators in fft_ops multiply the transformed
+     * multipoles in multipole_spectra instead and their products are summed 
+     * in Fourier space per observation cell. The resulting check surface 
+     * values are summed per observation cell and solved for the local 
+     * coefficients of all the cells with one more matrix product, instead 
+     * of one solve per task.
+     */
+    template <typename Real>
+    void M2L_batch(const M2LBatch<dim>& batch,
+        const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls,
+        const std::vector<size_t>& task_ops,
+        const std::vector<std::vector<Real>>& m2l_ops,
+        const std::vector<std::vector<double>>& fft_ops,
+        const std::vector<size_t>& fft_src_slots,
+        const double* multipole_spectra,
+        const std::vector<Real>& down_check_to_equiv, const Real* multipoles,
+        Real* locals, size_t n_rhs) const;
+
+    /* The Fourier space part of M2L_batch for right hand side k: add the 
+     * check surface values of the tasks at positions fft_tasks[0, n_fft_tasks)
+     * of the batch to check, which has a column per observation cell. Tasks
+     * that share an operator must be next to each other: for each block of
+     * frequencies (see fft_freq_block), the transforms of all of the tasks
+     * of one operator are multiplied by the operator's block as one batched
+     * matrix product.
+     */
+    template <typename Real>
+    void M2L_fft_tasks(const M2LBatch<dim>& batch,
+        const std::vector<typename FMMTasks<dim>::CellPairTask>& m2ls,
+        const std::vector<size_t>& task_ops,
+        const std::vector<std::vector<double>>& fft_ops,
+        const std::vector<size_t>& fft_src_slots,
+        const double* multipole_spectra,
+        const size_t* fft_tasks, size_t n_fft_tasks, Real* check, size_t k,
+        size_t n_rhs) const;
+
+    /* Transform the multipoles of a source cell for the Fourier space M2L, 
+     * writing each input channel of each right hand side to spectra (see 
+     * FMMArena::multipole_spectra). This is done once per cell, right after
+     * its multipoles are computed, instead of once per M2L batch.
      */
-    void M2L(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
-        const std::vector<double>& down_check_to_equiv, double* multipoles, 
-        double* locals) const;
+    void transform_multipoles(const double* multipoles,
+        double* spectra, size_t n_rhs) const;
 
     /* Convert from equivalent sources at a farfield parent observation cell
-     * to its child cells.
+     * to one of its child cells.
      */
-    void L2L(const Octree<dim>& cell, const std::vector<double>& check_to_equiv,
-        double* parent_locals, std::vector<double*>& child_locals) const;
+    void L2L(const OctreeNode<dim>& parent_cell, const OctreeNode<dim>& child_cell,
+        const std::vector<double>& check_to_equiv, double* parent_locals,
+        double* child_locals, size_t n_rhs = 1) const;
 
     /* The L2P operator evaluates the influence of the equivalent sources from
      * a observation cell on the observation points in that cell
      */
-    void L2P(const Octree<dim>& cell, double* locals, std::vector<double>& out) const;
+    void L2P(const OctreeNode<dim>& cell, double* locals, std::vector<double>& out,
+        size_t n_rhs = 1) const;
+
+    /* Add the values at the observation points in cell to out. */
+    void add_obs_vals(const OctreeNode<dim>& cell, const double* vals,
+        std::vector<double>& out, size_t n_rhs) const;
 
     /* Perform a direct n body calculation between a source and observation
      * cell.
      */
-    void P2P(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
-        const std::vector<double>& x, std::vector<double>& out) const;
+    void P2P(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        const std::vector<double>& x, std::vector<double>& out,
+        size_t n_rhs = 1) const;
+
+    /* Perform a direct n body calculation between two cells of a symmetric
+     * operator in both directions, adding the influence of src_cell on 
+     * obs_cell and of obs_cell on src_cell. If the two cells are the same, 
+     * each pair of points is evaluated once. With transpose, the transposed
+     * interaction is added instead, which for a symmetric kernel only moves
+     * the source weights from the inputs to the outputs.
+     */
+    void P2P_symmetric(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        const std::vector<double>& x, std::vector<double>& out,
+        size_t n_rhs = 1, bool transpose = false) const;
+
+    /* The transposes of the translation operators, used by apply_transpose.
+     * Each one reads the values that the matching operator writes and adds 
+     * to the values that it reads: y and the observation point values are in
+     * the tree order of data.obs_locs and the source point values x are in 
+     * the tree order of data.src_locs. The same trees, check to equivalent 
+     * operators and M2L matrices are used, so nothing new is precomputed. 
+     * Several transposed operators can add to the same values at once, so 
+     * the additions are always atomic.
+     */
+    void P2M_transpose(const OctreeNode<dim>& cell,
+        const std::vector<double>& check_to_equiv, const double* multipoles,
+        std::vector<double>& x, size_t n_rhs = 1) const;
+    void M2M_transpose(const OctreeNode<dim>& cell,
+        const std::vector<double>& check_to_equiv, const double* parent_multipoles,
+        const std::array<double*,Octree<dim>::split>& child_multipoles,
+        size_t n_rhs = 1) const;
+    void P2L_transpose(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        const std::vector<double>& check_to_equiv, const double* locals,
+        std::vector<double>& x, size_t n_rhs = 1) const;
+    void M2P_transpose(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        const std::vector<double>& y, double* multipoles, size_t n_rhs = 1) const;
+    void M2L_transpose(const std::vector<double>& m2l_op,
+        const std::vector<double>& down_check_to_equiv, const double* locals,
+        double* multipoles, size_t n_rhs = 1) const;
+    /* With config.float_farfield, the translation runs in single precision
+     * but the coefficients are kept in double precision.
+     */
+    void M2L_transpose(const std::vector<float>& m2l_op,
+        const std::vector<float>& down_check_to_equiv, const double* locals,
+        double* multipoles, size_t n_rhs = 1) const;
+    /* The transpose of a Fourier space translation, always in double 
+     * precision. The transpose of the convolution is a correlation, which
+     * multiplies by the complex conjugate of the kernel transform.
+     */
+    void M2L_fft_transpose(const std::vector<double>& fft_op,
+        const std::vector<double>& down_check_to_equiv, const double* locals,
+        double* multipoles, size_t n_rhs = 1) const;
+    void L2L_transpose(const OctreeNode<dim>& parent_cell, const OctreeNode<dim>& child_cell,
+        const std::vector<double>& check_to_equiv, const double* child_locals,
+        double* parent_locals, size_t n_rhs = 1) const;
+    void L2P_transpose(const OctreeNode<dim>& cell, const std::vector<double>& y,
+        double* locals, size_t n_rhs = 1) const;
+    void P2P_transpose(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        const std::vector<double>& y, std::vector<double>& x,
+        size_t n_rhs = 1) const;
+
+    /* Add the values at the source points in cell to x. */
+    void add_src_vals(const OctreeNode<dim>& cell, const double* vals,
+        std::vector<double>& x, size_t n_rhs) const;
+
+    /* Run the upward, dual tree and downward traversals. The upper levels 
+     * of each traversal are split into OpenMP tasks that fill separate task
+     * lists, which are then joined in the order a serial traversal would 
+     * produce, so the tasks do not depend on the number of threads.
+     */
+    FMMTasks<dim> build_tasks() const;
 
     /* Determine the sequence of operations necessary to compute the upward
      * equivalent sources
      */
-    void upward_traversal(const Octree<dim>& cell, FMMTasks<dim>& tasks) const;
+    void upward_traversal(const OctreeNode<dim>& cell, FMMTasks<dim>& tasks) const;
 
     /* Determine the sequence of FMM operations for the interaction of a set of
      * sources and observers
      */
-    void dual_tree(const Octree<dim>& obs_cell, const Octree<dim>& src_cell,
+    void dual_tree(const OctreeNode<dim>& obs_cell, const OctreeNode<dim>& src_cell,
+        FMMTasks<dim>& tasks) const;
+
+    /* The dual tree traversal for a symmetric operator, visiting each 
+     * unordered pair of cells once. Far field interactions are added in both
+     * directions and each P2P task covers both directions.
+     */
+    void dual_tree_symmetric(const OctreeNode<dim>& a, const OctreeNode<dim>& b,
         FMMTasks<dim>& tasks) const;
 
+    /* Whether two cells are far enough apart to interact through the far 
+     * field operators.
+     */
+    bool well_separated(const OctreeNode<dim>& obs_cell,
+        const OctreeNode<dim>& src_cell) const;
+
+    /* Add the task for a well separated pair of cells. This is normally an 
+     * M2L, but with config.account_for_small_cells, cells with fewer points
+     * than the equivalent surfaces use P2P, M2P or P2L instead. Returns the 
+     * phase of the added task.
+     */
+    typename FMMTasks<dim>::Phase add_farfield_task(const OctreeNode<dim>& obs_cell,
+        const OctreeNode<dim>& src_cell, FMMTasks<dim>& tasks) const;
+
     /* Determine the sequence of FMM operations for calculating the influence of
      * observation cell equivalent sources on observation points
      */
-    void downward_traversal(const Octree<dim>& obs_cell, FMMTasks<dim>& tasks) const;
+    void downward_traversal(const OctreeNode<dim>& obs_cell, FMMTasks<dim>& tasks) const;
+
+    /* Determine the dependencies between FMM tasks. An M2M waits for the 
+     * P2M/M2M tasks of its children, M2L and M2P tasks wait for the source
+     * cell multipoles, and L2L and L2P tasks wait for every task that 
+     * contributes to the observation cell local coefficients. Everything
+     * else, like the P2P tasks, is free to overlap with the tree passes.
+     *
+     * The m2l tasks are split into M2LBatches, one node each, that each add
+     * to the local coefficients of a group of observation cells on one 
+     * level.
+     *
+     * With config.owner_computes, the other tasks are regrouped by output:
+     * one graph node per observation cell accumulates the rest of that 
+     * cell's local coefficients before its M2L batch runs and two nodes 
+     * per observation leaf (near field, then far field) write that leaf's 
+     * output values. Otherwise, each task is a separate node.
+     */
+    FMMSchedule<dim> build_schedule(const FMMTasks<dim>& tasks) const;
+
+    /* The number of kernel evaluations needed by a work item. The M2L 
+     * operators are precomputed, so M2L needs none.
+     */
+    size_t n_kernel_evals(const FMMTasks<dim>& tasks,
+        const FMMWorkItem<dim>& item) const;
 
     std::vector<double> execute_tasks(const FMMTasks<dim>& tasks,
-        const std::vector<double>& x, 
+        const FMMSchedule<dim>& schedule, const std::vector<double>& x, 
+        const CheckToEquiv& up_check_to_equiv,
+        const CheckToEquiv& down_check_to_equiv,
+        const M2LOperators& m2l_ops, size_t n_rhs) const;
+
+    /* Run the schedule with multipole and local coefficients of type Real,
+     * which is float with config.float_farfield and double otherwise. The
+     * other operators work in double precision, so float coefficients are
+     * converted on the way in and out of them. The tasks use the 
+     * workspaces and multipole transforms in arena.
+     */
+    template <typename Real>
+    void run_schedule(FMMArena<dim>& arena, const FMMTasks<dim>& tasks,
+        const FMMSchedule<dim>& schedule, const std::vector<double>& x_tree,
         const CheckToEquiv& up_check_to_equiv,
-        const CheckToEquiv& down_check_to_equiv) const;
+        const CheckToEquiv& down_check_to_equiv,
+        const M2LOperators& m2l_ops, Real* multipoles, Real* locals,
+        std::vector<double>& out_tree, size_t n_rhs) const;
 
     std::vector<double> apply(const std::vector<double>& x) const;
 
+    /* Copy the multipole coefficients of a source tree cell computed by the
+     * most recent apply or apply_block to finish into out, in double precision even 
+     * with config.float_farfield. They are the strengths of the 
+     * up_equiv_cells points of the cell, stored like the input of apply with
+     * the stats.n_rhs vectors adjacent: C * n_equiv * stats.n_rhs values.
+     * An apply_transpose that finishes in between replaces them.
+     */
+    void copy_multipoles(const OctreeNode<dim>& cell, double* out) const;
+
+    /* Apply the transpose of the FMM approximation. The tasks are run 
+     * transposed with transpose_schedule, so the result is the exact 
+     * transpose of apply() up to rounding and costs about the same. The 
+     * rounding is single precision in the M2L operators with 
+     * config.float_farfield. The statistics are not updated.
+     */
+    virtual std::vector<double> apply_transpose(const std::vector<double>& y) const;
+
+    /* Run the tasks transposed on n_rhs vectors stored like the output of
+     * execute_tasks. The coefficients are always kept in double precision.
+     */
+    std::vector<double> execute_transpose_tasks(const std::vector<double>& y,
+        size_t n_rhs) const;
+
+    /* Apply the operator to several vectors in a single pass over the tasks.
+     */
+    virtual std::vector<std::vector<double>> apply_block(
+        const std::vector<std::vector<double>>& xs) const;
+
+    /* Whether the schedule gives each output a single owner. The symmetric
+     * P2P tasks write to two cells at once, so a symmetric operator always 
+     * uses the shared schedule.
+     */
+    bool owns_outputs() const {return config.owner_computes && !symmetric;}
+
+    /* Add value to an output entry, atomically unless the schedule 
+     * guarantees that each output has a single owner.
+     */
+    void accumulate(double& target, double value) const;
+    void accumulate(float& target, float value) const;
+
+    /* The scratch memory for the calling thread, in the arena of the apply
+     * that it is working on, or in the first arena outside of an apply.
+     */
+    FMMWorkspace<dim>& workspace() const;
+
+    /* Make sure that the arena has a workspace for every thread and that 
+     * each one is large enough for any of the operators acting on n_rhs 
+     * vectors. Reserving the maximum up front means that the memory used 
+     * does not depend on which thread happens to run which task.
+     */
+    void reserve_workspaces(FMMArena<dim>& arena, size_t n_rhs) const;
+
+    /* The arena of the most recent apply to finish, which holds its 
+     * multipoles and locals.
+     */
+    const FMMArena<dim>& latest_arena() const {return arenas.latest();}
+
+    /* A copy of the statistics, taken under the lock that applies update 
+     * them with.
+     */
+    FMMStats latest_stats() const
+    {
+        std::lock_guard<std::mutex> lock(arenas.mutex);
+        return stats;
+    }
+
+    /* The number of times that the scratch memory has grown. After the 
+     * first apply, further applies from one thread with the same number of
+     * vectors should not change this.
+     */
+    size_t n_workspace_allocations() const {return arenas.total_allocations();}
+
     virtual size_t n_rows() const {return data.obs_locs.size() * R;}
     virtual size_t n_cols() const {return data.src_locs.size() * C;}
 };
 
+/* Move the points of op, refitting it in place when the trees are still 
+ * valid and replacing it with a newly built operator otherwise. Returns true
+ * if the operator was rebuilt.
+ */
+template <size_t dim, size_t R, size_t C>
+bool update_points(std::shared_ptr<FMMOperator<dim,R,C>>& op,
+    const NBodyData<dim>& new_data, double tolerance = 0.0)
+{
+    if (op->refit(new_data, tolerance)) {
+        return false;
+    }
+    op = std::make_shared<FMMOperator<dim,R,C>>(*op->K, new_data, op->config);
+    return true;
+}
+
 } // END namespace tbem
 #endif
@@ -0,0 +1,354 @@
+#include "fmm_autotune.h"
+#include "fmm_cache.h"
+#include "util.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace tbem {
+
+FMMTuneSpace FMMTuneSpace::default_space(size_t dim)
+{
+    if (dim == 2) {
+        return {{0.3, 0.4, 0.5}, {10, 15, 20, 30, 40, 60, 80}, {20, 50, 100, 250}};
+    }
+    return {{0.3, 0.4, 0.5}, {40, 60, 100, 150, 200, 300}, {20, 50, 100, 250}};
+}
+
+std::vector<size_t> sample_rows(size_t n, size_t n_samples)
+{
+    if (n_samples >= n) {
+        return range(n);
+    }
+    std::vector<size_t> rows(n_samples);
+    for (size_t i = 0; i < n_samples; i++) {
+        rows[i] = (i * n) / n_samples;
+    }
+    return rows;
+}
+
+/* The reference values for the sampled rows are computed once and compared
+ * against the output of every candidate.
+ */
+template <size_t dim, size_t R, size_t C>
+struct SampledDirect {
+    const std::vector<size_t> rows;
+    const std::vector<double> x;
+    const std::vector<double> correct;
+
+    double rel_error(const std::vector<double>& fmm_out, size_t n_obs) const
+    {
+        double diff2 = 0.0;
+        double norm2 = 0.0;
+        for (size_t d = 0; d < R; d++) {
+            for (size_t i = 0; i < rows.size(); i++) {
+                auto exact = correct[d * rows.size() + i];
+                auto diff = fmm_out[d * n_obs + rows[i]] - exact;
+                diff2 += diff * diff;
+                norm2 += exact * exact;
+            }
+        }
+        if (norm2 == 0.0) {
+            return std::sqrt(diff2);
+        }
+        return std::sqrt(diff2 / norm2);
+    }
+};
+
+template <size_t dim, size_t R, size_t C>
+SampledDirect<dim,R,C> make_sampled_direct(const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& data, size_t n_samples)
+{
+    auto rows = sample_rows(data.obs_locs.size(), n_samples);
+    NBodyData<dim> sample_data{
+        {}, {}, data.src_locs, data.src_normals, data.src_weights
+    };
+    for (auto r: rows) {
+        sample_data.obs_locs.push_back(data.obs_locs[r]);
+        sample_data.obs_normals.push_back(data.obs_normals[r]);
+    }
+    auto x = random_list(C * data.src_locs.size(), -1.0, 1.0);
+    auto correct = nbody_eval(K, sample_data, x.data());
+    return {rows, x, correct};
+}
+
+/* Apply op to x n_trials times, returning the fastest time. */
+template <size_t dim, size_t R, size_t C>
+double timed_apply(const FMMOperator<dim,R,C>& op, const std::vector<double>& x,
+    size_t n_trials, std::vector<double>& out)
+{
+    double best_time = std::numeric_limits<double>::max();
+    for (size_t i = 0; i < std::max<size_t>(n_trials, 1); i++) {
+        auto start = std::chrono::steady_clock::now();
+        out = op.apply(x);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best_time = std::min(best_time, elapsed.count());
+    }
+    return best_time;
+}
+
+template <size_t dim, size_t R, size_t C>
+FMMTuneResult run_trial(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    const FMMConfig& config, const SampledDirect<dim,R,C>& direct,
+    size_t n_trials)
+{
+    FMMOperator<dim,R,C> op(K, data, config);
+    std::vector<double> out;
+    auto best_time = timed_apply(op, direct.x, n_trials, out);
+    return {config, direct.rel_error(out, data.obs_locs.size()), best_time};
+}
+
+FMMConfig with_params(const FMMConfig& base, double mac, size_t order,
+    size_t min_pts_per_cell)
+{
+    return FMMConfig(
+        mac, order, min_pts_per_cell, base.d, base.account_for_small_cells,
+        base.owner_computes, base.use_fmm, base.float_farfield,
+        base.precompute_cache_dir, base.fft_m2l
+    );
+}
+
+template <size_t dim, size_t R, size_t C>
+FMMTuneResult autotune_fmm(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space,
+    size_t n_samples, size_t n_trials)
+{
+    assert(target_rel_error > 0);
+    assert(space.macs.size() > 0);
+    assert(space.orders.size() > 0);
+    assert(space.min_pts_per_cell.size() > 0);
+
+    auto direct = make_sampled_direct(K, data, n_samples);
+    auto mid_min_pts = space.min_pts_per_cell[space.min_pts_per_cell.size() / 2];
+
+    std::vector<FMMTuneResult> accurate;
+    std::vector<FMMTuneResult> all;
+    for (auto mac: space.macs) {
+        size_t order_idx = 0;
+        for (; order_idx < space.orders.size(); order_idx++) {
+            auto config = with_params(
+                base, mac, space.orders[order_idx], mid_min_pts
+            );
+            all.push_back(run_trial(K, data, config, direct, n_trials));
+            if (all.back().rel_error <= target_rel_error) {
+                break;
+            }
+        }
+        if (order_idx == space.orders.size()) {
+            continue;
+        }
+        auto order = space.orders[order_idx];
+        for (auto min_pts: space.min_pts_per_cell) {
+            if (min_pts == mid_min_pts) {
+                accurate.push_back(all.back());
+                continue;
+            }
+            auto trial = run_trial(
+                K, data, with_params(base, mac, order, min_pts), direct, n_trials
+            );
+            if (trial.rel_error <= target_rel_error) {
+                accurate.push_back(trial);
+            }
+        }
+    }
+
+    if (accurate.size() == 0) {
+        auto best = std::min_element(all.begin(), all.end(),
+            [] (const FMMTuneResult& a, const FMMTuneResult& b) {
+                return a.rel_error < b.rel_error;
+            });
+        return *best;
+    }
+    auto fastest = std::min_element(accurate.begin(), accurate.end(),
+        [] (const FMMTuneResult& a, const FMMTuneResult& b) {
+            return a.apply_time < b.apply_time;
+        });
+    return *fastest;
+}
+
+size_t log2_bucket(size_t n)
+{
+    size_t bucket = 0;
+    while (n > 1) {
+        n /= 2;
+        bucket++;
+    }
+    return bucket;
+}
+
+uint64_t tune_space_hash(const FMMTuneSpace& space)
+{
+    auto hash = hash_bytes(
+        space.macs.data(), space.macs.size() * sizeof(double)
+    );
+    hash = hash_bytes(
+        space.orders.data(), space.orders.size() * sizeof(size_t), hash
+    );
+    return hash_bytes(
+        space.min_pts_per_cell.data(),
+        space.min_pts_per_cell.size() * sizeof(size_t), hash
+    );
+}
+
+template <size_t dim, size_t R, size_t C>
+std::string tune_cache_key(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space)
+{
+    size_t n_threads = 1;
+#ifdef _OPENMP
+    n_threads = static_cast<size_t>(omp_get_max_threads());
+#endif
+    std::ostringstream key;
+    key << dim << " " << R << " " << C << " " << kernel_fingerprint(K) << " "
+        << log2_bucket(data.obs_locs.size()) << " "
+        << log2_bucket(data.src_locs.size()) << " "
+        << target_rel_error << " " << n_threads << " "
+        << base.d << " " << base.account_for_small_cells << " "
+        << base.owner_computes << " " << base.float_farfield << " "
+        << base.fft_m2l << " " << std::hex << tune_space_hash(space);
+    return key.str();
+}
+
+const size_t n_tune_key_fields = 14;
+
+template <size_t dim, size_t R, size_t C>
+FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space)
+{
+    auto key = tune_cache_key(K, data, target_rel_error, base, space);
+
+    std::ifstream in(cache_path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string field;
+        std::string line_key;
+        for (size_t i = 0; i < n_tune_key_fields && fields >> field; i++) {
+            line_key += (i == 0 ? "" : " ") + field;
+        }
+        if (line_key != key) {
+            continue;
+        }
+        double mac;
+        size_t order;
+        size_t min_pts_per_cell;
+        if (fields >> mac >> order >> min_pts_per_cell) {
+            return with_params(base, mac, order, min_pts_per_cell);
+        }
+    }
+    in.close();
+
+    auto result = autotune_fmm(K, data, target_rel_error, base, space);
+    std::ofstream out(cache_path, std::ios::app);
+    out << key << " " << result.config.mac << " " << result.config.order << " "
+        << result.config.min_pts_per_cell << std::endl;
+    return result.config;
+}
+
+template <size_t dim, size_t R, size_t C>
+size_t far_field_bytes(const FMMOperator<dim,R,C>& op)
+{
+    size_t total = 0;
+    for (auto& m: op.m2l_ops.ops) {
+        total += sizeof(double) * m.size();
+    }
+    for (auto& m: op.m2l_ops.float_ops) {
+        total += sizeof(float) * m.size();
+    }
+    auto& arena = op.latest_arena();
+    total += sizeof(double) * (arena.multipoles.size() + arena.locals.size());
+    total += sizeof(float) * (
+        arena.float_multipoles.size() + arena.float_locals.size()
+    );
+    return total;
+}
+
+template <size_t dim, size_t R, size_t C>
+FMMPrecisionReport float_farfield_report(const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& data, const FMMConfig& config, size_t n_samples,
+    size_t n_trials)
+{
+    auto direct = make_sampled_direct(K, data, n_samples);
+    auto n_obs = data.obs_locs.size();
+
+    FMMOperator<dim,R,C> double_op(K, data, FMMConfig(
+        config.mac, config.order, config.min_pts_per_cell, config.d,
+        config.account_for_small_cells, config.owner_computes, config.use_fmm,
+        false, config.precompute_cache_dir, config.fft_m2l
+    ));
+    std::vector<double> double_out;
+    auto double_time = timed_apply(double_op, direct.x, n_trials, double_out);
+
+    FMMOperator<dim,R,C> float_op(K, data, FMMConfig(
+        config.mac, config.order, config.min_pts_per_cell, config.d,
+        config.account_for_small_cells, config.owner_computes, config.use_fmm,
+        true, config.precompute_cache_dir, config.fft_m2l
+    ));
+    std::vector<double> float_out;
+    auto float_time = timed_apply(float_op, direct.x, n_trials, float_out);
+
+    double diff2 = 0.0;
+    double norm2 = 0.0;
+    for (size_t i = 0; i < double_out.size(); i++) {
+        auto diff = float_out[i] - double_out[i];
+        diff2 += diff * diff;
+        norm2 += double_out[i] * double_out[i];
+    }
+    auto rel_diff = norm2 == 0.0 ? std::sqrt(diff2) : std::sqrt(diff2 / norm2);
+
+    return {
+        rel_diff, direct.rel_error(double_out, n_obs),
+        direct.rel_error(float_out, n_obs), double_time, float_time,
+        far_field_bytes(double_op), far_field_bytes(float_op)
+    };
+}
+
+template FMMTuneResult autotune_fmm(const Kernel<2,1,1>& K,
+    const NBodyData<2>& data, double target_rel_error, const FMMConfig& base,
+    const FMMTuneSpace& space, size_t n_samples, size_t n_trials);
+template FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<2,1,1>& K, const NBodyData<2>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space);
+template FMMPrecisionReport float_farfield_report(const Kernel<2,1,1>& K,
+    const NBodyData<2>& data, const FMMConfig& config, size_t n_samples,
+    size_t n_trials);
+
+template FMMTuneResult autotune_fmm(const Kernel<2,2,2>& K,
+    const NBodyData<2>& data, double target_rel_error, const FMMConfig& base,
+    const FMMTuneSpace& space, size_t n_samples, size_t n_trials);
+template FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<2,2,2>& K, const NBodyData<2>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space);
+template FMMPrecisionReport float_farfield_report(const Kernel<2,2,2>& K,
+    const NBodyData<2>& data, const FMMConfig& config, size_t n_samples,
+    size_t n_trials);
+
+template FMMTuneResult autotune_fmm(const Kernel<3,1,1>& K,
+    const NBodyData<3>& data, double target_rel_error, const FMMConfig& base,
+    const FMMTuneSpace& space, size_t n_samples, size_t n_trials);
+template FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<3,1,1>& K, const NBodyData<3>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space);
+template FMMPrecisionReport float_farfield_report(const Kernel<3,1,1>& K,
+    const NBodyData<3>& data, const FMMConfig& config, size_t n_samples,
+    size_t n_trials);
+
+template FMMTuneResult autotune_fmm(const Kernel<3,3,3>& K,
+    const NBodyData<3>& data, double target_rel_error, const FMMConfig& base,
+    const FMMTuneSpace& space, size_t n_samples, size_t n_trials);
+template FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<3,3,3>& K, const NBodyData<3>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space);
+template FMMPrecisionReport float_farfield_report(const Kernel<3,3,3>& K,
+    const NBodyData<3>& data, const FMMConfig& config, size_t n_samples,
+    size_t n_trials);
+
+} // END namespace tbem
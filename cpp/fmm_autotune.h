@@ -0,0 +1,93 @@
+#ifndef TBEMQQWOEIRUTYAL_FMM_AUTOTUNE_H
+#define TBEMQQWOEIRUTYAL_FMM_AUTOTUNE_H
+
+#include <string>
+#include <vector>
+#include "fmm.h"
+#include "nbody_operator.h"
+
+namespace tbem {
+
+/* The candidate settings tried by autotune_fmm. Orders should be listed in
+ * increasing order, because the tuner stops raising the order at the first
+ * one that meets the accuracy target.
+ */
+struct FMMTuneSpace {
+    const std::vector<double> macs;
+    const std::vector<size_t> orders;
+    const std::vector<size_t> min_pts_per_cell;
+
+    static FMMTuneSpace default_space(size_t dim);
+};
+
+struct FMMTuneResult {
+    const FMMConfig config;
+
+    // Relative error in the 2-norm of a sampled subset of the output rows,
+    // measured against a direct evaluation.
+    const double rel_error;
+
+    // Seconds per apply, the fastest of the trial applies.
+    const double apply_time;
+};
+
+/* Search for the fastest FMMConfig that reaches target_rel_error for this
+ * kernel and set of points. For each mac, the lowest order meeting the
+ * target is found with the middle min_pts_per_cell candidate, and then every
+ * min_pts_per_cell candidate is timed at that order. The accuracy is checked
+ * against a direct evaluation of n_samples evenly spaced observation points,
+ * so the full O(N^2) direct product is never formed.
+ *
+ * The other FMMConfig fields, like d and account_for_small_cells, are 
+ * copied from base. If no candidate reaches the target, the most accurate one is
+ * returned and its rel_error will be larger than the target.
+ */
+template <size_t dim, size_t R, size_t C>
+FMMTuneResult autotune_fmm(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space,
+    size_t n_samples = 200, size_t n_trials = 2);
+
+/* The same as autotune_fmm, but the result is remembered in a text file at
+ * cache_path, one line per tuned problem. A problem is identified by the
+ * kernel and its parameters (see kernel_fingerprint), the number of
+ * observation and source points rounded to a power of two, the target
+ * accuracy, the number of threads, the fields of base that change the
+ * speed or accuracy of an apply and the candidates in space. Since the 
+ * timings are only meaningful on the machine where they were measured, each
+ * machine should use its own cache file.
+ */
+template <size_t dim, size_t R, size_t C>
+FMMConfig autotune_fmm_cached(const std::string& cache_path,
+    const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double target_rel_error, const FMMConfig& base, const FMMTuneSpace& space);
+
+/* How much accuracy a single precision far field costs for one problem. */
+struct FMMPrecisionReport {
+    // The relative difference in the 2-norm between the outputs of the
+    // single and double precision far fields for the same input.
+    const double rel_diff;
+
+    // The relative errors of the two outputs against a direct evaluation of
+    // a sample of the rows, as in FMMTuneResult.
+    const double double_rel_error;
+    const double float_rel_error;
+
+    // Seconds per apply, the fastest of the trial applies.
+    const double double_apply_time;
+    const double float_apply_time;
+
+    // The memory used by the M2L operators and the multipole and local
+    // coefficients.
+    const size_t double_far_field_bytes;
+    const size_t float_far_field_bytes;
+};
+
+/* Compare config with FMMConfig::float_farfield turned on and off. */
+template <size_t dim, size_t R, size_t C>
+FMMPrecisionReport float_farfield_report(const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& data, const FMMConfig& config,
+    size_t n_samples = 200, size_t n_trials = 2);
+
+} // END namespace tbem
+
+#endif
@@ -0,0 +1,171 @@
+#include "fmm_cache.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <typeinfo>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace tbem {
+
+uint64_t hash_bytes(const void* data, size_t n, uint64_t seed)
+{
+    auto bytes = static_cast<const unsigned char*>(data);
+    auto hash = seed;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string hex(uint64_t value)
+{
+    std::ostringstream out;
+    out << std::hex << std::setw(16) << std::setfill('0') << value;
+    return out.str();
+}
+
+template <size_t dim, size_t R, size_t C>
+std::string kernel_fingerprint(const Kernel<dim,R,C>& K)
+{
+    const size_t n_samples = 4;
+    uint64_t hash = hash_bytes(nullptr, 0);
+    for (size_t i = 0; i < n_samples; i++) {
+        Vec<double,dim> obs;
+        Vec<double,dim> src;
+        Vec<double,dim> nobs;
+        Vec<double,dim> nsrc;
+        for (size_t d = 0; d < dim; d++) {
+            obs[d] = 0.37 * (i + 1) + 0.11 * d;
+            src[d] = -0.29 * (i + 1) + 0.07 * d;
+            nobs[d] = (d == i % dim) ? 1.0 : 0.0;
+            nsrc[d] = (d == (i + 1) % dim) ? 1.0 : 0.0;
+        }
+        auto val = K(obs, src, nobs, nsrc);
+        hash = hash_bytes(&val, sizeof(val), hash);
+    }
+    return std::string(typeid(K).name()) + ":" + hex(hash);
+}
+
+template <size_t dim>
+uint64_t surface_hash(const TranslationSurface<dim>& surf)
+{
+    auto hash = hash_bytes(surf.pts.data(), surf.pts.size() * sizeof(surf.pts[0]));
+    return hash_bytes(
+        surf.normals.data(), surf.normals.size() * sizeof(surf.normals[0]), hash
+    );
+}
+
+const char cache_magic[8] = {'T','B','E','M','F','M','M','1'};
+
+std::string cache_path(const std::string& dir, const std::string& key)
+{
+    return dir + "/fmm_" + hex(hash_bytes(key.data(), key.size())) + ".bin";
+}
+
+/* The file layout is the magic bytes, the key length, the key, the number of
+ * values and then the values.
+ */
+bool read_entry(const char* mem, size_t size, const std::string& key,
+    std::vector<double>& op)
+{
+    size_t pos = 0;
+    auto read = [&] (void* out, size_t n) {
+        if (pos + n > size) {
+            return false;
+        }
+        std::memcpy(out, mem + pos, n);
+        pos += n;
+        return true;
+    };
+
+    char magic[sizeof(cache_magic)];
+    uint64_t key_size;
+    if (!read(magic, sizeof(magic)) ||
+        std::memcmp(magic, cache_magic, sizeof(magic)) != 0 ||
+        !read(&key_size, sizeof(key_size)) || key_size != key.size() ||
+        pos + key_size > size || key.compare(0, key.size(), mem + pos, key_size) != 0)
+    {
+        return false;
+    }
+    pos += key_size;
+
+    uint64_t n_values;
+    if (!read(&n_values, sizeof(n_values)) ||
+        pos + n_values * sizeof(double) != size)
+    {
+        return false;
+    }
+    op.resize(n_values);
+    return read(op.data(), n_values * sizeof(double));
+}
+
+bool load_cached_operator(const std::string& dir, const std::string& key,
+    std::vector<double>& op)
+{
+    auto path = cache_path(dir, key);
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size <= 0) {
+        close(fd);
+        return false;
+    }
+    auto size = static_cast<size_t>(file_stat.st_size);
+    auto mem = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return false;
+    }
+    std::vector<double> entry;
+    bool found = read_entry(static_cast<const char*>(mem), size, key, entry);
+    munmap(mem, size);
+    if (found) {
+        op = std::move(entry);
+    }
+    return found;
+}
+
+void save_cached_operator(const std::string& dir, const std::string& key,
+    const std::vector<double>& op)
+{
+    mkdir(dir.c_str(), 0755);
+    auto path = cache_path(dir, key);
+    auto tmp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(tmp_path, std::ios::binary);
+        uint64_t key_size = key.size();
+        uint64_t n_values = op.size();
+        out.write(cache_magic, sizeof(cache_magic));
+        out.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+        out.write(key.data(), key.size());
+        out.write(reinterpret_cast<const char*>(&n_values), sizeof(n_values));
+        out.write(
+            reinterpret_cast<const char*>(op.data()), op.size() * sizeof(double)
+        );
+        if (!out) {
+            out.close();
+            std::remove(tmp_path.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+    }
+}
+
+template std::string kernel_fingerprint(const Kernel<2,1,1>& K);
+template std::string kernel_fingerprint(const Kernel<2,2,2>& K);
+template std::string kernel_fingerprint(const Kernel<3,1,1>& K);
+template std::string kernel_fingerprint(const Kernel<3,3,3>& K);
+template uint64_t surface_hash(const TranslationSurface<2>& surf);
+template uint64_t surface_hash(const TranslationSurface<3>& surf);
+
+} // END namespace tbem
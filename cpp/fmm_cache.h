@@ -0,0 +1,46 @@
+#ifndef TBEMPPZMXNCBVAL_FMM_CACHE_H
+#define TBEMPPZMXNCBVAL_FMM_CACHE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "fmm.h"
+
+namespace tbem {
+
+/* 64 bit FNV-1a hash of n bytes, continuing from seed. */
+uint64_t hash_bytes(const void* data, size_t n,
+    uint64_t seed = 14695981039346656037ULL);
+
+/* A string identifying a kernel and its parameters: the kernel type and a
+ * hash of its values at a few fixed points. Two kernels of the same type
+ * with different parameters (an elastic kernel with a different Poisson
+ * ratio, for example) get different fingerprints.
+ */
+template <size_t dim, size_t R, size_t C>
+std::string kernel_fingerprint(const Kernel<dim,R,C>& K);
+
+/* A hash of the points and normals of a translation surface. */
+template <size_t dim>
+uint64_t surface_hash(const TranslationSurface<dim>& surf);
+
+/* FMM precomputation is cached on disk as one binary file per operator in
+ * the directory dir, named by a hash of the key. The file also holds the
+ * full key, so a hash collision is treated as a miss. Files are memory
+ * mapped for reading and written to a temporary file that is then renamed,
+ * so several processes can share a cache directory.
+ *
+ * Returns false, leaving op untouched, if there is no valid entry for key.
+ */
+bool load_cached_operator(const std::string& dir, const std::string& key,
+    std::vector<double>& op);
+
+/* Store op under key, creating dir if needed. Failing to write the cache
+ * is not an error, the operator will just be recomputed next time.
+ */
+void save_cached_operator(const std::string& dir, const std::string& key,
+    const std::vector<double>& op);
+
+} // END namespace tbem
+
+#endif
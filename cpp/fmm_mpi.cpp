@@ -0,0 +1,566 @@
+#ifdef TBEM_USE_MPI
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include "fmm_mpi.h"
+#include "geometry.h"
+
+namespace tbem {
+
+template <size_t dim>
+uint64_t morton_key(const Vec<double,dim>& pt, const Box<dim>& bounds)
+{
+    const size_t bits = 63 / dim;
+    const uint64_t n_cells = uint64_t(1) << bits;
+    std::array<uint64_t,dim> cell;
+    for (size_t d = 0; d < dim; d++) {
+        auto width = 2 * bounds.half_width[d];
+        double t = 0.0;
+        if (width > 0) {
+            t = (pt[d] - (bounds.center[d] - bounds.half_width[d])) / width;
+        }
+        t = std::min(std::max(t, 0.0), 1.0);
+        cell[d] = std::min(static_cast<uint64_t>(t * n_cells), n_cells - 1);
+    }
+
+    uint64_t key = 0;
+    for (size_t b = bits; b > 0; b--) {
+        for (size_t d = 0; d < dim; d++) {
+            key = (key << 1) | ((cell[d] >> (b - 1)) & 1);
+        }
+    }
+    return key;
+}
+
+int comm_rank(MPI_Comm comm)
+{
+    int rank;
+    MPI_Comm_rank(comm, &rank);
+    return rank;
+}
+
+int comm_size(MPI_Comm comm)
+{
+    int size;
+    MPI_Comm_size(comm, &size);
+    return size;
+}
+
+std::vector<int> displacements(const std::vector<int>& counts)
+{
+    std::vector<int> out(counts.size(), 0);
+    for (size_t i = 1; i < counts.size(); i++) {
+        out[i] = out[i - 1] + counts[i - 1];
+    }
+    return out;
+}
+
+std::vector<uint64_t> morton_splitters(MPI_Comm comm,
+    const std::vector<uint64_t>& keys)
+{
+    // Sampling every stride-th key from every rank gives each rank a number
+    // of samples proportional to its number of keys.
+    const size_t samples_per_rank = 32;
+    auto n_ranks = comm_size(comm);
+    unsigned long long n_local = keys.size();
+    unsigned long long n_total;
+    MPI_Allreduce(&n_local, &n_total, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, comm);
+    auto stride = std::max<size_t>(1, n_total / (samples_per_rank * n_ranks));
+
+    auto sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<uint64_t> samples;
+    for (size_t i = stride / 2; i < sorted.size(); i += stride) {
+        samples.push_back(sorted[i]);
+    }
+
+    int n_samples = samples.size();
+    std::vector<int> counts(n_ranks);
+    MPI_Allgather(&n_samples, 1, MPI_INT, counts.data(), 1, MPI_INT, comm);
+    auto displs = displacements(counts);
+    std::vector<uint64_t> all_samples(displs.back() + counts.back());
+    MPI_Allgatherv(
+        samples.data(), n_samples, MPI_UINT64_T, all_samples.data(),
+        counts.data(), displs.data(), MPI_UINT64_T, comm
+    );
+    std::sort(all_samples.begin(), all_samples.end());
+
+    std::vector<uint64_t> splitters(n_ranks - 1, 0);
+    for (size_t i = 0; i < splitters.size() && !all_samples.empty(); i++) {
+        splitters[i] = all_samples[((i + 1) * all_samples.size()) / n_ranks];
+    }
+    return splitters;
+}
+
+std::vector<double> exchange(MPI_Comm comm, const std::vector<double>& send,
+    const std::vector<int>& send_counts, const std::vector<int>& recv_counts,
+    size_t width)
+{
+    auto n_ranks = send_counts.size();
+    std::vector<int> send_sizes(n_ranks);
+    std::vector<int> recv_sizes(n_ranks);
+    for (size_t i = 0; i < n_ranks; i++) {
+        send_sizes[i] = send_counts[i] * width;
+        recv_sizes[i] = recv_counts[i] * width;
+    }
+    auto send_displs = displacements(send_sizes);
+    auto recv_displs = displacements(recv_sizes);
+    assert(send.size() ==
+        static_cast<size_t>(send_displs.back() + send_sizes.back()));
+
+    std::vector<double> recv(recv_displs.back() + recv_sizes.back());
+    MPI_Alltoallv(
+        send.data(), send_sizes.data(), send_displs.data(), MPI_DOUBLE,
+        recv.data(), recv_sizes.data(), recv_displs.data(), MPI_DOUBLE, comm
+    );
+    return recv;
+}
+
+/* Route each point i to the rank owners[i]. */
+PointRoute make_route(MPI_Comm comm, const std::vector<int>& owners)
+{
+    auto n_ranks = comm_size(comm);
+    std::vector<int> send_counts(n_ranks, 0);
+    for (auto o: owners) {
+        send_counts[o]++;
+    }
+
+    auto next = displacements(send_counts);
+    std::vector<size_t> send_order(owners.size());
+    for (size_t i = 0; i < owners.size(); i++) {
+        send_order[next[owners[i]]++] = i;
+    }
+
+    std::vector<int> recv_counts(n_ranks);
+    MPI_Alltoall(
+        send_counts.data(), 1, MPI_INT, recv_counts.data(), 1, MPI_INT, comm
+    );
+    size_t n_recv = 0;
+    for (auto c: recv_counts) {
+        n_recv += c;
+    }
+    return {send_order, send_counts, recv_counts, n_recv};
+}
+
+/* Send values stored component by component, width values for each of the
+ * local points, to the ranks that own the points. The result holds the
+ * values for the received points, component by component.
+ */
+std::vector<double> route_values(MPI_Comm comm, const PointRoute& route,
+    const std::vector<double>& vals, size_t width)
+{
+    auto n = route.send_order.size();
+    std::vector<double> send(n * width);
+    for (size_t j = 0; j < n; j++) {
+        for (size_t d = 0; d < width; d++) {
+            send[j * width + d] = vals[d * n + route.send_order[j]];
+        }
+    }
+    auto recv = exchange(comm, send, route.send_counts, route.recv_counts, width);
+
+    auto n_recv = route.n_recv;
+    std::vector<double> out(n_recv * width);
+    for (size_t j = 0; j < n_recv; j++) {
+        for (size_t d = 0; d < width; d++) {
+            out[d * n_recv + j] = recv[j * width + d];
+        }
+    }
+    return out;
+}
+
+/* The reverse of route_values: send the values for the received points back
+ * to the ranks that the points came from.
+ */
+std::vector<double> return_values(MPI_Comm comm, const PointRoute& route,
+    const std::vector<double>& vals, size_t width)
+{
+    auto n_recv = route.n_recv;
+    std::vector<double> send(n_recv * width);
+    for (size_t j = 0; j < n_recv; j++) {
+        for (size_t d = 0; d < width; d++) {
+            send[j * width + d] = vals[d * n_recv + j];
+        }
+    }
+    auto recv = exchange(comm, send, route.recv_counts, route.send_counts, width);
+
+    auto n = route.send_order.size();
+    std::vector<double> out(n * width);
+    for (size_t j = 0; j < n; j++) {
+        for (size_t d = 0; d < width; d++) {
+            out[d * n + route.send_order[j]] = recv[j * width + d];
+        }
+    }
+    return out;
+}
+
+template <size_t dim>
+Box<dim> global_bounds(MPI_Comm comm, const NBodyData<dim>& data)
+{
+    // The maximum is found as minus the minimum of the negated coordinates
+    // so that a single reduction covers both.
+    std::array<double,2 * dim> extents;
+    extents.fill(std::numeric_limits<double>::max());
+    auto include = [&] (const std::vector<Vec<double,dim>>& pts) {
+        for (auto& p: pts) {
+            for (size_t d = 0; d < dim; d++) {
+                extents[d] = std::min(extents[d], p[d]);
+                extents[dim + d] = std::min(extents[dim + d], -p[d]);
+            }
+        }
+    };
+    include(data.obs_locs);
+    include(data.src_locs);
+    MPI_Allreduce(
+        MPI_IN_PLACE, extents.data(), 2 * dim, MPI_DOUBLE, MPI_MIN, comm
+    );
+
+    Vec<double,dim> center;
+    Vec<double,dim> half_width;
+    for (size_t d = 0; d < dim; d++) {
+        center[d] = (extents[d] - extents[dim + d]) / 2;
+        half_width[d] = (-extents[dim + d] - extents[d]) / 2;
+    }
+    return {center, half_width};
+}
+
+/* The cells of the tree below cell, cut off at level depth, stored as their
+ * centers and half widths.
+ */
+template <size_t dim>
+void collect_boxes(const OctreeNode<dim>& cell, size_t depth, std::vector<double>& out)
+{
+    if (cell.is_leaf() || cell.level >= depth) {
+        for (size_t d = 0; d < dim; d++) {
+            out.push_back(cell.bounds.center[d]);
+        }
+        for (size_t d = 0; d < dim; d++) {
+            out.push_back(cell.bounds.half_width[d]);
+        }
+        return;
+    }
+    for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+        auto child = cell.child(c_idx);
+        if (child != nullptr) {
+            collect_boxes(*child, depth, out);
+        }
+    }
+}
+
+template <size_t dim>
+Box<dim> read_box(const double* vals)
+{
+    Vec<double,dim> center;
+    Vec<double,dim> half_width;
+    for (size_t d = 0; d < dim; d++) {
+        center[d] = vals[d];
+        half_width[d] = vals[dim + d];
+    }
+    return {center, half_width};
+}
+
+template <size_t dim, size_t R, size_t C>
+DistributedFMMOperator<dim,R,C>::DistributedFMMOperator(const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& local_data, const FMMConfig& config, MPI_Comm comm):
+    comm(comm),
+    rank(comm_rank(comm)),
+    n_ranks(comm_size(comm)),
+    config(config),
+    n_obs(local_data.obs_locs.size()),
+    n_src(local_data.src_locs.size())
+{
+    // Partition the points by their position along the Morton curve.
+    auto bounds = global_bounds(comm, local_data);
+    std::vector<uint64_t> keys;
+    for (auto& p: local_data.obs_locs) {
+        keys.push_back(morton_key(p, bounds));
+    }
+    for (auto& p: local_data.src_locs) {
+        keys.push_back(morton_key(p, bounds));
+    }
+    auto splitters = morton_splitters(comm, keys);
+    auto owners = [&] (size_t begin, size_t end) {
+        std::vector<int> out;
+        for (size_t i = begin; i < end; i++) {
+            out.push_back(
+                std::upper_bound(splitters.begin(), splitters.end(), keys[i]) -
+                splitters.begin()
+            );
+        }
+        return out;
+    };
+    obs_route = make_route(comm, owners(0, n_obs));
+    src_route = make_route(comm, owners(n_obs, n_obs + n_src));
+
+    // Send the points to their owners, packed as the coordinates and then
+    // the normal components of each point, followed by the source weights.
+    std::vector<double> obs_vals(2 * dim * n_obs);
+    for (size_t i = 0; i < n_obs; i++) {
+        for (size_t d = 0; d < dim; d++) {
+            obs_vals[d * n_obs + i] = local_data.obs_locs[i][d];
+            obs_vals[(dim + d) * n_obs + i] = local_data.obs_normals[i][d];
+        }
+    }
+    std::vector<double> src_vals((2 * dim + 1) * n_src);
+    for (size_t i = 0; i < n_src; i++) {
+        for (size_t d = 0; d < dim; d++) {
+            src_vals[d * n_src + i] = local_data.src_locs[i][d];
+            src_vals[(dim + d) * n_src + i] = local_data.src_normals[i][d];
+        }
+        src_vals[2 * dim * n_src + i] = local_data.src_weights[i];
+    }
+    auto owned_obs_vals = route_values(comm, obs_route, obs_vals, 2 * dim);
+    auto owned_src_vals = route_values(comm, src_route, src_vals, 2 * dim + 1);
+
+    auto n_owned_obs = obs_route.n_recv;
+    n_owned_src = src_route.n_recv;
+    NBodyData<dim> owned;
+    owned.obs_locs.resize(n_owned_obs);
+    owned.obs_normals.resize(n_owned_obs);
+    for (size_t i = 0; i < n_owned_obs; i++) {
+        for (size_t d = 0; d < dim; d++) {
+            owned.obs_locs[i][d] = owned_obs_vals[d * n_owned_obs + i];
+            owned.obs_normals[i][d] = owned_obs_vals[(dim + d) * n_owned_obs + i];
+        }
+    }
+    owned.src_locs.resize(n_owned_src);
+    owned.src_normals.resize(n_owned_src);
+    owned.src_weights.resize(n_owned_src);
+    for (size_t i = 0; i < n_owned_src; i++) {
+        for (size_t d = 0; d < dim; d++) {
+            owned.src_locs[i][d] = owned_src_vals[d * n_owned_src + i];
+            owned.src_normals[i][d] = owned_src_vals[(dim + d) * n_owned_src + i];
+        }
+        owned.src_weights[i] = owned_src_vals[2 * dim * n_owned_src + i];
+    }
+
+    if (n_owned_obs > 0 && n_owned_src > 0) {
+        local_op.reset(new FMMOperator<dim,R,C>(K, owned, config));
+    }
+
+    // Share the observation cells of every rank.
+    std::vector<double> box_vals;
+    if (local_op != nullptr) {
+        collect_boxes(local_op->obs_oct.root(), essential_tree_depth, box_vals);
+    } else if (n_owned_obs > 0) {
+        auto obs_oct = make_octree(owned.obs_locs, config.min_pts_per_cell);
+        collect_boxes(obs_oct.root(), essential_tree_depth, box_vals);
+    }
+    int n_box_vals = box_vals.size();
+    std::vector<int> box_counts(n_ranks);
+    MPI_Allgather(&n_box_vals, 1, MPI_INT, box_counts.data(), 1, MPI_INT, comm);
+    auto box_displs = displacements(box_counts);
+    std::vector<double> all_box_vals(box_displs.back() + box_counts.back());
+    MPI_Allgatherv(
+        box_vals.data(), n_box_vals, MPI_DOUBLE, all_box_vals.data(),
+        box_counts.data(), box_displs.data(), MPI_DOUBLE, comm
+    );
+
+    // Find the locally essential tree for each of the other ranks.
+    auto equiv_surf = TranslationSurface<dim>::up_equiv_surface(
+        config.order, config.d, config.fft_m2l
+    );
+    auto n_equiv = equiv_surf.pts.size();
+    ghost_cells.resize(n_ranks);
+    ghost_pts.resize(n_ranks);
+    ghost_send_counts.assign(n_ranks, 0);
+    std::vector<int> cell_send_counts(n_ranks, 0);
+    std::vector<int> pt_send_counts(n_ranks, 0);
+    for (int r = 0; r < n_ranks; r++) {
+        if (r == rank || box_counts[r] == 0) {
+            continue;
+        }
+        if (local_op != nullptr) {
+            std::vector<Box<dim>> obs_boxes;
+            for (int i = 0; i < box_counts[r]; i += 2 * dim) {
+                obs_boxes.push_back(
+                    read_box<dim>(&all_box_vals[box_displs[r] + i])
+                );
+            }
+            essential_tree(local_op->src_oct.root(), obs_boxes, ghost_cells[r], ghost_pts[r]);
+        } else {
+            for (size_t i = 0; i < n_owned_src; i++) {
+                ghost_pts[r].push_back(i);
+            }
+        }
+        cell_send_counts[r] = ghost_cells[r].size();
+        pt_send_counts[r] = ghost_pts[r].size();
+        ghost_send_counts[r] = ghost_cells[r].size() * n_equiv + ghost_pts[r].size();
+    }
+
+    // Send the ghost cells and the ghost points.
+    std::vector<double> cell_vals;
+    std::vector<double> pt_vals;
+    for (int r = 0; r < n_ranks; r++) {
+        for (auto cell: ghost_cells[r]) {
+            for (size_t d = 0; d < dim; d++) {
+                cell_vals.push_back(cell->bounds.center[d]);
+            }
+            for (size_t d = 0; d < dim; d++) {
+                cell_vals.push_back(cell->bounds.half_width[d]);
+            }
+        }
+        for (auto i: ghost_pts[r]) {
+            for (size_t d = 0; d < dim; d++) {
+                pt_vals.push_back(owned.src_locs[i][d]);
+            }
+            for (size_t d = 0; d < dim; d++) {
+                pt_vals.push_back(owned.src_normals[i][d]);
+            }
+            pt_vals.push_back(owned.src_weights[i]);
+        }
+    }
+    std::vector<int> cell_recv_counts(n_ranks);
+    std::vector<int> pt_recv_counts(n_ranks);
+    MPI_Alltoall(
+        cell_send_counts.data(), 1, MPI_INT, cell_recv_counts.data(), 1, MPI_INT,
+        comm
+    );
+    MPI_Alltoall(
+        pt_send_counts.data(), 1, MPI_INT, pt_recv_counts.data(), 1, MPI_INT, comm
+    );
+    auto recv_cells = exchange(
+        comm, cell_vals, cell_send_counts, cell_recv_counts, 2 * dim
+    );
+    auto recv_pts = exchange(
+        comm, pt_vals, pt_send_counts, pt_recv_counts, 2 * dim + 1
+    );
+
+    // The ghost sources from each rank are the equivalent surface points of
+    // its cells followed by its points, in the order that apply receives
+    // their strengths. The equivalent surface points have unit weights.
+    NBodyData<dim> ghosts;
+    ghosts.obs_locs = owned.obs_locs;
+    ghosts.obs_normals = owned.obs_normals;
+    ghost_recv_counts.assign(n_ranks, 0);
+    size_t next_cell = 0;
+    size_t next_pt = 0;
+    for (int q = 0; q < n_ranks; q++) {
+        for (int c = 0; c < cell_recv_counts[q]; c++, next_cell++) {
+            auto box = read_box<dim>(&recv_cells[next_cell * 2 * dim]);
+            auto pts = equiv_surf.move(box);
+            ghosts.src_locs.insert(ghosts.src_locs.end(), pts.begin(), pts.end());
+            ghosts.src_normals.insert(
+                ghosts.src_normals.end(), equiv_surf.normals.begin(),
+                equiv_surf.normals.end()
+            );
+            ghosts.src_weights.insert(ghosts.src_weights.end(), n_equiv, 1.0);
+        }
+        for (int p = 0; p < pt_recv_counts[q]; p++, next_pt++) {
+            auto vals = &recv_pts[next_pt * (2 * dim + 1)];
+            Vec<double,dim> loc;
+            Vec<double,dim> normal;
+            for (size_t d = 0; d < dim; d++) {
+                loc[d] = vals[d];
+                normal[d] = vals[dim + d];
+            }
+            ghosts.src_locs.push_back(loc);
+            ghosts.src_normals.push_back(normal);
+            ghosts.src_weights.push_back(vals[2 * dim]);
+        }
+        ghost_recv_counts[q] = cell_recv_counts[q] * n_equiv + pt_recv_counts[q];
+    }
+
+    if (n_owned_obs > 0 && !ghosts.src_locs.empty()) {
+        ghost_op.reset(new FMMOperator<dim,R,C>(K, ghosts, config));
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void DistributedFMMOperator<dim,R,C>::essential_tree(const OctreeNode<dim>& cell,
+    const std::vector<Box<dim>>& obs_boxes,
+    std::vector<const OctreeNode<dim>*>& cells, std::vector<size_t>& pts) const
+{
+    if (cell.n_pts() == 0) {
+        return;
+    }
+
+    bool far = std::all_of(obs_boxes.begin(), obs_boxes.end(),
+        [&] (const Box<dim>& b) {
+            return well_separated(b, cell.bounds, config.mac);
+        });
+    // Sending the points of a cell with fewer points than its equivalent
+    // surface is both cheaper and exact.
+    bool small = cell.n_pts() <= local_op->up_equiv_surface.pts.size();
+    if (far && !small) {
+        cells.push_back(&cell);
+    } else if (small || cell.is_leaf()) {
+        auto& indices = local_op->src_oct.indices;
+        pts.insert(pts.end(), indices.begin() + cell.begin, indices.begin() + cell.end);
+    } else {
+        for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
+            auto child = cell.child(c_idx);
+            if (child != nullptr) {
+                essential_tree(*child, obs_boxes, cells, pts);
+            }
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double> DistributedFMMOperator<dim,R,C>::apply(
+    const std::vector<double>& x) const
+{
+    assert(x.size() == C * n_src);
+
+    auto x_owned = route_values(comm, src_route, x, C);
+    auto n_owned_obs = obs_route.n_recv;
+    std::vector<double> out_owned(R * n_owned_obs, 0.0);
+    if (local_op != nullptr) {
+        out_owned = local_op->apply(x_owned);
+    }
+
+    // The local apply leaves the multipole coefficients of the ghost cells
+    // behind, so they are sent along with the ghost point strengths.
+    size_t n_equiv = 0;
+    if (local_op != nullptr) {
+        n_equiv = local_op->up_equiv_surface.pts.size();
+    }
+    std::vector<double> multipoles(C * n_equiv);
+    std::vector<double> ghost_send;
+    for (int r = 0; r < n_ranks; r++) {
+        for (auto cell: ghost_cells[r]) {
+            local_op->copy_multipoles(*cell, multipoles.data());
+            for (size_t i = 0; i < n_equiv; i++) {
+                for (size_t d = 0; d < C; d++) {
+                    ghost_send.push_back(multipoles[d * n_equiv + i]);
+                }
+            }
+        }
+        for (auto i: ghost_pts[r]) {
+            for (size_t d = 0; d < C; d++) {
+                ghost_send.push_back(x_owned[d * n_owned_src + i]);
+            }
+        }
+    }
+    auto ghost_recv = exchange(
+        comm, ghost_send, ghost_send_counts, ghost_recv_counts, C
+    );
+
+    if (ghost_op != nullptr) {
+        auto n_ghosts = ghost_recv.size() / C;
+        std::vector<double> ghost_x(ghost_recv.size());
+        for (size_t j = 0; j < n_ghosts; j++) {
+            for (size_t d = 0; d < C; d++) {
+                ghost_x[d * n_ghosts + j] = ghost_recv[j * C + d];
+            }
+        }
+        auto ghost_out = ghost_op->apply(ghost_x);
+        for (size_t i = 0; i < out_owned.size(); i++) {
+            out_owned[i] += ghost_out[i];
+        }
+    }
+
+    return return_values(comm, obs_route, out_owned, R);
+}
+
+template uint64_t morton_key(const Vec<double,2>& pt, const Box<2>& bounds);
+template uint64_t morton_key(const Vec<double,3>& pt, const Box<3>& bounds);
+template struct DistributedFMMOperator<2,1,1>;
+template struct DistributedFMMOperator<2,2,2>;
+template struct DistributedFMMOperator<3,1,1>;
+template struct DistributedFMMOperator<3,3,3>;
+
+} // END namespace tbem
+
+#endif
@@ -0,0 +1,132 @@
+#ifndef TBEMXJQWPOEIRU_FMM_MPI_H
+#define TBEMXJQWPOEIRU_FMM_MPI_H
+
+// The distributed FMM is only built when compiling with an MPI compiler
+// wrapper and TBEM_USE_MPI defined (see tbempy/setup.py).
+#ifdef TBEM_USE_MPI
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <mpi.h>
+#include "fmm.h"
+#include "nbody_operator.h"
+
+namespace tbem {
+
+/* The position of pt along the Morton (Z order) curve through bounds, using
+ * 63 / dim bits per axis, with the first axis the most significant at each
+ * level. Points outside bounds are clamped onto it.
+ */
+template <size_t dim>
+uint64_t morton_key(const Vec<double,dim>& pt, const Box<dim>& bounds);
+
+/* Split the Morton curve into one range per rank of comm so that each range
+ * holds about the same number of the keys from all the ranks. The keys are
+ * sampled rather than fully sorted. Returns the n_ranks - 1 boundaries: a
+ * key k belongs to the rank
+ * std::upper_bound(splitters.begin(), splitters.end(), k) - splitters.begin().
+ */
+std::vector<uint64_t> morton_splitters(MPI_Comm comm,
+    const std::vector<uint64_t>& keys);
+
+/* Where a set of points are sent by an all to all exchange. The points are
+ * sent grouped by destination rank, send_order[j] is the local index of the
+ * j-th point sent, and the counts are numbers of points per rank.
+ */
+struct PointRoute {
+    std::vector<size_t> send_order;
+    std::vector<int> send_counts;
+    std::vector<int> recv_counts;
+    size_t n_recv;
+};
+
+/* Exchange width values per point between all the ranks of comm. send holds
+ * the values grouped by destination rank and the result holds the values
+ * grouped by source rank.
+ */
+std::vector<double> exchange(MPI_Comm comm, const std::vector<double>& send,
+    const std::vector<int>& send_counts, const std::vector<int>& recv_counts,
+    size_t width);
+
+/* A fast multipole method distributed across the ranks of an MPI
+ * communicator. Each rank passes in its own share of the observation and
+ * source points, in any distribution, and the ranks then act together as
+ * one operator on all the points. Every member function is collective.
+ *
+ * The points are repartitioned by Morton key so that each rank owns the
+ * points in a contiguous range of the Morton curve through the global
+ * bounding box, and each rank builds an FMMOperator for the points it owns.
+ * The other ranks' sources reach a rank through its locally essential tree:
+ * the source cells of another rank that are well separated from all of
+ * this rank's observation points send their multipole coefficients, and
+ * the rest of the sources near this rank's observation points are sent
+ * as ghost points, so the near field is evaluated entirely by the rank
+ * that owns the observation points. The ghost points and the equivalent
+ * source points of the ghost multipoles are fixed when the operator is
+ * built, so a second FMMOperator from them to the owned observation points
+ * is built once and each apply only exchanges strengths.
+ */
+template <size_t dim, size_t R, size_t C>
+struct DistributedFMMOperator {
+    // The observation cells of each rank that the locally essential trees
+    // are checked against are its observation tree cells cut off at this
+    // depth, so that sources close to one part of a rank's domain can still
+    // be far from the rest of it.
+    static const size_t essential_tree_depth = 4;
+
+    const MPI_Comm comm;
+    const int rank;
+    const int n_ranks;
+    const FMMConfig config;
+    const size_t n_obs;
+    const size_t n_src;
+    // The routes of the local points to the ranks that own them.
+    PointRoute obs_route;
+    PointRoute src_route;
+
+    // The FMM for the owned points. It is null if this rank owns no
+    // observation or no source points.
+    std::unique_ptr<FMMOperator<dim,R,C>> local_op;
+    // The FMM from the other ranks' ghost sources and ghost multipoles to
+    // the owned observation points, null if there are none.
+    std::unique_ptr<FMMOperator<dim,R,C>> ghost_op;
+    size_t n_owned_src;
+
+    // The locally essential tree sent to each rank: the cells whose
+    // multipole coefficients are sent and the owned source points that are
+    // sent directly. The counts are in ghost source points, with every
+    // cell counting as its equivalent surface points.
+    std::vector<std::vector<const OctreeNode<dim>*>> ghost_cells;
+    std::vector<std::vector<size_t>> ghost_pts;
+    std::vector<int> ghost_send_counts;
+    std::vector<int> ghost_recv_counts;
+
+    DistributedFMMOperator(const Kernel<dim,R,C>& K,
+        const NBodyData<dim>& local_data, const FMMConfig& config,
+        MPI_Comm comm = MPI_COMM_WORLD);
+
+    /* The number of output and input values held by this rank. */
+    size_t n_rows() const { return R * n_obs; }
+    size_t n_cols() const { return C * n_src; }
+
+    /* Apply the operator to the source strengths held by this rank, in the
+     * order of its local source points, returning the values at its local
+     * observation points. The values are stored component by component, like
+     * FMMOperator::apply.
+     */
+    std::vector<double> apply(const std::vector<double>& x) const;
+
+    /* Find the locally essential tree of cell for a rank with observation
+     * cells obs_boxes.
+     */
+    void essential_tree(const OctreeNode<dim>& cell,
+        const std::vector<Box<dim>>& obs_boxes,
+        std::vector<const OctreeNode<dim>*>& cells, std::vector<size_t>& pts) const;
+};
+
+} // END namespace tbem
+
+#endif
+
+#endif
@@ -49,6 +49,13 @@ struct GravityDisplacement<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
@@ -89,6 +96,13 @@ struct GravityTraction<2>: public Kernel<2,2,2>
         return out;
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,2,2>> clone() const
     {
         return std::unique_ptr<Kernel<2,2,2>>(
@@ -119,6 +133,13 @@ struct GravityDisplacement<3>: public Kernel<3,3,3>
         return zeros<Kernel::OperatorType>::make();
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
@@ -149,6 +170,13 @@ struct GravityTraction<3>: public Kernel<3,3,3>
         return zeros<Kernel::OperatorType>::make();
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,3,3>> clone() const
     {
         return std::unique_ptr<Kernel<3,3,3>>(
@@ -33,6 +33,10 @@ struct IdentityTensor: public Kernel<dim,R,C>
     {
         return std::unique_ptr<Kernel<dim,R,C>>(new IdentityTensor<dim,R,C>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return 0.0;}
+    virtual bool is_symmetric() const {return R == C;}
 };
 
 template <size_t dim>
@@ -61,6 +61,33 @@ struct IntegralOperator: public OperatorI {
         }
         return eval;
     }
+
+    /* The transpose applies each piece transposed, in reverse order. The
+     * far field operator provides its own transpose, which for the FMM reuses
+     * the same trees and translation operators.
+     */
+    virtual std::vector<double> apply_transpose(const std::vector<double>& y) const {
+        auto nbody_far = interp.apply_transpose(
+            farfield->apply_transpose(galerkin.apply_transpose(y))
+        );
+        auto eval = nearfield.apply_transpose(y);
+        auto correction = farfield_correction.apply_transpose(y);
+        for (size_t i = 0; i < eval.size(); i++) {
+            eval[i] += nbody_far[i] + correction[i];
+        }
+        return eval;
+    }
+
+    /* The statistics of the far field FMM. Empty statistics are returned 
+     * when the far field is evaluated directly.
+     */
+    FMMStats fmm_stats() const {
+        auto fmm = dynamic_cast<const FMMOperator<dim,R,C>*>(farfield.get());
+        if (fmm == nullptr) {
+            return FMMStats();
+        }
+        return fmm->latest_stats();
+    }
 };
 
 //TODO Lots of ugly duplication in this file
@@ -69,7 +96,6 @@ IntegralOperator<dim,R,C> boundary_operator(const Mesh<dim>& obs_mesh,
     const Mesh<dim>& src_mesh, const IntegrationStrategy<dim,R,C>& mthd,
     const FMMConfig& fmm_config, const Mesh<dim>& all_mesh) 
 {
-    (void)fmm_config;
     auto near_obs_pts = galerkin_obs_pts(obs_mesh, mthd.obs_near_quad, all_mesh);
     auto nearfield = make_nearfield_operator(near_obs_pts, src_mesh, mthd);
     auto far_obs_pts = galerkin_obs_pts(obs_mesh, mthd.obs_far_quad, all_mesh);
@@ -79,13 +105,16 @@ IntegralOperator<dim,R,C> boundary_operator(const Mesh<dim>& obs_mesh,
     auto nbody_data = nbody_data_from_bem(
         obs_mesh, src_mesh, mthd.obs_far_quad, mthd.src_far_quad
     );
-    // auto farfield = std::make_shared<FMMOperator<dim,R,C>>(
-    //     FMMOperator<dim,R,C>(*mthd.K, nbody_data, fmm_config)
-    // );
-    auto farfield = std::make_shared<DenseOperator>(
-        make_direct_nbody_operator(nbody_data, *mthd.K)
-    );
-    std::shared_ptr<OperatorI> farfield_ptr = farfield;
+    std::shared_ptr<OperatorI> farfield_ptr;
+    if (fmm_config.use_fmm) {
+        farfield_ptr = std::make_shared<FMMOperator<dim,R,C>>(
+            *mthd.K, nbody_data, fmm_config
+        );
+    } else {
+        farfield_ptr = std::make_shared<DenseOperator>(
+            make_direct_nbody_operator(nbody_data, *mthd.K)
+        );
+    }
 
     auto far_galerkin = make_galerkin_operator(R, obs_mesh, mthd.obs_far_quad);
     auto interp = make_interpolation_operator(C, src_mesh, mthd.src_far_quad);
@@ -25,6 +25,60 @@ Vec<Vec<Vec<double,C>,R>,dim> IntegralTerm<dim,R,C>::eval_point_influence(
     return eval_point_influence(k, x_hat, obs.loc);
 }
 
+template <size_t dim, size_t R, size_t C>
+void IntegralTerm<dim,R,C>::eval_point_influences(const Kernel<dim,R,C>& k,
+    const Vec<double,dim-1>* x_hats, size_t n,
+    const Vec<double,dim>& moved_obs_loc,
+    Vec<Vec<Vec<double,C>,R>,dim>* out) const
+{
+    // One buffer for the source points and normals in the PointsSoA layout
+    // followed by the kernel values.
+    std::vector<double> buffer((2 * dim + R * C) * n);
+    auto locs = buffer.data();
+    auto normals = locs + dim * n;
+    auto row = normals + dim * n;
+    for (size_t i = 0; i < n; i++) {
+        auto src_pt = ref_to_real(x_hats[i], src_face.facet);
+        for (size_t d = 0; d < dim; d++) {
+            locs[d * n + i] = src_pt[d];
+            normals[d * n + i] = src_face.normal[d];
+        }
+    }
+    k.call_row(moved_obs_loc, obs.normal, {locs, normals, n, n}, row);
+
+    for (size_t i = 0; i < n; i++) {
+        Vec<Vec<double,C>,R> kernel_val;
+        for (size_t d1 = 0; d1 < R; d1++) {
+            for (size_t d2 = 0; d2 < C; d2++) {
+                kernel_val[d1][d2] = row[(d1 * C + d2) * n + i];
+            }
+        }
+        out[i] = outer_product(
+            linear_basis(x_hats[i]), kernel_val * src_face.jacobian
+        );
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+Vec<Vec<Vec<double,C>,R>,dim> IntegralTerm<dim,R,C>::eval_quad_influence(
+    const Kernel<dim,R,C>& k, const QuadRule<dim-1>& quad,
+    const Vec<double,dim>& moved_obs_loc) const
+{
+    auto n = quad.size();
+    std::vector<Vec<double,dim-1>> x_hats(n);
+    for (size_t i = 0; i < n; i++) {
+        x_hats[i] = quad[i].x_hat;
+    }
+    std::vector<Vec<Vec<Vec<double,C>,R>,dim>> influences(n);
+    eval_point_influences(k, x_hats.data(), n, moved_obs_loc, influences.data());
+
+    auto integrals = zeros<Vec<Vec<Vec<double,C>,R>,dim>>::make();
+    for (size_t i = 0; i < n; i++) {
+        integrals += influences[i] * quad[i].w;
+    }
+    return integrals;
+}
+
 template struct IntegralTerm<2,1,1>;
 template struct IntegralTerm<2,2,2>;
 template struct IntegralTerm<3,1,1>;
@@ -80,12 +134,7 @@ template <size_t dim, size_t R, size_t C>
 Vec<Vec<Vec<double,C>,R>,dim> 
 IntegrationStrategy<dim,R,C>::compute_farfield(const IntegralTerm<dim,R,C>& term) const
 {
-    auto integrals = zeros<Vec<Vec<Vec<double,C>,R>,dim>>::make();
-    for (size_t i = 0; i < src_far_quad.size(); i++) {
-        integrals += term.eval_point_influence(*K, src_far_quad[i].x_hat) *
-                     src_far_quad[i].w;
-    }
-    return integrals;
+    return term.eval_quad_influence(*K, src_far_quad, term.obs.loc);
 }
 
 template struct IntegrationStrategy<2,1,1>;
@@ -100,16 +149,22 @@ struct UnitFacetAdaptiveIntegrator {
         const IntegralTerm<dim,R,C>& term, const Vec<double,dim>& nf_obs_pt);
 };
 
+/* The adaptive integrators evaluate the kernel at all the points of each 
+ * adaptive step in one batch, see adaptive_integrate_batched.
+ */
 template <>
 struct UnitFacetAdaptiveIntegrator<2> {
     template <size_t R, size_t C>
     Vec<Vec<Vec<double,C>,R>,2> operator()(const Kernel<2,R,C>& k, double tolerance, 
         const IntegralTerm<2,R,C>& term, const Vec<double,2>& nf_obs_pt) 
     {
-        return adaptive_integrate<Vec<Vec<Vec<double,C>,R>,2>>(
-            [&] (double x_hat) {
-                Vec<double,1> q_pt = {x_hat};
-                return term.eval_point_influence(k, q_pt, nf_obs_pt);
+        return adaptive_integrate_batched<Vec<Vec<Vec<double,C>,R>,2>>(
+            [&] (const double* x_hats, size_t n, Vec<Vec<Vec<double,C>,R>,2>* out) {
+                std::vector<Vec<double,1>> q_pts(n);
+                for (size_t i = 0; i < n; i++) {
+                    q_pts[i] = {x_hats[i]};
+                }
+                term.eval_point_influences(k, q_pts.data(), n, nf_obs_pt, out);
             }, -1.0, 1.0, tolerance);
     }
 };
@@ -125,10 +180,17 @@ struct UnitFacetAdaptiveIntegrator<3> {
                 if (x_hat == 1.0) {
                     return zeros<Vec<Vec<Vec<double,C>,R>,3>>::make();
                 }
-                return adaptive_integrate<Vec<Vec<Vec<double,C>,R>,3>>(
-                    [&] (double y_hat) {
-                        Vec<double,2> q_pt = {x_hat, y_hat};
-                        return term.eval_point_influence(k, q_pt, nf_obs_pt);
+                return adaptive_integrate_batched<Vec<Vec<Vec<double,C>,R>,3>>(
+                    [&] (const double* y_hats, size_t n,
+                        Vec<Vec<Vec<double,C>,R>,3>* out) 
+                    {
+                        std::vector<Vec<double,2>> q_pts(n);
+                        for (size_t i = 0; i < n; i++) {
+                            q_pts[i] = {x_hat, y_hats[i]};
+                        }
+                        term.eval_point_influences(
+                            k, q_pts.data(), n, nf_obs_pt, out
+                        );
                     }, 0.0, 1 - x_hat, tolerance);
             }, 0.0, 1.0, tolerance);
     }
@@ -190,11 +252,7 @@ SinhIntegrator<dim,R,C>::compute_nearfield(const Kernel<dim,R,C>& K,
     assert(l > 0);
     auto S = term.src_face.length_scale;
     auto q = choose_sinh_quad<dim>(sinh_order, sinh_order, S, l, nearest_pt.ref_pt);
-    auto integrals = zeros<Vec<Vec<Vec<double,C>,R>,dim>>::make();
-    for (size_t i = 0; i < q.size(); i++) {
-        integrals += term.eval_point_influence(K, q[i].x_hat, term.obs.loc) * q[i].w;
-    }
-    return integrals;
+    return term.eval_quad_influence(K, q, term.obs.loc);
 }
 
 template struct SinhIntegrator<2,1,1>;
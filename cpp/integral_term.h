@@ -34,6 +34,21 @@ struct IntegralTerm {
 
     Vec<Vec<Vec<double,C>,R>,dim> eval_point_influence(const Kernel<dim,R,C>& k,
         const Vec<double,dim-1>& x_hat) const; 
+
+    /* eval_point_influence at the n points x_hats, stored in out. The 
+     * kernel is evaluated at all the points in one batch with 
+     * Kernel::call_row.
+     */
+    void eval_point_influences(const Kernel<dim,R,C>& k,
+        const Vec<double,dim-1>* x_hats, size_t n,
+        const Vec<double,dim>& moved_obs_loc,
+        Vec<Vec<Vec<double,C>,R>,dim>* out) const;
+
+    /* The sum of eval_point_influence times the weight over the points of a
+     * quadrature rule, using eval_point_influences.
+     */
+    Vec<Vec<Vec<double,C>,R>,dim> eval_quad_influence(const Kernel<dim,R,C>& k,
+        const QuadRule<dim-1>& quad, const Vec<double,dim>& moved_obs_loc) const;
 };
 
 template <size_t dim> struct NearestPoint;
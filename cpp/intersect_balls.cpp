@@ -11,8 +11,8 @@ template <size_t dim>
 std::vector<std::pair<size_t,size_t>> intersect_balls_all_pairs(
     const std::vector<Ball<dim>>& ptsA,
     const std::vector<Ball<dim>>& ptsB,
-    const Octree<dim>& cellA,
-    const Octree<dim>& cellB)
+    const Octree<dim>& octA, const OctreeNode<dim>& cellA,
+    const Octree<dim>& octB, const OctreeNode<dim>& cellB)
 {
     auto rA = hypot(cellA.true_bounds.half_width);
     auto rB = hypot(cellB.true_bounds.half_width);
@@ -26,8 +26,10 @@ std::vector<std::pair<size_t,size_t>> intersect_balls_all_pairs(
     if (cellA.is_leaf() && cellB.is_leaf()) {
         // the cells are intersecting leaf cells. perform a direct intersection
         std::vector<std::pair<size_t,size_t>> out_pairs;
-        for (auto idxA: cellA.indices) {
-            for (auto idxB: cellB.indices) {
+        for (size_t i = cellA.begin; i < cellA.end; i++) {
+            auto idxA = octA.indices[i];
+            for (size_t j = cellB.begin; j < cellB.end; j++) {
+                auto idxB = octB.indices[j];
                 if (balls_intersect(ptsA[idxA], ptsB[idxB])) {
                     out_pairs.push_back({idxA, idxB});
                 }
@@ -43,22 +45,24 @@ std::vector<std::pair<size_t,size_t>> intersect_balls_all_pairs(
     if (splitB) {
         //split B because it is shallower
         for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (cellB.children[c] == nullptr) {
+            auto child = cellB.child(c);
+            if (child == nullptr) {
                 continue;
             }
             auto child_pairs = intersect_balls_all_pairs(
-                ptsA, ptsB, cellA, *cellB.children[c]
+                ptsA, ptsB, octA, cellA, octB, *child
             );
             out_pairs.insert(out_pairs.end(), child_pairs.begin(), child_pairs.end());
         }
     } else {
         //split A because it is shallower
         for (size_t c = 0; c < Octree<dim>::split; c++) {
-            if (cellA.children[c] == nullptr) {
+            auto child = cellA.child(c);
+            if (child == nullptr) {
                 continue;
             }
             auto child_pairs = intersect_balls_all_pairs(
-                ptsA, ptsB, *cellA.children[c], cellB
+                ptsA, ptsB, octA, *child, octB, cellB
             );
             out_pairs.insert(out_pairs.end(), child_pairs.begin(), child_pairs.end());
         }
@@ -74,7 +78,9 @@ std::vector<std::pair<size_t,size_t>> intersect_balls_all_pairs(
 {
     auto octA = make_octree(ptsA, 20);
     auto octB = make_octree(ptsB, 20);
-    return intersect_balls_all_pairs(ptsA, ptsB, octA, octB);
+    return intersect_balls_all_pairs(
+        ptsA, ptsB, octA, octA.root(), octB, octB.root()
+    );
 }
 
 template 
@@ -94,7 +100,9 @@ std::vector<size_t> intersect_balls(const Ball<dim>& ptA,
     const std::vector<Ball<dim>>& ptsB, const Octree<dim>& octB)
 {
     auto octA = make_octree<dim>({ptA}, 1);
-    auto pairs = intersect_balls_all_pairs({ptA}, ptsB, octA, octB);
+    auto pairs = intersect_balls_all_pairs(
+        {ptA}, ptsB, octA, octA.root(), octB, octB.root()
+    );
     std::vector<size_t> out_indices(pairs.size());
     for (size_t i = 0; i < pairs.size(); i++) {
         assert(pairs[i].first == 0);
@@ -3,10 +3,78 @@
 
 #include "vec_ops.h"
 #include "geometry.h"
+#include <algorithm>
 #include <memory>
+#include <vector>
 
 namespace tbem {
 
+/* A block of n points and their normals stored as a structure of arrays: 
+ * coordinate d of point j is locs[d * stride + j]. The batched kernel 
+ * evaluations load the same coordinate of consecutive points together, so 
+ * this is the layout that lets their loops over the points use SIMD 
+ * instructions.
+ */
+template <size_t dim>
+struct PointsSoA {
+    const double* locs;
+    const double* normals;
+    size_t stride;
+    size_t n;
+
+    /* The n_pts points starting from start. */
+    PointsSoA<dim> slice(size_t start, size_t n_pts) const
+    {
+        return {locs + start, normals + start, stride, n_pts};
+    }
+};
+
+/* Copy n points and normals into buffer in the PointsSoA layout. */
+template <size_t dim>
+PointsSoA<dim> to_soa(const Vec<double,dim>* locs, const Vec<double,dim>* normals,
+    size_t n, std::vector<double>& buffer)
+{
+    buffer.resize(2 * dim * n);
+    auto soa_locs = buffer.data();
+    auto soa_normals = buffer.data() + dim * n;
+    for (size_t d = 0; d < dim; d++) {
+        for (size_t j = 0; j < n; j++) {
+            soa_locs[d * n + j] = locs[j][d];
+            soa_normals[d * n + j] = normals[j][d];
+        }
+    }
+    return {soa_locs, soa_normals, n, n};
+}
+
+/* Point j of a block stored like PointsSoA. Spelling out the coordinates
+ * keeps the point in registers in the batched kernel loops.
+ */
+template <size_t dim>
+Vec<double,dim> soa_load(const double* coords, size_t stride, size_t j);
+
+template <>
+inline Vec<double,2> soa_load<2>(const double* coords, size_t stride, size_t j)
+{
+    return {coords[j], coords[stride + j]};
+}
+
+template <>
+inline Vec<double,3> soa_load<3>(const double* coords, size_t stride, size_t j)
+{
+    return {coords[j], coords[stride + j], coords[2 * stride + j]};
+}
+
+/* Storage for the batched kernel evaluations of one thread: the sources in
+ * the PointsSoA layout, a row of kernel values and the input strengths
+ * multiplied by the source weights. The vectors keep their capacity, so
+ * reusing one between calls avoids allocating each time.
+ */
+struct KernelScratch {
+    std::vector<double> src;
+    std::vector<double> row;
+    std::vector<double> strengths;
+};
+
 template <size_t dim, size_t R, size_t C>
 struct Kernel {
     typedef Vec<double,R> OutType;
@@ -15,6 +83,9 @@ struct Kernel {
 
     const static size_t n_rows = R;
     const static size_t n_cols = C;
+    // Pairs of points closer than this are treated as coincident and the
+    // kernel is zero.
+    static constexpr double min_r2 = 1e-12;
 
     OperatorType operator()(
         const Vec<double,dim>& obs_pt, 
@@ -25,7 +96,7 @@ struct Kernel {
         const auto d = src_pt - obs_pt;
         const auto r2 = dot_product(d, d);
         //TODO: 1e-12 should be dependent on length scale... 
-        if (r2 < 1e-12) {
+        if (r2 < min_r2) {
             //TODO: log something in this circumstance?
             return zeros<OperatorType>::make();
         }
@@ -35,9 +106,102 @@ struct Kernel {
     virtual OperatorType call(double r2, const Vec<double,dim>& delta, 
         const Vec<double,dim>& nobs, const Vec<double,dim>& nsrc) const = 0;
 
+    /* Evaluate the kernel between one observation point and each of a block
+     * of sources. Component (d1, d2) for source j is written to 
+     * out[(d1 * C + d2) * src.n + j]. The default calls operator() for each
+     * source; kernels override it with batched_call_row so that the loop
+     * over the sources is inlined and vectorized.
+     */
+    virtual void call_row(const Vec<double,dim>& obs_pt,
+        const Vec<double,dim>& obs_normal, const PointsSoA<dim>& src,
+        double* out) const
+    {
+        for (size_t j = 0; j < src.n; j++) {
+            Vec<double,dim> src_pt, src_normal;
+            for (size_t d = 0; d < dim; d++) {
+                src_pt[d] = src.locs[d * src.stride + j];
+                src_normal[d] = src.normals[d * src.stride + j];
+            }
+            auto val = (*this)(obs_pt, src_pt, obs_normal, src_normal);
+            for (size_t d1 = 0; d1 < R; d1++) {
+                for (size_t d2 = 0; d2 < C; d2++) {
+                    out[(d1 * C + d2) * src.n + j] = val[d1][d2];
+                }
+            }
+        }
+    }
+
     virtual std::unique_ptr<Kernel<dim,R,C>> clone() const = 0;
+
+    /* A kernel is homogeneous of degree p if K(s * delta) = s^p K(delta) for
+     * any scale s > 0. Kernels with a logarithmic term are not homogeneous.
+     * The FMM uses this to reuse translation operators between cell sizes.
+     */
+    virtual bool is_homogeneous() const {return false;}
+    virtual double homogeneity_degree() const {return 0.0;}
+
+    /* A kernel is symmetric if swapping the observation and source points
+     * and normals transposes the kernel: K(y, x, ny, nx) = K(x, y, nx, ny)^T.
+     * The FMM uses this to evaluate each near field interaction once when 
+     * the observation and source points are the same.
+     */
+    virtual bool is_symmetric() const {return false;}
 };
 
+template <size_t dim, size_t R, size_t C>
+constexpr double Kernel<dim,R,C>::min_r2;
+
+/* The loop of Kernel::call_row for a concrete kernel type. The qualified
+ * call to KernelType::call is not virtual, so the kernel is inlined into
+ * the loop over the sources and the compiler can vectorize it for whatever
+ * SIMD instructions the build targets. The loop has no branches: coincident
+ * points are evaluated at a distance of sqrt(min_r2) and then multiplied by
+ * zero. The values are first written to a tile on the stack, which the 
+ * compiler knows cannot alias the sources, and then copied to out.
+ */
+template <typename KernelType, size_t dim>
+void batched_call_row(const KernelType& K, const Vec<double,dim>& obs_pt,
+    const Vec<double,dim>& obs_normal, const PointsSoA<dim>& src, double* out)
+{
+    const size_t R = KernelType::n_rows;
+    const size_t C = KernelType::n_cols;
+    const size_t tile_size = 32;
+    const auto n = src.n;
+    const auto stride = src.stride;
+    const auto locs = src.locs;
+    const auto normals = src.normals;
+    // Local copies that the writes to out cannot alias.
+    const KernelType kernel = K;
+    const auto obs = obs_pt;
+    const auto nobs = obs_normal;
+
+    double tile[R * C][tile_size];
+    double mask[tile_size];
+    for (size_t start = 0; start < n; start += tile_size) {
+        const auto n_tile = std::min(tile_size, n - start);
+        for (size_t t = 0; t < n_tile; t++) {
+            const auto j = start + t;
+            auto delta = soa_load<dim>(locs, stride, j) - obs;
+            auto src_normal = soa_load<dim>(normals, stride, j);
+            auto r2 = dot_product(delta, delta);
+            mask[t] = static_cast<double>(r2 >= KernelType::min_r2);
+            auto val = kernel.KernelType::call(
+                std::max(r2, KernelType::min_r2), delta, nobs, src_normal
+            );
+            for (size_t d1 = 0; d1 < R; d1++) {
+                for (size_t d2 = 0; d2 < C; d2++) {
+                    tile[d1 * C + d2][t] = val[d1][d2];
+                }
+            }
+        }
+        for (size_t c = 0; c < R * C; c++) {
+            for (size_t t = 0; t < n_tile; t++) {
+                out[c * n + start + t] = mask[t] * tile[c][t];
+            }
+        }
+    }
+}
+
 
 } //End namespace tbem
 
@@ -25,10 +25,21 @@ struct LaplaceSingle<3>: Kernel<3,1,1>
         return {{{1.0 / (4.0 * M_PI * std::sqrt(r2))}}};
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<3,1,1>>(new LaplaceSingle<3>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -1.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -41,10 +52,20 @@ struct LaplaceDouble<3>: Kernel<3,1,1>
         return {{{dot_product(nsrc, delta) / (4 * M_PI * r2 * std::sqrt(r2))}}};
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<3,1,1>>(new LaplaceDouble<3>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -2.0;}
 };
 
 template <>
@@ -57,10 +78,21 @@ struct LaplaceHypersingular<3>: Kernel<3,1,1>
         return {{0}};
     }
 
+    virtual void call_row(const Vec<double,3>& obs_pt,
+        const Vec<double,3>& obs_normal, const PointsSoA<3>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<3,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<3,1,1>>(new LaplaceHypersingular<3>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -3.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -70,13 +102,22 @@ struct LaplaceSingle<2>: Kernel<2,1,1>
         const Vec<double,2>& nobs, const Vec<double,2>& nsrc) const 
     {
         (void)delta; (void)nobs; (void)nsrc;
-        return {{{std::log(std::sqrt(r2)) / (2 * M_PI)}}};
+        return {{{std::log(r2) / (4 * M_PI)}}};
+    }
+
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
     }
 
     virtual std::unique_ptr<Kernel<2,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<2,1,1>>(new LaplaceSingle<2>());
     }
+
+    virtual bool is_symmetric() const {return true;}
 };
 
 template <>
@@ -89,10 +130,20 @@ struct LaplaceDouble<2>: Kernel<2,1,1>
         return {{{dot_product(nsrc, delta) / (2 * M_PI * r2)}}};
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<2,1,1>>(new LaplaceDouble<2>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -1.0;}
 };
 
 template <>
@@ -106,10 +157,21 @@ struct LaplaceHypersingular<2>: Kernel<2,1,1>
             / (2 * M_PI)}}};
     }
 
+    virtual void call_row(const Vec<double,2>& obs_pt,
+        const Vec<double,2>& obs_normal, const PointsSoA<2>& src,
+        double* out) const
+    {
+        batched_call_row(*this, obs_pt, obs_normal, src, out);
+    }
+
     virtual std::unique_ptr<Kernel<2,1,1>> clone() const
     {
         return std::unique_ptr<Kernel<2,1,1>>(new LaplaceHypersingular<2>());
     }
+
+    virtual bool is_homogeneous() const {return true;}
+    virtual double homogeneity_degree() const {return -2.0;}
+    virtual bool is_symmetric() const {return true;}
 };
 
 } // END namespace tbem
@@ -3,6 +3,7 @@
 
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
 #include "vec.h"
 #include "kernel.h"
 #include "operator.h"
@@ -88,24 +89,27 @@ template <size_t dim, size_t R, size_t C>
 std::vector<double>
 nbody_matrix(const Kernel<dim,R,C>& K, const NBodyData<dim>& data, bool parallel = false) 
 {
-    auto n_pairs = data.obs_locs.size() * data.src_locs.size();
-    auto n_blocks = R * C;
-    std::vector<double> op(n_pairs * n_blocks);
-
-#pragma omp parallel for if(parallel)
-    for (size_t i = 0; i < data.obs_locs.size(); i++) {
-        for (size_t j = 0; j < data.src_locs.size(); j++) {
-            auto kernel_val = data.src_weights[j] * K(
-                data.obs_locs[i], data.src_locs[j],
-                data.obs_normals[i], data.src_normals[j]
-            );
+    auto n_obs = data.obs_locs.size();
+    auto n_src = data.src_locs.size();
+    std::vector<double> op(n_obs * n_src * R * C);
+    std::vector<double> src_buffer;
+    auto src = to_soa(
+        data.src_locs.data(), data.src_normals.data(), n_src, src_buffer
+    );
 
+#pragma omp parallel if(parallel)
+    {
+        std::vector<double> row(R * C * n_src);
+#pragma omp for
+        for (size_t i = 0; i < n_obs; i++) {
+            K.call_row(data.obs_locs[i], data.obs_normals[i], src, row.data());
             for (size_t d1 = 0; d1 < R; d1++) {
-                auto row = d1 * data.obs_locs.size() + i;
                 for (size_t d2 = 0; d2 < C; d2++) {
-                    auto col = d2 * data.src_locs.size() + j;
-                    auto matrix_idx = row * C * data.src_locs.size() + col;
-                    op[matrix_idx] = kernel_val[d1][d2];
+                    auto vals = &row[(d1 * C + d2) * n_src];
+                    auto op_row = &op[((d1 * n_obs + i) * C + d2) * n_src];
+                    for (size_t j = 0; j < n_src; j++) {
+                        op_row[j] = data.src_weights[j] * vals[j];
+                    }
                 }
             }
         }
@@ -114,29 +118,165 @@ nbody_matrix(const Kernel<dim,R,C>& K, const NBodyData<dim>& data, bool parallel
     return op;
 }
 
+/* A non-owning view of contiguous ranges of observation and source points.
+ * This allows evaluating interactions between parts of larger point sets
+ * without copying the points.
+ */
+template <size_t dim>
+struct NBodyView {
+    const Vec<double,dim>* obs_locs;
+    const Vec<double,dim>* obs_normals;
+    size_t n_obs;
+    const Vec<double,dim>* src_locs;
+    const Vec<double,dim>* src_normals;
+    const double* src_weights;
+    size_t n_src;
+};
+
+template <size_t dim>
+NBodyView<dim> make_view(const NBodyData<dim>& data)
+{
+    return {
+        data.obs_locs.data(), data.obs_normals.data(), data.obs_locs.size(),
+        data.src_locs.data(), data.src_normals.data(), data.src_weights.data(),
+        data.src_locs.size()
+    };
+}
+
+/* Evaluate the interaction of the sources with n_rhs sets of strengths x
+ * stored row-major, so that the strengths for each source and component are
+ * adjacent. Component d of source j has its strengths starting at 
+ * x[(d * x_stride + j) * n_rhs], so x can be a slice of a larger array. The 
+ * output is laid out the same way, with a stride of n_obs. The kernel is
+ * evaluated one observation point at a time with Kernel::call_row, and each
+ * kernel value is reused for all n_rhs vectors.
+ */
 template <size_t dim, size_t R, size_t C>
-std::vector<double>
-nbody_eval(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
-           double const* x) 
+void nbody_eval(const Kernel<dim,R,C>& K, const NBodyView<dim>& view,
+    double const* x, size_t x_stride, size_t n_rhs, double* out,
+    KernelScratch& scratch) 
 {
-    std::vector<double> out(R * data.obs_locs.size(), 0.0);
-    for (size_t i = 0; i < data.obs_locs.size(); i++) {
-        for (size_t j = 0; j < data.src_locs.size(); j++) {
-            auto kernel_val = data.src_weights[j] * K(
-                data.obs_locs[i], data.src_locs[j],
-                data.obs_normals[i], data.src_normals[j]
-            );
+    auto n_src = view.n_src;
+    auto src = to_soa(view.src_locs, view.src_normals, n_src, scratch.src);
+    scratch.row.resize(R * C * n_src);
+    auto row = scratch.row.data();
 
-            for (size_t d1 = 0; d1 < R; d1++) {
-                auto row = d1 * data.obs_locs.size() + i;
+    // The strengths times the source weights, with the sources of each 
+    // component and vector contiguous.
+    scratch.strengths.resize(C * n_rhs * n_src);
+    auto strengths = scratch.strengths.data();
+    for (size_t d2 = 0; d2 < C; d2++) {
+        for (size_t k = 0; k < n_rhs; k++) {
+            auto in = &strengths[(d2 * n_rhs + k) * n_src];
+            for (size_t j = 0; j < n_src; j++) {
+                in[j] = view.src_weights[j] * x[(d2 * x_stride + j) * n_rhs + k];
+            }
+        }
+    }
+
+    for (size_t i = 0; i < view.n_obs; i++) {
+        K.call_row(view.obs_locs[i], view.obs_normals[i], src, row);
+        for (size_t d1 = 0; d1 < R; d1++) {
+            auto out_row = &out[(d1 * view.n_obs + i) * n_rhs];
+            for (size_t k = 0; k < n_rhs; k++) {
+                // Four interleaved partial sums that are combined in a fixed
+                // order, so the sum vectorizes but a block of vectors still 
+                // gives the same results as one at a time.
+                double sums[4] = {0.0, 0.0, 0.0, 0.0};
                 for (size_t d2 = 0; d2 < C; d2++) {
-                    auto col = d2 * data.src_locs.size() + j;
-                    out[row] += kernel_val[d1][d2] * x[col];
+                    auto vals = &row[(d1 * C + d2) * n_src];
+                    auto in = &strengths[(d2 * n_rhs + k) * n_src];
+                    size_t j = 0;
+                    for (; j + 4 <= n_src; j += 4) {
+                        for (size_t l = 0; l < 4; l++) {
+                            sums[l] += vals[j + l] * in[j + l];
+                        }
+                    }
+                    for (; j < n_src; j++) {
+                        sums[0] += vals[j] * in[j];
+                    }
                 }
+                out_row[k] = (sums[0] + sums[1]) + (sums[2] + sums[3]);
             }
         }
     }
+}
+
+template <size_t dim, size_t R, size_t C>
+void nbody_eval(const Kernel<dim,R,C>& K, const NBodyView<dim>& view,
+    double const* x, size_t x_stride, size_t n_rhs, double* out) 
+{
+    KernelScratch scratch;
+    nbody_eval(K, view, x, x_stride, n_rhs, out, scratch);
+}
+
+/* The transpose of nbody_eval: y holds n_rhs sets of values at the 
+ * observation points, laid out like the x of nbody_eval with a stride of
+ * y_stride, and out receives the C components at each source, laid out with
+ * a stride of n_src. Each source's output includes its weight.
+ */
+template <size_t dim, size_t R, size_t C>
+void nbody_eval_transpose(const Kernel<dim,R,C>& K, const NBodyView<dim>& view,
+    double const* y, size_t y_stride, size_t n_rhs, double* out,
+    KernelScratch& scratch) 
+{
+    auto n_src = view.n_src;
+    auto src = to_soa(view.src_locs, view.src_normals, n_src, scratch.src);
+    scratch.row.resize(R * C * n_src);
+    auto row = scratch.row.data();
 
+    std::fill(out, out + C * n_src * n_rhs, 0.0);
+    for (size_t i = 0; i < view.n_obs; i++) {
+        K.call_row(view.obs_locs[i], view.obs_normals[i], src, row);
+        for (size_t d1 = 0; d1 < R; d1++) {
+            auto y_row = &y[(d1 * y_stride + i) * n_rhs];
+            for (size_t d2 = 0; d2 < C; d2++) {
+                auto vals = &row[(d1 * C + d2) * n_src];
+                auto out_col = &out[d2 * n_src * n_rhs];
+                for (size_t k = 0; k < n_rhs; k++) {
+                    auto yk = y_row[k];
+#pragma omp simd
+                    for (size_t j = 0; j < n_src; j++) {
+                        out_col[j * n_rhs + k] += vals[j] * yk;
+                    }
+                }
+            }
+        }
+    }
+
+    // The weights are the same for every observation point, so they are
+    // applied once at the end.
+    for (size_t d2 = 0; d2 < C; d2++) {
+        for (size_t j = 0; j < n_src; j++) {
+            for (size_t k = 0; k < n_rhs; k++) {
+                out[(d2 * n_src + j) * n_rhs + k] *= view.src_weights[j];
+            }
+        }
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void nbody_eval_transpose(const Kernel<dim,R,C>& K, const NBodyView<dim>& view,
+    double const* y, size_t y_stride, size_t n_rhs, double* out) 
+{
+    KernelScratch scratch;
+    nbody_eval_transpose(K, view, y, y_stride, n_rhs, out, scratch);
+}
+
+template <size_t dim, size_t R, size_t C>
+void nbody_eval(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+    double const* x, size_t n_rhs, double* out) 
+{
+    nbody_eval(K, make_view(data), x, data.src_locs.size(), n_rhs, out);
+}
+
+template <size_t dim, size_t R, size_t C>
+std::vector<double>
+nbody_eval(const Kernel<dim,R,C>& K, const NBodyData<dim>& data,
+           double const* x, size_t n_rhs = 1) 
+{
+    std::vector<double> out(R * data.obs_locs.size() * n_rhs);
+    nbody_eval(K, data, x, n_rhs, out.data());
     return out;
 }
 
@@ -35,12 +35,13 @@ struct NearestNeighborData {
 template <size_t dim>
 NearestNeighbor<dim> nearest_facet_brute_force(const Vec<double,dim>& pt,
     const NearestNeighborData<dim>& nn_data,
-    const std::vector<size_t>& indices)
+    const size_t* indices, size_t n_indices)
 {
     double dist_to_closest_facet = std::numeric_limits<double>::max();
     size_t closest_facet_idx = 0;
     auto nearest_pt = pt;
-    for (auto facet_idx: indices) {
+    for (size_t i = 0; i < n_indices; i++) {
+        auto facet_idx = indices[i];
         auto ball = nn_data.facet_balls[facet_idx];
         if (dist(ball.center, pt) > dist_to_closest_facet + ball.radius) {
             continue;
@@ -59,26 +60,29 @@ template <size_t dim>
 NearestNeighbor<dim> nearest_facet_brute_force(const Vec<double,dim>& pt,
     const NearestNeighborData<dim>& nn_data)
 {
-    return nearest_facet_brute_force(pt, nn_data, range(nn_data.facets.size()));
+    auto indices = range(nn_data.facets.size());
+    return nearest_facet_brute_force(pt, nn_data, indices.data(), indices.size());
 }
 
 template <size_t dim>
 NearestNeighbor<dim> nearest_facet_helper(const Vec<double,dim>& pt,
-    const NearestNeighborData<dim>& nn_data, const Octree<dim>& cell)
+    const NearestNeighborData<dim>& nn_data, const OctreeNode<dim>& cell)
 {
     if (cell.is_leaf()) {
-        return nearest_facet_brute_force(pt, nn_data, cell.indices);
+        return nearest_facet_brute_force(
+            pt, nn_data, &nn_data.oct.indices[cell.begin], cell.n_pts()
+        );
     } else {
         auto closest_child = cell.find_closest_nonempty_child(pt);
         auto recurse_closest = nearest_facet_helper(
-            pt, nn_data, *cell.children[closest_child]
+            pt, nn_data, *cell.child(closest_child)
         );
         Ball<dim> search_ball{pt, recurse_closest.distance};;
         for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
             if (c_idx == closest_child) {
                 continue;
             }
-            auto& c = cell.children[c_idx];
+            auto c = cell.child(c_idx);
             if (c == nullptr) {
                 continue;
             }
@@ -99,7 +103,7 @@ template <size_t dim>
 NearestNeighbor<dim> nearest_facet(const Vec<double,dim>& pt,
     const NearestNeighborData<dim>& nn_data)
 {
-    return nearest_facet_helper(pt, nn_data, nn_data.oct);
+    return nearest_facet_helper(pt, nn_data, nn_data.oct.root());
 }
 
 } //end namespace tbem
@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <cmath>
+#include <cstdint>
 #include <limits>
 #include <algorithm>
+#include <bitset>
 #include "octree.h"
 #include "numerics.h"
 #include "vec_ops.h"
@@ -10,44 +13,36 @@
 namespace tbem {
 
 template <size_t dim>
-size_t Octree<dim>::n_immediate_children() const {
-    size_t c = 0;
-    for (const auto& p: children) {
-        if (p != nullptr) {
-            c++;
-        }
-    }
-    return c;
+size_t OctreeNode<dim>::n_pts() const {
+    return end - begin;
 }
 
 template <size_t dim>
-size_t Octree<dim>::n_children() const {
-    size_t c = 0;
-    for (const auto& p: children) {
-        if (p != nullptr) {
-            c += 1 + p->n_children();
-        }
-    }
-    return c;
+size_t OctreeNode<dim>::n_immediate_children() const {
+    return std::bitset<split>(child_mask).count();
 }
 
 template <size_t dim>
-bool Octree<dim>::is_leaf() const {
-    for (const auto& p: children) {
-        if (p != nullptr) {
-            return false;
-        }
+bool OctreeNode<dim>::is_leaf() const {
+    return child_mask == 0;
+}
+
+template <size_t dim>
+const OctreeNode<dim>* OctreeNode<dim>::child(size_t c) const {
+    if ((child_mask & (size_t(1) << c)) == 0) {
+        return nullptr;
     }
-    return true;
+    auto before = std::bitset<split>(child_mask & ((size_t(1) << c) - 1));
+    return this + child_offset + before.count();
 }
 
 template <size_t dim>
-size_t Octree<dim>::find_closest_nonempty_child(const Vec<double,dim>& pt) const
+size_t OctreeNode<dim>::find_closest_nonempty_child(const Vec<double,dim>& pt) const
 {
     size_t closest_child = 0;
     double dist2_to_closest_child = std::numeric_limits<double>::max();
-    for (size_t c_idx = 0; c_idx < Octree<dim>::split; c_idx++) {
-        auto& c = children[c_idx];
+    for (size_t c_idx = 0; c_idx < split; c_idx++) {
+        auto c = child(c_idx);
         if (c == nullptr) {
             continue;
         }
@@ -60,6 +55,18 @@ size_t Octree<dim>::find_closest_nonempty_child(const Vec<double,dim>& pt) const
     return closest_child;
 }
 
+template <size_t dim>
+const OctreeNode<dim>& Octree<dim>::root() const {
+    return nodes[0];
+}
+
+template <size_t dim>
+size_t Octree<dim>::n_nodes() const {
+    return nodes.size();
+}
+
+template struct OctreeNode<2>;
+template struct OctreeNode<3>;
 template struct Octree<2>;
 template struct Octree<3>;
 
@@ -79,96 +86,507 @@ Vec<size_t,2> make_child_idx<2>(size_t i);
 template 
 Vec<size_t,3> make_child_idx<3>(size_t i);
 
+/* The octree is built from Morton codes. The center of each ball is
+ * quantized to morton_bits bits along each axis of the root box and the
+ * bits are interleaved, most significant first and dimension 0 first within
+ * each level. So, the digit of dim bits for level l of a code is the index
+ * of the child of the level l cell that holds the ball, in the same order as
+ * Box::find_containing_subcell. Once the codes are sorted, the balls of every
+ * cell are a contiguous range of the sorted order and the children of a cell
+ * split its range where the cell's digit changes.
+ *
+ * Only the cells that are split need their balls sorted by their digit, so
+ * the codes are not sorted up front. Instead, a cell that is split and whose
+ * range is not yet sorted by its own digit sorts the range by the digits of
+ * the next levels_per_sort levels. This is a most significant digit first
+ * radix sort that stops where the leaves are reached, and it moves each
+ * ball about depth / levels_per_sort times instead of once for each byte of
+ * the whole code.
+ *
+ * The quantization limits the depth of the tree to morton_bits levels: a
+ * cell at that level is a leaf however many balls it holds.
+ */
+template <size_t dim>
+constexpr size_t morton_bits()
+{
+    return 64 / dim;
+}
+
+/* Move bit i of x to bit dim * i. */
+template <size_t dim>
+uint64_t spread_bits(uint64_t x);
+
+template <>
+uint64_t spread_bits<2>(uint64_t x)
+{
+    x &= 0x00000000ffffffff;
+    x = (x | (x << 16)) & 0x0000ffff0000ffff;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0f;
+    x = (x | (x << 2)) & 0x3333333333333333;
+    x = (x | (x << 1)) & 0x5555555555555555;
+    return x;
+}
+
+template <>
+uint64_t spread_bits<3>(uint64_t x)
+{
+    x &= 0x00000000001fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffff;
+    x = (x | (x << 16)) & 0x001f0000ff0000ff;
+    x = (x | (x << 8)) & 0x100f00f00f00f00f;
+    x = (x | (x << 4)) & 0x10c30c30c30c30c3;
+    x = (x | (x << 2)) & 0x1249249249249249;
+    return x;
+}
+
 template <size_t dim>
-std::array<std::vector<size_t>,Octree<dim>::split> split_pts_into_children(
-    const Box<dim>& bounds, const std::vector<Ball<dim>>& pts, 
-    const std::vector<size_t>& indices)
+uint64_t morton_code(const Box<dim>& box, const Vec<double,dim>& pt)
 {
-    std::array<std::vector<size_t>,Octree<dim>::split> child_indices;
-    for (size_t i = 0; i < indices.size(); i++) {
-        auto child_idx = bounds.find_containing_subcell(pts[indices[i]].center);
-        child_indices[child_idx].push_back(indices[i]);
+    const double scale = static_cast<double>(uint64_t(1) << (morton_bits<dim>() - 1));
+    const double max_q = static_cast<double>(
+        (uint64_t(1) << (morton_bits<dim>() - 1)) * 2 - 1
+    );
+    uint64_t code = 0;
+    for (size_t d = 0; d < dim; d++) {
+        double q = 0.0;
+        if (box.half_width[d] > 0.0) {
+            // Rounding up and subtracting one puts a point that lies exactly
+            // on a cell boundary in the lower cell, like find_containing_subcell.
+            auto s = (pt[d] - box.center[d]) / box.half_width[d];
+            q = std::min(std::max(std::ceil((s + 1.0) * scale) - 1.0, 0.0), max_q);
+        }
+        code |= spread_bits<dim>(static_cast<uint64_t>(q)) << (dim - 1 - d);
     }
-    return child_indices;
+    return code;
 }
 
 template <size_t dim>
-typename Octree<dim>::ChildrenType
-build_children(const Box<dim>& bounds, 
-    const std::vector<Ball<dim>>& pts, const std::vector<size_t>& indices,
-    size_t level, size_t min_pts_per_cell, size_t& next_index) 
+size_t morton_digit(uint64_t code, size_t level)
+{
+    auto shift = dim * (morton_bits<dim>() - 1 - level);
+    return static_cast<size_t>((code >> shift) & (Octree<dim>::split - 1));
+}
+
+template <size_t dim>
+constexpr size_t levels_per_sort()
+{
+    return 8 / dim;
+}
+
+template <size_t dim>
+struct MortonOrder {
+    const std::vector<Ball<dim>>& balls;
+    // The codes and the index of the ball that each one belongs to, sorted
+    // within each cell as the cells are split.
+    std::vector<uint64_t> codes;
+    std::vector<size_t> order;
+    // Scratch space for the sorts. A range is sorted through the same range
+    // of the scratch space, so cells can be sorted in parallel.
+    std::vector<uint64_t> codes_scratch;
+    std::vector<size_t> order_scratch;
+    size_t min_pts_per_cell;
+};
+
+template <size_t dim>
+MortonOrder<dim> make_morton_order(const std::vector<Ball<dim>>& balls,
+    const Box<dim>& box, size_t min_pts_per_cell)
 {
-    typename Octree<dim>::ChildrenType children;
-    if (indices.size() <= min_pts_per_cell) {
-        return std::move(children);
+    auto n = balls.size();
+    MortonOrder<dim> sorted{
+        balls, std::vector<uint64_t>(n), range(n), std::vector<uint64_t>(n),
+        std::vector<size_t>(n), min_pts_per_cell
+    };
+#pragma omp parallel for
+    for (size_t i = 0; i < n; i++) {
+        sorted.codes[i] = morton_code(box, balls[i].center);
     }
+    return sorted;
+}
 
-    auto child_indices = split_pts_into_children(bounds, pts, indices);
+/* Sort the balls [begin, end) of a cell at level by the digits of the
+ * following levels_per_sort levels with a stable counting sort. Large
+ * ranges are counted and scattered in parallel blocks. The blocks do not
+ * depend on the number of threads, so neither does the result. Returns the
+ * first level whose digits are not sorted.
+ */
+template <size_t dim>
+size_t sort_cell(MortonOrder<dim>& sorted, size_t begin, size_t end, size_t level)
+{
+    const size_t block_size = 1 << 14;
+    auto end_level = std::min(level + levels_per_sort<dim>(), morton_bits<dim>());
+    auto shift = dim * (morton_bits<dim>() - end_level);
+    auto n_buckets = size_t(1) << (dim * (end_level - level));
+    auto n = end - begin;
+    auto n_blocks = (n + block_size - 1) / block_size;
+    auto codes = sorted.codes.data() + begin;
+    auto order = sorted.order.data() + begin;
+    auto bucket = [&] (uint64_t code) {
+        return static_cast<size_t>(code >> shift) & (n_buckets - 1);
+    };
 
-    auto child_level = level + 1;
-#pragma omp parallel for if(level == 0)
-    for (size_t i = 0; i < Octree<dim>::split; i++) {
-        if (child_indices[i].size() == 0) {
-            continue;
+    std::vector<size_t> offsets(n_blocks * n_buckets, 0);
+#pragma omp parallel for if(n_blocks > 1)
+    for (size_t b = 0; b < n_blocks; b++) {
+        auto count = &offsets[b * n_buckets];
+        auto block_end = std::min(n, (b + 1) * block_size);
+        for (size_t i = b * block_size; i < block_end; i++) {
+            count[bucket(codes[i])]++;
         }
-        auto idx = make_child_idx<dim>(i);
-        auto child_bounds = bounds.get_subcell(idx);
+    }
 
-        std::vector<Ball<dim>> tight_pts(child_indices[i].size());
-        for (size_t pt_idx = 0; pt_idx < child_indices[i].size(); pt_idx++) {
-            tight_pts[pt_idx] = pts[child_indices[i][pt_idx]];
+    // The buckets are laid out one after the other and, within a bucket, the
+    // blocks in order.
+    size_t next = 0;
+    for (size_t k = 0; k < n_buckets; k++) {
+        for (size_t b = 0; b < n_blocks; b++) {
+            auto count = offsets[b * n_buckets + k];
+            offsets[b * n_buckets + k] = next;
+            next += count;
         }
-        auto tight_bounds = Box<dim>::bounding_box(tight_pts);
+    }
 
-        auto largest_ball = std::max_element(tight_pts.begin(), tight_pts.end(),
-            [](const Ball<dim>& a, const Ball<dim>& b) {
-                return a.radius < b.radius;
+    auto codes_out = sorted.codes_scratch.data() + begin;
+    auto order_out = sorted.order_scratch.data() + begin;
+#pragma omp parallel for if(n_blocks > 1)
+    for (size_t b = 0; b < n_blocks; b++) {
+        auto position = &offsets[b * n_buckets];
+        auto block_end = std::min(n, (b + 1) * block_size);
+        for (size_t i = b * block_size; i < block_end; i++) {
+            auto& p = position[bucket(codes[i])];
+            codes_out[p] = codes[i];
+            order_out[p] = order[i];
+            p++;
+        }
+    }
+    std::copy(codes_out, codes_out + n, codes);
+    std::copy(order_out, order_out + n, order);
+    return end_level;
+}
+
+/* A cell of the tree before it becomes an Octree node: the range of the
+ * sorted balls that it holds and the corners of their tight bounding box.
+ * Cells are stored depth first, so the children of a cell follow it and
+ * n_cells, the number of cells in its subtree, skips to its next sibling.
+ */
+template <size_t dim>
+struct MortonCell {
+    size_t begin;
+    size_t end;
+    size_t level;
+    size_t n_cells;
+    Vec<double,dim> lower;
+    Vec<double,dim> upper;
+    double max_radius;
+};
+
+template <size_t dim>
+bool can_split(const MortonOrder<dim>& sorted, const MortonCell<dim>& cell)
+{
+    return cell.end - cell.begin > sorted.min_pts_per_cell &&
+        cell.level < morton_bits<dim>();
+}
+
+/* Call f(child_begin, child_end) for the range of each nonempty child of
+ * the cell at level holding the sorted balls [begin, end).
+ */
+template <size_t dim, typename F>
+void for_each_child_range(const MortonOrder<dim>& sorted, size_t begin,
+    size_t end, size_t level, const F& f)
+{
+    auto first = sorted.codes.begin() + begin;
+    auto last = sorted.codes.begin() + end;
+    while (first != last) {
+        auto digit = morton_digit<dim>(*first, level);
+        auto next = std::partition_point(first, last,
+            [&] (uint64_t code) {
+                return morton_digit<dim>(code, level) == digit;
             });
+        f(first - sorted.codes.begin(), next - sorted.codes.begin());
+        first = next;
+    }
+}
+
+template <size_t dim>
+MortonCell<dim> make_leaf_cell(const MortonOrder<dim>& sorted, size_t begin,
+    size_t end, size_t level)
+{
+    auto& first = sorted.balls[sorted.order[begin]];
+    MortonCell<dim> cell{
+        begin, end, level, 1, first.center - first.radius,
+        first.center + first.radius, first.radius
+    };
+    for (size_t i = begin + 1; i < end; i++) {
+        auto& b = sorted.balls[sorted.order[i]];
+        for (size_t d = 0; d < dim; d++) {
+            cell.lower[d] = std::min(cell.lower[d], b.center[d] - b.radius);
+            cell.upper[d] = std::max(cell.upper[d], b.center[d] + b.radius);
+        }
+        cell.max_radius = std::max(cell.max_radius, b.radius);
+    }
+    return cell;
+}
+
+template <size_t dim>
+void merge_bounds(MortonCell<dim>& cell, const MortonCell<dim>& child)
+{
+    for (size_t d = 0; d < dim; d++) {
+        cell.lower[d] = std::min(cell.lower[d], child.lower[d]);
+        cell.upper[d] = std::max(cell.upper[d], child.upper[d]);
+    }
+    cell.max_radius = std::max(cell.max_radius, child.max_radius);
+}
+
+/* Splitting a cell whose tight bounds are no wider than its largest ball
+ * along any axis would never separate the balls, so such a cell is kept as
+ * a leaf. This means that min_pts_per_cell is not a guarantee, but it is
+ * unlikely to matter for any reasonable set of points.
+ */
+template <size_t dim>
+bool is_degenerate(const MortonCell<dim>& cell)
+{
+    auto half_width = (cell.upper - cell.lower) / 2.0;
+    return !any(half_width != cell.max_radius);
+}
+
+/* Set the bounds of cells[i] from those of its children. */
+template <size_t dim>
+void merge_child_bounds(std::vector<MortonCell<dim>>& cells, size_t i)
+{
+    auto& c = cells[i];
+    c.lower = cells[i + 1].lower;
+    c.upper = cells[i + 1].upper;
+    c.max_radius = cells[i + 1].max_radius;
+    for (auto j = i + 1; j < i + c.n_cells; j += cells[j].n_cells) {
+        merge_bounds(c, cells[j]);
+    }
+}
 
-        typename Octree<dim>::ChildrenType sub_children;
-        //TODO: Documentation should be precise that min_pts_per_cell is not a 
-        //guarantee. Because of this shortcircuiting that prevents impossible
-        //infinitely subdivision, the number of pts in a cell could be larger.
-        //But, that's unlikely for any reasonable set of points.
-        if (any(tight_bounds.half_width != (*largest_ball).radius)) {
-            sub_children = build_children(
-                child_bounds, pts, child_indices[i],
-                child_level, min_pts_per_cell, next_index
-            );
-        }
-        auto expanded_tight_bounds = tight_bounds.expand_by_max_axis_multiple(1e-5);
-
-        size_t child_idx;
-#pragma omp critical 
-        {
-            child_idx = next_index;
-            next_index++;
-        }
-        children[i] = std::unique_ptr<Octree<dim>>(new Octree<dim>{
-            child_bounds, expanded_tight_bounds, child_indices[i],
-            child_level, child_idx, std::move(sub_children)
+/* Append the subtree of the cell holding the balls [begin, end) to cells.
+ * The range is sorted by the digits of the levels before sorted_level. Only
+ * the leaves look at the balls; the other cells merge the bounds of their
+ * children.
+ */
+template <size_t dim>
+void build_cells(MortonOrder<dim>& sorted, size_t begin, size_t end,
+    size_t level, size_t sorted_level, std::vector<MortonCell<dim>>& cells)
+{
+    auto i = cells.size();
+    cells.push_back({begin, end, level, 1, {}, {}, 0.0});
+    if (!can_split(sorted, cells[i])) {
+        cells[i] = make_leaf_cell(sorted, begin, end, level);
+        return;
+    }
+    if (sorted_level <= level) {
+        sorted_level = sort_cell(sorted, begin, end, level);
+    }
+    for_each_child_range(sorted, begin, end, level, [&] (size_t b, size_t e) {
+        build_cells(sorted, b, e, level + 1, sorted_level, cells);
+    });
+    cells[i].n_cells = cells.size() - i;
+    merge_child_bounds(cells, i);
+    if (is_degenerate(cells[i])) {
+        cells.resize(i + 1);
+        cells[i].n_cells = 1;
+    }
+}
+
+/* The upper levels of the tree are split off serially until the cells hold
+ * no more than grain balls. Those cells are the roots of independent
+ * subtrees that are built in parallel and then joined to the upper levels.
+ */
+template <size_t dim>
+struct MortonTree {
+    std::vector<MortonCell<dim>> top;
+    // For each cell of top, the index of the subtree rooted at it, or
+    // no_subtree if the cell was split here.
+    std::vector<size_t> subtree_of;
+    std::vector<std::vector<MortonCell<dim>>> subtrees;
+    // For each subtree, the first level whose digits are not sorted.
+    std::vector<size_t> subtree_sorted_level;
+    // Whether a cell of top is a leaf after removing degenerate cells and
+    // the number of cells in its subtree after joining.
+    std::vector<bool> is_leaf;
+    std::vector<size_t> n_cells;
+};
+
+const size_t no_subtree = std::numeric_limits<size_t>::max();
+
+template <size_t dim>
+void build_top(MortonOrder<dim>& sorted, size_t begin, size_t end,
+    size_t level, size_t sorted_level, size_t grain, MortonTree<dim>& tree)
+{
+    auto i = tree.top.size();
+    tree.top.push_back({begin, end, level, 1, {}, {}, 0.0});
+    tree.subtree_of.push_back(no_subtree);
+    if (level > 0 && end - begin <= grain) {
+        tree.subtree_of[i] = tree.subtrees.size();
+        tree.subtrees.emplace_back();
+        tree.subtree_sorted_level.push_back(sorted_level);
+        return;
+    }
+    if (can_split(sorted, tree.top[i])) {
+        if (sorted_level <= level) {
+            sorted_level = sort_cell(sorted, begin, end, level);
+        }
+        for_each_child_range(sorted, begin, end, level, [&] (size_t b, size_t e) {
+            build_top(sorted, b, e, level + 1, sorted_level, grain, tree);
         });
     }
-    return std::move(children);
+    tree.top[i].n_cells = tree.top.size() - i;
 }
 
 template <size_t dim>
-Octree<dim> make_octree(const std::vector<Ball<dim>>& pts, size_t min_pts_per_cell)
+MortonTree<dim> build_morton_tree(MortonOrder<dim>& sorted)
+{
+    auto n = sorted.codes.size();
+    auto grain = std::max(sorted.min_pts_per_cell, std::max<size_t>(n / 256, 1024));
+
+    MortonTree<dim> tree;
+    build_top(sorted, 0, n, 0, 0, grain, tree);
+
+    std::vector<size_t> roots;
+    for (size_t i = 0; i < tree.top.size(); i++) {
+        if (tree.subtree_of[i] != no_subtree) {
+            roots.push_back(i);
+        }
+    }
+#pragma omp parallel for schedule(dynamic)
+    for (size_t r = 0; r < roots.size(); r++) {
+        auto& c = tree.top[roots[r]];
+        build_cells(
+            sorted, c.begin, c.end, c.level, tree.subtree_sorted_level[r],
+            tree.subtrees[r]
+        );
+    }
+
+    // Children follow their parents, so a reverse sweep sees the children
+    // of a cell before the cell.
+    tree.is_leaf.resize(tree.top.size());
+    tree.n_cells.resize(tree.top.size());
+    for (auto i = tree.top.size(); i-- > 0;) {
+        auto& c = tree.top[i];
+        if (tree.subtree_of[i] != no_subtree) {
+            auto& root = tree.subtrees[tree.subtree_of[i]][0];
+            c.lower = root.lower;
+            c.upper = root.upper;
+            c.max_radius = root.max_radius;
+            tree.is_leaf[i] = root.n_cells == 1;
+            tree.n_cells[i] = root.n_cells;
+            continue;
+        }
+        tree.n_cells[i] = 1;
+        if (c.n_cells == 1) {
+            // Only an empty root or a cell at the deepest level ends here.
+            if (c.end > c.begin) {
+                c = make_leaf_cell(sorted, c.begin, c.end, c.level);
+            }
+            tree.is_leaf[i] = true;
+            continue;
+        }
+        merge_child_bounds(tree.top, i);
+        for (auto j = i + 1; j < i + c.n_cells; j += tree.top[j].n_cells) {
+            tree.n_cells[i] += tree.n_cells[j];
+        }
+        tree.is_leaf[i] = c.level > 0 && is_degenerate(c);
+        if (tree.is_leaf[i]) {
+            tree.n_cells[i] = 1;
+        }
+    }
+    return tree;
+}
+
+template <size_t dim>
+Box<dim> tight_bounds(const MortonCell<dim>& cell)
+{
+    Box<dim> box{(cell.upper + cell.lower) / 2.0, (cell.upper - cell.lower) / 2.0};
+    return box.expand_by_max_axis_multiple(1e-5);
+}
+
+/* A cell of a MortonTree: cell i of top if subtree is no_subtree and
+ * otherwise cell i of that subtree.
+ */
+struct MortonCellRef {
+    size_t subtree;
+    size_t i;
+};
+
+template <size_t dim>
+const MortonCell<dim>& get_cell(const MortonTree<dim>& tree, const MortonCellRef& ref)
+{
+    if (ref.subtree == no_subtree) {
+        return tree.top[ref.i];
+    }
+    return tree.subtrees[ref.subtree][ref.i];
+}
+
+/* Append the children of a cell to out in the order of their digits. */
+template <size_t dim>
+void append_children(const MortonTree<dim>& tree, MortonCellRef ref,
+    std::vector<MortonCellRef>& out)
+{
+    if (ref.subtree == no_subtree) {
+        if (tree.subtree_of[ref.i] == no_subtree) {
+            if (tree.is_leaf[ref.i]) {
+                return;
+            }
+            auto& c = tree.top[ref.i];
+            for (auto j = ref.i + 1; j < ref.i + c.n_cells; j += tree.top[j].n_cells) {
+                out.push_back({no_subtree, j});
+            }
+            return;
+        }
+        ref = {tree.subtree_of[ref.i], 0};
+    }
+    auto& cells = tree.subtrees[ref.subtree];
+    auto end = ref.i + cells[ref.i].n_cells;
+    for (auto j = ref.i + 1; j < end; j += cells[j].n_cells) {
+        out.push_back({ref.subtree, j});
+    }
+}
+
+template <size_t dim>
+Octree<dim> make_octree(const std::vector<Ball<dim>>& pts, size_t min_pts_per_cell,
+    const Box<dim>& box)
 {
     assert(min_pts_per_cell > 0);
-    auto box = Box<dim>::bounding_box(pts);
+    auto sorted = make_morton_order(pts, box, min_pts_per_cell);
+    auto tree = build_morton_tree(sorted);
+
+    // Lay the cells out breadth first. queue[k] is the cell of node k.
+    Octree<dim> oct{std::move(sorted.order), {}};
+    oct.nodes.reserve(tree.n_cells[0]);
     auto expanded_box = box.expand_by_max_axis_multiple(1e-5);
-    auto all_indices = range(pts.size());
-    size_t next_index = 1;
-    auto children = build_children(
-        box, pts, all_indices, 0, min_pts_per_cell, next_index
-    );
-    // for (size_t i = 0; i < all_indices.size(); i++) {
-    //     std::cout << all_indices[i] << std::endl;
-    // }
-    return Octree<dim>{
-        expanded_box, expanded_box, all_indices, 0, 0, std::move(children)
-    };
+    oct.nodes.push_back({expanded_box, expanded_box, 0, pts.size(), 0, 0, 0, 0});
+    std::vector<MortonCellRef> queue{{no_subtree, 0}};
+    std::vector<MortonCellRef> children;
+    for (size_t k = 0; k < queue.size(); k++) {
+        children.clear();
+        append_children(tree, queue[k], children);
+        if (children.empty()) {
+            continue;
+        }
+        // The root is split before its bounds are expanded.
+        auto parent_bounds = (k == 0) ? box : oct.nodes[k].bounds;
+        oct.nodes[k].child_offset = oct.nodes.size() - k;
+        for (auto& ref: children) {
+            auto& c = get_cell(tree, ref);
+            auto child = morton_digit<dim>(sorted.codes[c.begin], c.level - 1);
+            oct.nodes[k].child_mask |= size_t(1) << child;
+            oct.nodes.push_back({
+                parent_bounds.get_subcell(make_child_idx<dim>(child)),
+                tight_bounds(c), c.begin, c.end, c.level, oct.nodes.size(), 0, 0
+            });
+            queue.push_back(ref);
+        }
+    }
+    return oct;
+}
+
+template <size_t dim>
+Octree<dim> make_octree(const std::vector<Ball<dim>>& pts, size_t min_pts_per_cell)
+{
+    return make_octree(pts, min_pts_per_cell, Box<dim>::bounding_box(pts));
 }
 
 template <size_t dim>
@@ -179,6 +597,14 @@ Octree<dim> make_octree(const std::vector<Vec<double,dim>>& pts,
     return make_octree(bs, min_pts_per_cell);
 }
 
+template <size_t dim>
+Octree<dim> make_octree(const std::vector<Vec<double,dim>>& pts,
+    size_t min_pts_per_cell, const Box<dim>& box)
+{
+    auto bs = balls_from_centers_radii(pts, std::vector<double>(pts.size(), 0.0));
+    return make_octree(bs, min_pts_per_cell, box);
+}
+
 template 
 Octree<2>
 make_octree(const std::vector<Ball<2>>& pts, size_t min_pts_per_cell);
@@ -191,5 +617,13 @@ make_octree(const std::vector<Vec<double,2>>& pts, size_t min_pts_per_cell);
 template 
 Octree<3>
 make_octree(const std::vector<Vec<double,3>>& pts, size_t min_pts_per_cell);
+template 
+Octree<2>
+make_octree(const std::vector<Vec<double,2>>& pts, size_t min_pts_per_cell,
+    const Box<2>& box);
+template 
+Octree<3>
+make_octree(const std::vector<Vec<double,3>>& pts, size_t min_pts_per_cell,
+    const Box<3>& box);
 
 } // END namespace tbem
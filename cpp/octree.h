@@ -1,9 +1,7 @@
 #ifndef TBEM_12312312_OCTREE_H
 #define TBEM_12312312_OCTREE_H
 
-#include <array>
 #include <vector>
-#include <memory>
 #include "vec.h"
 
 namespace tbem { 
@@ -11,23 +9,46 @@ namespace tbem {
 template <size_t dim> struct Ball;
 template <size_t dim> struct Box;
 
+/* A cell of an Octree. The nodes of a tree live in one array and the
+ * nonempty children of a node are consecutive entries of it, so a node finds
+ * its children without pointers: bit c of child_mask is set if child c
+ * exists, and the first existing child is child_offset entries after the
+ * node. The points in the cell are Octree::indices[begin, end).
+ */
 template <size_t dim>
-struct Octree {
+struct OctreeNode {
     static const size_t split = 2<<(dim-1);
-    typedef std::array<std::unique_ptr<Octree<dim>>,split> ChildrenType;
     const Box<dim> bounds;
     const Box<dim> true_bounds;
-    const std::vector<size_t> indices;
+    const size_t begin;
+    const size_t end;
     const size_t level;
     const size_t index;
-    ChildrenType children;
+    size_t child_offset;
+    size_t child_mask;
 
+    size_t n_pts() const;
     size_t n_immediate_children() const; 
-    size_t n_children() const; 
     bool is_leaf() const; 
+    const OctreeNode<dim>* child(size_t c) const;
     size_t find_closest_nonempty_child(const Vec<double,dim>& pt) const;
 };
 
+/* The nodes are in breadth first order, so nodes[0] is the root, a node's
+ * index is its position and the nodes of each level are contiguous. The 
+ * points are ordered depth first (Morton order): indices[i] is the original
+ * index of the i-th point in that order.
+ */
+template <size_t dim>
+struct Octree {
+    static const size_t split = OctreeNode<dim>::split;
+    std::vector<size_t> indices;
+    std::vector<OctreeNode<dim>> nodes;
+
+    const OctreeNode<dim>& root() const;
+    size_t n_nodes() const;
+};
+
 template <size_t dim>
 Vec<size_t,dim> make_child_idx(size_t i);
 
@@ -39,5 +60,14 @@ template <size_t dim>
 Octree<dim> 
 make_octree(const std::vector<Vec<double,dim>>& pts, size_t min_pts_per_cell);
 
+/* Subdivide box, which must contain all the points, instead of the bounding
+ * box of the points. Trees built in the same box have cells of the same 
+ * size on each level.
+ */
+template <size_t dim>
+Octree<dim> 
+make_octree(const std::vector<Vec<double,dim>>& pts, size_t min_pts_per_cell,
+    const Box<dim>& box);
+
 } // END namespace tbem
 #endif
@@ -16,6 +16,27 @@ struct OperatorI {
     virtual size_t n_cols() const = 0;
     virtual std::vector<double> apply(const std::vector<double>& x) const = 0;
     virtual std::unique_ptr<OperatorI> clone() const = 0;
+
+    /* Apply the transpose of the operator, mapping a vector of length 
+     * n_rows() to a vector of length n_cols(). Needed by least squares 
+     * solvers like LSQR and by adjoint methods.
+     */
+    virtual std::vector<double> apply_transpose(
+        const std::vector<double>& y) const = 0;
+
+    /* Apply the operator to each of the vectors in xs. Operators that can 
+     * share work between the vectors should override this.
+     */
+    virtual std::vector<std::vector<double>> apply_block(
+        const std::vector<std::vector<double>>& xs) const 
+    {
+        std::vector<std::vector<double>> out;
+        out.reserve(xs.size());
+        for (auto& x: xs) {
+            out.push_back(apply(x));
+        }
+        return out;
+    }
 };
 
 } // end namespace tbem
@@ -111,6 +111,21 @@ std::vector<double> RowZeroDistributor::apply(const std::vector<double>& x) cons
     return out;
 }
 
+std::vector<double> RowZeroDistributor::apply_transpose(
+    const std::vector<double>& y) const
+{
+    // The zero rows are columns of zeros in the transpose, so their entries
+    // are dropped.
+    std::vector<double> intermediate;
+    intermediate.reserve(wrapped_op->n_rows());
+    for (size_t i = 0; i < n_rows(); i++) {
+        if (ignored_rows.count(i) == 0) {
+            intermediate.push_back(y[i]);
+        }
+    }
+    return wrapped_op->apply_transpose(intermediate);
+}
+
 std::unique_ptr<OperatorI> RowZeroDistributor::clone() const
 {
     return std::unique_ptr<OperatorI>(new RowZeroDistributor(
@@ -27,6 +27,7 @@ struct RowZeroDistributor: public OperatorI
     virtual size_t n_rows() const;
     virtual size_t n_cols() const;
     virtual std::vector<double> apply(const std::vector<double>& x) const;
+    virtual std::vector<double> apply_transpose(const std::vector<double>& y) const;
     virtual std::unique_ptr<OperatorI> clone() const;
 };
 
@@ -27,6 +27,16 @@ std::vector<double> SparseOperator::apply(const std::vector<double>& x) const
     return out;
 }
 
+std::vector<double> SparseOperator::apply_transpose(const std::vector<double>& y) const 
+{
+    std::vector<double> out(n_cols(), 0.0);
+    for (size_t i = 0; i < row_ptrs.size() - 1; i++) {
+        for (size_t c_idx = row_ptrs[i]; c_idx < row_ptrs[i + 1]; c_idx++) {
+            out[column_indices[c_idx]] += values[c_idx] * y[i];
+        }
+    }
+    return out;
+}
 
 DenseOperator SparseOperator::to_dense() const
 {
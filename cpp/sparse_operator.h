@@ -35,6 +35,7 @@ struct SparseOperator: public OperatorI
     size_t nnz() const {return row_ptrs.back();}
 
     virtual std::vector<double> apply(const std::vector<double>& x) const;
+    virtual std::vector<double> apply_transpose(const std::vector<double>& y) const;
     DenseOperator to_dense() const; 
 
     virtual std::unique_ptr<OperatorI> clone() const;
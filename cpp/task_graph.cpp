@@ -0,0 +1,81 @@
+#include "task_graph.h"
+#include <atomic>
+#include <memory>
+#include <cassert>
+
+namespace tbem {
+
+size_t TaskGraph::add_task() 
+{
+    successors.push_back({});
+    n_dependencies.push_back(0);
+    return successors.size() - 1;
+}
+
+void TaskGraph::add_dependency(size_t before, size_t after) 
+{
+    assert(before < size());
+    assert(after < size());
+    successors[before].push_back(after);
+    n_dependencies[after]++;
+}
+
+size_t TaskGraph::size() const 
+{
+    return successors.size();
+}
+
+TaskGraph TaskGraph::reversed() const
+{
+    TaskGraph out;
+    for (size_t i = 0; i < size(); i++) {
+        out.add_task();
+    }
+    for (size_t i = 0; i < size(); i++) {
+        for (auto s: successors[i]) {
+            out.add_dependency(s, i);
+        }
+    }
+    return out;
+}
+
+void run_and_release(const TaskGraph* graph, std::atomic<size_t>* remaining,
+    const std::function<void(size_t)>* run_task, size_t task)
+{
+    (*run_task)(task);
+    for (auto s: graph->successors[task]) {
+        // The last dependency to finish is responsible for launching the
+        // successor.
+        if (--remaining[s] == 0) {
+#pragma omp task firstprivate(graph, remaining, run_task, s)
+            run_and_release(graph, remaining, run_task, s);
+        }
+    }
+}
+
+void TaskGraph::execute(const std::function<void(size_t)>& run_task) const
+{
+    std::unique_ptr<std::atomic<size_t>[]> remaining(
+        new std::atomic<size_t>[size()]
+    );
+    for (size_t i = 0; i < size(); i++) {
+        remaining[i] = n_dependencies[i];
+    }
+
+    auto graph = this;
+    auto remaining_ptr = remaining.get();
+    auto run_task_ptr = &run_task;
+#pragma omp parallel
+#pragma omp single
+    {
+        for (size_t i = 0; i < size(); i++) {
+            if (n_dependencies[i] != 0) {
+                continue;
+            }
+#pragma omp task firstprivate(graph, remaining_ptr, run_task_ptr, i)
+            run_and_release(graph, remaining_ptr, run_task_ptr, i);
+        }
+    }
+}
+
+} // end namespace tbem
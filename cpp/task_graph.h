@@ -0,0 +1,44 @@
+#ifndef TBEMPQOWIEURYTASKGRAPH_H
+#define TBEMPQOWIEURYTASKGRAPH_H
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+namespace tbem {
+
+/* A directed acyclic graph of tasks. Tasks are identified by the index 
+ * returned from add_task. A task becomes runnable as soon as all the tasks
+ * it depends on have finished, so independent work from different stages
+ * of an algorithm can overlap instead of waiting on a barrier between 
+ * stages.
+ *
+ * The graph only stores the dependency structure. The work itself is passed
+ * to execute, which lets the same graph be built once and run many times
+ * with different data.
+ */
+struct TaskGraph {
+    std::vector<std::vector<size_t>> successors;
+    std::vector<size_t> n_dependencies;
+
+    size_t add_task();
+    void add_dependency(size_t before, size_t after);
+    size_t size() const;
+
+    /* The same tasks with every dependency reversed, so that each task runs
+     * after the tasks that depended on it. Running the transpose of a 
+     * linear algorithm needs this order.
+     */
+    TaskGraph reversed() const;
+
+    /* Run every task in the graph by calling run_task with the task index.
+     * Tasks are scheduled as OpenMP tasks, so idle threads pick up whatever
+     * work is ready. run_task must be safe to call concurrently for tasks 
+     * that do not depend on each other.
+     */
+    void execute(const std::function<void(size_t)>& run_task) const;
+};
+
+} // end namespace tbem
+
+#endif
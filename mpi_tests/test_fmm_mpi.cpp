@@ -0,0 +1,231 @@
+#include "catch.hpp"
+#include "fmm_mpi.h"
+#include "geometry.h"
+#include "laplace_kernels.h"
+#include "elastic_kernels.h"
+#include "util.h"
+#include <cmath>
+
+using namespace tbem;
+
+/* Concatenate the vectors held by all the ranks, in rank order. */
+std::vector<double> all_gather(const std::vector<double>& vals)
+{
+    int n_ranks;
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+    int n = vals.size();
+    std::vector<int> counts(n_ranks);
+    MPI_Allgather(&n, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+    std::vector<int> displs(n_ranks, 0);
+    for (int i = 1; i < n_ranks; i++) {
+        displs[i] = displs[i - 1] + counts[i - 1];
+    }
+    std::vector<double> out(displs.back() + counts.back());
+    MPI_Allgatherv(
+        vals.data(), n, MPI_DOUBLE, out.data(), counts.data(), displs.data(),
+        MPI_DOUBLE, MPI_COMM_WORLD
+    );
+    return out;
+}
+
+template <size_t dim>
+std::vector<Vec<double,dim>> all_gather(const std::vector<Vec<double,dim>>& pts)
+{
+    std::vector<double> flat;
+    for (auto& p: pts) {
+        flat.insert(flat.end(), p.begin(), p.end());
+    }
+    auto all_flat = all_gather(flat);
+    std::vector<Vec<double,dim>> out(all_flat.size() / dim);
+    for (size_t i = 0; i < out.size(); i++) {
+        for (size_t d = 0; d < dim; d++) {
+            out[i][d] = all_flat[i * dim + d];
+        }
+    }
+    return out;
+}
+
+/* Compare the distributed FMM against a direct sum over the sources of all
+ * the ranks. Every rank checks its own observation points and the largest
+ * error over all the ranks is returned.
+ */
+template <size_t dim, size_t R, size_t C>
+double distributed_error(const NBodyData<dim>& data, const Kernel<dim,R,C>& K,
+    const FMMConfig& config)
+{
+    auto x = random_list(C * data.src_locs.size());
+    DistributedFMMOperator<dim,R,C> op(K, data, config);
+    auto out = op.apply(x);
+    REQUIRE(out.size() == R * data.obs_locs.size());
+
+    // The strengths are stored by component, so each component is gathered
+    // separately.
+    auto n_src = data.src_locs.size();
+    std::vector<double> all_x;
+    size_t n_all_src = 0;
+    for (size_t d = 0; d < C; d++) {
+        auto component = all_gather(std::vector<double>(
+            x.begin() + d * n_src, x.begin() + (d + 1) * n_src
+        ));
+        all_x.insert(all_x.end(), component.begin(), component.end());
+        n_all_src = component.size();
+    }
+    NBodyData<dim> all_data{
+        data.obs_locs, data.obs_normals, all_gather(data.src_locs),
+        all_gather(data.src_normals), all_gather(data.src_weights)
+    };
+    REQUIRE(all_data.src_locs.size() == n_all_src);
+    auto exact = nbody_eval(K, all_data, all_x.data());
+
+    double average_magnitude = 0.0;
+    for (auto v: exact) {
+        average_magnitude += std::fabs(v);
+    }
+    double n_vals = exact.size();
+    MPI_Allreduce(
+        MPI_IN_PLACE, &average_magnitude, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD
+    );
+    MPI_Allreduce(MPI_IN_PLACE, &n_vals, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    average_magnitude /= n_vals;
+
+    double max_error = 0.0;
+    for (size_t i = 0; i < exact.size(); i++) {
+        auto error = std::fabs(out[i] - exact[i]) /
+            std::max(std::fabs(exact[i]), average_magnitude);
+        max_error = std::max(max_error, error);
+    }
+    MPI_Allreduce(
+        MPI_IN_PLACE, &max_error, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD
+    );
+    return max_error;
+}
+
+template <size_t dim>
+NBodyData<dim> random_data(size_t n_obs, size_t n_src)
+{
+    return NBodyData<dim>{
+        random_pts<dim>(n_obs), random_pts<dim>(n_obs),
+        random_pts<dim>(n_src), random_pts<dim>(n_src),
+        random_list(n_src, 0.5, 1.5)
+    };
+}
+
+TEST_CASE("Morton keys", "[fmm_mpi]")
+{
+    Box<2> unit{{0.5, 0.5}, {0.5, 0.5}};
+    auto a = morton_key(Vec<double,2>{0.1, 0.1}, unit);
+    auto b = morton_key(Vec<double,2>{0.9, 0.1}, unit);
+    auto c = morton_key(Vec<double,2>{0.1, 0.9}, unit);
+    auto d = morton_key(Vec<double,2>{0.9, 0.9}, unit);
+    // The first coordinate is the most significant.
+    REQUIRE(a < c);
+    REQUIRE(c < b);
+    REQUIRE(b < d);
+    REQUIRE(morton_key(Vec<double,2>{0.0, 0.0}, unit) == 0);
+    REQUIRE(morton_key(Vec<double,2>{-1.0, -1.0}, unit) == 0);
+    REQUIRE(morton_key(Vec<double,2>{1.0, 1.0}, unit) == (uint64_t(1) << 62) - 1);
+}
+
+TEST_CASE("Morton splitters balance the ranks", "[fmm_mpi]")
+{
+    int rank;
+    int n_ranks;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+
+    // Every rank holds a different number of keys.
+    size_t n = 1000 * (rank + 1);
+    auto vals = random_list(n, 0, 1e12);
+    std::vector<uint64_t> keys(vals.begin(), vals.end());
+    auto splitters = morton_splitters(MPI_COMM_WORLD, keys);
+    REQUIRE(splitters.size() == static_cast<size_t>(n_ranks - 1));
+
+    std::vector<int> counts(n_ranks, 0);
+    for (auto k: keys) {
+        counts[std::upper_bound(splitters.begin(), splitters.end(), k) -
+            splitters.begin()]++;
+    }
+    MPI_Allreduce(
+        MPI_IN_PLACE, counts.data(), n_ranks, MPI_INT, MPI_SUM, MPI_COMM_WORLD
+    );
+    int total = 1000 * n_ranks * (n_ranks + 1) / 2;
+    for (auto c: counts) {
+        REQUIRE(std::fabs(c - total / double(n_ranks)) < 0.2 * total / n_ranks);
+    }
+}
+
+TEST_CASE("Distributed FMM 2D", "[fmm_mpi]")
+{
+    auto data = random_data<2>(400, 400);
+    REQUIRE(distributed_error(
+        data, ElasticHypersingular<2>(30e9, 0.25), {0.3, 30, 20, 0.05, true}
+    ) < 1e-4);
+    REQUIRE(distributed_error(
+        data, LaplaceSingle<2>(), {0.3, 30, 20, 0.05, true}
+    ) < 1e-4);
+}
+
+TEST_CASE("Distributed FMM 3D", "[fmm_mpi]")
+{
+    auto data = random_data<3>(400, 400);
+    REQUIRE(distributed_error(
+        data, LaplaceDouble<3>(), {0.3, 75, 20, 0.05, true}
+    ) < 1e-4);
+}
+
+TEST_CASE("Distributed FMM with the points on one rank", "[fmm_mpi]")
+{
+    // Every point starts on rank 0 and is moved to its owner.
+    int rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    size_t n = (rank == 0) ? 1500 : 0;
+    auto data = random_data<2>(n, n);
+    REQUIRE(distributed_error(
+        data, LaplaceDouble<2>(), {0.3, 30, 20, 0.05, true}
+    ) < 1e-4);
+}
+
+TEST_CASE("Distributed symmetric FMM", "[fmm_mpi]")
+{
+    auto pts = random_pts<2>(500);
+    auto normals = random_pts<2>(500);
+    NBodyData<2> data{pts, normals, pts, normals, std::vector<double>(500, 1.0)};
+    REQUIRE(distributed_error(
+        data, LaplaceSingle<2>(), {0.3, 30, 20, 0.05, true}
+    ) < 1e-4);
+}
+
+TEST_CASE("Distributed FMM with a single precision far field", "[fmm_mpi]")
+{
+    auto data = random_data<2>(400, 400);
+    FMMConfig config(0.3, 30, 20, 0.05, true, true, true, true);
+    REQUIRE(distributed_error(data, LaplaceDouble<2>(), config) < 1e-3);
+}
+
+TEST_CASE("Locally essential trees", "[fmm_mpi]")
+{
+    int n_ranks;
+    MPI_Comm_size(MPI_COMM_WORLD, &n_ranks);
+    size_t n = 5000;
+    auto data = random_data<2>(n, n);
+    LaplaceDouble<2> K;
+    DistributedFMMOperator<2,1,1> op(K, data, {0.3, 30, 20, 0.05, true});
+
+    // With more than one rank, the distant cells of the other ranks arrive
+    // as multipoles, so the ranks receive fewer ghost sources than there are
+    // sources on the other ranks.
+    unsigned long long counts[2] = {0, 0};
+    for (int r = 0; r < n_ranks; r++) {
+        counts[0] += op.ghost_cells[r].size();
+        counts[1] += op.ghost_recv_counts[r];
+    }
+    MPI_Allreduce(
+        MPI_IN_PLACE, counts, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, MPI_COMM_WORLD
+    );
+    if (n_ranks > 1) {
+        REQUIRE(counts[0] > 0);
+        REQUIRE(counts[1] < n * (n_ranks - 1) * n_ranks);
+    } else {
+        REQUIRE(counts[1] == 0);
+    }
+}
@@ -0,0 +1,13 @@
+// Catch's main, wrapped in MPI_Init and MPI_Finalize. Every rank runs every
+// test, so the tests must make the same collective calls on all the ranks.
+#define CATCH_CONFIG_RUNNER
+#include "catch.hpp"
+#include <mpi.h>
+
+int main(int argc, char* argv[])
+{
+    MPI_Init(&argc, &argv);
+    int result = Catch::Session().run(argc, argv);
+    MPI_Finalize();
+    return result;
+}
@@ -71,13 +71,15 @@ void export_dimension() {
     auto integral_op_scalar = p::class_<
         IntegralOperator<dim,1,1>, p::bases<OperatorI>>(
             "IntegralOperatorScalar", p::no_init)
-        .def_readonly("nearfield", &IntegralOperator<dim,1,1>::nearfield);
+        .def_readonly("nearfield", &IntegralOperator<dim,1,1>::nearfield)
+        .def("fmm_stats", &IntegralOperator<dim,1,1>::fmm_stats);
     export_operator<IntegralOperator<dim,1,1>>(integral_op_scalar);
 
     auto integral_op_tensor = p::class_<
         IntegralOperator<dim,dim,dim>, p::bases<OperatorI>>(
             "IntegralOperatorTensor", p::no_init)
-        .def_readonly("nearfield", &IntegralOperator<dim,dim,dim>::nearfield);
+        .def_readonly("nearfield", &IntegralOperator<dim,dim,dim>::nearfield)
+        .def("fmm_stats", &IntegralOperator<dim,dim,dim>::fmm_stats);
     export_operator<IntegralOperator<dim,dim,dim>>(integral_op_tensor);
 
     p::def("boundary_operator", boundary_operator<dim,1,1>);
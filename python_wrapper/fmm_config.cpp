@@ -4,5 +4,41 @@
 void export_fmm_config() {
     using namespace boost::python;
     using namespace tbem;
-    class_<FMMConfig>("FMMConfig", init<double,size_t,size_t,double,bool>());
+    class_<FMMConfig>("FMMConfig", 
+        init<double,size_t,size_t,double,bool,optional<bool,bool,bool,std::string,bool>>((
+            arg("mac"), arg("order"), arg("min_pts_per_cell"), arg("d"),
+            arg("account_for_small_cells"), arg("owner_computes") = true,
+            arg("use_fmm") = true, arg("float_farfield") = false,
+            arg("precompute_cache_dir") = "", arg("fft_m2l") = false
+        )))
+        .def_readonly("mac", &FMMConfig::mac)
+        .def_readonly("order", &FMMConfig::order)
+        .def_readonly("min_pts_per_cell", &FMMConfig::min_pts_per_cell)
+        .def_readonly("d", &FMMConfig::d)
+        .def_readonly("account_for_small_cells", &FMMConfig::account_for_small_cells)
+        .def_readonly("owner_computes", &FMMConfig::owner_computes)
+        .def_readonly("use_fmm", &FMMConfig::use_fmm)
+        .def_readonly("float_farfield", &FMMConfig::float_farfield)
+        .def_readonly("precompute_cache_dir", &FMMConfig::precompute_cache_dir)
+        .def_readonly("fft_m2l", &FMMConfig::fft_m2l);
+
+    // The vectors are converted to numpy arrays, so they are returned by 
+    // value.
+    auto by_value = return_value_policy<return_by_value>();
+    class_<FMMStats>("FMMStats")
+        .def_readonly("src_tree_depth", &FMMStats::src_tree_depth)
+        .def_readonly("obs_tree_depth", &FMMStats::obs_tree_depth)
+        .add_property("src_leaf_size_histogram",
+            make_getter(&FMMStats::src_leaf_size_histogram, by_value))
+        .add_property("obs_leaf_size_histogram",
+            make_getter(&FMMStats::obs_leaf_size_histogram, by_value))
+        .def_readonly("n_applies", &FMMStats::n_applies)
+        .def_readonly("n_rhs", &FMMStats::n_rhs)
+        .def_readonly("apply_time", &FMMStats::apply_time)
+        .add_property("n_tasks", make_getter(&FMMStats::n_tasks, by_value))
+        .add_property("n_kernel_evals",
+            make_getter(&FMMStats::n_kernel_evals, by_value))
+        .add_property("phase_time", make_getter(&FMMStats::phase_time, by_value))
+        .add_property("thread_time", make_getter(&FMMStats::thread_time, by_value))
+        .def_readonly("temporary_bytes", &FMMStats::temporary_bytes);
 }
@@ -5,6 +5,7 @@ template <typename T, typename BPObj>
 void export_operator(BPObj& class_obj)
 {
    auto c = class_obj.def("apply", &T::apply)
+        .def("apply_transpose", &T::apply_transpose)
         .def("n_rows", &T::n_rows)
         .def("n_cols", &T::n_cols)
         .def("clone", &T::clone);
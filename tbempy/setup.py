@@ -122,11 +122,25 @@ def get_extension_config():
     link_args = [
         '-fopenmp'
     ]
+    # The distributed FMM (cpp/fmm_mpi.h) is only compiled with TBEM_USE_MPI
+    # set in the environment, which also needs CXX set to an MPI compiler
+    # wrapper like mpicxx.
+    if os.environ.get('TBEM_USE_MPI'):
+        compile_args.append('-DTBEM_USE_MPI')
     includes = ['cpp', 'lib', os.path.join('lib', 'gte', 'Include')]
 
     build_type = 'release'
     if build_type is 'release':
-        compile_args.extend(['-O3'])
+        # Nothing reads errno or the floating point exception flags, and
+        # without them sqrt and division in the batched kernel loops
+        # (batched_call_row in cpp/kernel.h) can be vectorized.
+        compile_args.extend(['-O3', '-fno-math-errno', '-fno-trapping-math'])
+        # The kernel loops use whatever SIMD instructions the compiler
+        # targets, so building with TBEM_NATIVE_ARCH set in the environment
+        # uses AVX2 or AVX-512 where the build machine has them. The
+        # resulting library only runs on machines like the build machine.
+        if os.environ.get('TBEM_NATIVE_ARCH'):
+            compile_args.append('-march=native')
     elif build_type is 'debug':
         compile_args.extend(['-O0', '-g'])
 
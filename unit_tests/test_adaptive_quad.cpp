@@ -43,3 +43,17 @@ TEST_CASE("AdaptiveQuadTensor", "[quadrature]") {
     }};
     REQUIRE_ARRAY_CLOSE((double*)(&result[0]), (double*)(&correct[0]), 4, 1e-12);
 }
+
+TEST_CASE("AdaptiveQuadBatched", "[quadrature]") {
+    auto f = [] (double x) { return 1.0 / (x * x + 1e-3); };
+    size_t n_calls = 0;
+    double batched = adaptive_integrate_batched<double>(
+        [&] (const double* xs, size_t n, double* out) {
+            n_calls++;
+            for (size_t i = 0; i < n; i++) {
+                out[i] = f(xs[i]);
+            }
+        }, -1, 1, 1e-6);
+    REQUIRE(batched == adaptive_integrate<double>(f, -1, 1, 1e-6));
+    REQUIRE(n_calls > 1);
+}
@@ -94,8 +94,52 @@ TEST_CASE("matrix vector non-square", "[blas_wrapper]")
     REQUIRE_ARRAY_CLOSE(result, std::vector<double>{6.5, 0}, 2, 1e-15);
 }
 
+TEST_CASE("matrix transpose vector product", "[blas_wrapper]")
+{
+    std::vector<double> matrix{
+        2, 1, 1, -1, 0.5, 10
+    };
+    auto result = matrix_transpose_vector_product(matrix, {4, -2});
+    REQUIRE_ARRAY_CLOSE(result, std::vector<double>{10, 3, -16}, 3, 1e-15);
+}
+
 TEST_CASE("matrix vector 0 columns", "[blas_wrapper]")
 {
     auto result = matrix_vector_product({}, {});
     REQUIRE(result.size() == 0);
 }
+
+TEST_CASE("matrix matrix product", "[blas_wrapper]")
+{
+    std::vector<double> A{
+        2, 1, 1, -1, 0.5, 10
+    };
+    std::vector<double> B{
+        4, 1, -2, 0, 0.5, 3
+    };
+    auto result = matrix_matrix_product(A, B, 2, 3, 2);
+    REQUIRE_ARRAY_CLOSE(result, std::vector<double>{6.5, 5, 0, 29}, 4, 1e-15);
+}
+
+TEST_CASE("transpose matrix product", "[blas_wrapper]")
+{
+    std::vector<double> A{
+        2, 1, 1, -1, 0.5, 10
+    };
+    std::vector<double> B{
+        4, 1, -2, 0, 0.5, 3
+    };
+    std::vector<double> result(9);
+    transpose_matrix_product(A.data(), B.data(), result.data(), 3, 2, 3);
+    REQUIRE_ARRAY_CLOSE(result, std::vector<double>{
+        8, 1.5, -7, 4, 1.25, -0.5, 4, 6, 28
+    }, 9, 1e-15);
+
+    std::vector<float> fA(A.begin(), A.end());
+    std::vector<float> fB(B.begin(), B.end());
+    std::vector<float> float_result(9);
+    transpose_matrix_product(fA.data(), fB.data(), float_result.data(), 3, 2, 3);
+    for (size_t i = 0; i < 9; i++) {
+        REQUIRE(float_result[i] == Approx(result[i]));
+    }
+}
@@ -34,3 +34,10 @@ TEST_CASE("compose overlap", "[dense]")
     REQUIRE(result[1] == 6);
     REQUIRE(result[15] == 0);
 }
+
+TEST_CASE("dense transpose apply", "[dense]")
+{
+    DenseOperator A(2, 3, {1, 2, 3, 4, 5, 6});
+    auto result = A.apply_transpose({1, -1});
+    REQUIRE_ARRAY_EQUAL(result, std::vector<double>{-3, -3, -3}, 3);
+}
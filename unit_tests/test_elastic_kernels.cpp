@@ -1,6 +1,8 @@
 #include "catch.hpp"
 #include "elastic_kernels.h"
 #include "gravity_kernels.h"
+#include "laplace_kernels.h"
+#include "util.h"
 
 #include <fstream>
 #include <string>
@@ -141,3 +143,52 @@ TEST_CASE("TestElasticTensorKernels3DAdjointTraction", "[elastic_kernels]") {
 TEST_CASE("TestElasticTensorKernels3DHypersingular", "[elastic_kernels]") {
     test_elastic_kernel<3>("hyp");
 }
+
+template <size_t dim, size_t R, size_t C>
+void test_call_row(const Kernel<dim,R,C>& K)
+{
+    size_t n = 37;
+    auto obs_loc = random_pt<dim>();
+    auto obs_normal = random_pt<dim>();
+    auto src_locs = random_pts<dim>(n);
+    auto src_normals = random_pts<dim>(n);
+    // A coincident source gives zero, like operator().
+    src_locs[5] = obs_loc;
+
+    std::vector<double> buffer;
+    auto src = to_soa(src_locs.data(), src_normals.data(), n, buffer);
+    std::vector<double> row(R * C * n);
+    K.call_row(obs_loc, obs_normal, src, row.data());
+    for (size_t j = 0; j < n; j++) {
+        auto correct = K(obs_loc, src_locs[j], obs_normal, src_normals[j]);
+        for (size_t d1 = 0; d1 < R; d1++) {
+            for (size_t d2 = 0; d2 < C; d2++) {
+                auto val = row[(d1 * C + d2) * n + j];
+                REQUIRE_CLOSE(val, correct[d1][d2], 1e-12 * (1 + std::fabs(val)));
+            }
+        }
+    }
+    REQUIRE(row[5] == 0.0);
+}
+
+TEST_CASE("Batched rows match pointwise kernel evaluation", "[elastic_kernels]") {
+    double sm = 30e9;
+    double pr = 0.25;
+    test_call_row(LaplaceSingle<2>());
+    test_call_row(LaplaceDouble<2>());
+    test_call_row(LaplaceHypersingular<2>());
+    test_call_row(LaplaceSingle<3>());
+    test_call_row(LaplaceDouble<3>());
+    test_call_row(ElasticDisplacement<2>(sm, pr));
+    test_call_row(ElasticTraction<2>(sm, pr));
+    test_call_row(ElasticAdjointTraction<2>(sm, pr));
+    test_call_row(ElasticHypersingular<2>(sm, pr));
+    test_call_row(GravityDisplacement<2>(sm, pr, {0, -9.8}));
+    test_call_row(GravityTraction<2>(sm, pr, {0, -9.8}));
+    test_call_row(ElasticDisplacement<3>(sm, pr));
+    test_call_row(ElasticTraction<3>(sm, pr));
+    test_call_row(ElasticAdjointTraction<3>(sm, pr));
+    test_call_row(ElasticHypersingular<3>(sm, pr));
+    test_call_row(GravityDisplacement<3>(sm, pr, {0, 0, -9.8}));
+    test_call_row(GravityTraction<3>(sm, pr, {0, 0, -9.8}));
+}
@@ -0,0 +1,68 @@
+#include "catch.hpp"
+#include "fft.h"
+#include "util.h"
+
+using namespace tbem;
+
+typedef std::complex<double> Complex;
+
+std::vector<Complex> naive_dft_2d(const std::vector<Complex>& x, size_t n)
+{
+    std::vector<Complex> out(n * n);
+    for (size_t k0 = 0; k0 < n; k0++) {
+        for (size_t k1 = 0; k1 < n; k1++) {
+            Complex sum = 0;
+            for (size_t j0 = 0; j0 < n; j0++) {
+                for (size_t j1 = 0; j1 < n; j1++) {
+                    auto theta = -2 * M_PI * (j0 * k0 + j1 * k1) / double(n);
+                    sum += x[j0 * n + j1] * Complex(std::cos(theta), std::sin(theta));
+                }
+            }
+            out[k0 * n + k1] = sum;
+        }
+    }
+    return out;
+}
+
+TEST_CASE("FFT matches direct DFT", "[fft]")
+{
+    for (size_t n: {1, 2, 4, 6, 7, 9, 12, 15, 16, 25}) {
+        FFTPlan plan(n, 2);
+        auto re = random_list(n * n, -1, 1);
+        auto im = random_list(n * n, -1, 1);
+        std::vector<Complex> x(n * n);
+        for (size_t i = 0; i < x.size(); i++) {
+            x[i] = Complex(re[i], im[i]);
+        }
+        auto correct = naive_dft_2d(x, n);
+        std::vector<Complex> scratch(plan.scratch_size());
+        plan.forward(x.data(), scratch.data());
+        for (size_t i = 0; i < x.size(); i++) {
+            REQUIRE(std::abs(x[i] - correct[i]) < 1e-11);
+        }
+    }
+}
+
+TEST_CASE("Inverse FFT undoes forward FFT", "[fft]")
+{
+    size_t n = 10;
+    FFTPlan plan(n, 3);
+    REQUIRE(plan.size() == 1000);
+    auto vals = random_list(plan.size(), -1, 1);
+    std::vector<Complex> x(vals.begin(), vals.end());
+    std::vector<Complex> scratch(plan.scratch_size());
+    plan.forward(x.data(), scratch.data());
+    plan.inverse(x.data(), scratch.data());
+    for (size_t i = 0; i < x.size(); i++) {
+        REQUIRE(std::abs(x[i] / double(plan.size()) - vals[i]) < 1e-13);
+    }
+}
+
+TEST_CASE("FFT sizes", "[fft]")
+{
+    REQUIRE(fft_size(1) == 1);
+    REQUIRE(fft_size(7) == 8);
+    REQUIRE(fft_size(9) == 9);
+    REQUIRE(fft_size(11) == 12);
+    REQUIRE(fft_size(31) == 32);
+}
@@ -18,6 +18,15 @@ NBodyData<dim> ones_data(size_t n)
     return NBodyData<dim>{obs_pts, normals, src_pts, normals, weights};
 }
 
+NBodyData<2> uneven_data(size_t n_obs, size_t n_src)
+{
+    return NBodyData<2>{
+        random_pts<2>(n_obs), random_pts<2>(n_obs),
+        random_pts<2>(n_src), random_pts<2>(n_src),
+        std::vector<double>(n_src, 1.0)
+    };
+}
+
 TEST_CASE("MakeSurroundingSurface", "[fmm]") 
 {
     auto surface = TranslationSurface<2>::make_surrounding_surface(4);
@@ -28,6 +37,23 @@ TEST_CASE("MakeSurroundingSurface", "[fmm]")
     REQUIRE_CLOSE(surface.normals[1], (Vec<double,2>{0.0, 1.0}), 1e-12);
 } 
 
+TEST_CASE("MakeGridSurface", "[fmm]")
+{
+    auto surface = TranslationSurface<2>::make_grid_surface(30);
+    REQUIRE(surface.pts.size() == 32);
+    for (size_t i = 0; i < surface.pts.size(); i++) {
+        auto& p = surface.pts[i];
+        REQUIRE(std::max(std::fabs(p[0]), std::fabs(p[1])) == Approx(1.0));
+        REQUIRE(hypot(surface.normals[i]) == Approx(1.0));
+    }
+    REQUIRE_CLOSE(surface.pts[0], (Vec<double,2>{-1.0, -1.0}), 1e-12);
+    REQUIRE_CLOSE(surface.normals[1], (Vec<double,2>{-1.0, 0.0}), 1e-12);
+
+    // 5 and 6 points per side give 98 and 152 boundary points.
+    REQUIRE(TranslationSurface<3>::make_grid_surface(100).pts.size() == 98);
+    REQUIRE(TranslationSurface<3>::make_grid_surface(140).pts.size() == 152);
+}
+
 TEST_CASE("IdentityOperations", "[fmm]") 
 {
     size_t n = 500;
@@ -42,38 +68,210 @@ TEST_CASE("IdentityOperations", "[fmm]")
     FMMOperator<2,1,1> tree(K, data, {0.3, 1, 1, 0.05, false});
 
     double M_coeff;
-    tree.P2M(tree.src_oct, tree.up_check_to_equiv[0], x, &M_coeff);
+    tree.P2M(tree.src_oct.root(), tree.up_check_to_equiv[0], x, &M_coeff);
     REQUIRE(M_coeff == static_cast<double>(n));
 
     double L_coeff = 0.0;
-    tree.M2L(tree.obs_oct, tree.src_oct, tree.down_check_to_equiv[0], &M_coeff, &L_coeff);
+    auto m2l_op = tree.build_M2L(tree.obs_oct.root(), tree.src_oct.root());
+    tree.M2L(m2l_op, tree.down_check_to_equiv[0], &M_coeff, &L_coeff);
     REQUIRE(L_coeff == static_cast<double>(n));
 
     std::vector<double> L_child(4);
-    std::vector<double*> child_ptr(4);
     for (size_t i = 0; i < 4; i++) {
-        child_ptr[i] = &L_child[i];
+        auto& child = *tree.src_oct.root().child(i);
+        tree.L2L(
+            tree.src_oct.root(), child, tree.down_check_to_equiv[1], &L_coeff, &L_child[i]
+        );
     }
-    tree.L2L(tree.src_oct, tree.down_check_to_equiv[1], &L_coeff, child_ptr);
     REQUIRE_ARRAY_CLOSE(L_child, std::vector<double>(4, n), 4, 1e-12);
 
     std::vector<double> out(n, 0.0);
-    tree.L2P(tree.src_oct, &L_coeff, out);
+    tree.L2P(tree.src_oct.root(), &L_coeff, out);
     REQUIRE_ARRAY_CLOSE(out, std::vector<double>(n, n), n, 1e-12);
 
     
     std::vector<double> out2(n, 0.0);
-    tree.M2P(tree.src_oct, tree.obs_oct, &M_coeff, out2);
+    tree.M2P(tree.src_oct.root(), tree.obs_oct.root(), &M_coeff, out2);
     REQUIRE_ARRAY_CLOSE(out2, std::vector<double>(n, n), n, 1e-12);
 }
 
+void check_cell_surfaces(const CellSurfaces<2>& cached,
+    const TranslationSurface<2>& surf, const Octree<2>& oct)
+{
+    for (auto& cell: oct.nodes) {
+        auto moved = surf.move(cell.bounds);
+        REQUIRE(cached.n_pts == moved.size());
+        for (size_t i = 0; i < moved.size(); i++) {
+            REQUIRE_ARRAY_CLOSE(cached.cell_pts(cell)[i], moved[i], 2, 1e-14);
+        }
+    }
+}
+
+TEST_CASE("Cached cell surfaces", "[fmm]")
+{
+    auto data = uneven_data(1000, 500);
+    FMMOperator<2,1,1> tree(LaplaceDouble<2>(), data, {0.3, 10, 20, 0.05, false});
+    check_cell_surfaces(tree.up_equiv_cells, tree.up_equiv_surface, tree.src_oct);
+    check_cell_surfaces(tree.up_check_cells, tree.up_check_surface, tree.src_oct);
+    check_cell_surfaces(tree.down_equiv_cells, tree.down_equiv_surface, tree.obs_oct);
+    check_cell_surfaces(tree.down_check_cells, tree.down_check_surface, tree.obs_oct);
+}
+
+TEST_CASE("M2L operators are shared between equivalent cell pairs", "[fmm]")
+{
+    size_t n = 2000;
+    auto pts = random_pts<2>(n);
+    NBodyData<2> data{pts, pts, pts, pts, std::vector<double>(n, 1.0)};
+    FMMOperator<2,1,1> tree(LaplaceDouble<2>(), data, {0.3, 10, 20, 0.05, false});
+    auto& m2l_ops = tree.m2l_ops;
+    REQUIRE(m2l_ops.task_ops.size() == tree.tasks.m2ls.size());
+    REQUIRE(m2l_ops.ops.size() < tree.tasks.m2ls.size());
+    for (size_t i = 0; i < tree.tasks.m2ls.size(); i += 50) {
+        auto& t = tree.tasks.m2ls[i];
+        auto direct = tree.build_M2L(t.obs_cell, t.src_cell);
+        auto& shared = m2l_ops.ops[m2l_ops.task_ops[i]];
+        REQUIRE_ARRAY_CLOSE(shared, direct, direct.size(), 1e-6);
+    }
+}
+
+TEST_CASE("M2L batches cover every m2l task once", "[fmm]")
+{
+    size_t n = 2000;
+    auto pts = random_pts<2>(n);
+    NBodyData<2> data{pts, pts, pts, pts, std::vector<double>(n, 1.0)};
+    FMMOperator<2,1,1> tree(LaplaceDouble<2>(), data, {0.3, 10, 20, 0.05, false});
+    auto& m2ls = tree.tasks.m2ls;
+    auto& task_ops = tree.m2l_ops.task_ops;
+    auto& batches = tree.schedule.m2l_batches;
+    REQUIRE(batches.size() > 0);
+    REQUIRE(batches.size() < m2ls.size());
+
+    std::vector<size_t> n_runs(m2ls.size(), 0);
+    for (auto& b: batches) {
+        REQUIRE(b.obs_cells.size() > 0);
+        REQUIRE(b.tasks.size() == b.obs_slots.size());
+        for (auto c: b.obs_cells) {
+            REQUIRE(c->level == b.obs_cells[0]->level);
+        }
+        for (size_t j = 0; j < b.tasks.size(); j++) {
+            auto t = b.tasks[j];
+            n_runs[t]++;
+            REQUIRE(b.obs_cells[b.obs_slots[j]] == &m2ls[t].obs_cell);
+            if (j > 0) {
+                REQUIRE(task_ops[b.tasks[j - 1]] <= task_ops[t]);
+            }
+        }
+    }
+    for (auto r: n_runs) {
+        REQUIRE(r == 1);
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void check_homogeneity(const Kernel<dim,R,C>& K)
+{
+    REQUIRE(K.is_homogeneous());
+    auto pts = random_pts<dim>(4);
+    auto s = 3.7;
+    auto unscaled = K(pts[0], pts[1], pts[2], pts[3]);
+    auto scaled = K(s * pts[0], s * pts[1], pts[2], pts[3]);
+    auto factor = std::pow(s, K.homogeneity_degree());
+    for (size_t d1 = 0; d1 < R; d1++) {
+        for (size_t d2 = 0; d2 < C; d2++) {
+            REQUIRE(scaled[d1][d2] == Approx(factor * unscaled[d1][d2]));
+        }
+    }
+}
+
+TEST_CASE("Kernel homogeneity degrees", "[fmm]")
+{
+    check_homogeneity(LaplaceSingle<3>());
+    check_homogeneity(LaplaceDouble<2>());
+    check_homogeneity(LaplaceDouble<3>());
+    check_homogeneity(LaplaceHypersingular<2>());
+    check_homogeneity(ElasticTraction<2>(30e9, 0.25));
+    check_homogeneity(ElasticHypersingular<2>(30e9, 0.25));
+    check_homogeneity(ElasticDisplacement<3>(30e9, 0.25));
+    check_homogeneity(ElasticAdjointTraction<3>(30e9, 0.25));
+    check_homogeneity(ElasticHypersingular<3>(30e9, 0.25));
+    REQUIRE(!LaplaceSingle<2>().is_homogeneous());
+    REQUIRE(!ElasticDisplacement<2>(30e9, 0.25).is_homogeneous());
+}
+
+template <size_t dim, size_t R, size_t C>
+void check_symmetry(const Kernel<dim,R,C>& K)
+{
+    REQUIRE(K.is_symmetric());
+    for (size_t trial = 0; trial < 10; trial++) {
+        auto x = random_pt<dim>();
+        auto y = random_pt<dim>();
+        auto nx = random_pt<dim>();
+        auto ny = random_pt<dim>();
+        auto forward = K(x, y, nx, ny);
+        auto backward = K(y, x, ny, nx);
+        for (size_t i = 0; i < R; i++) {
+            for (size_t j = 0; j < C; j++) {
+                REQUIRE(backward[j][i] == Approx(forward[i][j]).epsilon(1e-10));
+            }
+        }
+    }
+}
+
+TEST_CASE("Kernel symmetry", "[fmm]")
+{
+    check_symmetry(LaplaceSingle<2>());
+    check_symmetry(LaplaceSingle<3>());
+    check_symmetry(LaplaceHypersingular<2>());
+    check_symmetry(ElasticDisplacement<2>(30e9, 0.25));
+    check_symmetry(ElasticHypersingular<2>(30e9, 0.25));
+    check_symmetry(ElasticDisplacement<3>(30e9, 0.25));
+    check_symmetry(ElasticHypersingular<3>(30e9, 0.25));
+    REQUIRE(!LaplaceDouble<2>().is_symmetric());
+    REQUIRE(!ElasticTraction<3>(30e9, 0.25).is_symmetric());
+}
+
+// Hides the homogeneity of the wrapped kernel so that the FMM computes the
+// check to equivalent operator for every level with an SVD.
+struct InhomogeneousTraction: public ElasticTraction<2> 
+{
+    InhomogeneousTraction(): ElasticTraction<2>(30e9, 0.25) {}
+    virtual bool is_homogeneous() const {return false;}
+};
+
+TEST_CASE("Rescaled check to equivalent operators", "[fmm]")
+{
+    size_t n = 3000;
+    auto data = uneven_data(n, n);
+    FMMConfig config{0.3, 20, 20, 0.05, false};
+    FMMOperator<2,2,2> rescaled(ElasticTraction<2>(30e9, 0.25), data, config);
+    FMMOperator<2,2,2> direct(InhomogeneousTraction(), data, config);
+    for (auto ops: {
+            std::make_pair(&rescaled.up_check_to_equiv, &direct.up_check_to_equiv),
+            std::make_pair(&rescaled.down_check_to_equiv, &direct.down_check_to_equiv)})
+    {
+        REQUIRE(ops.first->size() > 3);
+        REQUIRE(ops.first->size() == ops.second->size());
+        for (size_t level = 0; level < ops.first->size(); level++) {
+            auto& a = (*ops.first)[level];
+            auto& b = (*ops.second)[level];
+            REQUIRE(a.size() == b.size());
+            double max_val = 0.0;
+            for (auto v: b) {
+                max_val = std::max(max_val, std::fabs(v));
+            }
+            for (size_t i = 0; i < a.size(); i++) {
+                REQUIRE(std::fabs(a[i] - b[i]) < 1e-6 * max_val);
+            }
+        }
+    }
+}
+
 template <size_t dim, size_t R, size_t C>
 void test_kernel(const NBodyData<dim>& data, const Kernel<dim,R,C>& K,
-    size_t order, double allowed_error) 
+    const FMMConfig& config, double allowed_error) 
 {
-    size_t n_per_cell = 1;
     std::vector<double> x(C * data.src_locs.size(), 1.0);
-    FMMOperator<dim,R,C> tree(K, data, {0.35, order, n_per_cell, 0.05, false});
+    FMMOperator<dim,R,C> tree(K, data, config);
     auto out = tree.apply(x);
 
     auto exact_op = make_direct_nbody_operator(data, K);
@@ -98,6 +296,14 @@ void test_kernel(const NBodyData<dim>& data, const Kernel<dim,R,C>& K,
 }
 
 
+template <size_t dim, size_t R, size_t C>
+void test_kernel(const NBodyData<dim>& data, const Kernel<dim,R,C>& K,
+    size_t order, double allowed_error) 
+{
+    size_t n_per_cell = 1;
+    test_kernel(data, K, {0.35, order, n_per_cell, 0.05, false}, allowed_error);
+}
+
 template <size_t dim, size_t R, size_t C>
 void test_kernel(const Kernel<dim,R,C>& K, size_t order, double allowed_error) 
 {
@@ -148,4 +354,596 @@ TEST_CASE("ElasticHypersingular2DFMM", "[fmm]")
 {
     test_kernel(ElasticHypersingular<2>(30e9, 0.25), 30, 1e-4);
 }
+TEST_CASE("ElasticHypersingular2DFMMSmallCells", "[fmm]")
+{
+    // With larger leaves, small cell handling turned on and very different
+    // source and observation densities, every type of FMM task is exercised.
+    auto K = ElasticHypersingular<2>(30e9, 0.25);
+    FMMConfig config{0.35, 30, 20, 0.05, true};
+
+    auto sparse_src = uneven_data(3000, 300);
+    FMMOperator<2,2,2> sparse_src_tree(K, sparse_src, config);
+    REQUIRE(sparse_src_tree.tasks.p2ls.size() > 0);
+    test_kernel(sparse_src, K, config, 1e-4);
+
+    auto sparse_obs = uneven_data(300, 3000);
+    FMMOperator<2,2,2> sparse_obs_tree(K, sparse_obs, config);
+    REQUIRE(sparse_obs_tree.tasks.m2ps.size() > 0);
+    test_kernel(sparse_obs, K, config, 1e-4);
+}
+
+TEST_CASE("FMM statistics", "[fmm]")
+{
+    auto data = uneven_data(2000, 1000);
+    FMMOperator<2,1,1> tree(LaplaceDouble<2>(), data, {0.3, 10, 20, 0.05, false});
+    auto& stats = tree.stats;
+    REQUIRE(stats.n_applies == 0);
+    REQUIRE(stats.src_tree_depth > 0);
+    size_t n_leaves = 0;
+    for (auto n: stats.obs_leaf_size_histogram) {
+        n_leaves += n;
+    }
+    REQUIRE(n_leaves == tree.tasks.l2ps.size());
+    REQUIRE(stats.obs_leaf_size_histogram.size() <= 6);
+
+    tree.apply(random_list(tree.n_cols()));
+    tree.apply_block({random_list(tree.n_cols()), random_list(tree.n_cols())});
+    REQUIRE(stats.n_applies == 2);
+    REQUIRE(stats.n_rhs == 2);
+    REQUIRE(stats.n_tasks[FMMTasks<2>::P2P] == tree.tasks.p2ps.size());
+    REQUIRE(stats.n_tasks[FMMTasks<2>::M2L] == tree.tasks.m2ls.size());
+    REQUIRE(stats.n_kernel_evals[FMMTasks<2>::M2L] == 0);
+    REQUIRE(stats.n_kernel_evals[FMMTasks<2>::P2P] > 0);
+    REQUIRE(stats.temporary_bytes > 0);
+
+    double phase_total = 0.0;
+    for (auto t: stats.phase_time) {
+        phase_total += t;
+    }
+    double thread_total = 0.0;
+    for (auto t: stats.thread_time) {
+        thread_total += t;
+    }
+    REQUIRE(phase_total > 0);
+    REQUIRE(thread_total == Approx(phase_total));
+
+    // With a single cell, everything is a P2P between all the points.
+    FMMOperator<2,1,1> one_cell(LaplaceDouble<2>(), data, {0.3, 10, 5000, 0.05, false});
+    one_cell.apply(random_list(one_cell.n_cols()));
+    REQUIRE(one_cell.stats.n_kernel_evals[FMMTasks<2>::P2P] == 2000 * 1000);
+    REQUIRE(one_cell.stats.src_tree_depth == 0);
+    REQUIRE(one_cell.stats.src_leaf_size_histogram.size() == 11);
+}
+
+TEST_CASE("Empty FMM operators", "[fmm]")
+{
+    for (auto data: {uneven_data(0, 0), uneven_data(10, 0), uneven_data(0, 10)}) {
+        FMMOperator<2,1,1> tree(LaplaceDouble<2>(), data, {0.3, 10, 5, 0.05, false});
+        REQUIRE(tree.n_rows() == data.obs_locs.size());
+        REQUIRE(tree.n_cols() == data.src_locs.size());
+        auto out = tree.apply(std::vector<double>(tree.n_cols(), 1.0));
+        REQUIRE(out == std::vector<double>(tree.n_rows(), 0.0));
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void check_against_direct(const FMMOperator<dim,R,C>& tree,
+    const Kernel<dim,R,C>& K, const NBodyData<dim>& data, double allowed_error)
+{
+    auto x = random_list(tree.n_cols());
+    auto out = tree.apply(x);
+    auto exact = nbody_eval(K, data, x.data());
+    double diff2 = 0.0;
+    double norm2 = 0.0;
+    for (size_t i = 0; i < exact.size(); i++) {
+        diff2 += (out[i] - exact[i]) * (out[i] - exact[i]);
+        norm2 += exact[i] * exact[i];
+    }
+    REQUIRE(std::sqrt(diff2 / norm2) < allowed_error);
+}
+
+NBodyData<2> coincident_data(size_t n)
+{
+    auto pts = random_pts<2>(n);
+    auto normals = random_pts<2>(n);
+    return NBodyData<2>{pts, normals, pts, normals, random_list(n)};
+}
+
+TEST_CASE("Symmetric FMM for coincident points", "[fmm]")
+{
+    auto data = coincident_data(2000);
+    for (bool small_cells: {false, true}) {
+        FMMConfig config{0.3, 30, 20, 0.05, small_cells};
+
+        ElasticHypersingular<2> K(30e9, 0.25);
+        FMMOperator<2,2,2> tree(K, data, config);
+        REQUIRE(tree.single_tree);
+        REQUIRE(tree.symmetric);
+        REQUIRE(&tree.obs_oct == &tree.src_oct);
+        check_against_direct(tree, K, data, 1e-5);
+
+        LaplaceSingle<2> single;
+        FMMOperator<2,1,1> single_tree(single, data, config);
+        REQUIRE(single_tree.symmetric);
+        check_against_direct(single_tree, single, data, 1e-5);
+
+        // A non-symmetric kernel still shares the tree.
+        LaplaceDouble<2> double_layer;
+        FMMOperator<2,1,1> double_tree(double_layer, data, config);
+        REQUIRE(double_tree.single_tree);
+        REQUIRE(!double_tree.symmetric);
+        check_against_direct(double_tree, double_layer, data, 1e-5);
+
+        // Each near field pair is evaluated once instead of twice. The two
+        // traversals split cells in a different order, so the near fields
+        // are not exactly the same size.
+        auto sym_evals = single_tree.stats.n_kernel_evals[FMMTasks<2>::P2P];
+        auto full_evals = double_tree.stats.n_kernel_evals[FMMTasks<2>::P2P];
+        REQUIRE(2.0 * sym_evals == Approx(full_evals).epsilon(0.05));
+    }
+}
+
+TEST_CASE("Symmetric FMM in 3D", "[fmm]")
+{
+    size_t n = 2000;
+    auto pts = random_pts<3>(n);
+    auto normals = random_pts<3>(n);
+    NBodyData<3> data{pts, normals, pts, normals, std::vector<double>(n, 1.0)};
+    ElasticDisplacement<3> K(30e9, 0.25);
+    FMMOperator<3,3,3> tree(K, data, {0.3, 75, 50, 0.05, true});
+    REQUIRE(tree.symmetric);
+    check_against_direct(tree, K, data, 1e-4);
+}
+
+TEST_CASE("Single precision far field", "[fmm]")
+{
+    auto data = ones_data<2>(2000);
+    ElasticHypersingular<2> K(30e9, 0.25);
+    for (bool owner_computes: {true, false}) {
+        FMMConfig config(0.3, 30, 20, 0.05, true, owner_computes, true, true);
+        FMMOperator<2,2,2> tree(K, data, config);
+        REQUIRE(tree.m2l_ops.ops.size() == 0);
+        REQUIRE(tree.m2l_ops.float_ops.size() > 0);
+        REQUIRE(tree.float_down_check_to_equiv.size() ==
+            tree.down_check_to_equiv.size());
+        check_against_direct(tree, K, data, 1e-4);
+        REQUIRE(tree.latest_arena().multipoles.size() == 0);
+        REQUIRE(tree.latest_arena().float_multipoles.size() > 0);
+    }
+}
+
+/* Move each point halfway towards the center of its leaf cell. */
+void shrink_into_leaves(const Octree<2>& oct, std::vector<Vec<double,2>>& pts)
+{
+    for (auto& cell: oct.nodes) {
+        if (!cell.is_leaf()) {
+            continue;
+        }
+        for (size_t j = cell.begin; j < cell.end; j++) {
+            auto i = oct.indices[j];
+            pts[i] = cell.bounds.center + 0.5 * (pts[i] - cell.bounds.center);
+        }
+    }
+}
+
+TEST_CASE("Refit moved points", "[fmm]")
+{
+    auto data = uneven_data(1500, 2000);
+    LaplaceDouble<2> K;
+    auto tree = std::make_shared<FMMOperator<2,1,1>>(
+        K, data, FMMConfig{0.3, 30, 20, 0.05, true}
+    );
+    auto n_m2l_ops = tree->m2l_ops.ops.size();
+
+    auto moved = data;
+    shrink_into_leaves(tree->obs_oct, moved.obs_locs);
+    shrink_into_leaves(tree->src_oct, moved.src_locs);
+    moved.src_weights = random_list(moved.src_weights.size());
+    auto before = tree.get();
+    REQUIRE(!update_points(tree, moved));
+    REQUIRE(tree.get() == before);
+    REQUIRE(tree->m2l_ops.ops.size() == n_m2l_ops);
+    check_against_direct(*tree, K, moved, 1e-5);
+
+    // A point that leaves its cell forces a rebuild, unless the tolerance
+    // allows for it.
+    auto far = moved;
+    far.src_locs[0] = data.src_locs[0] + Vec<double,2>{2.0, 2.0};
+    REQUIRE(!tree->refit(far, 1e-3));
+    check_against_direct(*tree, K, moved, 1e-5);
+    REQUIRE(update_points(tree, far));
+    REQUIRE(tree.get() != before);
+    check_against_direct(*tree, K, far, 1e-5);
+    REQUIRE(tree->refit(far));
+
+    // A point just outside its leaf is accepted with enough tolerance and 
+    // the result stays accurate. The tolerance is capped, so a point further
+    // out forces a rebuild however large the requested tolerance is.
+    auto tol = tree->max_refit_tolerance;
+    REQUIRE(tol > 0.0);
+    REQUIRE(tol < 1.0);
+    auto& oct = tree->src_oct;
+    const OctreeNode<2>* leaf = nullptr;
+    for (auto& cell: oct.nodes) {
+        for (size_t j = cell.begin; j < cell.end; j++) {
+            if (cell.is_leaf() && oct.indices[j] == 0) {
+                leaf = &cell;
+            }
+        }
+    }
+    REQUIRE(leaf != nullptr);
+    auto nudged = far;
+    auto& box = leaf->bounds;
+    nudged.src_locs[0] = box.center + (1 + 0.5 * tol) * box.half_width;
+    REQUIRE(!tree->refit(nudged));
+    REQUIRE(tree->refit(nudged, tol));
+    check_against_direct(*tree, K, nudged, 1e-5);
+
+    auto beyond = far;
+    beyond.src_locs[0] = box.center + (1 + 2 * tol) * box.half_width;
+    REQUIRE(!tree->refit(beyond, 100.0));
+}
+
+TEST_CASE("Refit a single tree operator", "[fmm]")
+{
+    auto data = coincident_data(1000);
+    LaplaceSingle<2> K;
+    FMMOperator<2,1,1> tree(K, data, {0.3, 30, 20, 0.05, true});
+    REQUIRE(tree.symmetric);
+
+    auto moved = data;
+    shrink_into_leaves(tree.src_oct, moved.src_locs);
+    moved.obs_locs = moved.src_locs;
+    REQUIRE(tree.refit(moved));
+    check_against_direct(tree, K, moved, 1e-5);
+
+    // Separating the observation points from the sources invalidates the 
+    // shared tree.
+    auto split = moved;
+    split.obs_locs[0] = split.obs_locs[0] + Vec<double,2>{1e-12, 0.0};
+    REQUIRE(!tree.refit(split));
+}
+
+template <typename Task>
+void check_same_cells(const std::vector<Task>& a, const std::vector<Task>& b)
+{
+    REQUIRE(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        REQUIRE(&a[i].cell == &b[i].cell);
+    }
+}
+
+void check_same_pairs(const std::vector<FMMTasks<2>::CellPairTask>& a,
+    const std::vector<FMMTasks<2>::CellPairTask>& b)
+{
+    REQUIRE(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        REQUIRE(&a[i].obs_cell == &b[i].obs_cell);
+        REQUIRE(&a[i].src_cell == &b[i].src_cell);
+    }
+}
+
+template <size_t R, size_t C>
+void check_parallel_traversal(const FMMOperator<2,R,C>& tree)
+{
+    // Outside of a parallel region, the traversals run on one thread.
+    FMMTasks<2> serial;
+    tree.upward_traversal(tree.src_oct.root(), serial);
+    if (tree.symmetric) {
+        tree.dual_tree_symmetric(tree.obs_oct.root(), tree.src_oct.root(), serial);
+    } else {
+        tree.dual_tree(tree.obs_oct.root(), tree.src_oct.root(), serial);
+    }
+    tree.downward_traversal(tree.obs_oct.root(), serial);
+
+    check_same_cells(tree.tasks.p2ms, serial.p2ms);
+    check_same_cells(tree.tasks.m2ms, serial.m2ms);
+    check_same_pairs(tree.tasks.p2ps, serial.p2ps);
+    check_same_pairs(tree.tasks.m2ps, serial.m2ps);
+    check_same_pairs(tree.tasks.p2ls, serial.p2ls);
+    check_same_pairs(tree.tasks.m2ls, serial.m2ls);
+    check_same_cells(tree.tasks.l2ls, serial.l2ls);
+    check_same_cells(tree.tasks.l2ps, serial.l2ps);
+}
+
+TEST_CASE("Parallel traversal matches a serial traversal", "[fmm]")
+{
+    FMMConfig config{0.3, 10, 5, 0.05, true};
+    FMMOperator<2,1,1> tree(LaplaceDouble<2>(), uneven_data(3000, 1000), config);
+    REQUIRE(tree.tasks.m2ls.size() > 0);
+    check_parallel_traversal(tree);
+
+    FMMOperator<2,1,1> sym_tree(LaplaceSingle<2>(), coincident_data(3000), config);
+    REQUIRE(sym_tree.symmetric);
+    check_parallel_traversal(sym_tree);
+}
+
+TEST_CASE("Owner computes and shared accumulation agree", "[fmm]")
+{
+    auto K = ElasticHypersingular<2>(30e9, 0.25);
+    for (auto data: {uneven_data(3000, 300), uneven_data(300, 3000)}) {
+        FMMOperator<2,2,2> owner(K, data, {0.35, 30, 20, 0.05, true, true});
+        FMMOperator<2,2,2> shared(K, data, {0.35, 30, 20, 0.05, true, false});
+        auto x = random_list(shared.n_cols());
+        auto owner_out = owner.apply(x);
+        auto shared_out = shared.apply(x);
+        for (size_t i = 0; i < owner_out.size(); i++) {
+            REQUIRE(owner_out[i] == Approx(shared_out[i]).epsilon(1e-8));
+        }
+    }
+}
+
+TEST_CASE("Block apply matches applying each vector", "[fmm]")
+{
+    auto K = ElasticHypersingular<2>(30e9, 0.25);
+    for (auto owner_computes: {true, false}) {
+        auto data = uneven_data(3000, 300);
+        FMMOperator<2,2,2> tree(
+            K, data, {0.35, 30, 20, 0.05, true, owner_computes}
+        );
+        std::vector<std::vector<double>> xs;
+        for (size_t k = 0; k < 3; k++) {
+            xs.push_back(random_list(tree.n_cols()));
+        }
+        auto block_out = tree.apply_block(xs);
+        REQUIRE(block_out.size() == xs.size());
+        for (size_t k = 0; k < xs.size(); k++) {
+            auto out = tree.apply(xs[k]);
+            REQUIRE(block_out[k].size() == out.size());
+            for (size_t i = 0; i < out.size(); i++) {
+                REQUIRE(block_out[k][i] == Approx(out[i]).epsilon(1e-8));
+            }
+        }
+    }
+}
+
+TEST_CASE("Repeated applies reuse the FMM workspace", "[fmm]")
+{
+    auto K = ElasticHypersingular<2>(30e9, 0.25);
+    for (auto owner_computes: {true, false}) {
+        auto data = uneven_data(3000, 300);
+        FMMOperator<2,2,2> tree(
+            K, data, {0.35, 30, 20, 0.05, true, owner_computes}
+        );
+        auto x = random_list(tree.n_cols());
+        tree.apply(x);
+        auto n_allocations = tree.n_workspace_allocations();
+        REQUIRE(n_allocations > 0);
+        tree.apply(x);
+        REQUIRE(tree.n_workspace_allocations() == n_allocations);
+
+        tree.apply_block({x, x});
+        auto n_block_allocations = tree.n_workspace_allocations();
+        tree.apply_block({x, x});
+        REQUIRE(tree.n_workspace_allocations() == n_block_allocations);
+        tree.apply(x);
+        REQUIRE(tree.n_workspace_allocations() == n_block_allocations);
+    }
+}
+
+TEST_CASE("Concurrent applies of one operator", "[fmm]")
+{
+    auto K = ElasticHypersingular<2>(30e9, 0.25);
+    auto data = uneven_data(2000, 300);
+    FMMOperator<2,2,2> tree(K, data, {0.35, 20, 20, 0.05, true});
+    size_t n = 8;
+    std::vector<std::vector<double>> xs, ys, expected;
+    for (size_t k = 0; k < n; k++) {
+        xs.push_back(random_list(tree.n_cols()));
+        ys.push_back(random_list(tree.n_rows()));
+        expected.push_back(tree.apply(xs[k]));
+    }
+
+    // The first apply_transpose runs concurrently with the others, so the
+    // transposed schedule must not be built lazily.
+    std::vector<std::vector<double>> outs(n), transpose_outs(n);
+#pragma omp parallel for
+    for (size_t k = 0; k < n; k++) {
+        outs[k] = tree.apply(xs[k]);
+        transpose_outs[k] = tree.apply_transpose(ys[k]);
+    }
+
+    // The transposed translations add their results atomically, so the
+    // order of the sums and the rounding change from run to run.
+    auto require_close = [] (const std::vector<double>& a,
+        const std::vector<double>& b) 
+    {
+        REQUIRE(a.size() == b.size());
+        double max_val = 0;
+        for (auto v: b) {
+            max_val = std::max(max_val, std::fabs(v));
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            REQUIRE(std::fabs(a[i] - b[i]) < 1e-10 * max_val);
+        }
+    };
+    for (size_t k = 0; k < n; k++) {
+        require_close(outs[k], expected[k]);
+        require_close(transpose_outs[k], tree.apply_transpose(ys[k]));
+    }
+    REQUIRE(tree.latest_stats().n_applies == 2 * n);
+}
+
+TEST_CASE("Tree ordering is undone for random input", "[fmm]")
+{
+    auto K = ElasticTraction<2>(30e9, 0.25);
+    auto data = uneven_data(2000, 1000);
+    FMMOperator<2,2,2> tree(K, data, {0.3, 30, 20, 0.05, true});
+    auto x = random_list(tree.n_cols());
+    auto out = tree.apply(x);
+    auto exact = make_direct_nbody_operator(data, K).apply(x);
+    double max_exact = 0.0;
+    for (auto v: exact) {
+        max_exact = std::max(max_exact, std::fabs(v));
+    }
+    for (size_t i = 0; i < out.size(); i++) {
+        REQUIRE(std::fabs(out[i] - exact[i]) < 1e-4 * max_exact);
+    }
+
+    auto cloned_out = tree.clone()->apply(x);
+    for (size_t i = 0; i < out.size(); i++) {
+        REQUIRE(cloned_out[i] == Approx(out[i]).epsilon(1e-10));
+    }
+}
+
 //TODO: Make a FMM capacity test
+
+template <size_t dim, size_t R, size_t C>
+void check_transpose(const FMMOperator<dim,R,C>& tree, const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& data, double allowed_error, double adjoint_error)
+{
+    auto y = random_list(tree.n_rows());
+    auto out = tree.apply_transpose(y);
+    auto exact = make_direct_nbody_operator(data, K).apply_transpose(y);
+    REQUIRE(out.size() == tree.n_cols());
+    double diff2 = 0.0;
+    double norm2 = 0.0;
+    for (size_t i = 0; i < exact.size(); i++) {
+        diff2 += (out[i] - exact[i]) * (out[i] - exact[i]);
+        norm2 += exact[i] * exact[i];
+    }
+    REQUIRE(std::sqrt(diff2 / norm2) < allowed_error);
+
+    // The transpose is the transpose of the FMM approximation itself, not 
+    // just of the exact operator, so <Ax, y> = <x, A^T y> up to rounding. 
+    // The rounding is amplified by the poorly conditioned check to 
+    // equivalent operators.
+    auto x = random_list(tree.n_cols());
+    auto Ax = tree.apply(x);
+    double Ax_y = 0.0;
+    double Ax_norm2 = 0.0;
+    double y_norm2 = 0.0;
+    for (size_t i = 0; i < y.size(); i++) {
+        Ax_y += Ax[i] * y[i];
+        Ax_norm2 += Ax[i] * Ax[i];
+        y_norm2 += y[i] * y[i];
+    }
+    double x_ATy = 0.0;
+    for (size_t i = 0; i < x.size(); i++) {
+        x_ATy += x[i] * out[i];
+    }
+    auto scale = std::sqrt(Ax_norm2 * y_norm2);
+    REQUIRE(std::fabs(Ax_y - x_ATy) < adjoint_error * scale);
+}
+
+TEST_CASE("Transposed FMM", "[fmm]")
+{
+    size_t n_obs = 1500;
+    size_t n_src = 2500;
+    NBodyData<2> data{
+        random_pts<2>(n_obs), random_pts<2>(n_obs),
+        random_pts<2>(n_src), random_pts<2>(n_src), random_list(n_src)
+    };
+    ElasticTraction<2> K(30e9, 0.25);
+    for (bool small_cells: {false, true}) {
+        for (bool owner_computes: {true, false}) {
+            FMMConfig config(0.3, 30, 20, 0.05, small_cells, owner_computes);
+            FMMOperator<2,2,2> tree(K, data, config);
+            check_transpose(tree, K, data, 1e-5, 1e-7);
+        }
+    }
+
+    FMMConfig float_config(0.3, 30, 20, 0.05, true, true, true, true);
+    FMMOperator<2,2,2> float_tree(K, data, float_config);
+    check_transpose(float_tree, K, data, 1e-4, 1e-4);
+
+    auto data3d = ones_data<3>(2000);
+    LaplaceDouble<3> K3d;
+    FMMOperator<3,1,1> tree3d(K3d, data3d, {0.3, 75, 50, 0.05, true});
+    check_transpose(tree3d, K3d, data3d, 1e-4, 1e-7);
+}
+
+TEST_CASE("Transposed FMM with a single tree", "[fmm]")
+{
+    // The weights differ between points, so a symmetric kernel still gives
+    // a nonsymmetric operator.
+    auto data = coincident_data(2000);
+    FMMConfig config{0.3, 30, 20, 0.05, true};
+
+    ElasticHypersingular<2> K(30e9, 0.25);
+    FMMOperator<2,2,2> tree(K, data, config);
+    REQUIRE(tree.symmetric);
+    check_transpose(tree, K, data, 1e-5, 1e-7);
+
+    LaplaceDouble<2> double_layer;
+    FMMOperator<2,1,1> double_tree(double_layer, data, config);
+    REQUIRE(!double_tree.symmetric);
+    check_transpose(double_tree, double_layer, data, 1e-5, 1e-7);
+}
+
+/* Compare the transposed Fourier space translations with the dense 
+ * translations between the same grid surfaces. The check to equivalent 
+ * solve cancels large terms, so the rounding in the transforms shows up at
+ * between 1e-6 and 1e-5 of the result.
+ */
+template <size_t dim, size_t R, size_t C>
+void check_fft_translations(const FMMOperator<dim,R,C>& tree)
+{
+    auto& m2l_ops = tree.m2l_ops;
+    auto n_local = C * tree.down_equiv_surface.pts.size();
+    auto n_multipole = C * tree.up_equiv_surface.pts.size();
+    size_t n_checked = 0;
+    auto& m2ls = tree.tasks.m2ls;
+    for (size_t i = 0; i < m2ls.size(); i += 1 + m2ls.size() / 50) {
+        auto op_idx = m2l_ops.task_ops[i];
+        if (!m2l_ops.is_fft(op_idx)) {
+            continue;
+        }
+        auto& t = m2ls[i];
+        auto& D = tree.down_check_to_equiv[t.obs_cell.level];
+        auto locals = random_list(n_local, -1, 1);
+        std::vector<double> dense(n_multipole, 0.0);
+        std::vector<double> fft(n_multipole, 0.0);
+        tree.M2L_transpose(
+            tree.build_M2L(t.obs_cell, t.src_cell), D, locals.data(), dense.data()
+        );
+        tree.M2L_fft_transpose(m2l_ops.fft_ops[op_idx], D, locals.data(), fft.data());
+        double max_val = 0.0;
+        for (auto v: dense) {
+            max_val = std::max(max_val, std::fabs(v));
+        }
+        for (size_t j = 0; j < n_multipole; j++) {
+            REQUIRE(std::fabs(fft[j] - dense[j]) < 1e-4 * max_val);
+        }
+        n_checked++;
+    }
+    REQUIRE(n_checked > 0);
+}
+
+TEST_CASE("Fourier space M2L", "[fmm]")
+{
+    auto data = ones_data<2>(2000);
+    ElasticHypersingular<2> K(30e9, 0.25);
+    for (bool owner_computes: {true, false}) {
+        FMMConfig config(
+            0.3, 30, 20, 0.05, true, owner_computes, true, false, "", true
+        );
+        FMMOperator<2,2,2> tree(K, data, config);
+        // The hypersingular kernel is linear in both normals.
+        REQUIRE(tree.fft_grid.n_obs_channels == 2);
+        REQUIRE(tree.fft_grid.n_src_channels == 2);
+        // The stress is symmetric, so two of the four channels are merged.
+        REQUIRE(tree.fft_grid.n_out == 3);
+        REQUIRE(tree.fft_grid.n_in == 3);
+        REQUIRE(tree.m2l_ops.fft_ops.size() == tree.m2l_ops.ops.size());
+        check_fft_translations(tree);
+        check_against_direct(tree, K, data, 1e-4);
+        check_transpose(tree, K, data, 1e-4, 1e-7);
+    }
+
+    auto data3d = ones_data<3>(4000);
+    FMMConfig config3d(0.3, 56, 20, 0.05, false, true, true, false, "", true);
+    LaplaceSingle<3> single;
+    FMMOperator<3,1,1> single_tree(single, data3d, config3d);
+    REQUIRE(single_tree.fft_grid.n_obs_channels == 1);
+    REQUIRE(single_tree.fft_grid.n_src_channels == 1);
+    check_fft_translations(single_tree);
+    check_against_direct(single_tree, single, data3d, 1e-4);
+
+    LaplaceDouble<3> double_layer;
+    FMMOperator<3,1,1> double_tree(double_layer, data3d, config3d);
+    REQUIRE(double_tree.fft_grid.n_obs_channels == 1);
+    REQUIRE(double_tree.fft_grid.n_src_channels == 3);
+    check_fft_translations(double_tree);
+    check_against_direct(double_tree, double_layer, data3d, 1e-4);
+}
@@ -0,0 +1,128 @@
+#include "catch.hpp"
+#include "elastic_kernels.h"
+#include "fmm_autotune.h"
+#include "laplace_kernels.h"
+#include "util.h"
+#include <cstdio>
+#include <fstream>
+
+using namespace tbem;
+
+NBodyData<2> tune_data(size_t n)
+{
+    auto normals = random_pts<2>(n);
+    return NBodyData<2>{
+        random_pts<2>(n), normals, random_pts<2>(n), normals,
+        std::vector<double>(n, 1.0)
+    };
+}
+
+double full_rel_error(const FMMConfig& config, const NBodyData<2>& data)
+{
+    LaplaceDouble<2> K;
+    auto x = random_list(data.src_locs.size());
+    auto exact = nbody_eval(K, data, x.data());
+    auto out = FMMOperator<2,1,1>(K, data, config).apply(x);
+    double diff2 = 0.0;
+    double norm2 = 0.0;
+    for (size_t i = 0; i < exact.size(); i++) {
+        diff2 += (out[i] - exact[i]) * (out[i] - exact[i]);
+        norm2 += exact[i] * exact[i];
+    }
+    return std::sqrt(diff2 / norm2);
+}
+
+TEST_CASE("Autotuned config meets the accuracy target", "[fmm_autotune]")
+{
+    auto data = tune_data(3000);
+    FMMTuneSpace space{{0.3, 0.5}, {5, 10, 20, 40}, {20, 50, 100}};
+    FMMConfig base{0.3, 20, 50, 0.05, false};
+    auto result = autotune_fmm(LaplaceDouble<2>(), data, 1e-5, base, space);
+    REQUIRE(result.rel_error <= 1e-5);
+    REQUIRE(result.apply_time > 0);
+    REQUIRE(result.config.d == base.d);
+    REQUIRE(full_rel_error(result.config, data) < 1e-4);
+}
+
+TEST_CASE("Unreachable accuracy returns the most accurate config", "[fmm_autotune]")
+{
+    auto data = tune_data(1000);
+    FMMTuneSpace space{{0.5}, {5, 10}, {50}};
+    FMMConfig base{0.3, 20, 50, 0.05, false};
+    auto result = autotune_fmm(LaplaceDouble<2>(), data, 1e-15, base, space);
+    REQUIRE(result.config.order == 10);
+    REQUIRE(result.rel_error > 1e-15);
+}
+
+size_t count_lines(const std::string& path)
+{
+    std::ifstream in(path);
+    size_t n_lines = 0;
+    std::string line;
+    while (std::getline(in, line)) {
+        n_lines++;
+    }
+    return n_lines;
+}
+
+TEST_CASE("Autotune results are cached", "[fmm_autotune]")
+{
+    std::string path = "test_fmm_autotune_cache.txt";
+    std::remove(path.c_str());
+
+    auto data = tune_data(1000);
+    FMMTuneSpace space{{0.3, 0.5}, {5, 10, 20}, {20, 50}};
+    FMMConfig base{0.3, 20, 50, 0.05, false};
+    auto first = autotune_fmm_cached(path, LaplaceDouble<2>(), data, 1e-4, base, space);
+    REQUIRE(count_lines(path) == 1);
+
+    // A second call for the same problem reads the result instead of tuning
+    // again and adding another line.
+    auto second = autotune_fmm_cached(path, LaplaceDouble<2>(), data, 1e-4, base, space);
+    REQUIRE(second.mac == first.mac);
+    REQUIRE(second.order == first.order);
+    REQUIRE(second.min_pts_per_cell == first.min_pts_per_cell);
+    REQUIRE(count_lines(path) == 1);
+
+    // Different candidates are a different problem.
+    FMMTuneSpace other_space{{0.4}, {7}, {33}};
+    auto third = autotune_fmm_cached(
+        path, LaplaceDouble<2>(), data, 1e-4, base, other_space
+    );
+    REQUIRE(third.order == 7);
+    REQUIRE(count_lines(path) == 2);
+
+    // So are a different target and a different base configuration.
+    autotune_fmm_cached(path, LaplaceDouble<2>(), data, 1e-2, base, other_space);
+    REQUIRE(count_lines(path) == 3);
+    FMMConfig float_base{0.3, 20, 50, 0.05, false, true, true, true};
+    autotune_fmm_cached(path, LaplaceDouble<2>(), data, 1e-2, float_base, other_space);
+    REQUIRE(count_lines(path) == 4);
+
+    // And the same kernel with different parameters.
+    autotune_fmm_cached(
+        path, ElasticHypersingular<2>(1.0, 0.25), data, 1e-2, base, other_space
+    );
+    REQUIRE(count_lines(path) == 5);
+    autotune_fmm_cached(
+        path, ElasticHypersingular<2>(1.0, 0.3), data, 1e-2, base, other_space
+    );
+    REQUIRE(count_lines(path) == 6);
+    autotune_fmm_cached(
+        path, ElasticHypersingular<2>(1.0, 0.3), data, 1e-2, base, other_space
+    );
+    REQUIRE(count_lines(path) == 6);
+    std::remove(path.c_str());
+}
+
+TEST_CASE("Single precision far field report", "[fmm_autotune]")
+{
+    auto data = tune_data(3000);
+    FMMConfig config{0.3, 30, 50, 0.05, true};
+    auto report = float_farfield_report(LaplaceDouble<2>(), data, config);
+    REQUIRE(report.double_rel_error < 1e-6);
+    REQUIRE(report.float_rel_error < 1e-3);
+    REQUIRE(report.rel_diff < 1e-3);
+    REQUIRE(report.rel_diff > 0.0);
+    REQUIRE(report.float_far_field_bytes < report.double_far_field_bytes);
+}
@@ -0,0 +1,149 @@
+#include "catch.hpp"
+#include "fmm_cache.h"
+#include "elastic_kernels.h"
+#include "laplace_kernels.h"
+#include "nbody_operator.h"
+#include "util.h"
+#include <cstdio>
+#include <fstream>
+#include <dirent.h>
+#include <unistd.h>
+
+using namespace tbem;
+
+std::vector<std::string> cache_files(const std::string& dir)
+{
+    std::vector<std::string> out;
+    auto d = opendir(dir.c_str());
+    if (d == nullptr) {
+        return out;
+    }
+    while (auto entry = readdir(d)) {
+        std::string name(entry->d_name);
+        if (name != "." && name != "..") {
+            out.push_back(dir + "/" + name);
+        }
+    }
+    closedir(d);
+    return out;
+}
+
+void remove_cache(const std::string& dir)
+{
+    for (auto& f: cache_files(dir)) {
+        std::remove(f.c_str());
+    }
+    rmdir(dir.c_str());
+}
+
+TEST_CASE("Cached operator round trip", "[fmm_cache]")
+{
+    std::string dir = "test_fmm_cache_round_trip";
+    remove_cache(dir);
+
+    std::vector<double> op;
+    REQUIRE(!load_cached_operator(dir, "a", op));
+
+    std::vector<double> stored{1.0, -2.5, 3.25};
+    save_cached_operator(dir, "a", stored);
+    REQUIRE(cache_files(dir).size() == 1);
+    REQUIRE(load_cached_operator(dir, "a", op));
+    REQUIRE(op == stored);
+    REQUIRE(!load_cached_operator(dir, "b", op));
+
+    save_cached_operator(dir, "a", {4.0});
+    REQUIRE(load_cached_operator(dir, "a", op));
+    REQUIRE(op == std::vector<double>{4.0});
+    REQUIRE(cache_files(dir).size() == 1);
+
+    // A truncated file is a miss.
+    auto path = cache_files(dir)[0];
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "TBEMFMM1";
+    REQUIRE(!load_cached_operator(dir, "a", op));
+
+    remove_cache(dir);
+}
+
+TEST_CASE("Kernel fingerprints depend on parameters", "[fmm_cache]")
+{
+    auto a = kernel_fingerprint(ElasticHypersingular<2>(30e9, 0.25));
+    REQUIRE(a == kernel_fingerprint(ElasticHypersingular<2>(30e9, 0.25)));
+    REQUIRE(a != kernel_fingerprint(ElasticHypersingular<2>(30e9, 0.3)));
+    REQUIRE(a != kernel_fingerprint(ElasticHypersingular<2>(20e9, 0.25)));
+    REQUIRE(kernel_fingerprint(LaplaceSingle<2>()) !=
+        kernel_fingerprint(LaplaceDouble<2>()));
+}
+
+/* Rewrite every cached operator multiplied by factor, reading the file
+ * layout directly.
+ */
+void scale_cache_files(const std::string& dir, double factor)
+{
+    for (auto& f: cache_files(dir)) {
+        std::ifstream in(f, std::ios::binary);
+        std::string contents(
+            (std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>()
+        );
+        in.close();
+        uint64_t key_size;
+        std::copy_n(contents.data() + 8, sizeof(key_size),
+            reinterpret_cast<char*>(&key_size));
+        auto values_start = 8 + 2 * sizeof(uint64_t) + key_size;
+        auto n_values = (contents.size() - values_start) / sizeof(double);
+        auto values = reinterpret_cast<double*>(&contents[values_start]);
+        for (size_t i = 0; i < n_values; i++) {
+            values[i] *= factor;
+        }
+        std::ofstream(f, std::ios::binary | std::ios::trunc) << contents;
+    }
+}
+
+template <size_t dim, size_t R, size_t C>
+void check_cached_check_to_equiv(const Kernel<dim,R,C>& K,
+    const NBodyData<dim>& data, size_t n_expected_files)
+{
+    std::string dir = "test_fmm_cache_operators";
+    remove_cache(dir);
+    FMMConfig config(0.3, 20, 20, 0.05, false, true, true, false, dir);
+
+    FMMOperator<dim,R,C> first(K, data, config);
+    REQUIRE(cache_files(dir).size() == n_expected_files);
+
+    FMMOperator<dim,R,C> second(K, data, config);
+    REQUIRE(second.up_check_to_equiv == first.up_check_to_equiv);
+    REQUIRE(second.down_check_to_equiv == first.down_check_to_equiv);
+
+    // The operators must really come from the cache files.
+    scale_cache_files(dir, 2.0);
+    FMMOperator<dim,R,C> third(K, data, config);
+    for (size_t level = 0; level < first.up_check_to_equiv.size(); level++) {
+        auto& a = first.up_check_to_equiv[level];
+        auto& b = third.up_check_to_equiv[level];
+        REQUIRE(a.size() == b.size());
+        for (size_t i = 0; i < a.size(); i++) {
+            REQUIRE(b[i] == 2.0 * a[i]);
+        }
+    }
+    remove_cache(dir);
+}
+
+TEST_CASE("Check to equivalent operators are loaded from the cache", "[fmm_cache]")
+{
+    size_t n = 2000;
+    auto normals = random_pts<2>(n);
+    NBodyData<2> data{
+        random_pts<2>(n), normals, random_pts<2>(n), normals,
+        std::vector<double>(n, 1.0)
+    };
+
+    // A homogeneous kernel needs one up and one down operator, whatever the
+    // cell sizes.
+    check_cached_check_to_equiv(ElasticHypersingular<2>(30e9, 0.25), data, 2);
+
+    // The logarithmic kernel needs one up and one down operator per level.
+    LaplaceSingle<2> K;
+    FMMOperator<2,1,1> tree(K, data, {0.3, 20, 20, 0.05, false});
+    check_cached_check_to_equiv(
+        K, data, tree.up_check_to_equiv.size() + tree.down_check_to_equiv.size()
+    );
+}
@@ -34,18 +34,24 @@ TEST_CASE("interior operator", "[dense_builder]")
     }
 }
 
-void test_boundary_operator(Mesh<2> m1, Mesh<2> m2) 
+void test_boundary_operator(Mesh<2> m1, Mesh<2> m2,
+    FMMConfig fmm_config = {0.3, 30, 10000, 0.1, true}) 
 {
     LaplaceDouble<2> k;
     auto mthd = make_adaptive_integrator(1e-4, 4, 4, 3, 8, 3.0, k);
-    FMMConfig fmm_config{0.3, 30, 10000, 0.1, true};
     std::vector<double> v(random_list(m2.n_dofs()));
-    auto correct = dense_boundary_operator(m1, m2, mthd, {m2}).apply(v);
+    auto dense_op = dense_boundary_operator(m1, m2, mthd, {m2});
+    auto correct = dense_op.apply(v);
     auto other_op = boundary_operator(m1, m2, mthd, fmm_config, {m2});
     auto other = other_op.apply(v);
     REQUIRE(other_op.n_rows() == m1.n_dofs());
     REQUIRE(other_op.n_cols() == m2.n_dofs());
     REQUIRE_ARRAY_CLOSE(correct, other, m1.n_dofs(), 1e-3);
+
+    std::vector<double> w(random_list(m1.n_dofs()));
+    auto correct_transpose = dense_op.apply_transpose(w);
+    auto other_transpose = other_op.apply_transpose(w);
+    REQUIRE_ARRAY_CLOSE(correct_transpose, other_transpose, m2.n_dofs(), 1e-3);
 }
 
 TEST_CASE("IntegralOperatorSameMesh", "[boundary_operator]") 
@@ -61,6 +67,18 @@ TEST_CASE("IntegralOperatorDifferentMesh", "[boundary_operator]")
     test_boundary_operator(m1, m2);
 }
 
+TEST_CASE("IntegralOperatorFMMFarfield", "[boundary_operator]") 
+{
+    auto m = circle_mesh({0, 0}, 1.0, 6);
+    test_boundary_operator(m, m, {0.3, 30, 50, 0.1, true});
+}
+
+TEST_CASE("IntegralOperatorDirectFarfield", "[boundary_operator]") 
+{
+    auto m = circle_mesh({0, 0}, 1.0, 4);
+    test_boundary_operator(m, m, {0.3, 30, 50, 0.1, true, true, false});
+}
+
 TEST_CASE("IntegralOperatorTensor", "[boundary_operator]") 
 {
     auto m1 = circle_mesh({0, 0}, 1.0, 3);
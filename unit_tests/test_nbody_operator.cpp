@@ -53,3 +53,52 @@ TEST_CASE("compare with eval", "[nbody_operator]")
     auto eval = nbody_eval(K, data, input.data());
     REQUIRE_ARRAY_CLOSE(from_op, eval, n, 1e-12);
 }
+
+TEST_CASE("block eval", "[nbody_operator]") 
+{
+    size_t n = 20;
+    size_t n_rhs = 3;
+    NBodyData<2> data{
+        random_pts<2>(n), random_pts<2>(n), 
+        random_pts<2>(n), random_pts<2>(n), random_list(n)
+    };
+    auto input = random_list(n * n_rhs);
+    LaplaceHypersingular<2> K;
+    auto block = nbody_eval(K, data, input.data(), n_rhs);
+    for (size_t k = 0; k < n_rhs; k++) {
+        std::vector<double> x(n);
+        for (size_t j = 0; j < n; j++) {
+            x[j] = input[j * n_rhs + k];
+        }
+        auto eval = nbody_eval(K, data, x.data());
+        for (size_t i = 0; i < n; i++) {
+            REQUIRE_CLOSE(block[i * n_rhs + k], eval[i], 1e-12);
+        }
+    }
+}
+
+TEST_CASE("transpose eval", "[nbody_operator]") 
+{
+    size_t n_obs = 15;
+    size_t n_src = 20;
+    size_t n_rhs = 2;
+    NBodyData<2> data{
+        random_pts<2>(n_obs), random_pts<2>(n_obs), 
+        random_pts<2>(n_src), random_pts<2>(n_src), random_list(n_src)
+    };
+    auto input = random_list(n_obs * n_rhs);
+    LaplaceDouble<2> K;
+    std::vector<double> block(n_src * n_rhs);
+    nbody_eval_transpose(K, make_view(data), input.data(), n_obs, n_rhs, block.data());
+    auto op = make_direct_nbody_operator(data, K);
+    for (size_t k = 0; k < n_rhs; k++) {
+        std::vector<double> y(n_obs);
+        for (size_t i = 0; i < n_obs; i++) {
+            y[i] = input[i * n_rhs + k];
+        }
+        auto eval = op.apply_transpose(y);
+        for (size_t j = 0; j < n_src; j++) {
+            REQUIRE_CLOSE(block[j * n_rhs + k], eval[j], 1e-12);
+        }
+    }
+}
@@ -26,7 +26,7 @@ TEST_CASE("check law of large numbers", "[octree]")
     //TODO: Make a octree capacity test
     auto tree = make_octree(pts, 100);
     for (size_t i = 0; i < 8; i++) {
-        int n_pts = tree.children[i]->indices.size();
+        int n_pts = tree.root().child(i)->n_pts();
         int diff = abs(n_pts - (n / 8));
         CHECK(diff < (n / 16));
     }
@@ -36,11 +36,12 @@ TEST_CASE("one level octree", "[octree]")
 {
     auto es = random_balls<3>(3, 0.0);
     auto oct = make_octree(es, 4);
-    REQUIRE(oct.level == 0);
+    REQUIRE(oct.root().level == 0);
     for (size_t i = 0; i < 8; i++) {
-        REQUIRE(oct.children[i] == nullptr);
+        REQUIRE(oct.root().child(i) == nullptr);
     }
-    REQUIRE(oct.indices.size() == 3);
+    REQUIRE(oct.n_nodes() == 1);
+    REQUIRE(oct.root().n_pts() == 3);
 }
 
 TEST_CASE("many level octree", "[octree]") 
@@ -48,7 +49,7 @@ TEST_CASE("many level octree", "[octree]")
     auto pts = random_pts<3>(1000);
     auto oct = make_octree(pts, 4);
     REQUIRE(oct.indices.size() == 1000);
-    REQUIRE(oct.children[0]->level == 1);
+    REQUIRE(oct.root().child(0)->level == 1);
 }
 
 TEST_CASE("degenerate line octree in 2d", "[octree]") 
@@ -58,45 +59,51 @@ TEST_CASE("degenerate line octree in 2d", "[octree]")
         pts.push_back({static_cast<double>(i), 0.0});
     }
     auto oct = make_octree(pts, 1);
-    REQUIRE(!oct.is_leaf());
+    REQUIRE(!oct.root().is_leaf());
 }
 
 template <size_t dim>
-size_t n_pts(const Octree<dim>& cell) 
+size_t n_pts(const OctreeNode<dim>& cell) 
 {
     if (cell.is_leaf()) {
-        return cell.indices.size();
+        return cell.n_pts();
     }
     size_t n_child_pts = 0;
     for (size_t c = 0; c < Octree<dim>::split; c++) {
-        if (cell.children[c] == nullptr) {
+        if (cell.child(c) == nullptr) {
             continue;
         }
-        n_child_pts += n_pts(*cell.children[c]);
+        n_child_pts += n_pts(*cell.child(c));
     }
     return n_child_pts;
 }
 
 template <size_t dim>
-void check_n_pts(const Octree<dim>& cell) 
+void check_n_pts(const OctreeNode<dim>& cell) 
 {
-    REQUIRE(n_pts(cell) == cell.indices.size());
+    REQUIRE(n_pts(cell) == cell.n_pts());
+    // The children split the points of their parent in order.
+    auto next = cell.begin;
     for (size_t c = 0; c < Octree<dim>::split; c++) {
-        if (cell.children[c] == nullptr) {
+        auto child = cell.child(c);
+        if (child == nullptr) {
             continue;
         }
-        if (cell.children[c]->is_leaf()) {
+        REQUIRE(child->begin == next);
+        next = child->end;
+        if (child->is_leaf()) {
             continue;
         }
-        check_n_pts(*cell.children[c]);
+        check_n_pts(*child);
     }
+    REQUIRE((cell.is_leaf() || next == cell.end));
 }
 
 TEST_CASE("check octree cell counts", "[octree]") 
 {
     auto pts = random_pts<3>(1000);
     auto oct = make_octree(pts, 4);
-    check_n_pts(oct);
+    check_n_pts(oct.root());
 }
 
 TEST_CASE("check octree cell counts for degenerate line", "[octree]") 
@@ -107,7 +114,7 @@ TEST_CASE("check octree cell counts for degenerate line", "[octree]")
         pts.push_back({static_cast<double>(i), 0.0});
     }
     auto oct = make_octree(pts, 26);
-    CHECK(n_pts(oct) == n);
+    CHECK(n_pts(oct.root()) == n);
 }
 
 TEST_CASE("make octree with two identical points", "[octree]") 
@@ -125,18 +132,18 @@ TEST_CASE("make octree with two very similar points", "[octree]")
 }
 
 template <size_t dim>
-size_t count_children(const Octree<dim>& cell) 
+size_t count_children(const OctreeNode<dim>& cell) 
 {
     if (cell.is_leaf()) {
         return 1;
     }
 
     size_t n_c = 0;
-    for (auto& c: cell.children) {
-        if (c == nullptr) {
+    for (size_t c = 0; c < Octree<dim>::split; c++) {
+        if (cell.child(c) == nullptr) {
             continue;
         }
-        n_c += 1 + count_children(*c);
+        n_c += 1 + count_children(*cell.child(c));
     }
     return n_c;
 }
@@ -151,30 +158,71 @@ TEST_CASE("count children for degenerate line octree", "[octree]")
     }
 
     auto oct = make_octree(pts, 1);
-    REQUIRE(count_children(oct) == 31); 
+    REQUIRE(count_children(oct.root()) == 31); 
 }
 
-template <size_t dim>
-std::set<size_t> check_indices_unique(const Octree<dim>& oct,
-    const std::set<size_t>& indices)
-{
-    auto new_set = indices;
-    auto ret = new_set.emplace(oct.index);
-    CHECK(ret.second);
-    for (auto& c: oct.children) {
-        if (c == nullptr) {
-            continue;
+TEST_CASE("nodes are stored breadth first", "[octree]") 
+{
+    auto pts = random_pts<3>(20000);
+    auto oct = make_octree(pts, 4);
+    size_t next_child = 1;
+    for (size_t i = 0; i < oct.n_nodes(); i++) {
+        auto& cell = oct.nodes[i];
+        REQUIRE(cell.index == i);
+        if (i > 0) {
+            REQUIRE(cell.level >= oct.nodes[i - 1].level);
+        }
+        for (size_t c = 0; c < Octree<3>::split; c++) {
+            auto child = cell.child(c);
+            if (child == nullptr) {
+                continue;
+            }
+            REQUIRE(child->index == next_child);
+            REQUIRE(child->level == cell.level + 1);
+            next_child++;
         }
-        new_set = check_indices_unique(*c, new_set);
     }
-    return new_set;
+    REQUIRE(next_child == oct.n_nodes());
 }
 
-TEST_CASE("check cells have unique indices", "[octree]") 
+TEST_CASE("point indices are a permutation", "[octree]") 
 {
     auto pts = random_pts<3>(1000);
     auto oct = make_octree(pts, 4);
-    check_indices_unique(oct, std::set<size_t>{});
+    std::set<size_t> indices(oct.indices.begin(), oct.indices.end());
+    REQUIRE(oct.indices.size() == pts.size());
+    REQUIRE(indices.size() == pts.size());
+    REQUIRE(*indices.rbegin() == pts.size() - 1);
+}
+
+template <size_t dim>
+void check_containing_subcells(const Octree<dim>& oct,
+    const std::vector<Vec<double,dim>>& pts)
+{
+    for (size_t n = 1; n < oct.n_nodes(); n++) {
+        auto& cell = oct.nodes[n];
+        for (size_t i = cell.begin; i < cell.end; i++) {
+            REQUIRE(cell.bounds.in_box_inclusive(pts[oct.indices[i]]));
+        }
+    }
+}
+
+TEST_CASE("points on cell boundaries go to the lower cell", "[octree]") 
+{
+    std::vector<Vec<double,2>> pts;
+    for (size_t i = 0; i <= 16; i++) {
+        for (size_t j = 0; j <= 16; j++) {
+            pts.push_back({static_cast<double>(i), static_cast<double>(j)});
+        }
+    }
+    auto oct = make_octree(pts, 1);
+    auto& lower = *oct.root().child(0);
+    REQUIRE(lower.n_pts() == 9 * 9);
+    for (size_t i = lower.begin; i < lower.end; i++) {
+        REQUIRE(pts[oct.indices[i]][0] <= 8.0);
+        REQUIRE(pts[oct.indices[i]][1] <= 8.0);
+    }
+    check_containing_subcells(oct, pts);
 }
 
 TEST_CASE("non zero ball radius", "[octree]")
@@ -187,15 +235,10 @@ template <size_t dim>
 void check_true_bounds_contain_balls(const Octree<dim>& oct,
     const std::vector<Ball<dim>>& balls)
 {
-    for (size_t i = 0; i < oct.indices.size(); i++) {
-        auto ball_idx = oct.indices[i];
-        REQUIRE(oct.true_bounds.in_box(balls[ball_idx]));
-    }
-    for (auto& c: oct.children) {
-        if (c == nullptr) {
-            continue;
+    for (auto& cell: oct.nodes) {
+        for (size_t i = cell.begin; i < cell.end; i++) {
+            REQUIRE(cell.true_bounds.in_box(balls[oct.indices[i]]));
         }
-        check_true_bounds_contain_balls(*c, balls);
     }
 }
 
@@ -221,6 +264,6 @@ TEST_CASE("find closest nonempty child", "[nearest_neighbors]")
         {1, 1, 1}, {-1, -1, -1}
     };
     auto oct = make_octree(pts, 1);  
-    auto idx = oct.find_closest_nonempty_child({0.1, 0.1, -1});
+    auto idx = oct.root().find_closest_nonempty_child({0.1, 0.1, -1});
     REQUIRE(idx == 0);
 }
@@ -70,3 +70,13 @@ TEST_CASE("row zero distributor", "[row_zero_distributor]")
     std::vector<double> correct{{0, 0, 1, 1, 1}};
     REQUIRE_ARRAY_EQUAL(result, correct, 5);
 }
+
+TEST_CASE("row zero distributor transpose", "[row_zero_distributor]")
+{
+    DenseOperator op(3, 2, {{1,2  ,  3,4  ,  5,6}});
+    RowZeroDistributor rzd(std::set<size_t>{0, 3}, op);
+    REQUIRE(rzd.n_rows() == 5);
+    auto result = rzd.apply_transpose({100, 1, 1, 100, 1});
+    std::vector<double> correct{{9, 12}};
+    REQUIRE_ARRAY_EQUAL(result, correct, 2);
+}
@@ -143,3 +143,13 @@ TEST_CASE("sparse times sparse", "[sparse]")
     };
     REQUIRE_ARRAY_EQUAL(out.to_dense().data(), correct, 8);
 }
+
+TEST_CASE("Sparse transpose apply", "[sparse]") 
+{
+    auto op = SparseOperator::csr_from_coo(2, 3, {
+        {0, 0, 1.0}, {1, 0, 2.0}, {1, 2, 4.0}
+    });
+    auto out = op.apply_transpose({0.5, 7.0});
+    REQUIRE_ARRAY_EQUAL(out, std::vector<double>{14.5, 0.0, 28.0}, 3);
+    REQUIRE_ARRAY_EQUAL(out, op.to_dense().apply_transpose({0.5, 7.0}), 3);
+}
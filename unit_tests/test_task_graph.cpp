@@ -0,0 +1,84 @@
+#include "catch.hpp"
+#include "task_graph.h"
+#include <atomic>
+
+using namespace tbem;
+
+TEST_CASE("Empty task graph", "[task_graph]")
+{
+    TaskGraph g;
+    g.execute([] (size_t) { REQUIRE(false); });
+}
+
+TEST_CASE("Every task runs once", "[task_graph]")
+{
+    TaskGraph g;
+    size_t n = 1000;
+    for (size_t i = 0; i < n; i++) {
+        g.add_task();
+    }
+    std::vector<std::atomic<int>> counts(n);
+    for (auto& c: counts) {
+        c = 0;
+    }
+    g.execute([&] (size_t i) { counts[i]++; });
+    for (auto& c: counts) {
+        REQUIRE(c == 1);
+    }
+}
+
+TEST_CASE("Tasks run after their dependencies", "[task_graph]")
+{
+    // A binary tree reduction: each parent depends on its two children.
+    TaskGraph g;
+    size_t n_leaves = 256;
+    size_t n = 2 * n_leaves - 1;
+    for (size_t i = 0; i < n; i++) {
+        g.add_task();
+    }
+    for (size_t i = 1; i < n; i++) {
+        g.add_dependency(i, (i - 1) / 2);
+    }
+
+    std::vector<int> sums(n, 0);
+    g.execute([&] (size_t i) {
+        auto left = 2 * i + 1;
+        if (left >= n) {
+            sums[i] = 1;
+        } else {
+            sums[i] = sums[left] + sums[left + 1];
+        }
+    });
+    REQUIRE(sums[0] == static_cast<int>(n_leaves));
+}
+
+TEST_CASE("Reversed task graph", "[task_graph]")
+{
+    // The reverse of a reduction is a broadcast from the root.
+    TaskGraph g;
+    size_t n = 511;
+    for (size_t i = 0; i < n; i++) {
+        g.add_task();
+    }
+    for (size_t i = 1; i < n; i++) {
+        g.add_dependency(i, (i - 1) / 2);
+    }
+
+    auto r = g.reversed();
+    REQUIRE(r.size() == n);
+    std::vector<int> depths(n, -1);
+    std::atomic<bool> parents_first(true);
+    r.execute([&] (size_t i) {
+        if (i == 0) {
+            depths[i] = 0;
+            return;
+        }
+        auto parent_depth = depths[(i - 1) / 2];
+        if (parent_depth < 0) {
+            parents_first = false;
+        }
+        depths[i] = parent_depth + 1;
+    });
+    REQUIRE(parents_first);
+    REQUIRE(depths[n - 1] == 8);
+}